@@ -0,0 +1,222 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../object_pool.hpp"
+#include "../test_common/chat_fixture.hpp"
+#include "../packets.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// BlockPool gives distinct blocks and reuses freed ones, clients, members and packet buffers
+// come from pools. Then counts calls of operator new on those paths against make_shared
+
+static size_t mallocs = 0;
+
+void *operator new(size_t size){
+	++mallocs;
+	void *p = malloc(size);
+	if (!p){
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// allocations from pools of blocks which have room for object of size
+static size_t poolAllocations(size_t size = 0){
+	size_t res = 0;
+	for (auto &st : BlockPool::getAllStats()){
+		if (st.blockSize >= size){
+			res += st.allocations;
+		}
+	}
+	return res;
+}
+
+static const char *inbound = R"({"type":2,"target":"#main","to":0,"time":0,"message":"Hello, how are you? Let's test allocations of the chat server"})";
+
+static bool checkPool(){
+	if (BlockPool::forSize(1) != BlockPool::forSize(BlockPool::granularity) || BlockPool::forSize(BlockPool::granularity + 1) == BlockPool::forSize(BlockPool::granularity)
+			|| BlockPool::forSize(0) || BlockPool::forSize(BlockPool::maxBlockSize + 1) || !BlockPool::forSize(BlockPool::maxBlockSize)){
+		out << "Wrong size classes" << endl;
+		return false;
+	}
+
+	// blocks don't overlap and keep what is written to them
+	BlockPool pool(48);
+	vector<char *> blocks;
+	for (int i = 0; i < 1000; ++i){
+		blocks.push_back(static_cast<char *>(pool.allocate()));
+		memset(blocks.back(), i % 256, 48);
+	}
+	for (int i = 0; i < 1000; ++i){
+		if (blocks[i][0] != (char) (i % 256) || blocks[i][47] != (char) (i % 256)){
+			out << "Block is overwritten" << endl;
+			return false;
+		}
+	}
+	auto sorted = blocks;
+	sort(sorted.begin(), sorted.end());
+	for (size_t i = 1; i < sorted.size(); ++i){
+		if (sorted[i] - sorted[i - 1] < 48){
+			out << "Blocks overlap" << endl;
+			return false;
+		}
+	}
+
+	// freed blocks are reused before new slabs, also ones freed by other thread
+	auto st = pool.getStats();
+	thread([&]{
+		for (auto b : blocks){
+			pool.deallocate(b);
+		}
+	}).join();
+	if (pool.getStats().inUse != 0){
+		out << "Freed blocks are in use" << endl;
+		return false;
+	}
+	vector<char *> again;
+	for (int i = 0; i < 1000; ++i){
+		again.push_back(static_cast<char *>(pool.allocate()));
+	}
+	auto st2 = pool.getStats();
+	sort(again.begin(), again.end());
+	if (st2.fresh != st.fresh || st2.slabs != st.slabs || st2.inUse != 1000 || again != sorted){
+		out << "Freed blocks aren't reused" << endl;
+		return false;
+	}
+	for (auto b : again){
+		pool.deallocate(b);
+	}
+
+	// big sizes go to operator new
+	size_t before = mallocs;
+	void *big = BlockPool::allocate(BlockPool::maxBlockSize + 1);
+	BlockPool::deallocate(big, BlockPool::maxBlockSize + 1);
+	if (mallocs != before + 1){
+		out << "Big block isn't allocated by operator new" << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool checkSites(Server &server){
+	// client and its control block are one pooled block
+	auto conn = make_shared<WSServerBase::Connection>(service, context);
+	size_t pooled = poolAllocations(sizeof(Client));
+	auto cli = allocate_shared<Client>(PoolAllocator<Client>(), &server, conn);
+	if (poolAllocations(sizeof(Client)) != pooled + 1){
+		out << "Client isn't allocated from pool" << endl;
+		return false;
+	}
+	cli.reset();
+
+	// member is made by room on join
+	auto room = makeRoom(server, "main");
+	auto user = makeClient(server, 10);
+	pooled = poolAllocations(sizeof(Member));
+	auto m = room->addMember(user);
+	// online list and statuses sent on join are pooled too, in blocks smaller than member
+	if (!m || poolAllocations(sizeof(Member)) != pooled + 1){
+		out << "Member isn't allocated from pool" << endl;
+		return false;
+	}
+
+	// serialized packet is shared from pool, only its text is allocated by operator new
+	AnyPacket any;
+	Packet::read(inbound, any);
+	auto pack = boost::get<PacketMessage>(&any);
+	if (!pack){
+		out << "Message isn't read" << endl;
+		return false;
+	}
+	// the first one grows buffer which serializer reuses
+	EncodedPacket(*pack).get(Encoding::json);
+	EncodedPacket data(*pack);
+	pooled = poolAllocations();
+	size_t before = mallocs;
+	auto &buf = data.get(Encoding::json);
+	size_t used = mallocs - before;
+	if (!buf || poolAllocations() != pooled + 1 || used != 1){
+		out << "Packet buffer isn't allocated from pool" << endl;
+		return false;
+	}
+	return true;
+}
+
+template<typename F>
+static void bench(const char *name, int n, F func){
+	// warm up pools and reused buffers
+	for (int i = 0; i < 100; ++i){
+		func();
+	}
+
+	size_t before = mallocs;
+	auto start = steady_clock::now();
+	for (int i = 0; i < n; ++i){
+		func();
+	}
+	double us = duration<double, micro>(steady_clock::now() - start).count();
+
+	out << setw(28) << left << name << right << setw(16) << fixed << setprecision(2) << (double) (mallocs - before) / n
+		<< setw(14) << us * 1000 / n << endl;
+}
+
+int main(int argc, char **argv){
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+
+	Server server(0);
+	cout.rdbuf(nullptr);
+	if (!checkPool() || !checkSites(server)){
+		out << "Correctness check failed" << endl;
+		return 1;
+	}
+	out << "Correctness check passed" << endl;
+
+	AnyPacket any;
+	Packet::read(inbound, any);
+	auto &msg = boost::get<PacketMessage>(any);
+	auto conn = make_shared<WSServerBase::Connection>(service, context);
+	auto room = makeRoom(server, "main");
+	uint uid = 10;
+
+	out << setw(28) << left << "operation" << right << setw(16) << "mallocs/op" << setw(14) << "ns/op" << endl;
+	bench("read message", n, [&]{
+		AnyPacket pack;
+		Packet::read(inbound, pack);
+	});
+	bench("serialize message", n, [&]{
+		EncodedPacket(msg).get(Encoding::json);
+	});
+	auto text = EncodedPacket(msg).get(Encoding::json);
+	bench("buffer, make_shared", n, [&]{
+		make_shared<const string>(*text);
+	});
+	bench("buffer, pool", n, [&]{
+		allocate_shared<const string>(PoolAllocator<string>(), *text);
+	});
+	bench("client, make_shared", n, [&]{
+		make_shared<Client>(&server, conn);
+	});
+	bench("client, pool", n, [&]{
+		allocate_shared<Client>(PoolAllocator<Client>(), &server, conn);
+	});
+	bench("connect, join and leave", n / 10, [&]{
+		auto cli = makeClient(server, uid++);
+		room->addMember(cli);
+		room->removeMember(cli);
+	});
+	return 0;
+}
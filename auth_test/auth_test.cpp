@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+
+#include "../test_common/chat_fixture.hpp"
+#include "../memcached.hpp"
+#include "../packets.hpp"
+
+using namespace std;
+
+// Auth whose lookup throws, as on id in memcached which isn't a number, fails with PacketError
+// and packets which client sent meanwhile are processed. Needs memcached of wsserver.conf
+
+static size_t frames(Server &server, const ClientPtr &cli){
+	return server.getSendQueueDepth(cli).frames;
+}
+
+static void send(const ClientPtr &cli, const string &msg){
+	AnyPacket pack;
+	Packet::read(msg, pack);
+	cli->onPacket(pack, msg);
+}
+
+static bool checkCorrectness(Server &server){
+	Memcache cache;
+	if (!cache.set("chat-key-auth_test_bad", "not a number") || !cache.set("chat-key-auth_test_unknown", "0")){
+		out << "Can't store keys in memcached" << endl;
+		return false;
+	}
+
+	PacketAuth guest;
+	guest.ukey = "auth_test_unknown";
+	auto res = guest.authenticate("10.0.0.1");
+	if (res.failed || res.user_id != 0){
+		out << "Unknown key isn't a guest" << endl;
+		return false;
+	}
+
+	PacketAuth bad;
+	bad.ukey = "auth_test_bad";
+	res = bad.authenticate("10.0.0.1");
+	if (!res.failed || res.info.empty()){
+		out << "Lookup which throws isn't a failed result" << endl;
+		return false;
+	}
+
+	// packet sent while auth is pending waits for it
+	auto cli = makeClient(server, 0);
+	cli->beginAuth();
+	const string list = R"({"type":3,"target":"nowhere"})";
+	send(cli, list);
+	if (frames(server, cli) != 0){
+		out << "Packet is processed while auth is pending" << endl;
+		return false;
+	}
+
+	// error of auth, then error of queued packet
+	bad.complete(*cli, res);
+	if (frames(server, cli) != 2 || cli->getID() != 0){
+		out << "Failed auth isn't answered with errors of auth and of queued packet" << endl;
+		return false;
+	}
+
+	send(cli, list);
+	if (frames(server, cli) != 3){
+		out << "Auth is still pending after it failed" << endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	Server server(0);
+	cout.rdbuf(nullptr);
+	if (!checkCorrectness(server)){
+		out << "Correctness check failed" << endl;
+		return 1;
+	}
+	out << "Correctness check passed" << endl;
+	return 0;
+}
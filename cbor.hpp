@@ -0,0 +1,623 @@
+#ifndef CBOR_HPP
+#define CBOR_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "json_fields.hpp"
+#include "json_writer.hpp"
+
+/// Binary encoding of packets, CBOR (RFC 7049). Packet is a map with the same fields as
+/// in JSON, but keys known to cborKeys are written as their index, one byte for the first 24.
+/// Maps and arrays have indefinite length, so writer doesn't count fields in advance.
+/// Strings are text, invalid UTF-8 is replaced the same way JSON encoding does it
+
+/// New keys are only appended, index of key must never change
+static const char *const cborKeys[] = {
+	"type", "target", "message", "time", "to", "from", "from_login", "color",
+	"style", "status", "member_id", "user_id", "name", "girl", "is_owner", "is_moder",
+	"data", "list", "login", "source", "code", "info", "auto_login", "load_history",
+	"api_key", "ukey", "password", "batch", "before", "limit", "since", "version",
+};
+
+/// Index of key in cborKeys, -1 if key is unknown and is written as text
+inline int cborKeyIndex(boost::string_view key){
+	using Item = std::pair<boost::string_view, int>;
+	static const std::vector<Item> sorted = []{
+		std::vector<Item> res;
+		for (size_t i = 0; i < sizeof(cborKeys) / sizeof(cborKeys[0]); ++i){
+			res.emplace_back(cborKeys[i], (int) i);
+		}
+		std::sort(res.begin(), res.end());
+		return res;
+	}();
+
+	auto it = std::lower_bound(sorted.begin(), sorted.end(), Item(key, -1));
+	return it != sorted.end() && it->first == key ? it->second : -1;
+}
+
+/// Same interface as JsonWriter
+class CborWriter {
+private:
+	std::string &out;
+
+	void head(uint8_t major, uint64_t v){
+		char buf[9];
+		size_t n;
+		if (v < 24){
+			buf[0] = (char) ((major << 5) | v);
+			n = 1;
+		} else {
+			size_t bytes = v <= 0xFF ? 1 : v <= 0xFFFF ? 2 : v <= 0xFFFFFFFF ? 4 : 8;
+			buf[0] = (char) ((major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+			for (size_t i = 0; i < bytes; ++i){
+				buf[1 + i] = (char) (v >> (8 * (bytes - i - 1)));
+			}
+			n = 1 + bytes;
+		}
+		out.append(buf, n);
+	}
+
+	static void appendUtf8(std::string &res, unsigned cp){
+		if (cp < 0x80){
+			res += (char) cp;
+		} else if (cp < 0x800){
+			res += (char) (0xC0 | (cp >> 6));
+			res += (char) (0x80 | (cp & 0x3F));
+		} else if (cp < 0x10000){
+			res += (char) (0xE0 | (cp >> 12));
+			res += (char) (0x80 | ((cp >> 6) & 0x3F));
+			res += (char) (0x80 | (cp & 0x3F));
+		} else {
+			res += (char) (0xF0 | (cp >> 18));
+			res += (char) (0x80 | ((cp >> 12) & 0x3F));
+			res += (char) (0x80 | ((cp >> 6) & 0x3F));
+			res += (char) (0x80 | (cp & 0x3F));
+		}
+	}
+public:
+	CborWriter(std::string &o) : out(o){}
+
+	/// Strict check: no overlong forms, surrogates or code points above U+10FFFF
+	static bool isValidUtf8(boost::string_view str){
+		auto s = reinterpret_cast<const unsigned char *>(str.data());
+		auto e = s + str.size();
+		while (s < e){
+			unsigned char c = *s;
+			if (c < 0x80){
+				++s;
+				continue;
+			}
+
+			size_t n;
+			unsigned cp;
+			if (c >= 0xC2 && c <= 0xDF){
+				n = 1; cp = c & 0x1F;
+			} else if (c >= 0xE0 && c <= 0xEF){
+				n = 2; cp = c & 0x0F;
+			} else if (c >= 0xF0 && c <= 0xF4){
+				n = 3; cp = c & 0x07;
+			} else {
+				return false;
+			}
+			if ((size_t) (e - s) <= n){
+				return false;
+			}
+			for (size_t i = 1; i <= n; ++i){
+				if ((s[i] & 0xC0) != 0x80){
+					return false;
+				}
+				cp = (cp << 6) | (s[i] & 0x3F);
+			}
+			if ((n == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (n == 3 && (cp < 0x10000 || cp > 0x10FFFF))){
+				return false;
+			}
+			s += n + 1;
+		}
+		return true;
+	}
+
+	void beginObject(){ out += '\xbf'; }
+	void endObject(){ out += '\xff'; }
+	void beginArray(){ out += '\x9f'; }
+	void endArray(){ out += '\xff'; }
+
+	void key(boost::string_view k){
+		int idx = cborKeyIndex(k);
+		if (idx >= 0){
+			head(0, (uint64_t) idx);
+		} else {
+			head(3, k.size());
+			out.append(k.data(), k.size());
+		}
+	}
+
+	void writeNull(){ out += '\xf6'; }
+	void writeBool(bool v){ out += v ? '\xf5' : '\xf4'; }
+	void writeUInt(uint64_t v){ head(0, v); }
+
+	void writeInt(int64_t v){
+		if (v < 0){
+			head(1, (uint64_t) -(v + 1));
+		} else {
+			head(0, (uint64_t) v);
+		}
+	}
+
+	void writeDouble(double v){
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		out += '\xfb';
+		for (int i = 7; i >= 0; --i){
+			out += (char) (bits >> (8 * i));
+		}
+	}
+
+	/// Item which is CBOR already
+	void writeRaw(boost::string_view v){
+		out.append(v.data(), v.size());
+	}
+
+	void writeString(boost::string_view v){
+		if (isValidUtf8(v)){
+			head(3, v.size());
+			out.append(v.data(), v.size());
+			return;
+		}
+
+		// code points which JsonWriter escapes for the same string
+		std::string fixed;
+		fixed.reserve(v.size() + 16);
+		auto s = reinterpret_cast<const unsigned char *>(v.data());
+		auto e = s + v.size();
+		for (; s < e; ++s){
+			unsigned cp = *s < 0x80 ? *s : JsonWriter::decodeUtf8(s, e);
+			if (cp >= 0x10000){
+				cp = 0x10000 + ((cp - 0x10000) & 0xFFFFF);
+			}
+			appendUtf8(fixed, cp);
+		}
+		head(3, fixed.size());
+		out += fixed;
+	}
+};
+
+/// Same interface as JsonFields for CBOR frame, which must be a map. Numbers are decoded
+/// during parse, strings point into frame
+class CborFields {
+public:
+	enum class Kind : uint8_t {
+		missing,
+		null,
+		boolean,
+		posint,
+		negint,		// value is -1 - u
+		real,
+		string,
+		array,
+		object,
+	};
+
+	class Field {
+		friend class CborFields;
+
+		Kind kind = Kind::missing;
+		uint64_t u = 0;
+		double d = 0;
+		const char *begin = nullptr;	// contents of string, otherwise whole item
+		size_t len = 0;
+
+		template<typename T>
+		T asNumber() const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				return 0;
+			case Kind::boolean:
+				return (T) u;
+			case Kind::posint:
+				if (u > (uint64_t) std::numeric_limits<T>::max()){
+					throw std::runtime_error("CBOR value is out of range");
+				}
+				return (T) u;
+			case Kind::negint:
+				if (std::numeric_limits<T>::min() == 0){
+					throw std::runtime_error("Negative CBOR value is not convertible to unsigned");
+				}
+				if (u > (uint64_t) std::numeric_limits<T>::max()){
+					throw std::runtime_error("CBOR value is out of range");
+				}
+				return (T) (-1 - (int64_t) u);
+			case Kind::real:
+				if (!(d >= (double) std::numeric_limits<T>::min() && d <= (double) std::numeric_limits<T>::max())){
+					throw std::runtime_error("CBOR value is out of range");
+				}
+				return (T) d;
+			default:
+				throw std::runtime_error("CBOR value is not convertible to number");
+			}
+		}
+	public:
+		inline Kind getKind() const { return kind; }
+		inline bool isMissing() const { return kind == Kind::missing; }
+		inline boost::string_view raw() const { return boost::string_view(begin, len); }
+
+		inline int asInt() const { return asNumber<int>(); }
+		inline unsigned asUInt() const { return asNumber<unsigned>(); }
+		inline uint64_t asUInt64() const { return asNumber<uint64_t>(); }
+		inline int64_t asInt64() const { return asNumber<int64_t>(); }
+
+		bool asBool() const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				return false;
+			case Kind::boolean:
+			case Kind::posint:
+				return u != 0;
+			case Kind::negint:
+				return true;
+			case Kind::real:
+				return d != 0;
+			default:
+				throw std::runtime_error("CBOR value is not convertible to bool");
+			}
+		}
+
+		std::string asString() const {
+			std::string res;
+			copyTo(res);
+			return res;
+		}
+
+		void copyTo(std::string &out) const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				out.clear();
+				return;
+			case Kind::string:
+				out.assign(begin, len);
+				return;
+			case Kind::boolean:
+				out = u ? "true" : "false";
+				return;
+			case Kind::posint:
+				out = std::to_string(u);
+				return;
+			case Kind::negint:
+				out = u < std::numeric_limits<uint64_t>::max() ? "-" + std::to_string(u + 1) : "-18446744073709551616";
+				return;
+			case Kind::real: {
+				char buf[32];
+				snprintf(buf, sizeof(buf), "%.17g", d);
+				out = buf;
+				return;
+			}
+			default:
+				throw std::runtime_error("CBOR value is not convertible to string");
+			}
+		}
+	};
+private:
+	struct Entry {
+		boost::string_view key;
+		Field value;
+	};
+
+	static const int maxDepth = 256;
+	static const uint8_t indefinite = 31;
+
+	std::vector<Entry> fields;
+	const unsigned char *p = nullptr;
+	const unsigned char *end = nullptr;
+
+	/// Reads initial byte and argument of item
+	bool readHead(uint8_t &major, uint8_t &info, uint64_t &arg){
+		if (p == end){
+			return false;
+		}
+		major = *p >> 5;
+		info = *p & 31;
+		++p;
+
+		if (info < 24 || info == indefinite){
+			arg = info;
+			return true;
+		}
+		if (info > 27){
+			return false;
+		}
+		size_t bytes = (size_t) 1 << (info - 24);
+		if ((size_t) (end - p) < bytes){
+			return false;
+		}
+		arg = 0;
+		for (size_t i = 0; i < bytes; ++i){
+			arg = (arg << 8) | p[i];
+		}
+		p += bytes;
+		return true;
+	}
+
+	static double halfToDouble(uint16_t h){
+		int exp = (h >> 10) & 0x1F;
+		int mant = h & 0x3FF;
+		double val;
+		if (exp == 0){
+			val = ldexp(mant, -24);
+		} else if (exp != 31){
+			val = ldexp(mant + 1024, exp - 25);
+		} else {
+			val = mant == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+		}
+		return h & 0x8000 ? -val : val;
+	}
+
+	inline bool atBreak(){
+		if (p < end && *p == 0xFF){
+			++p;
+			return true;
+		}
+		return false;
+	}
+
+	bool readItem(Field &f, int depth){
+		if (depth > maxDepth){
+			return false;
+		}
+
+		auto start = p;
+		uint8_t major, info;
+		uint64_t arg;
+		if (!readHead(major, info, arg)){
+			return false;
+		}
+		if (info == indefinite && major != 4 && major != 5){
+			// chunked strings aren't supported
+			return false;
+		}
+
+		f.begin = reinterpret_cast<const char *>(start);
+		switch (major){
+		case 0:
+			f.kind = Kind::posint;
+			f.u = arg;
+			break;
+		case 1:
+			f.kind = Kind::negint;
+			f.u = arg;
+			break;
+		case 2:
+		case 3:
+			if (arg > (uint64_t) (end - p)){
+				return false;
+			}
+			f.kind = Kind::string;
+			f.begin = reinterpret_cast<const char *>(p);
+			f.len = (size_t) arg;
+			p += arg;
+			return true;
+		case 4:
+		case 5: {
+			f.kind = major == 4 ? Kind::array : Kind::object;
+			Field item;
+			size_t items = major == 5 ? 2 : 1;
+			if (info == indefinite){
+				while (!atBreak()){
+					for (size_t i = 0; i < items; ++i){
+						if (!readItem(item, depth + 1)){
+							return false;
+						}
+					}
+				}
+			} else {
+				if (arg > (uint64_t) (end - p)){
+					return false;
+				}
+				for (uint64_t n = 0; n < arg * items; ++n){
+					if (!readItem(item, depth + 1)){
+						return false;
+					}
+				}
+			}
+			break;
+		}
+		case 6:
+			// tag is ignored
+			return readItem(f, depth + 1);
+		default:
+			switch (info){
+			case 20:
+			case 21:
+				f.kind = Kind::boolean;
+				f.u = info == 21;
+				break;
+			case 22:
+			case 23:
+				f.kind = Kind::null;
+				break;
+			case 25:
+				f.kind = Kind::real;
+				f.d = halfToDouble((uint16_t) arg);
+				break;
+			case 26: {
+				uint32_t bits = (uint32_t) arg;
+				float v;
+				memcpy(&v, &bits, sizeof(v));
+				f.kind = Kind::real;
+				f.d = v;
+				break;
+			}
+			case 27:
+				f.kind = Kind::real;
+				memcpy(&f.d, &arg, sizeof(f.d));
+				break;
+			default:
+				return false;
+			}
+		}
+		f.len = reinterpret_cast<const char *>(p) - f.begin;
+		return true;
+	}
+
+	bool readEntry(){
+		Entry e;
+		Field key;
+		if (!readItem(key, 1)){
+			return false;
+		}
+		if (key.kind == Kind::posint){
+			if (key.u < sizeof(cborKeys) / sizeof(cborKeys[0])){
+				e.key = cborKeys[key.u];
+			}
+		} else if (key.kind == Kind::string){
+			e.key = key.raw();
+		} else {
+			return false;
+		}
+
+		if (!readItem(e.value, 1)){
+			return false;
+		}
+		// keys of newer clients which this server doesn't know are skipped
+		if (!e.key.empty()){
+			fields.push_back(e);
+		}
+		return true;
+	}
+public:
+	/// Returns false if data is not valid CBOR map. Nothing else is allowed after it
+	bool parse(const char *data, size_t size){
+		fields.clear();
+		p = reinterpret_cast<const unsigned char *>(data);
+		end = p + size;
+
+		uint8_t major, info;
+		uint64_t arg;
+		if (!readHead(major, info, arg) || major != 5){
+			return false;
+		}
+
+		if (info == indefinite){
+			while (!atBreak()){
+				if (!readEntry()){
+					return false;
+				}
+			}
+		} else {
+			if (arg > (uint64_t) (end - p)){
+				return false;
+			}
+			for (uint64_t i = 0; i < arg; ++i){
+				if (!readEntry()){
+					return false;
+				}
+			}
+		}
+		return p == end;
+	}
+
+	inline bool parse(const std::string &data){
+		return parse(data.data(), data.size());
+	}
+
+	/// Field of top level key, missing field if there is no such key. Last one wins for duplicates
+	const Field &operator [](boost::string_view name) const {
+		static const Field missing;
+		for (auto it = fields.rbegin(); it != fields.rend(); ++it){
+			if (it->key == name){
+				return it->value;
+			}
+		}
+		return missing;
+	}
+
+	inline size_t size() const { return fields.size(); }
+};
+
+namespace cbor_detail {
+	inline bool transcode(const JsonFields::Field &f, CborWriter &w, int depth){
+		switch (f.getKind()){
+		case JsonFields::Kind::null:
+			w.writeNull();
+			return true;
+		case JsonFields::Kind::boolean:
+			w.writeBool(f.asBool());
+			return true;
+		case JsonFields::Kind::number:
+			if (f.isIntegral()){
+				try {
+					if (f.raw()[0] == '-'){
+						w.writeInt(f.asInt64());
+					} else {
+						w.writeUInt(f.asUInt64());
+					}
+					return true;
+				} catch (std::runtime_error &){
+					// too big for 64 bits
+				}
+			}
+			w.writeDouble(f.asDouble());
+			return true;
+		case JsonFields::Kind::string:
+			w.writeString(f.asString());
+			return true;
+		case JsonFields::Kind::array:
+		case JsonFields::Kind::object: {
+			if (depth > 64){
+				return false;
+			}
+			bool object = f.getKind() == JsonFields::Kind::object;
+			auto raw = f.raw();
+			JsonFields sub;
+			if (!(object ? sub.parse(raw.data(), raw.size()) : sub.parseArray(raw.data(), raw.size()))){
+				return false;
+			}
+
+			bool ok = true;
+			object ? w.beginObject() : w.beginArray();
+			sub.forEach([&](const JsonFields::Field &key, const JsonFields::Field &value){
+				if (object){
+					w.key(key.asString());
+				}
+				ok = ok && transcode(value, w, depth + 1);
+			});
+			object ? w.endObject() : w.endArray();
+			return ok;
+		}
+		default:
+			return false;
+		}
+	}
+}
+
+/// Converts JSON packet, as JsonWriter wrote it, into bytes which CborWriter writes for the
+/// same packet. Used for packets which exist only as JSON: history and events of other processes
+inline bool jsonToCbor(boost::string_view json, std::string &out){
+	JsonFields top;
+	if (!top.parse(json.data(), json.size())){
+		return false;
+	}
+
+	CborWriter w(out);
+	bool ok = true;
+	w.beginObject();
+	top.forEach([&](const JsonFields::Field &key, const JsonFields::Field &value){
+		w.key(key.asString());
+		ok = ok && cbor_detail::transcode(value, w, 1);
+	});
+	w.endObject();
+	return ok;
+}
+
+#endif //CBOR_HPP
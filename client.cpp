@@ -4,62 +4,125 @@
 #include "packet.hpp"
 #include "packets.hpp"
 #include "logger.hpp"
+#include "object_pool.hpp"
 
-void Client::onPacket(string msg){
-	unique_ptr<Packet> pack(Packet::read(msg));
-	if (pack){
+void Client::onPacket(AnyPacket &pack, const string &msg){
+	if (!pack.empty()){
 		lastPacketTime = time(nullptr);
-		pack->process(*this);
+		server->onClientActivity(*this);
+		if (authPending){
+			if (afterAuth.size() >= maxAfterAuth){
+				Logger::warn("Dropped packet of client waiting for auth: ", msg);
+				return;
+			}
+			afterAuth.emplace_back([this, pack]() mutable { pack.process(*this); });
+			return;
+		}
+		pack.process(*this);
 	} else {
 		Logger::warn("Dropped invalid packet: ", msg);
 	}
 }
 
+void Client::beginAuth(){
+	authPending = true;
+}
+
+void Client::endAuth(){
+	authPending = false;
+	// queued packet may start auth again, the rest waits for it
+	while (!authPending && !afterAuth.empty()){
+		auto func = std::move(afterAuth.front());
+		afterAuth.pop_front();
+		func();
+	}
+}
+
 void Client::onDisconnect(){
 	auto ptr = self.lock();
-	for (RoomPtr room : rooms){
-		auto member = room->findMemberByClient(ptr);
-		room->removeMember(ptr);
+	for (auto &r : rooms){
+		auto room = r.second;
+		room->post([room, ptr]{ room->removeMember(ptr); });
 	}
 	rooms.clear();
 }
 
 void Client::onKick(RoomPtr room){
-	rooms.erase(room);
+	auto it = rooms.find(room->getName());
+	if (it != rooms.end() && it->second == room){
+		rooms.erase(it);
+	}
+}
+
+void Client::setBatching(bool enabled){
+	server->setFrameBatching(connection, enabled);
 }
 
 void Client::sendPacket(const Packet &pack){
-	server->sendPacket(connection, pack);
+	server->sendPacket(connection, pack, encoding);
 }
 
-void Client::sendRawData(const string &data){
-	server->sendRawData(connection, data);
+void Client::sendRawData(const EncodedPacket &data, bool droppable){
+	server->sendRawData(connection, data.get(encoding), droppable, encoding,
+			deflate.enabled ? data.getDeflated(encoding) : nullptr);
 }
 
-MemberPtr Client::joinRoom(RoomPtr room){
-	auto ptr = self.lock();
-	auto member = room->addMember(ptr);
+void Client::sendHistory(RoomHistory &history){
+	// connection which keeps deflate window must see every compressed frame, so it gets plain ones
+	auto &frames = history.getReplay(encoding, deflate.enabled && !deflate.contextTakeover);
+	if (frames){
+		server->sendFramed(connection, frames);
+	}
+}
 
-	if (member){
-		rooms.insert(room);
-		member->setStatus(Member::Status::online);
+void Client::sendFrames(const vector<boost::string_view> &packets){
+	if (packets.empty()){
+		return;
 	}
 
-	return member;
-}
+	// compressed one by one, without context, the way frames of history are
+	bool deflated = deflate.enabled && !deflate.contextTakeover;
+	string run, cbor, packed;
+	for (auto p : packets){
+		if (encoding == Encoding::cbor){
+			cbor.clear();
+			jsonToCbor(p, cbor);
+			p = cbor;
+		}
 
-void Client::leaveRoom(RoomPtr room){
-	if (rooms.erase(room) > 0){
-		room->removeMember(self.lock());
+		packed.clear();
+		if (deflated && p.size() >= DeflateOptions::get().minSize && Deflater::shared().compress(p, packed)){
+			appendFrame(run, packed, encoding, true);
+		} else {
+			appendFrame(run, p, encoding, false);
+		}
 	}
+	server->sendFramed(connection, allocate_shared<const string>(PoolAllocator<string>(), run));
 }
 
-RoomPtr Client::getRoomByName(const string &name){
-	for (RoomPtr room : rooms){
-		if (room->getName() == name){
-			return room;
+void Client::joinRoom(RoomPtr room, uint64_t version, std::function<void(MemberPtr)> then){
+	auto ptr = self.lock();
+	rooms[room->getName()] = room;
+
+	room->post([room, ptr, version, then]{
+		auto member = room->addMember(ptr, version);
+		if (member){
+			member->setStatus(Member::Status::online);
+			then(member);
+		} else {
+			room->postToServer([room, ptr]{ ptr->onKick(room); });
 		}
+	});
+}
+
+void Client::leaveRoom(RoomPtr room){
+	auto ptr = self.lock();
+	if (rooms.erase(room->getName()) > 0){
+		room->post([room, ptr]{ room->removeMember(ptr); });
 	}
+}
 
-	return nullptr;
+RoomPtr Client::getRoomByName(const string &name){
+	auto it = rooms.find(name);
+	return it != rooms.end() ? it->second : nullptr;
 }
@@ -1,16 +1,21 @@
 #ifndef CLIENT_H_
 #define CLIENT_H_
 
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <set>
+#include <unordered_map>
 
 class Client;
+class RoomHistory;
 
 using ClientPtr = std::shared_ptr<Client>;
 
 #include "packet.hpp"
 #include "server.hpp"
 #include "rooms.hpp"
+#include "timer_wheel.hpp"
 
 using namespace std;
 
@@ -18,18 +23,30 @@ class Client {
 private:
 	shared_ptr<WSServerBase::Connection> connection;
 	Server *server;
-	set<RoomPtr> rooms;
+	unordered_map<string, RoomPtr> rooms;
 	weak_ptr<Client> self;
 
 	string name;
-	uint uid;
+	// read by room shards
+	std::atomic<uint> uid;
 	bool _isGirl;
 	string color;
+	// chosen at handshake, never change
+	Encoding encoding;
+	DeflateParams deflate;
+
+	// packets which came while credentials are looked up, processed when auth completes
+	static const size_t maxAfterAuth = 64;
+	bool authPending = false;
+	std::deque<std::function<void()>> afterAuth;
 public:
 	time_t lastPacketTime;
 	time_t lastMessageTime;
 	int messageCounter;
 
+	TimerWheel<ClientPtr>::Handle idleTimer;
+	bool pingSent;
+
 	Client(Server *srv, shared_ptr<WSServerBase::Connection> conn){
 		server = srv;
 		connection = conn;
@@ -37,8 +54,15 @@ public:
 		lastMessageTime = time(nullptr);
 		lastPacketTime = lastMessageTime;
 		messageCounter = 0;
+		pingSent = false;
 		_isGirl = false;
 		color = "gray";
+
+		// subprotocol is chosen and echoed by handshake of server
+		encoding = encodingForProtocol(conn->protocol);
+
+		// negotiated by handshake of server, its send queue compresses frames
+		deflate = conn->deflate;
 	}
 	
 	~Client(){
@@ -58,6 +82,8 @@ public:
 	inline void setName(const string &nm){ name = nm; }
 	
 	inline string getIP(){ return connection->remote_endpoint_address; }
+	inline Encoding getEncoding(){ return encoding; }
+	inline const DeflateParams &getDeflate(){ return deflate; }
 
 	inline uint getID(){ return uid; }
 	inline void setID(int id){ uid = id; }
@@ -65,18 +91,31 @@ public:
 	inline Server *getServer(){ return server; }
 	shared_ptr<WSServerBase::Connection> getConnection(){ return connection; }
 	
-	void onPacket(string pack);
+	void onPacket(AnyPacket &pack, const string &msg);
+	/// Packets of client are queued from beginAuth to endAuth, so none of them is processed as of guest
+	void beginAuth();
+	void endAuth();
 	void onDisconnect();
 	void onKick(RoomPtr room);
 	
-	MemberPtr joinRoom(RoomPtr room);
+	/// Adds client to room. Member is created on thread of room, where then is called.
+	/// then is not called if client can't join the room. Client which has online list of
+	/// version gets only changes since it
+	void joinRoom(RoomPtr room, uint64_t version, std::function<void(MemberPtr)> then);
 	void leaveRoom(RoomPtr room);
 
 	RoomPtr getRoomByName(const string &name);
-	inline const set<RoomPtr> &getConnectedRooms(){ return rooms; }
+	inline const unordered_map<string, RoomPtr> &getConnectedRooms(){ return rooms; }
+
+	void setBatching(bool enabled);
 
 	void sendPacket(const Packet &);
-	void sendRawData(const string &data);
+	/// Sends buffer of client encoding, compressed once for everyone if client uses permessage-deflate
+	void sendRawData(const EncodedPacket &data, bool droppable = false);
+	/// Sends whole history of room as one buffer, must be called on thread of room
+	void sendHistory(RoomHistory &history);
+	/// Sends JSON packets as one buffer of frames in encoding of client
+	void sendFrames(const vector<boost::string_view> &packets);
 
 	inline bool isAdmin(){
 		return uid == 1 || uid == 2;
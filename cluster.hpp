@@ -0,0 +1,493 @@
+#ifndef CLUSTER_HPP
+#define CLUSTER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/// State shared by wsserver processes of one cluster. Lives in anonymous shared
+/// mapping created before fork, so there is nothing to clean up after exit.
+///
+/// Bus is a multi-producer ring of fixed slots. Every process reads all of it with
+/// own cursor and skips own events. Slot is protected by sequence number: odd while
+/// written, 2*pos+2 when event pos is ready. Writers of one slot are serialized by its
+/// lock, which holds pid of writer, so that lock of writer which died is taken over.
+/// Event bigger than slot is written in chunks to consecutive slots.
+///
+/// Every process reads the ring by own thread into local queue, which poll empties, and
+/// writer waits until every process has read the slot it reuses. Process which doesn't
+/// read for maxWaitMs is marked lagging and isn't waited for until it catches up, it loses
+/// oldest events then. Lost events are counted, so that process can ask others for resync
+///
+/// Members are shared as statuses which rooms send to all: every process lists members of
+/// the others and keeps their nicks taken. Answer to resync lists members of every process,
+/// members of process which died leave rooms
+class ClusterBus {
+public:
+	enum class Event : uint8_t {
+		broadcast = 1,		// packet of room, sent to local members of every other process
+		room_created,
+		room_removed,
+		room_settings,		// bans, moderators and owner of room
+		resync,				// process lost events, payload is its number
+		room_list,			// names of all rooms, answer to resync
+		member_info,		// nick, gender and color of user who left room
+		room_members,		// statuses of all members of room connected to process, answer to resync
+	};
+
+	/// Flags of broadcast
+	enum Flags : uint8_t {
+		droppable = 1,
+		to_history = 2,
+		// status of member, other processes keep it in online list of room
+		member_status = 4,
+		// not sent to members, only changes online list: rights of member changed
+		list_only = 8,
+	};
+
+	static const size_t slotSize = 64*1024;
+	static const size_t maxNodes = 256;
+	// writer stops waiting for process which doesn't read
+	static const int maxWaitMs = 100;
+	// slot which stays unwritten for so long and whose writer isn't known to be dead is given up
+	static const int abandonMs = 1000;
+
+	struct Stats {
+		uint64_t published = 0;
+		uint64_t received = 0;
+		uint64_t lost = 0;			// slots which this process didn't read
+		uint64_t oversized = 0;
+		uint64_t outrun = 0;
+		uint64_t chunked = 0;		// events written in several slots
+		uint64_t lagging = 0;		// times writer stopped waiting for process
+		uint64_t recovered = 0;		// locks taken over from writers which died
+	};
+private:
+	struct Slot {
+		std::atomic<uint64_t> seq;
+		// pid of writer, 0 when free
+		std::atomic<int32_t> lock;
+		// pid of the last writer which reserved slot, it may wait for readers before it locks it
+		std::atomic<int32_t> reserved;
+		// pid of the last writer, kept after unlock
+		int32_t writer;
+		uint32_t size;
+		// size of whole event, chunk is number of this part of it
+		uint32_t total;
+		uint16_t chunk;
+		uint8_t node;
+		uint8_t event;
+		uint8_t flags;
+		char data[slotSize];
+	};
+
+	struct Counter {
+		std::atomic<uint64_t> key;
+		std::atomic<int32_t> value;
+	};
+
+	struct Shared {
+		std::atomic<uint64_t> head;
+		std::atomic<uint64_t> oversized;
+		std::atomic<uint64_t> outrun;
+		std::atomic<uint64_t> chunked;
+		std::atomic<uint64_t> lagging;
+		std::atomic<uint64_t> recovered;
+		// position of the next event every process reads
+		std::atomic<uint64_t> cursors[maxNodes];
+		std::atomic<bool> lagged[maxNodes];
+		std::atomic<int32_t> pids[maxNodes];
+	};
+
+	struct Received {
+		Event event;
+		uint8_t flags;
+		std::string room;
+		std::string payload;
+	};
+
+	void *mem = nullptr;
+	size_t memSize = 0;
+	Shared *shared = nullptr;
+	Slot *slots = nullptr;
+	size_t slotCount = 0;
+	Counter *counters = nullptr;
+	size_t counterCount = 0;
+
+	uint8_t node = 0;
+	uint8_t nodes = 1;
+	int32_t pid = 0;
+	std::atomic<uint64_t> published{0};
+	std::atomic<uint64_t> lost{0};
+	// touched only by thread which polls
+	uint64_t received = 0;
+
+	// read from ring, not yet polled
+	std::mutex mtx;
+	std::deque<Received> queue;
+	std::thread reader;
+	std::atomic<bool> stopping{false};
+
+	// touched only by reader
+	uint64_t cursor = 0;
+	// event which is read in chunks
+	std::string pending;
+	bool assembling = false;
+	uint32_t pendingTotal = 0;
+	int32_t pendingWriter = 0;
+	uint16_t nextChunk = 0;
+	uint8_t pendingNode = 0, pendingEvent = 0, pendingFlags = 0;
+	// slot which isn't written yet since stuckSince
+	uint64_t stuckAt = UINT64_MAX;
+	std::chrono::steady_clock::time_point stuckSince;
+
+	static uint64_t hashKey(const std::string &key){
+		// FNV-1a, 0 marks free counter
+		uint64_t h = 14695981039346656037ULL;
+		for (unsigned char c : key){
+			h = (h ^ c) * 1099511628211ULL;
+		}
+		return h ? h : 1;
+	}
+
+	Counter *findCounter(const std::string &key){
+		uint64_t h = hashKey(key);
+		for (size_t i = 0; i < counterCount; ++i){
+			auto &c = counters[(h + i) % counterCount];
+			uint64_t k = c.key.load(std::memory_order_acquire);
+			if (k == h){
+				return &c;
+			}
+			if (k == 0){
+				uint64_t expected = 0;
+				if (c.key.compare_exchange_strong(expected, h) || expected == h){
+					return &c;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	static bool alive(int32_t p){
+		return kill(p, 0) == 0 || errno != ESRCH;
+	}
+
+	void lockSlot(Slot &s){
+		auto start = std::chrono::steady_clock::now();
+		int32_t owner = 0;
+		while (!s.lock.compare_exchange_weak(owner, pid, std::memory_order_acquire)){
+			// slot is written in microseconds, lock held longer may be left by writer which died
+			if (owner != 0 && std::chrono::steady_clock::now() - start > std::chrono::milliseconds(10) && !alive(owner)
+					&& s.lock.compare_exchange_strong(owner, pid, std::memory_order_acquire)){
+				shared->recovered.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			owner = 0;
+			std::this_thread::yield();
+		}
+	}
+
+	/// Waits until every process which isn't lagging has read the event which slot of pos held
+	void waitReaders(uint64_t pos){
+		if (pos < slotCount){
+			return;
+		}
+		uint64_t needed = pos - slotCount + 1;
+		auto start = std::chrono::steady_clock::now();
+		// own reader too, it passes own events
+		for (size_t n = 0; n < nodes; ++n){
+			while (!shared->lagged[n].load(std::memory_order_relaxed) && shared->cursors[n].load(std::memory_order_acquire) < needed){
+				if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(maxWaitMs)){
+					shared->lagged[n].store(true, std::memory_order_relaxed);
+					shared->lagging.fetch_add(1, std::memory_order_relaxed);
+					break;
+				}
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	/// Copies n bytes from offset from of room, its terminating zero and payload
+	static void copyPart(char *dst, const std::string &room, const std::string &payload, size_t from, size_t n){
+		size_t head = room.size() + 1;
+		if (from < head){
+			size_t k = std::min(n, head - from);
+			memcpy(dst, room.c_str() + from, k);
+			dst += k;
+			from += k;
+			n -= k;
+		}
+		if (n > 0){
+			memcpy(dst, payload.data() + (from - head), n);
+		}
+	}
+
+	bool writeSlot(uint64_t pos, Event event, uint8_t flags, uint16_t chunk, uint32_t total,
+			const std::string &room, const std::string &payload, size_t from, size_t n){
+		waitReaders(pos);
+
+		auto &s = slots[pos % slotCount];
+		lockSlot(s);
+
+		if (s.seq.load(std::memory_order_relaxed) > pos * 2 + 2){
+			s.lock.store(0, std::memory_order_release);
+			shared->outrun.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		s.seq.store(pos * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		s.writer = pid;
+		s.node = node;
+		s.event = (uint8_t) event;
+		s.flags = flags;
+		s.chunk = chunk;
+		s.total = total;
+		s.size = (uint32_t) n;
+		copyPart(s.data, room, payload, from, n);
+
+		s.seq.store(pos * 2 + 2, std::memory_order_release);
+		s.lock.store(0, std::memory_order_release);
+		return true;
+	}
+
+	/// Slot at cursor isn't written and won't be: its writer died, or nobody has locked it for abandonMs
+	bool abandoned(Slot &s){
+		int32_t owner = s.lock.load(std::memory_order_relaxed);
+		if (owner != 0){
+			return !alive(owner);
+		}
+		int32_t r = s.reserved.load(std::memory_order_relaxed);
+		if ((r != 0 && !alive(r)) || (assembling && !alive(pendingWriter))){
+			// the rest of event won't come
+			return true;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (stuckAt != cursor){
+			stuckAt = cursor;
+			stuckSince = now;
+			return false;
+		}
+		return now - stuckSince >= std::chrono::milliseconds(abandonMs);
+	}
+
+	inline void lose(){
+		lost.fetch_add(1, std::memory_order_relaxed);
+		assembling = false;
+	}
+
+	/// Moves new events of other processes from ring to queue, false if there were none
+	bool read(){
+		// head counts reserved slots, writers may wait to write them, so reader which is
+		// behind it for more than ring learns what it lost from sequences of slots
+		uint64_t head = shared->head.load(std::memory_order_acquire);
+		uint64_t start = cursor;
+		while (cursor < head){
+			auto &s = slots[cursor % slotCount];
+			uint64_t ready = cursor * 2 + 2;
+			uint64_t seq = s.seq.load(std::memory_order_acquire);
+			if (seq < ready){
+				if (!abandoned(s)){
+					// publisher is still writing
+					break;
+				}
+				lose();
+				++cursor;
+				continue;
+			}
+
+			if (seq > ready){
+				// slot was already reused by newer event
+				lose();
+				++cursor;
+				continue;
+			}
+
+			uint16_t chunk = s.chunk;
+			if (chunk != 0 && (!assembling || chunk != nextChunk)){
+				// the beginning of event is lost
+				lose();
+				++cursor;
+				continue;
+			}
+			if (chunk == 0){
+				pending.clear();
+				pendingWriter = s.writer;
+				pendingNode = s.node;
+				pendingEvent = s.event;
+				pendingFlags = s.flags;
+				pendingTotal = s.total;
+				assembling = true;
+			}
+			pending.append(s.data, std::min<uint32_t>(s.size, slotSize));
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) != ready){
+				lose();
+				++cursor;
+				continue;
+			}
+			nextChunk = chunk + 1;
+			++cursor;
+
+			if (pending.size() >= pendingTotal){
+				assembling = false;
+				if (pendingNode != node){
+					size_t end = strnlen(pending.data(), pending.size());
+					size_t off = std::min(end + 1, pending.size());
+					std::lock_guard<std::mutex> lock(mtx);
+					queue.push_back(Received{ (Event) pendingEvent, pendingFlags, pending.substr(0, end), pending.substr(off) });
+				}
+			}
+		}
+
+		shared->cursors[node].store(cursor, std::memory_order_release);
+		if (cursor == head && shared->lagged[node].load(std::memory_order_relaxed)){
+			shared->lagged[node].store(false, std::memory_order_relaxed);
+		}
+		return cursor != start;
+	}
+public:
+	/// Must be called before fork, mapping is inherited by children
+	ClusterBus(uint8_t nodeCount, size_t slotCount, size_t counterCount = 64*1024)
+		: slotCount(slotCount), counterCount(counterCount), nodes(nodeCount)
+	{
+		memSize = sizeof(Shared) + sizeof(Slot) * slotCount + sizeof(Counter) * counterCount;
+		mem = mmap(nullptr, memSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED){
+			mem = nullptr;
+			throw std::runtime_error("Can't map cluster shared memory");
+		}
+
+		// fresh anonymous mapping is zeroed, which is valid initial state
+		shared = static_cast<Shared *>(mem);
+		slots = reinterpret_cast<Slot *>(shared + 1);
+		counters = reinterpret_cast<Counter *>(slots + slotCount);
+		pid = getpid();
+	}
+
+	ClusterBus(const ClusterBus &) = delete;
+
+	~ClusterBus(){
+		stopping = true;
+		if (reader.joinable()){
+			reader.join();
+		}
+		if (mem){
+			munmap(mem, memSize);
+		}
+	}
+
+	/// Called once in every process after fork, starts reading. Events published since
+	/// creation of bus are still delivered to process which started later
+	void setNode(uint8_t n){
+		node = n;
+		pid = getpid();
+		shared->pids[node].store(pid, std::memory_order_release);
+		reader = std::thread([this]{
+			while (!stopping){
+				if (!read()){
+					std::this_thread::sleep_for(std::chrono::microseconds(200));
+				}
+			}
+		});
+	}
+
+	inline uint8_t getNode() const { return node; }
+	inline uint8_t getNodes() const { return nodes; }
+
+	/// False if process n has started and died
+	bool isAlive(uint8_t n){
+		int32_t p = shared->pids[n].load(std::memory_order_acquire);
+		return p == 0 || alive(p);
+	}
+
+	/// Safe to call from any thread. Returns false if event doesn't fit in half of ring or
+	/// was outrun. May wait up to maxWaitMs for every process which doesn't read
+	bool publish(Event event, const std::string &room, const std::string &payload, uint8_t flags = 0){
+		size_t size = room.size() + 1 + payload.size();
+		size_t chunks = (size + slotSize - 1) / slotSize;
+		if (chunks > slotCount / 2 || chunks > UINT16_MAX){
+			shared->oversized.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		if (chunks > 1){
+			shared->chunked.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// chunks take consecutive slots, readers join them in order
+		uint64_t pos = shared->head.fetch_add(chunks, std::memory_order_acq_rel);
+		for (size_t i = 0; i < chunks; ++i){
+			slots[(pos + i) % slotCount].reserved.store(pid, std::memory_order_relaxed);
+		}
+		bool res = true;
+		for (size_t i = 0; i < chunks; ++i){
+			size_t from = i * slotSize;
+			res = writeSlot(pos + i, event, flags, (uint16_t) i, (uint32_t) size, room, payload, from, std::min(slotSize, size - from)) && res;
+		}
+		if (res){
+			published.fetch_add(1, std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+	/// Calls func(event, room, payload, flags) for every event of other processes read
+	/// since the last poll. Must be called from one thread
+	template<typename F>
+	void poll(F func){
+		std::deque<Received> events;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			events.swap(queue);
+		}
+
+		for (auto &e : events){
+			++received;
+			func(e.event, e.room, e.payload, e.flags);
+		}
+	}
+
+	/// Changes cluster-wide counter, returns new value. Without free counters returns delta
+	int32_t addCounter(const std::string &key, int32_t delta){
+		auto c = findCounter(key);
+		if (!c){
+			return delta;
+		}
+		return c->value.fetch_add(delta, std::memory_order_acq_rel) + delta;
+	}
+
+	int32_t getCounter(const std::string &key){
+		auto c = findCounter(key);
+		return c ? c->value.load(std::memory_order_acquire) : 0;
+	}
+
+	/// Must be called from thread which polls. Counters of writers are cluster-wide
+	Stats getStats(){
+		Stats s;
+		s.published = published.load(std::memory_order_relaxed);
+		s.received = received;
+		s.lost = lost.load(std::memory_order_relaxed);
+		s.oversized = shared->oversized.load(std::memory_order_relaxed);
+		s.outrun = shared->outrun.load(std::memory_order_relaxed);
+		s.chunked = shared->chunked.load(std::memory_order_relaxed);
+		s.lagging = shared->lagging.load(std::memory_order_relaxed);
+		s.recovered = shared->recovered.load(std::memory_order_relaxed);
+		return s;
+	}
+};
+
+#endif //CLUSTER_HPP
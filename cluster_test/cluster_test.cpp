@@ -0,0 +1,302 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <jsoncpp/json/json.h>
+
+#include "../cluster.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Processes publish to small ring and poll it now and then: none of events is lost, also
+// ones bigger than slot. Process which doesn't read makes writers wait only for a while and
+// then counts events it lost. Writers killed while they publish don't stop the others.
+//
+// Then every process plays one wsserver of cluster: parses inbound messages, serializes
+// outbound packet, sends it to local members of room and publishes it to the bus.
+// Events of other processes are delivered to local members too.
+
+static const int membersPerProcess = 200;
+static const char *inbound = R"({"type":2,"target":"#main","to":0,"time":0,"message":"Hello, how are you? Let's test a cluster"})";
+
+struct Result {
+	uint64_t processed = 0;
+	uint64_t remote = 0;
+	uint64_t lost = 0;
+	double seconds = 0;
+};
+
+static void deliver(vector<vector<shared_ptr<const string>>> &queues, const shared_ptr<const string> &data){
+	for (auto &q : queues){
+		q.push_back(data);
+		if (q.size() > 64){
+			q.clear();
+		}
+	}
+}
+
+static Result runNode(ClusterBus &bus, int node, int messages){
+	bus.setNode((uint8_t) node);
+	vector<vector<shared_ptr<const string>>> queues(membersPerProcess);
+	Json::Reader rd;
+	Json::FastWriter wr;
+	Result res;
+
+	uint64_t expectRemote = (uint64_t) messages * (bus.getNodes() - 1);
+	auto onEvent = [&](ClusterBus::Event event, const string &room, const string &payload, uint8_t flags){
+		deliver(queues, make_shared<const string>(payload));
+		++res.remote;
+	};
+
+	auto start = steady_clock::now();
+	for (int i = 0; i < messages; ++i){
+		Json::Value in;
+		rd.parse(inbound, in);
+
+		Json::Value out;
+		out["type"] = 2;
+		out["target"] = in["target"];
+		out["time"] = (Json::UInt64) i;
+		out["from_login"] = "user" + to_string(node);
+		out["from"] = node;
+		out["message"] = in["message"];
+		auto data = make_shared<const string>(wr.write(out));
+
+		deliver(queues, data);
+		bus.publish(ClusterBus::Event::broadcast, "#main", *data);
+		++res.processed;
+
+		if (i % 16 == 0){
+			bus.poll(onEvent);
+		}
+	}
+
+	// wait for events of other processes
+	auto deadline = steady_clock::now() + seconds(30);
+	while (res.remote + bus.getStats().lost < expectRemote && steady_clock::now() < deadline){
+		bus.poll(onEvent);
+		this_thread::sleep_for(microseconds(100));
+	}
+
+	res.lost = bus.getStats().lost;
+	res.seconds = duration<double>(steady_clock::now() - start).count();
+	return res;
+}
+
+// payload which tells its sender and number, checked byte by byte
+static string makePayload(int node, int i, size_t size){
+	string res = to_string(node) + ":" + to_string(i) + ":";
+	while (res.size() < size){
+		res += (char) ('a' + (res.size() + i) % 26);
+	}
+	return res;
+}
+
+static bool checkPayload(const string &payload, int &node, int &i){
+	if (sscanf(payload.c_str(), "%d:%d:", &node, &i) != 2){
+		return false;
+	}
+	return payload == makePayload(node, i, payload.size());
+}
+
+static bool forkAll(int procs, function<bool(int)> func){
+	vector<pid_t> pids;
+	for (int n = 0; n < procs; ++n){
+		pid_t pid = fork();
+		if (pid == 0){
+			_exit(func(n) ? 0 : 1);
+		}
+		pids.push_back(pid);
+	}
+	bool res = true;
+	for (auto pid : pids){
+		int status = 0;
+		waitpid(pid, &status, 0);
+		res = res && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	return res;
+}
+
+static bool checkCorrectness(){
+	// every event is delivered in order of sender, big ones take several slots
+	const int procs = 4, events = 3000;
+	{
+		ClusterBus bus(procs, 64, 64);
+		bool ok = forkAll(procs, [&](int node){
+			bus.setNode((uint8_t) node);
+			vector<int> next(procs, 0);
+			bool valid = true;
+			uint64_t got = 0;
+			auto onEvent = [&](ClusterBus::Event event, const string &room, const string &payload, uint8_t flags){
+				int from, i;
+				valid = valid && room == "#main" && checkPayload(payload, from, i) && from != node && i == next[from]++;
+				++got;
+			};
+			for (int i = 0; i < events; ++i){
+				size_t size = i % 100 == 0 ? ClusterBus::slotSize * 3 + 17 : 100 + i % 1000;
+				if (!bus.publish(ClusterBus::Event::broadcast, "#main", makePayload(node, i, size))){
+					cout << "Event " << i << " isn't published by " << node << endl;
+					return false;
+				}
+				if (i % 16 == 0){
+					bus.poll(onEvent);
+				}
+			}
+			auto deadline = steady_clock::now() + seconds(30);
+			while (got < (uint64_t) events * (procs - 1) && valid && steady_clock::now() < deadline){
+				bus.poll(onEvent);
+				this_thread::sleep_for(microseconds(100));
+			}
+			auto st = bus.getStats();
+			if (!valid || got != (uint64_t) events * (procs - 1) || st.lost != 0 || st.chunked != (uint64_t) procs * events / 100){
+				cout << "Process " << node << " got " << got << " events of " << (uint64_t) events * (procs - 1) << ", lost " << st.lost << (valid ? "" : ", events are wrong or out of order") << endl;
+				return false;
+			}
+			return true;
+		});
+		if (!ok){
+			return false;
+		}
+	}
+
+	// writer doesn't wait for process which is stopped, which learns what it lost
+	{
+		const int count = 1000;
+		ClusterBus bus(2, 64, 64);
+		pid_t pid = fork();
+		if (pid == 0){
+			bus.setNode(1);
+			uint64_t got = 0;
+			auto deadline = steady_clock::now() + seconds(10);
+			while (got + bus.getStats().lost < count && steady_clock::now() < deadline){
+				bus.poll([&](ClusterBus::Event, const string &, const string &, uint8_t){ ++got; });
+				this_thread::sleep_for(milliseconds(1));
+			}
+			_exit(got + bus.getStats().lost == count && bus.getStats().lost > 0 ? 0 : 1);
+		}
+		bus.setNode(0);
+		this_thread::sleep_for(milliseconds(50));
+		kill(pid, SIGSTOP);
+
+		auto start = steady_clock::now();
+		for (int i = 0; i < count; ++i){
+			bus.publish(ClusterBus::Event::broadcast, "#main", makePayload(0, i, 100));
+		}
+		bool quick = steady_clock::now() - start < milliseconds(ClusterBus::maxWaitMs * 5);
+		kill(pid, SIGCONT);
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!quick || bus.getStats().lagging != 1){
+			cout << "Writer waited for process which doesn't read" << endl;
+			return false;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			cout << "Stopped process didn't count lost events" << endl;
+			return false;
+		}
+	}
+
+	// writers killed in the middle of big events leave locks and unfinished slots
+	{
+		ClusterBus bus(2, 64, 64);
+		for (int round = 0; round < 10; ++round){
+			pid_t pid = fork();
+			if (pid == 0){
+				bus.setNode(1);
+				string payload = makePayload(1, 0, ClusterBus::slotSize * 8);
+				for (;;){
+					bus.publish(ClusterBus::Event::broadcast, "#main", payload);
+				}
+			}
+			this_thread::sleep_for(milliseconds(5 + round));
+			kill(pid, SIGKILL);
+			waitpid(pid, nullptr, 0);
+		}
+
+		// the other process still gets what is published after them
+		bool ok = forkAll(1, [&](int){
+			bus.setNode(1);
+			return bus.publish(ClusterBus::Event::broadcast, "#main", makePayload(1, -1, 100));
+		});
+		bus.setNode(0);
+		auto deadline = steady_clock::now() + seconds(30);
+		bool found = false;
+		uint64_t got = 0;
+		while (ok && !found && steady_clock::now() < deadline){
+			bus.poll([&](ClusterBus::Event, const string &, const string &payload, uint8_t){
+				int from, i;
+				found = found || (checkPayload(payload, from, i) && i == -1);
+				++got;
+			});
+			this_thread::sleep_for(milliseconds(1));
+		}
+		if (!found){
+			cout << "Bus is stuck after writers were killed" << endl;
+			return false;
+		}
+		auto st = bus.getStats();
+		cout << "Killed writers: " << got << " events got, " << st.lost << " slots lost, "
+			<< st.recovered << " locks taken over" << endl;
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	int messages = argc > 1 ? atoi(argv[1]) : 200000;
+	int maxProcesses = argc > 2 ? atoi(argv[2]) : 8;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	cout << "Hardware threads: " << thread::hardware_concurrency() << ", messages per process: " << messages << endl;
+	cout << setw(10) << "processes" << setw(16) << "msg/s total" << setw(16) << "msg/s/process"
+		<< setw(18) << "remote delivered" << setw(10) << "lost" << setw(18) << "member sends/s" << endl;
+
+	for (int procs = 1; procs <= maxProcesses; procs *= 2){
+		ClusterBus bus((uint8_t) procs, 4096, 1024);
+		auto results = static_cast<Result *>(mmap(nullptr, sizeof(Result) * procs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+
+		vector<pid_t> pids;
+		for (int n = 0; n < procs; ++n){
+			pid_t pid = fork();
+			if (pid == 0){
+				results[n] = runNode(bus, n, messages);
+				_exit(0);
+			}
+			pids.push_back(pid);
+		}
+		for (auto pid : pids){
+			waitpid(pid, nullptr, 0);
+		}
+
+		double seconds = 0;
+		uint64_t processed = 0, remote = 0, lost = 0;
+		for (int n = 0; n < procs; ++n){
+			seconds = max(seconds, results[n].seconds);
+			processed += results[n].processed;
+			remote += results[n].remote;
+			lost += results[n].lost;
+		}
+
+		cout << setw(10) << procs << setw(16) << fixed << setprecision(0) << processed / seconds
+			<< setw(16) << processed / seconds / procs << setw(18) << remote << setw(10) << lost
+			<< setw(18) << (processed + remote) * membersPerProcess / seconds << endl;
+
+		munmap(results, sizeof(Result) * procs);
+	}
+
+	return 0;
+}
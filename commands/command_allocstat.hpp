@@ -0,0 +1,31 @@
+#ifndef BUILD_COMMAND_ALLOCSTAT_HPP
+#define BUILD_COMMAND_ALLOCSTAT_HPP
+
+#include <sstream>
+
+#include "command.hpp"
+#include "../packets.hpp"
+#include "../object_pool.hpp"
+
+class CommandAllocStat : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		auto room = member->getRoom();
+
+		std::ostringstream res;
+		res.precision(1);
+		res << std::fixed << "Пулы объектов (размер: используется, выделений, из пула, слэбов):\n";
+		for (auto &st : BlockPool::getAllStats()){
+			double reused = st.allocations > 0 ? 100.0 * (st.allocations - st.fresh) / st.allocations : 0;
+			res << st.blockSize << " байт: " << st.inUse << ", " << st.allocations << ", " << reused << "%, " << st.slabs << "\n";
+		}
+
+		member->sendPacket(PacketSystem(room->getName(), res.str()));
+	}
+
+	virtual std::string getName() override { return "allocstat"; }
+	virtual std::string getArgumentsTemplate() override { return ""; }
+	virtual std::string getDescription() override { return "Показать статистику пулов объектов"; }
+};
+
+#endif //BUILD_COMMAND_ALLOCSTAT_HPP
@@ -0,0 +1,39 @@
+#ifndef BUILD_COMMAND_AUTHSTAT_HPP
+#define BUILD_COMMAND_AUTHSTAT_HPP
+
+#include <sstream>
+
+#include "command.hpp"
+#include "../packets.hpp"
+#include "../profile_cache.hpp"
+
+class CommandAuthStat : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		auto room = member->getRoom();
+		auto server = member->getClient()->getServer();
+
+		auto stats = server->getAuthPool().getStats();
+
+		std::ostringstream res;
+		res.precision(2);
+		res << std::fixed
+			<< "Потоки авторизации: " << stats.workers << ", выполняется: " << stats.running << "\n"
+			<< "Очередь: " << stats.queued << " из " << stats.queueLimit << ", отклонено: " << stats.rejected << "\n"
+			<< "Выполнено: " << stats.done << "\n"
+			<< "Ожидание в очереди: среднее " << stats.avgWaitMs << " мс, максимальное " << stats.maxWaitMs << " мс\n";
+
+		auto cstats = ProfileCache::instance().getStats();
+		res << "Кэш профилей: " << cstats.size << " из " << cstats.capacity
+			<< ", попаданий: " << cstats.hits << ", отрицательных попаданий: " << cstats.negativeHits
+			<< ", промахов: " << cstats.misses << ", сброшено: " << cstats.invalidations << "\n";
+
+		member->sendPacket(PacketSystem(room->getName(), res.str()));
+	}
+
+	virtual std::string getName() override { return "authstat"; }
+	virtual std::string getArgumentsTemplate() override { return ""; }
+	virtual std::string getDescription() override { return "Показать статистику очереди авторизации"; }
+};
+
+#endif //BUILD_COMMAND_AUTHSTAT_HPP
@@ -0,0 +1,40 @@
+#ifndef BUILD_COMMAND_CLUSTERSTAT_HPP
+#define BUILD_COMMAND_CLUSTERSTAT_HPP
+
+#include <sstream>
+
+#include "command.hpp"
+#include "../packets.hpp"
+
+class CommandClusterStat : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		auto room = member->getRoom();
+		auto server = member->getClient()->getServer();
+
+		// stats of bus are read by thread which polls it
+		server->post([server, member, room]{
+			auto cluster = server->getCluster();
+			if (!cluster){
+				member->sendPacket(PacketSystem(room->getName(), "Сервер работает без кластера"));
+				return;
+			}
+
+			auto st = cluster->getStats();
+			std::ostringstream res;
+			res << "Процесс " << (int) cluster->getNode() << " из " << (int) cluster->getNodes() << ":\n"
+				<< "опубликовано " << st.published << ", получено " << st.received << ", потеряно " << st.lost << "\n"
+				<< "Весь кластер:\n"
+				<< "слишком больших " << st.oversized << ", обогнано " << st.outrun << ", по частям " << st.chunked << "\n"
+				<< "отставаний читателей " << st.lagging << ", снятых блокировок " << st.recovered;
+
+			member->sendPacket(PacketSystem(room->getName(), res.str()));
+		});
+	}
+
+	virtual std::string getName() override { return "clusterstat"; }
+	virtual std::string getArgumentsTemplate() override { return ""; }
+	virtual std::string getDescription() override { return "Показать статистику шины кластера"; }
+};
+
+#endif //BUILD_COMMAND_CLUSTERSTAT_HPP
@@ -0,0 +1,39 @@
+#ifndef BUILD_COMMAND_HISTORY_HPP
+#define BUILD_COMMAND_HISTORY_HPP
+
+#include "command.hpp"
+#include "../packets.hpp"
+
+class CommandHistorySize : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		static regex r_int("^\\d+");
+
+		auto room = member->getRoom();
+		PacketSystem syspack;
+		syspack.target = room->getName();
+
+		if (parser.next(r_int)){
+			uint size;
+			parser.read(0, size);
+
+			if (size == 0 || size > Room::maxHistorySize){
+				syspack.message = "Размер истории должен быть от 1 до " + to_string(Room::maxHistorySize);
+			} else if (room->setHistorySize(size)){
+				syspack.message = "Размер истории изменен";
+			} else {
+				syspack.message = "Размер истории не изменился";
+			}
+		}
+		else {
+			syspack.message = "Размер истории: " + to_string(room->getHistorySize());
+		}
+		member->sendPacket(syspack);
+	}
+
+	virtual std::string getName() override { return "history"; }
+	virtual std::string getArgumentsTemplate() override { return "[size]"; }
+	virtual std::string getDescription() override { return "Показать или изменить количество сообщений в истории комнаты"; }
+};
+
+#endif //BUILD_COMMAND_HISTORY_HPP
@@ -14,12 +14,14 @@ public:
 		auto room = member->getRoom();
 		auto server = member->getClient()->getServer();
 
-		string res = "Подключения:\n";
-		for (auto c : server->getConnectionsCounter()){
-			res += c.first + " - " + to_string(c.second) + "\n";
-		}
+		server->post([server, member, room]{
+			string res = "Подключения:\n";
+			for (auto c : server->getConnectionsCounter()){
+				res += c.first + " - " + to_string(c.second) + "\n";
+			}
 
-		member->sendPacket(PacketSystem(room->getName(), res));
+			member->sendPacket(PacketSystem(room->getName(), res));
+		});
 	}
 
 	virtual std::string getName() override { return "ipcounter"; }
@@ -22,7 +22,7 @@ public:
 		nick = regex_replace(regex_replace(nick, regex("^\\s+"), ""), regex("\\s+$"), "");
 
 		if (nick.empty() || regex_match(nick, r_login)){ //TODO: regex to config?
-			if (!nick.empty() && room->findMemberByNick(nick)){
+			if (!nick.empty() && room->isNickTaken(nick)){
 				syspack.message = "Такой ник уже занят";
 				member->sendPacket(syspack);
 			} else {
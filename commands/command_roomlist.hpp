@@ -14,12 +14,15 @@ public:
 		auto room = member->getRoom();
 		auto server = member->getClient()->getServer();
 
-		string rooms = "Комнаты:\n";
-		for (auto r : server->getRooms()){
-			rooms += to_string(r->getOwner()) + ": " + r->getName() + "\n";
-		}
+		// room set belongs to server thread, owner of room may be read from it
+		server->post([server, member, room]{
+			string rooms = "Комнаты:\n";
+			for (auto r : server->getRooms()){
+				rooms += to_string(r->getOwner()) + ": " + r->getName() + "\n";
+			}
 
-		member->sendPacket(PacketSystem(room->getName(), rooms));
+			member->sendPacket(PacketSystem(room->getName(), rooms));
+		});
 	}
 
 	virtual std::string getName() override { return "roomlist"; }
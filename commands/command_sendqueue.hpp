@@ -0,0 +1,44 @@
+#ifndef BUILD_COMMAND_SENDQUEUE_HPP
+#define BUILD_COMMAND_SENDQUEUE_HPP
+
+#include <algorithm>
+
+#include "command.hpp"
+#include "../packets.hpp"
+
+class CommandSendQueue : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		auto room = member->getRoom();
+		auto server = member->getClient()->getServer();
+
+		server->post([server, member, room]{
+			auto stats = server->getSendQueueStats();
+			string res = "Очереди отправки: " + to_string(stats.frames) + " сообщений, " + to_string(stats.bytes) + " байт\n"
+					+ "Отброшено сообщений: " + to_string(stats.dropped) + ", отключено клиентов: " + to_string(stats.evicted) + "\n";
+
+			vector<pair<size_t, ClientPtr>> depths;
+			for (auto cli : server->getClients()){
+				auto depth = server->getSendQueueDepth(cli);
+				if (depth.frames > 0){
+					depths.emplace_back(depth.bytes, cli);
+				}
+			}
+
+			size_t top = std::min<size_t>(depths.size(), 10);
+			std::partial_sort(depths.begin(), depths.begin() + top, depths.end(), [](auto &a, auto &b){ return a.first > b.first; });
+			for (size_t i = 0; i < top; ++i){
+				auto cli = depths[i].second;
+				res += cli->getName() + " (uid " + to_string(cli->getID()) + ", " + cli->getIP() + ") - " + to_string(depths[i].first) + " байт\n";
+			}
+
+			member->sendPacket(PacketSystem(room->getName(), res));
+		});
+	}
+
+	virtual std::string getName() override { return "sendqueue"; }
+	virtual std::string getArgumentsTemplate() override { return ""; }
+	virtual std::string getDescription() override { return "Показать размер очередей отправки"; }
+};
+
+#endif //BUILD_COMMAND_SENDQUEUE_HPP
@@ -0,0 +1,38 @@
+#ifndef BUILD_COMMAND_UNCACHE_HPP
+#define BUILD_COMMAND_UNCACHE_HPP
+
+#include "command.hpp"
+#include "../packets.hpp"
+#include "../profile_cache.hpp"
+
+class CommandUncache : public Command {
+public:
+	virtual void process(MemberPtr member, regex_parser &parser) override {
+		static regex r_int("^\\d+");
+
+		auto room = member->getRoom();
+		PacketSystem syspack;
+		syspack.target = room->getName();
+
+		if (parser.next(r_int)){
+			uint uid;
+			parser.read(0, uid);
+
+			if (ProfileCache::instance().invalidate(uid)){
+				syspack.message = "Профиль удален из кэша";
+			} else {
+				syspack.message = "Профиля нет в кэше";
+			}
+		}
+		else {
+			syspack.message = "Укажите ID аккаунта пользователя";
+		}
+		member->sendPacket(syspack);
+	}
+
+	virtual std::string getName() override { return "uncache"; }
+	virtual std::string getArgumentsTemplate() override { return "<uid>"; }
+	virtual std::string getDescription() override { return "Сбросить кэшированный профиль пользователя"; }
+};
+
+#endif //BUILD_COMMAND_UNCACHE_HPP
@@ -18,5 +18,11 @@
 #include "command_userlist.hpp"
 #include "command_roomlist.hpp"
 #include "command_ipcounter.hpp"
+#include "command_sendqueue.hpp"
+#include "command_authstat.hpp"
+#include "command_uncache.hpp"
+#include "command_allocstat.hpp"
+#include "command_clusterstat.hpp"
+#include "command_history.hpp"
 
 #endif //BUILD_COMMANDS_HPP
@@ -1,4 +1,113 @@
 #include "db.hpp"
 
-unique_ptr<sql::Connection> Database::conn;
+#include <chrono>
 
+ConnectionPool::ConnectionPool(){
+	auto dbconf = config["database"];
+	size = dbconf.get("pool_size", 4).asUInt();
+	checkInterval = dbconf.get("check_interval", 30).asInt();
+	acquireTimeout = dbconf.get("acquire_timeout", 5).asInt();
+	missing = size;
+
+	checker = std::thread([this]{ check(); });
+}
+
+ConnectionPool::~ConnectionPool(){
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopping = true;
+	}
+	cv_check.notify_all();
+	checker.join();
+}
+
+ConnectionPool &ConnectionPool::instance(){
+	static ConnectionPool pool;
+	return pool;
+}
+
+PooledConnectionPtr ConnectionPool::connect(){
+	sql::mysql::MySQL_Driver driver;
+	auto dbconf = config["database"];
+
+	auto pc = std::make_shared<PooledConnection>();
+	pc->conn = unique_ptr<sql::Connection>(driver.connect(dbconf["host"].asString(), dbconf["user"].asString(), dbconf["password"].asString()));
+
+	unique_ptr<sql::Statement> st(pc->conn->createStatement());
+	st->execute("set names utf8");
+	st->execute("use www");
+
+	return pc;
+}
+
+void ConnectionPool::check(){
+	std::unique_lock<std::mutex> lock(mtx);
+	while (!stopping){
+		// idle connections are checked outside of lock, acquire() waits for them meanwhile
+		auto checking = std::move(idle);
+		idle.clear();
+		lock.unlock();
+
+		std::vector<PooledConnectionPtr> healthy;
+		size_t broken = 0;
+		for (auto &pc : checking){
+			try {
+				if (!pc->conn->isClosed() && pc->conn->isValid()){
+					healthy.push_back(pc);
+					continue;
+				}
+			} catch (sql::SQLException &e){}
+			++broken;
+		}
+
+		lock.lock();
+		idle.insert(idle.end(), healthy.begin(), healthy.end());
+		missing += broken;
+		size_t toConnect = missing;
+		cv_free.notify_all();
+		lock.unlock();
+
+		for (size_t i = 0; i < toConnect; ++i){
+			try {
+				auto pc = connect();
+
+				std::lock_guard<std::mutex> guard(mtx);
+				idle.push_back(pc);
+				--missing;
+				cv_free.notify_one();
+			} catch (sql::SQLException &e){
+				Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
+				break;
+			}
+		}
+
+		lock.lock();
+		cv_check.wait_for(lock, std::chrono::seconds(missing > 0 ? 1 : checkInterval));
+	}
+}
+
+PooledConnectionPtr ConnectionPool::acquire(){
+	std::unique_lock<std::mutex> lock(mtx);
+	if (!cv_free.wait_for(lock, std::chrono::seconds(acquireTimeout), [this]{ return !idle.empty(); })){
+		throw sql::SQLException("No free database connection in pool", "HY000", 0);
+	}
+
+	auto pc = idle.back();
+	idle.pop_back();
+	return pc;
+}
+
+void ConnectionPool::release(PooledConnectionPtr pc){
+	if (!pc){
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mtx);
+	if (pc->broken){
+		++missing;
+		cv_check.notify_all();
+	} else {
+		idle.push_back(pc);
+		cv_free.notify_one();
+	}
+}
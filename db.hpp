@@ -9,6 +9,12 @@
 #include <cppconn/exception.h>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
 
 #include "config.hpp"
 #include "algo.hpp"
@@ -19,27 +25,82 @@ using std::unique_ptr;
 
 class Database;
 
+/// Connection of the pool with statements prepared on it
+struct PooledConnection {
+	unique_ptr<sql::Connection> conn;
+	std::unordered_map<string, std::shared_ptr<sql::PreparedStatement>> statements;
+	bool broken = false;
+};
+
+using PooledConnectionPtr = std::shared_ptr<PooledConnection>;
+
+/// Fixed count of MySQL connections. Broken connections are replaced and idle ones
+/// are checked by background thread, so request path never connects to database itself
+class ConnectionPool {
+private:
+	std::mutex mtx;
+	std::condition_variable cv_free;
+	std::condition_variable cv_check;
+	std::vector<PooledConnectionPtr> idle;
+	size_t size;
+	size_t missing;
+	int checkInterval;
+	int acquireTimeout;
+	bool stopping = false;
+	std::thread checker;
+
+	ConnectionPool();
+	~ConnectionPool();
+
+	PooledConnectionPtr connect();
+	void check();
+public:
+	static ConnectionPool &instance();
+
+	/// Waits for free healthy connection, throws sql::SQLException on timeout
+	PooledConnectionPtr acquire();
+	void release(PooledConnectionPtr pc);
+};
+
+/// Statement of pooled connection. Failed execution is retried on another connection of
+/// the pool, the statement is prepared there again and its parameters are bound again
 template <typename T>
 class SafeStatement {
 private:
 	Database *db;
-	unique_ptr<T> pst;
+	PooledConnectionPtr owner;
+	std::shared_ptr<T> pst;
+	string sql;
+	std::vector<std::function<void(T &)>> params;
+
+	void renew();
+
+	template <typename F>
+	auto retry(F func) -> decltype(func());
 public:
 	SafeStatement(SafeStatement<T> &) = delete;
 	SafeStatement(const SafeStatement<T> &) = delete;
 
-	explicit SafeStatement(Database &fdb, T *st){
-		pst.reset(st);
+	explicit SafeStatement(Database &fdb, PooledConnectionPtr pc, std::shared_ptr<T> st, const string &text){
+		pst = st;
+		owner = pc;
 		db = &fdb;
+		sql = text;
 	}
 
 	SafeStatement(SafeStatement &&ss){
 		pst.swap(ss.pst);
+		owner.swap(ss.owner);
+		sql.swap(ss.sql);
+		params.swap(ss.params);
 		db = ss.db;
 	}
 
 	SafeStatement<T> &operator = (SafeStatement<T> &&ss){
 		pst.swap(ss.pst);
+		owner.swap(ss.owner);
+		sql.swap(ss.sql);
+		params.swap(ss.params);
 		db = ss.db;
 		return *this;
 	}
@@ -48,6 +109,18 @@ public:
 	unique_ptr<sql::ResultSet> executeQuery();
 	int executeUpdate();
 
+	/// Parameters of prepared statement must be set here, not through operator ->,
+	/// to be bound again when execution is retried
+	void setString(unsigned int index, const string &value){
+		pst->setString(index, value);
+		params.push_back([index, value](T &st){ st.setString(index, value); });
+	}
+
+	void setInt(unsigned int index, int32_t value){
+		pst->setInt(index, value);
+		params.push_back([index, value](T &st){ st.setInt(index, value); });
+	}
+
 	T *operator -> (){
 		return pst.get();
 	}
@@ -59,66 +132,106 @@ public:
 
 class Database {
 private:
-	static unique_ptr<sql::Connection> conn;
-	
-	void init(){
-		execute("set names utf8");
-		execute("use www");
-	}
+	PooledConnectionPtr pc;
 
-	bool execute(const string &sql){
-		return statement()->execute(sql);
+	PooledConnectionPtr connection(){
+		if (!pc){
+			pc = ConnectionPool::instance().acquire();
+		}
+		return pc;
 	}
+public:
+	Database(){}
 
-	unique_ptr<sql::ResultSet> query(const string &sql){
-		return unique_ptr<sql::ResultSet>(statement()->executeQuery(sql));
-		//TODO: обертка, чтобы сохранять statement()
+	Database(const Database &) = delete;
+
+	~Database(){
+		ConnectionPool::instance().release(pc);
 	}
-public:
-	Database(){
-		if (!conn || conn->isClosed()){
-			reconnect();
+
+	/// Gives broken connection back to the pool for background reconnect,
+	/// next statement takes another one
+	void reconnect(){
+		if (pc){
+			pc->broken = true;
+			ConnectionPool::instance().release(pc);
+			pc = nullptr;
 		}
 	}
 	
-	void reconnect(){
-		sql::mysql::MySQL_Driver driver;
-		auto dbconf = config["database"];
-
-		if (conn){
-			conn->close();
-		}
+	/// Creates statement of type T on connection of this object and sets c to it
+	template <typename T>
+	std::shared_ptr<T> create(PooledConnectionPtr &c, const string &sql);
 
-		conn = unique_ptr<sql::Connection>(driver.connect(dbconf["host"].asString(), dbconf["user"].asString(), dbconf["password"].asString()));
-		init();
-	}
+	SafeStatement<sql::Statement> statement();
 	
-	SafeStatement<sql::Statement> statement(){
-		return SafeStatement<sql::Statement>(*this, conn->createStatement());
+	/// Statements are prepared once per connection and reused by SQL text
+	SafeStatement<sql::PreparedStatement> prepare(const string &sql);
+
+};
+
+template <>
+inline std::shared_ptr<sql::Statement> Database::create(PooledConnectionPtr &c, const string &){
+	c = connection();
+	return std::shared_ptr<sql::Statement>(c->conn->createStatement());
+}
+
+template <>
+inline std::shared_ptr<sql::PreparedStatement> Database::create(PooledConnectionPtr &c, const string &sql){
+	c = connection();
+	auto &ps = c->statements[sql];
+	if (!ps){
+		ps.reset(c->conn->prepareStatement(sql));
+	} else {
+		ps->clearParameters();
 	}
-	
-	SafeStatement<sql::PreparedStatement> prepare(const string &sql){
-		return SafeStatement<sql::PreparedStatement>(*this, conn->prepareStatement(sql));
+	return ps;
+}
+
+inline SafeStatement<sql::Statement> Database::statement(){
+	PooledConnectionPtr c;
+	auto st = create<sql::Statement>(c, string());
+	return SafeStatement<sql::Statement>(*this, c, st, string());
+}
+
+inline SafeStatement<sql::PreparedStatement> Database::prepare(const string &sql){
+	PooledConnectionPtr c;
+	auto ps = create<sql::PreparedStatement>(c, sql);
+	return SafeStatement<sql::PreparedStatement>(*this, c, ps, sql);
+}
+
+/// Broken connection goes back to the pool, statement is made again on the next one
+template <typename T>
+void SafeStatement<T>::renew(){
+	db->reconnect();
+	pst = db->create<T>(owner, sql);
+	for (auto &p : params){
+		p(*pst);
 	}
+}
 
-};
+template <typename T>
+template <typename F>
+auto SafeStatement<T>::retry(F func) -> decltype(func()){
+	int tries = 3;
+	while (true){
+		try {
+			return func();
+		} catch (sql::SQLException &e){
+			if (--tries <= 0){
+				throw;
+			}
+
+			Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
+			renew();
+		}
+	}
+}
 
 template <typename T>
 bool SafeStatement<T>::execute(){
 	if (pst){
-		int tries = 3;
-		while (tries--){
-			try {
-				return pst->execute();
-			} catch (sql::SQLException &e){
-				if (tries < 0){
-					throw;
-				}
-
-				Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
-				db->reconnect();
-			}
-		}
+		return retry([this]{ return pst->execute(); });
 	}
 	return false;
 }
@@ -126,19 +239,7 @@ bool SafeStatement<T>::execute(){
 template <typename T>
 unique_ptr<sql::ResultSet> SafeStatement<T>::executeQuery(){
 	if (pst){
-		int tries = 3;
-		while (tries--){
-			try {
-				return as_unique(pst->executeQuery());
-			} catch (sql::SQLException &e){
-				if (tries <= 0){
-					throw;
-				}
-
-				Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
-				db->reconnect();
-			}
-		}
+		return retry([this]{ return as_unique(pst->executeQuery()); });
 	}
 	return nullptr;
 }
@@ -146,22 +247,9 @@ unique_ptr<sql::ResultSet> SafeStatement<T>::executeQuery(){
 template <typename T>
 int SafeStatement<T>::executeUpdate(){
 	if (pst){
-		int tries = 3;
-		while (tries--){
-			try {
-				return pst->executeUpdate();
-			} catch (sql::SQLException &e){
-				if (tries < 0){
-					throw;
-				}
-
-				Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
-				db->reconnect();
-			}
-		}
+		return retry([this]{ return pst->executeUpdate(); });
 	}
 	return 0;
 }
 
 #endif
-
@@ -0,0 +1,288 @@
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <boost/utility/string_view.hpp>
+#include <zlib.h>
+
+/// permessage-deflate (RFC 7692). Message is raw deflate stream ended by sync flush, whose
+/// empty stored block 00 00 ff ff is cut off before sending and appended back by receiver.
+///
+/// By default server forgets LZ77 window after every message (server_no_context_takeover),
+/// so broadcast packet is compressed once and the same frame goes to every recipient.
+/// Connection may keep its own window when context_takeover is enabled in config: its private
+/// packets then compress better, but deflater of connection takes about 256 KB.
+/// Frames compressed once for everyone are put into that window as history, the way client
+/// inflater sees them, so both kinds of frames are mixed on one connection.
+/// Clients are always asked for client_no_context_takeover, so inbound frames are inflated
+/// by one inflater of thread
+
+/// Empty stored block of sync flush, cut off from every message
+static const char deflateTail[4] = { 0, 0, (char) 0xff, (char) 0xff };
+
+/// Compression settings of process, set once at start before io threads run
+struct DeflateOptions {
+	bool enabled = true;
+	int level = Z_DEFAULT_COMPRESSION;
+	// shorter payloads are sent uncompressed, deflate wouldn't win much on them
+	size_t minSize = 256;
+	bool contextTakeover = false;
+
+	static DeflateOptions &get(){
+		static DeflateOptions opts;
+		return opts;
+	}
+};
+
+/// Result of negotiation with client, from its Sec-WebSocket-Extensions header
+struct DeflateParams {
+	bool enabled = false;
+	bool contextTakeover = false;
+
+	/// Takes the first permessage-deflate offer which server can accept. Offer which limits
+	/// server window by server_max_window_bits is declined: frames compressed once for
+	/// everyone use full 32 KB window
+	static DeflateParams negotiate(const std::string &offers){
+		DeflateParams res;
+		auto &opts = DeflateOptions::get();
+		if (!opts.enabled){
+			return res;
+		}
+
+		size_t pos = 0;
+		while (pos < offers.size()){
+			size_t next = offers.find(',', pos);
+			if (next == std::string::npos){
+				next = offers.size();
+			}
+
+			bool first = true;
+			bool accept = false;
+			bool noTakeover = false;
+			size_t p = pos;
+			while (p < next){
+				size_t e = offers.find(';', p);
+				if (e == std::string::npos || e > next){
+					e = next;
+				}
+				auto param = trim(boost::string_view(offers).substr(p, e - p));
+				auto name = trim(param.substr(0, param.find('=')));
+				auto value = param.find('=') != boost::string_view::npos ? trim(param.substr(param.find('=') + 1)) : boost::string_view();
+				if (first){
+					accept = name == "permessage-deflate";
+					first = false;
+				} else if (name == "server_no_context_takeover"){
+					noTakeover = true;
+				} else if (name == "server_max_window_bits"){
+					accept = accept && (value == "15" || value == "\"15\"");
+				} else if (name != "client_max_window_bits" && name != "client_no_context_takeover"){
+					accept = false;
+				}
+				p = e + 1;
+			}
+
+			if (accept){
+				res.enabled = true;
+				res.contextTakeover = opts.contextTakeover && !noTakeover;
+				return res;
+			}
+			pos = next + 1;
+		}
+		return res;
+	}
+
+	/// Value of Sec-WebSocket-Extensions in handshake response
+	std::string responseHeader() const {
+		if (!enabled){
+			return std::string();
+		}
+		return contextTakeover ? "permessage-deflate; client_no_context_takeover"
+				: "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+	}
+private:
+	static boost::string_view trim(boost::string_view s){
+		while (!s.empty() && (s.front() == ' ' || s.front() == '\t')){
+			s.remove_prefix(1);
+		}
+		while (!s.empty() && (s.back() == ' ' || s.back() == '\t')){
+			s.remove_suffix(1);
+		}
+		return s;
+	}
+};
+
+/// Raw deflate stream which compresses messages one by one
+class Deflater {
+private:
+	z_stream zs;
+	bool ok;
+	bool keepContext;
+public:
+	/// keep_context: window stays between messages, otherwise every message is independent
+	Deflater(bool keep_context = false, int level = DeflateOptions::get().level) : keepContext(keep_context){
+		memset(&zs, 0, sizeof(zs));
+		ok = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	}
+
+	~Deflater(){
+		if (ok){
+			deflateEnd(&zs);
+		}
+	}
+
+	Deflater(const Deflater &) = delete;
+	Deflater &operator =(const Deflater &) = delete;
+
+	/// Appends compressed message to out, without 00 00 ff ff at the end
+	bool compress(boost::string_view in, std::string &out){
+		if (!ok){
+			return false;
+		}
+
+		size_t start = out.size();
+		zs.next_in = (Bytef *) in.data();
+		zs.avail_in = (uInt) in.size();
+		int res;
+		do {
+			size_t have = out.size();
+			size_t chunk = deflateBound(&zs, zs.avail_in) + 16;
+			out.resize(have + chunk);
+			zs.next_out = (Bytef *) &out[have];
+			zs.avail_out = (uInt) chunk;
+			res = deflate(&zs, Z_SYNC_FLUSH);
+			out.resize(have + chunk - zs.avail_out);
+		} while (res == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+
+		if (!keepContext){
+			deflateReset(&zs);
+		}
+		if ((res != Z_OK && res != Z_BUF_ERROR) || out.size() - start < 4){
+			out.resize(start);
+			return false;
+		}
+		out.resize(out.size() - 4);
+		return true;
+	}
+
+	/// Puts data which client inflated from other stream into window, as if it was compressed here
+	bool addHistory(boost::string_view data){
+		if (!ok || !keepContext){
+			return ok;
+		}
+		return deflateSetDictionary(&zs, (const Bytef *) data.data(), (uInt) data.size()) == Z_OK;
+	}
+
+	/// Deflater of thread for messages which are compressed once for every recipient
+	static Deflater &shared(){
+		static thread_local Deflater d(false);
+		return d;
+	}
+};
+
+/// Builds one compressed message of several parts. Parts compressed once for everyone are
+/// copied as they are, plain parts between them are compressed here. Every part ends with
+/// sync flush marker, which puts the next one at byte boundary, so parts are just concatenated
+class DeflateMessage {
+private:
+	std::string &out;
+	Deflater *context;
+	std::string pending;
+	bool ok = true;
+
+	void flush(){
+		if (pending.empty()){
+			return;
+		}
+		ok = (context ? *context : Deflater::shared()).compress(pending, out) && ok;
+		out.append(deflateTail, 4);
+		pending.clear();
+	}
+public:
+	/// context is deflater of connection which keeps window, nullptr if messages are independent
+	DeflateMessage(std::string &o, Deflater *ctx) : out(o), context(ctx){}
+
+	void addPlain(boost::string_view data){
+		pending.append(data.data(), data.size());
+	}
+
+	/// deflated is plain compressed independently of other messages
+	void addCompressed(boost::string_view deflated, boost::string_view plain){
+		flush();
+		out.append(deflated.data(), deflated.size());
+		out.append(deflateTail, 4);
+		if (context){
+			ok = context->addHistory(plain) && ok;
+		}
+	}
+
+	/// Returns false if some part couldn't be compressed, message is then broken
+	bool finish(){
+		flush();
+		if (out.size() >= 4){
+			out.resize(out.size() - 4);
+		}
+		return ok;
+	}
+};
+
+/// Raw inflate of messages from client, which doesn't keep its window between them
+class Inflater {
+private:
+	z_stream zs;
+	bool ok;
+public:
+	Inflater(){
+		memset(&zs, 0, sizeof(zs));
+		ok = inflateInit2(&zs, -15) == Z_OK;
+	}
+
+	~Inflater(){
+		if (ok){
+			inflateEnd(&zs);
+		}
+	}
+
+	Inflater(const Inflater &) = delete;
+	Inflater &operator =(const Inflater &) = delete;
+
+	/// Replaces out with inflated message. Fails on broken data and on messages longer than max_size
+	bool decompress(boost::string_view in, std::string &out, size_t max_size){
+		out.clear();
+		if (!ok){
+			return false;
+		}
+
+		bool res = feed(in, out, max_size) && feed(boost::string_view(deflateTail, 4), out, max_size);
+		inflateReset(&zs);
+		return res;
+	}
+
+	static Inflater &shared(){
+		static thread_local Inflater inf;
+		return inf;
+	}
+private:
+	bool feed(boost::string_view in, std::string &out, size_t max_size){
+		zs.next_in = (Bytef *) in.data();
+		zs.avail_in = (uInt) in.size();
+		int res;
+		do {
+			// one byte over limit tells that message is too long
+			size_t have = out.size();
+			size_t chunk = std::min(in.size() * 4 + 256, max_size + 1 - have);
+			out.resize(have + chunk);
+			zs.next_out = (Bytef *) &out[have];
+			zs.avail_out = (uInt) chunk;
+			res = inflate(&zs, Z_SYNC_FLUSH);
+			out.resize(have + chunk - zs.avail_out);
+			if (out.size() > max_size){
+				return false;
+			}
+		} while (res == Z_OK && zs.avail_out == 0);
+		return res == Z_OK || res == Z_STREAM_END || (res == Z_BUF_ERROR && zs.avail_in == 0);
+	}
+};
+
+#endif //DEFLATE_HPP
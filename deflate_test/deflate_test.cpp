@@ -0,0 +1,290 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "../deflate.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Client side of permessage-deflate is zlib inflate which keeps its window between messages,
+// as browsers do. Every kind of frame server sends must inflate back to the same bytes:
+// frames compressed once for everyone, frames of connection deflater with context takeover,
+// and batches which mix both. Then compares compression per recipient with compression once
+// on room broadcasts.
+
+class ClientInflater {
+private:
+	z_stream zs;
+public:
+	ClientInflater(){
+		memset(&zs, 0, sizeof(zs));
+		inflateInit2(&zs, -15);
+	}
+
+	~ClientInflater(){
+		inflateEnd(&zs);
+	}
+
+	bool inflateMessage(string data, string &out){
+		data.append(deflateTail, 4);
+		out.clear();
+		zs.next_in = (Bytef *) data.data();
+		zs.avail_in = (uInt) data.size();
+		char buf[16384];
+		int res;
+		do {
+			zs.next_out = (Bytef *) buf;
+			zs.avail_out = sizeof(buf);
+			res = inflate(&zs, Z_SYNC_FLUSH);
+			out.append(buf, sizeof(buf) - zs.avail_out);
+		} while (res == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+		return res == Z_OK || res == Z_BUF_ERROR;
+	}
+};
+
+static const char *const words[] = {
+	"\\u043f\\u0440\\u0438\\u0432\\u0435\\u0442", "\\u043a\\u0430\\u043a", "\\u0434\\u0435\\u043b\\u0430",
+	"hello", "chat", "\\u0441\\u0435\\u0433\\u043e\\u0434\\u043d\\u044f", "\\u0432\\u0441\\u0435\\u043c", ":)",
+};
+
+static string randomText(mt19937 &rnd, size_t len){
+	string res;
+	while (res.size() < len){
+		res += words[rnd() % (sizeof(words) / sizeof(words[0]))];
+		res += ' ';
+	}
+	return res;
+}
+
+static string messagePacket(mt19937 &rnd, size_t len){
+	return "{\"color\":\"gray\",\"from\":\"nick" + to_string(rnd() % 100) + "\",\"from_login\":\"user" + to_string(rnd() % 100)
+		+ "\",\"message\":\"" + randomText(rnd, len) + "\",\"style\":0,\"target\":\"main\",\"time\":" + to_string(1500000000 + rnd() % 1000000)
+		+ ",\"to\":0,\"type\":2}\n";
+}
+
+static string onlineList(mt19937 &rnd, size_t members){
+	string res = "{\"list\":[";
+	for (size_t i = 0; i < members; ++i){
+		res += (i ? "," : "");
+		res += "{\"color\":\"gray\",\"girl\":" + string(rnd() % 2 ? "true" : "false") + ",\"is_moder\":false,\"is_owner\":false,\"member_id\":"
+			+ to_string(i + 1) + ",\"name\":\"nick" + to_string(rnd() % 1000) + "\",\"status\":1,\"user_id\":" + to_string(rnd() % 100000) + "}";
+	}
+	return res + "],\"target\":\"main\",\"type\":3}\n";
+}
+
+struct Part {
+	string plain;
+	string deflated;	// empty if part is private to connection
+};
+
+template<typename Out>
+static void join(const vector<Part> &parts, Out &out){
+	out.addPlain("[");
+	for (size_t i = 0; i < parts.size(); ++i){
+		if (i){
+			out.addPlain(",");
+		}
+		if (!parts[i].deflated.empty()){
+			out.addCompressed(parts[i].deflated, parts[i].plain);
+		} else {
+			out.addPlain(parts[i].plain);
+		}
+	}
+	out.addPlain("]");
+}
+
+static Part sharedPart(mt19937 &rnd, size_t len){
+	Part p;
+	p.plain = messagePacket(rnd, len);
+	Deflater::shared().compress(p.plain, p.deflated);
+	return p;
+}
+
+// Sends random mix of frames to one connection, the same way WebSocketServerEx::write does
+static bool checkStream(bool takeover, mt19937 &rnd){
+	unique_ptr<Deflater> conn(takeover ? new Deflater(true) : nullptr);
+	ClientInflater client;
+	string wire, got;
+	for (int i = 0; i < 3000; ++i){
+		wire.clear();
+		string expected;
+		switch (rnd() % 3){
+		case 0: {
+			// private frame, compressed for connection
+			expected = messagePacket(rnd, rnd() % 3000);
+			if (!(conn ? *conn : Deflater::shared()).compress(expected, wire)){
+				cout << "Can't compress private frame" << endl;
+				return false;
+			}
+			break;
+		}
+		case 1: {
+			// broadcast, compressed once
+			auto p = sharedPart(rnd, rnd() % 3000);
+			expected = p.plain;
+			wire = p.deflated;
+			if (conn && !conn->addHistory(p.plain)){
+				cout << "Can't add history" << endl;
+				return false;
+			}
+			break;
+		}
+		case 2: {
+			// batch of both
+			vector<Part> parts;
+			for (size_t n = 2 + rnd() % 6; n > 0; --n){
+				if (rnd() % 2){
+					parts.push_back(sharedPart(rnd, rnd() % 2000));
+				} else {
+					parts.push_back(Part{ messagePacket(rnd, rnd() % 200), "" });
+				}
+			}
+			DeflateMessage msg(wire, conn.get());
+			join(parts, msg);
+			if (!msg.finish()){
+				cout << "Can't compress batch" << endl;
+				return false;
+			}
+			struct { string &out; void addPlain(boost::string_view s){ out.append(s.data(), s.size()); }
+				void addCompressed(boost::string_view, boost::string_view p){ addPlain(p); } } plain{expected};
+			join(parts, plain);
+			break;
+		}
+		}
+
+		if (!client.inflateMessage(wire, got) || got != expected){
+			cout << "Client got wrong message " << i << (takeover ? " with context takeover" : "") << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool checkCorrectness(){
+	mt19937 rnd(1);
+	if (!checkStream(false, rnd) || !checkStream(true, rnd)){
+		return false;
+	}
+
+	// inbound frames
+	string msg = messagePacket(rnd, 500), wire, got;
+	Deflater::shared().compress(msg, wire);
+	if (!Inflater::shared().decompress(wire, got, 1 << 20) || got != msg){
+		cout << "Inflater failed" << endl;
+		return false;
+	}
+	if (Inflater::shared().decompress(wire, got, msg.size() - 1)){
+		cout << "Inflater ignored size limit" << endl;
+		return false;
+	}
+	if (Inflater::shared().decompress("garbage", got, 1 << 20)){
+		cout << "Inflater accepted garbage" << endl;
+		return false;
+	}
+	if (!Inflater::shared().decompress(wire, got, msg.size()) || got != msg){
+		cout << "Inflater broken after error" << endl;
+		return false;
+	}
+
+	struct Offer {
+		const char *header;
+		bool enabled;
+	};
+	for (auto o : { Offer{"permessage-deflate; client_max_window_bits", true},
+			Offer{"permessage-deflate; server_max_window_bits=10, permessage-deflate", true},
+			Offer{"permessage-deflate; server_max_window_bits=10", false},
+			Offer{"x-webkit-deflate-frame", false},
+			Offer{"permessage-deflate;server_no_context_takeover;client_no_context_takeover", true},
+			Offer{"permessage-deflate; unknown_param", false} }){
+		if (DeflateParams::negotiate(o.header).enabled != o.enabled){
+			cout << "Wrong negotiation of " << o.header << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static volatile size_t sink;
+
+// Room broadcast of one packet to members: every recipient compresses for itself with its own
+// window, or packet is compressed once and the frame is shared
+static void benchBroadcast(const char *name, const vector<string> &packets, size_t members){
+	vector<unique_ptr<Deflater>> conns;
+	for (size_t i = 0; i < members; ++i){
+		conns.emplace_back(new Deflater(true));
+	}
+
+	size_t plain = 0, perConn = 0, once = 0;
+	string out;
+	auto start = steady_clock::now();
+	for (auto &p : packets){
+		for (auto &c : conns){
+			out.clear();
+			c->compress(p, out);
+			perConn += out.size();
+		}
+		plain += p.size() * members;
+	}
+	double perConnNs = duration<double, nano>(steady_clock::now() - start).count() / packets.size();
+
+	start = steady_clock::now();
+	for (auto &p : packets){
+		out.clear();
+		Deflater::shared().compress(p, out);
+		once += out.size() * members;
+	}
+	double onceNs = duration<double, nano>(steady_clock::now() - start).count() / packets.size();
+	sink = out.size();
+
+	cout << setw(14) << left << name << right << setw(10) << plain / packets.size() / members
+		<< setw(14) << perConn / packets.size() / members << setw(12) << once / packets.size() / members
+		<< setw(16) << fixed << setprecision(0) << perConnNs << setw(14) << onceNs
+		<< setw(9) << setprecision(1) << perConnNs / onceNs << "x" << endl;
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	mt19937 rnd(2);
+	size_t members = 100;
+	cout << "broadcast to " << members << " members, bytes per recipient and ns per packet" << endl;
+	cout << setw(14) << left << "packet" << right << setw(10) << "plain" << setw(14) << "per member" << setw(12) << "once"
+		<< setw(16) << "per member ns" << setw(14) << "once ns" << setw(10) << "speedup" << endl;
+
+	vector<string> packets;
+	for (int i = 0; i < rounds * 5; ++i){
+		packets.push_back(messagePacket(rnd, 100 + rnd() % 200));
+	}
+	benchBroadcast("message", packets, members);
+
+	packets.clear();
+	for (int i = 0; i < rounds; ++i){
+		packets.push_back(onlineList(rnd, 100));
+	}
+	benchBroadcast("online 100", packets, members);
+
+	// history replay: 50 messages to every joining client, compressed when room sent them
+	packets.clear();
+	for (int i = 0; i < rounds; ++i){
+		string history;
+		for (int j = 0; j < 50; ++j){
+			history += messagePacket(rnd, 100 + rnd() % 200);
+		}
+		packets.push_back(history);
+	}
+	benchBroadcast("history 50", packets, members);
+
+	return 0;
+}
@@ -0,0 +1,472 @@
+#ifndef HISTORY_LOG_HPP
+#define HISTORY_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "logger.hpp"
+
+/// Append-only history of room on disk. Log is a directory of segments, files of fixed size
+/// which are mapped into memory. Record is appended by memcpy into mapping of the last segment,
+/// pages are written to disk by HistoryFlusher thread, so thread of room never waits for disk.
+/// Every record has sequence number, one more than previous, and time. Segment keeps sparse
+/// index of every indexStep-th record, page of history is found by it and read straight from
+/// mapping. Whole oldest segments are dropped by retention policy
+
+struct HistoryLogOptions {
+	std::string dir = "history";
+	size_t segmentSize = 4*1024*1024;
+	// retention, zero means unlimited
+	size_t maxSegments = 16;
+	time_t maxAge = 30*24*3600;
+	size_t indexStep = 32;
+	int flushInterval = 1000;
+};
+
+/// One mapped file of log, named by sequence number of its first record
+class HistorySegment {
+public:
+	// record: size of payload, crc32 of the rest, seq, time, payload padded to 8 bytes.
+	// Zero size ends segment, bad crc marks record torn by crash
+	static const size_t headerSize = 24;
+
+	struct IndexEntry {
+		uint64_t seq;
+		int64_t time;
+		uint32_t offset;
+	};
+private:
+	std::string path;
+	char *data = nullptr;
+	size_t capacity = 0;
+	size_t end = 0;
+	uint64_t firstSeq;
+	uint64_t nextSeq;
+	int64_t lastTime = 0;
+	size_t indexStep;
+	std::vector<IndexEntry> index;
+	// blocks of file are allocated, so writes into mapping can't hit full disk
+	bool writable = true;
+
+	// set by room thread after append, cleared by flusher
+	std::atomic<bool> dirty{false};
+
+	static size_t padded(size_t size){
+		return (size + 7) & ~(size_t) 7;
+	}
+
+	static uint32_t checksum(uint64_t seq, int64_t time, boost::string_view payload){
+		uLong crc = crc32(0, (const Bytef *) &seq, sizeof(seq));
+		crc = crc32(crc, (const Bytef *) &time, sizeof(time));
+		return (uint32_t) crc32(crc, (const Bytef *) payload.data(), (uInt) payload.size());
+	}
+
+	struct Record {
+		uint32_t size;
+		uint64_t seq;
+		int64_t time;
+		boost::string_view payload;
+	};
+
+	// false at the end of written records or, when verify is set, on torn record.
+	// Records before end were checked on open or written here, so reading them skips crc
+	bool readAt(size_t offset, Record &r, bool verify = false) const {
+		if (offset + headerSize > capacity || (!verify && offset >= end)){
+			return false;
+		}
+		uint32_t crc;
+		memcpy(&r.size, data + offset, 4);
+		memcpy(&crc, data + offset + 4, 4);
+		memcpy(&r.seq, data + offset + 8, 8);
+		memcpy(&r.time, data + offset + 16, 8);
+		if (r.size == 0 || offset + headerSize + r.size > capacity){
+			return false;
+		}
+		r.payload = boost::string_view(data + offset + headerSize, r.size);
+		return !verify || crc == checksum(r.seq, r.time, r.payload);
+	}
+
+	void addToIndex(uint64_t seq, int64_t time, size_t offset){
+		if ((seq - firstSeq) % indexStep == 0){
+			index.push_back(IndexEntry{seq, time, (uint32_t) offset});
+		}
+	}
+
+	HistorySegment(const std::string &p, uint64_t first, size_t step) : path(p), firstSeq(first), nextSeq(first), indexStep(step){}
+public:
+	~HistorySegment(){
+		if (data){
+			munmap(data, capacity);
+		}
+	}
+
+	HistorySegment(const HistorySegment &) = delete;
+
+	/// Maps existing file or creates new one of given size. Existing records are checked and indexed
+	static std::shared_ptr<HistorySegment> open(const std::string &path, uint64_t first_seq, size_t size, size_t index_step){
+		std::shared_ptr<HistorySegment> seg(new HistorySegment(path, first_seq, index_step ? index_step : 1));
+
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0){
+			Logger::error("Can't open history segment ", path, ": ", strerror(errno));
+			return nullptr;
+		}
+
+		struct stat st;
+		bool created = fstat(fd, &st) != 0 || st.st_size == 0;
+		if (!created){
+			size = (size_t) st.st_size;
+		}
+		// sparse file would get SIGBUS on memcpy when disk is full, so blocks are allocated now.
+		// Existing segment which can't get them is only read
+		int err = posix_fallocate(fd, 0, (off_t) size);
+		if (err != 0){
+			Logger::error("Can't allocate history segment ", path, ": ", strerror(err));
+			if (created){
+				close(fd);
+				unlink(path.c_str());
+				return nullptr;
+			}
+			seg->writable = false;
+		}
+
+		void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		// mapping stays valid without descriptor
+		close(fd);
+		if (mem == MAP_FAILED){
+			Logger::error("Can't map history segment ", path, ": ", strerror(errno));
+			return nullptr;
+		}
+		seg->data = (char *) mem;
+		seg->capacity = size;
+
+		Record r;
+		while (seg->readAt(seg->end, r, true) && r.seq == seg->nextSeq){
+			seg->addToIndex(r.seq, r.time, seg->end);
+			seg->lastTime = r.time;
+			++seg->nextSeq;
+			seg->end += padded(headerSize + r.size);
+		}
+		// torn tail after crash is overwritten by next records
+		if (seg->writable && seg->end < seg->capacity){
+			memset(seg->data + seg->end, 0, std::min(seg->capacity - seg->end, headerSize));
+		}
+		return seg;
+	}
+
+	inline const std::string &getPath() const { return path; }
+	inline uint64_t getFirstSeq() const { return firstSeq; }
+	inline uint64_t getNextSeq() const { return nextSeq; }
+	inline int64_t getLastTime() const { return lastTime; }
+	inline bool empty() const { return nextSeq == firstSeq; }
+
+	/// Returns false if record doesn't fit
+	bool append(int64_t time, boost::string_view payload){
+		size_t len = padded(headerSize + payload.size());
+		if (!writable || end + len > capacity){
+			return false;
+		}
+
+		uint64_t seq = nextSeq;
+		uint32_t size = (uint32_t) payload.size();
+		uint32_t crc = checksum(seq, time, payload);
+		char *p = data + end;
+		memcpy(p, &size, 4);
+		memcpy(p + 4, &crc, 4);
+		memcpy(p + 8, &seq, 8);
+		memcpy(p + 16, &time, 8);
+		memcpy(p + headerSize, payload.data(), payload.size());
+		// header of the next record is zero, so reader stops there
+		if (end + len + headerSize <= capacity){
+			memset(p + len, 0, headerSize);
+		}
+
+		addToIndex(seq, time, end);
+		lastTime = time;
+		++nextSeq;
+		end += len;
+		return true;
+	}
+
+	/// Calls func(seq, time, payload) for records from seq from to seq to, not including it
+	template<typename F>
+	void read(uint64_t from, uint64_t to, F func) const {
+		from = std::max(from, firstSeq);
+		to = std::min(to, nextSeq);
+		if (from >= to){
+			return;
+		}
+
+		auto it = std::upper_bound(index.begin(), index.end(), from, [](uint64_t s, const IndexEntry &e){ return s < e.seq; });
+		size_t offset = it == index.begin() ? 0 : (it - 1)->offset;
+		Record r;
+		while (readAt(offset, r) && r.seq < to){
+			if (r.seq >= from){
+				func(r.seq, r.time, r.payload);
+			}
+			offset += padded(headerSize + r.size);
+		}
+	}
+
+	/// Sequence number of the first record not older than time, next seq if there is none
+	uint64_t seqAtTime(int64_t time) const {
+		auto it = std::lower_bound(index.begin(), index.end(), time, [](const IndexEntry &e, int64_t t){ return e.time < t; });
+		uint64_t res = nextSeq;
+		size_t offset = it == index.begin() ? 0 : (it - 1)->offset;
+		Record r;
+		while (readAt(offset, r)){
+			if (r.time >= time){
+				res = r.seq;
+				break;
+			}
+			offset += padded(headerSize + r.size);
+		}
+		return res;
+	}
+
+	/// Marks segment as having unflushed records, returns true if it wasn't marked
+	bool markDirty(){
+		return !dirty.exchange(true);
+	}
+
+	/// Writes mapped pages to disk, blocks until they are written
+	void flush(){
+		dirty = false;
+		if (msync(data, capacity, MS_SYNC) != 0){
+			Logger::error("Can't flush history segment ", path, ": ", strerror(errno));
+		}
+	}
+};
+
+/// Thread which writes dirty segments of all logs to disk every flushInterval ms,
+/// batching all records appended meanwhile into one msync per segment
+class HistoryFlusher {
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<std::shared_ptr<HistorySegment>> queue;
+	std::thread thread;
+	int interval;
+	bool stopping = false;
+
+	void flushQueued(){
+		std::vector<std::shared_ptr<HistorySegment>> segs;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			segs.swap(queue);
+		}
+		for (auto &s : segs){
+			s->flush();
+		}
+	}
+
+	void run(){
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stopping){
+			cv.wait_for(lock, std::chrono::milliseconds(interval));
+			lock.unlock();
+			flushQueued();
+			lock.lock();
+		}
+	}
+public:
+	HistoryFlusher(int interval_ms) : interval(interval_ms){
+		thread = std::thread([this]{ run(); });
+	}
+
+	HistoryFlusher(const HistoryFlusher &) = delete;
+
+	~HistoryFlusher(){
+		stop();
+	}
+
+	/// Writes everything queued and stops thread
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (stopping){
+				return;
+			}
+			stopping = true;
+		}
+		cv.notify_all();
+		thread.join();
+		flushQueued();
+	}
+
+	void add(const std::shared_ptr<HistorySegment> &seg){
+		if (seg->markDirty()){
+			std::lock_guard<std::mutex> lock(mtx);
+			queue.push_back(seg);
+		}
+	}
+};
+
+/// Log of one room, used only by thread of room
+class HistoryLog {
+private:
+	const HistoryLogOptions &opts;
+	HistoryFlusher &flusher;
+	std::string dir;
+	std::deque<std::shared_ptr<HistorySegment>> segments;
+	uint64_t nextSeq = 1;
+	// segment couldn't be allocated, nothing more is written until restart
+	bool disabled = false;
+
+	std::string segmentPath(uint64_t first_seq){
+		char name[32];
+		snprintf(name, sizeof(name), "%020llu.log", (unsigned long long) first_seq);
+		return dir + "/" + name;
+	}
+
+	bool addSegment(uint64_t first_seq){
+		auto seg = HistorySegment::open(segmentPath(first_seq), first_seq, opts.segmentSize, opts.indexStep);
+		if (!seg){
+			return false;
+		}
+		segments.push_back(seg);
+		return true;
+	}
+
+	static void makeDirs(const std::string &path){
+		for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)){
+			mkdir(path.substr(0, pos).c_str(), 0755);
+			if (pos == std::string::npos){
+				break;
+			}
+		}
+	}
+
+	/// Room name may contain anything, directory name keeps only letters and digits of ASCII
+	static std::string escapeName(const std::string &name){
+		std::string res;
+		for (unsigned char c : name){
+			if (isalnum(c) || c == '_' || c == '-'){
+				res += (char) c;
+			} else {
+				char buf[4];
+				snprintf(buf, sizeof(buf), "%%%02X", c);
+				res += buf;
+			}
+		}
+		return res.empty() ? "%" : res;
+	}
+public:
+	HistoryLog(const HistoryLogOptions &options, HistoryFlusher &fl, const std::string &room_name)
+		: opts(options), flusher(fl), dir(options.dir + "/" + escapeName(room_name))
+	{
+		makeDirs(dir);
+
+		std::vector<uint64_t> firsts;
+		if (DIR *d = opendir(dir.c_str())){
+			while (dirent *e = readdir(d)){
+				unsigned long long seq;
+				char tail[8];
+				if (sscanf(e->d_name, "%20llu.%7s", &seq, tail) == 2 && strcmp(tail, "log") == 0){
+					firsts.push_back(seq);
+				}
+			}
+			closedir(d);
+		}
+		std::sort(firsts.begin(), firsts.end());
+
+		for (auto first : firsts){
+			// segments must follow each other, anything after a gap is dropped
+			if (!segments.empty() && first != segments.back()->getNextSeq()){
+				Logger::error("Gap in history log before ", segmentPath(first), ", later segments are ignored");
+				break;
+			}
+			if (!addSegment(first)){
+				break;
+			}
+		}
+
+		if (!segments.empty()){
+			nextSeq = segments.back()->getNextSeq();
+		}
+	}
+
+	inline uint64_t getNextSeq() const { return nextSeq; }
+	inline uint64_t getFirstSeq() const { return segments.empty() ? nextSeq : segments.front()->getFirstSeq(); }
+
+	/// Returns sequence number of record, 0 if it can't be written
+	uint64_t append(int64_t time, boost::string_view payload){
+		if (disabled){
+			return 0;
+		}
+		if (segments.empty() || !segments.back()->append(time, payload)){
+			if (HistorySegment::headerSize + payload.size() > opts.segmentSize){
+				Logger::error("Record of ", payload.size(), " bytes doesn't fit history segment");
+				return 0;
+			}
+			if (!addSegment(nextSeq)){
+				Logger::error("History log of ", dir, " is disabled");
+				disabled = true;
+				return 0;
+			}
+			if (!segments.back()->append(time, payload)){
+				return 0;
+			}
+			applyRetention(time);
+		}
+
+		flusher.add(segments.back());
+		return nextSeq++;
+	}
+
+	/// Calls func(seq, time, payload) for up to limit records before seq before, the oldest first.
+	/// Returns sequence number of the first record given to func
+	template<typename F>
+	uint64_t readBefore(uint64_t before, size_t limit, F func) const {
+		before = std::min(before, nextSeq);
+		uint64_t from = before > limit ? before - limit : 0;
+		from = std::max(from, getFirstSeq());
+		for (auto &s : segments){
+			if (s->getNextSeq() > from && s->getFirstSeq() < before){
+				s->read(from, before, func);
+			}
+		}
+		return std::min(from, before);
+	}
+
+	/// Sequence number of the first record not older than time
+	uint64_t seqAtTime(int64_t time) const {
+		for (auto &s : segments){
+			if (s->getLastTime() >= time){
+				return s->seqAtTime(time);
+			}
+		}
+		return nextSeq;
+	}
+
+	/// Drops the oldest segments over maxSegments or older than maxAge, the last one is kept
+	void applyRetention(int64_t now){
+		while (segments.size() > 1 && ((opts.maxSegments && segments.size() > opts.maxSegments)
+				|| (opts.maxAge && segments.front()->getLastTime() < now - opts.maxAge))){
+			unlink(segments.front()->getPath().c_str());
+			segments.pop_front();
+		}
+	}
+};
+
+#endif //HISTORY_LOG_HPP
@@ -0,0 +1,194 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "../history_log.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Appends messages to HistoryLog of a room in temporary directory and reads pages back:
+// after reopen, after torn record at the end, across segments and after retention drops
+// the oldest ones. Then measures append and paging speed.
+
+static const string dir = "history_log_test.tmp";
+
+static string payload(uint64_t seq){
+	return "{\"message\":\"" + string(seq * 37 % 700, 'a' + seq % 26) + "\",\"seq\":" + to_string(seq) + ",\"type\":2}\n";
+}
+
+static bool checkPage(const HistoryLog &log, uint64_t before, size_t limit, uint64_t first_kept){
+	before = min(before, log.getNextSeq());
+	uint64_t expected = max(before > limit ? before - limit : 0, first_kept);
+	uint64_t next = expected;
+	bool ok = true;
+	uint64_t cursor = log.readBefore(before, limit, [&](uint64_t seq, int64_t time, boost::string_view data){
+		if (seq != next || data != payload(seq) || time != (int64_t) seq / 10){
+			ok = false;
+		}
+		++next;
+	});
+	if (!ok || next != max(before, expected) || cursor != min(expected, before)){
+		cout << "Wrong page before " << before << " of " << limit << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool checkCorrectness(){
+	system(("rm -rf " + dir).c_str());
+
+	HistoryLogOptions opts;
+	opts.dir = dir;
+	opts.segmentSize = 64*1024;
+	opts.maxSegments = 0;
+	opts.maxAge = 0;
+	HistoryFlusher flusher(10);
+
+	{
+		HistoryLog log(opts, flusher, "main room/1");
+		for (uint64_t seq = 1; seq <= 3000; ++seq){
+			if (log.append((int64_t) seq / 10, payload(seq)) != seq){
+				cout << "Wrong seq of appended record " << seq << endl;
+				return false;
+			}
+		}
+	}
+
+	HistoryLog log(opts, flusher, "main room/1");
+	if (log.getNextSeq() != 3001){
+		cout << "Reopened log continues from " << log.getNextSeq() << endl;
+		return false;
+	}
+
+	mt19937 rnd(1);
+	for (int i = 0; i < 2000; ++i){
+		if (!checkPage(log, 1 + rnd() % 3100, 1 + rnd() % 120, 1)){
+			return false;
+		}
+	}
+	for (int64_t t = 0; t < 300; t += 7){
+		uint64_t seq = log.seqAtTime(t);
+		if (seq != max<uint64_t>(1, t * 10)){
+			cout << "Wrong seq at time " << t << ": " << seq << endl;
+			return false;
+		}
+	}
+
+	// torn last record: crc doesn't match, it is cut on reopen
+	flusher.stop();
+	{
+		string last;
+		uint64_t lastFirst = 0;
+		if (DIR *d = opendir((dir + "/main%20room%2F1").c_str())){
+			while (dirent *e = readdir(d)){
+				unsigned long long first;
+				if (sscanf(e->d_name, "%llu.log", &first) == 1 && first > lastFirst){
+					lastFirst = first;
+					last = e->d_name;
+				}
+			}
+			closedir(d);
+		}
+		string path = dir + "/main%20room%2F1/" + last;
+		FILE *f = fopen(path.c_str(), "r+b");
+		if (!f){
+			cout << "Can't find segment " << path << endl;
+			return false;
+		}
+
+		// payload of the last record is somewhere before the first zero header
+		vector<char> buf(opts.segmentSize);
+		size_t n = fread(buf.data(), 1, buf.size(), f);
+		auto tailPos = string(buf.data(), n).rfind("\"seq\":3000");
+		fseek(f, (long) tailPos, SEEK_SET);
+		fputc('X', f);
+		fclose(f);
+	}
+
+	HistoryFlusher flusher2(10);
+	HistoryLog torn(opts, flusher2, "main room/1");
+	if (torn.getNextSeq() != 3000 || !checkPage(torn, 3000, 50, 1)){
+		cout << "Torn record wasn't cut: next seq " << torn.getNextSeq() << endl;
+		return false;
+	}
+	if (torn.append(300, payload(3000)) != 3000 || !checkPage(torn, 3001, 50, 1)){
+		cout << "Can't append after torn record" << endl;
+		return false;
+	}
+
+	// retention by count of segments
+	opts.maxSegments = 3;
+	HistoryLog limited(opts, flusher2, "limited");
+	for (uint64_t seq = 1; seq <= 3000; ++seq){
+		limited.append((int64_t) seq / 10, payload(seq));
+	}
+	uint64_t first = limited.getFirstSeq();
+	if (first <= 1 || !checkPage(limited, 3001, 100, first) || !checkPage(limited, first + 5, 100, first)){
+		cout << "Retention broke log, first seq " << first << endl;
+		return false;
+	}
+
+	// retention by age
+	opts.maxSegments = 0;
+	opts.maxAge = 100;
+	HistoryLog aged(opts, flusher2, "aged");
+	for (uint64_t seq = 1; seq <= 3000; ++seq){
+		aged.append((int64_t) seq / 10, payload(seq));
+	}
+	if (aged.getFirstSeq() <= 1 || aged.seqAtTime(0) < 1000){
+		cout << "Old segments weren't dropped, first seq " << aged.getFirstSeq() << endl;
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	system(("rm -rf " + dir).c_str());
+	HistoryLogOptions opts;
+	opts.dir = dir;
+	HistoryFlusher flusher(opts.flushInterval);
+	HistoryLog log(opts, flusher, "bench");
+
+	vector<string> messages;
+	mt19937 rnd(2);
+	for (int i = 0; i < 1000; ++i){
+		messages.push_back(payload(rnd() % 1000));
+	}
+
+	size_t n = rounds * 10000;
+	auto start = steady_clock::now();
+	for (size_t i = 0; i < n; ++i){
+		log.append((int64_t) i, messages[i % messages.size()]);
+	}
+	double appendNs = duration<double, nano>(steady_clock::now() - start).count() / n;
+
+	size_t pages = rounds * 1000, bytes = 0;
+	start = steady_clock::now();
+	for (size_t i = 0; i < pages; ++i){
+		log.readBefore(1 + rnd() % n, 50, [&](uint64_t, int64_t, boost::string_view data){
+			bytes += data.size();
+		});
+	}
+	double pageNs = duration<double, nano>(steady_clock::now() - start).count() / pages;
+
+	cout << "append " << fixed << setprecision(0) << appendNs << " ns, page of 50 " << pageNs << " ns, "
+		<< bytes / pages << " bytes per page" << endl;
+
+	flusher.stop();
+	system(("rm -rf " + dir).c_str());
+	return 0;
+}
@@ -0,0 +1,496 @@
+#ifndef JSON_FIELDS_HPP
+#define JSON_FIELDS_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+/// On-demand reader of one JSON object, used for inbound packets instead of Json::Value.
+/// parse() walks the frame once, checks syntax and remembers where value of every top
+/// level key lies. Nested objects and arrays are only skipped. Values are decoded when
+/// packet asks for them, conversions follow Json::Value::asXxx.
+///
+/// Fields point into parsed data, which must outlive the reader. Reader is reused between
+/// frames, so after warm up parsing doesn't allocate
+class JsonFields {
+public:
+	enum class Kind : uint8_t {
+		missing,
+		null,
+		boolean,
+		number,
+		string,
+		array,
+		object,
+	};
+
+	class Field {
+		friend class JsonFields;
+
+		const char *begin = nullptr;	// contents of string without quotes, otherwise whole value
+		size_t len = 0;
+		Kind kind = Kind::missing;
+		bool escaped = false;
+
+		template<typename T>
+		T asNumber() const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				return 0;
+			case Kind::boolean:
+				return *begin == 't' ? 1 : 0;
+			case Kind::number:
+				break;
+			default:
+				throw std::runtime_error("JSON value is not convertible to number");
+			}
+
+			bool negative = *begin == '-';
+			uint64_t mag = 0;
+			bool integral = true;
+			for (const char *c = begin + negative; c < begin + len; ++c){
+				if (*c < '0' || *c > '9' || mag > (std::numeric_limits<uint64_t>::max() - 9) / 10){
+					integral = false;
+					break;
+				}
+				mag = mag * 10 + (*c - '0');
+			}
+
+			if (integral){
+				if (negative){
+					if (std::numeric_limits<T>::min() == 0 && mag != 0){
+						throw std::runtime_error("Negative JSON value is not convertible to unsigned");
+					}
+					if (mag > (uint64_t) std::numeric_limits<T>::max() + 1){
+						throw std::runtime_error("JSON value is out of range");
+					}
+					return (T) (0 - mag);
+				}
+				if (mag > (uint64_t) std::numeric_limits<T>::max()){
+					throw std::runtime_error("JSON value is out of range");
+				}
+				return (T) mag;
+			}
+
+			// number is always followed by ',', '}' or ']' of object, so strtod stops on it
+			double d = strtod(begin, nullptr);
+			if (!(d >= (double) std::numeric_limits<T>::min() && d <= (double) std::numeric_limits<T>::max())){
+				throw std::runtime_error("JSON value is out of range");
+			}
+			return (T) d;
+		}
+	public:
+		inline Kind getKind() const { return kind; }
+		inline bool isMissing() const { return kind == Kind::missing; }
+
+		/// Text of value as in frame. Contents of string without quotes, escapes are not decoded
+		inline boost::string_view raw() const { return boost::string_view(begin, len); }
+
+		inline int asInt() const { return asNumber<int>(); }
+		inline unsigned asUInt() const { return asNumber<unsigned>(); }
+		inline uint64_t asUInt64() const { return asNumber<uint64_t>(); }
+		inline int64_t asInt64() const { return asNumber<int64_t>(); }
+
+		/// Number without fraction and exponent
+		bool isIntegral() const {
+			return kind == Kind::number && raw().find_first_of(".eE") == boost::string_view::npos;
+		}
+
+		double asDouble() const {
+			return kind == Kind::number ? strtod(begin, nullptr) : asNumber<int>();
+		}
+
+		bool asBool() const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				return false;
+			case Kind::boolean:
+				return *begin == 't';
+			case Kind::number:
+				return strtod(begin, nullptr) != 0;
+			default:
+				throw std::runtime_error("JSON value is not convertible to bool");
+			}
+		}
+
+		std::string asString() const {
+			std::string res;
+			copyTo(res);
+			return res;
+		}
+
+		/// Same as asString, reuses memory of out
+		void copyTo(std::string &out) const {
+			switch (kind){
+			case Kind::missing:
+			case Kind::null:
+				out.clear();
+				return;
+			case Kind::string:
+				if (escaped){
+					unescape(begin, len, out);
+				} else {
+					out.assign(begin, len);
+				}
+				return;
+			case Kind::boolean:
+			case Kind::number:
+				out.assign(begin, len);
+				return;
+			default:
+				throw std::runtime_error("JSON value is not convertible to string");
+			}
+		}
+	};
+private:
+	struct Entry {
+		Field key;
+		Field value;
+	};
+
+	static const int maxDepth = 256;
+
+	std::vector<Entry> fields;
+	const char *p = nullptr;
+	const char *end = nullptr;
+
+	static int hex(char c){
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	static unsigned hex4(const char *s){
+		return (hex(s[0]) << 12) | (hex(s[1]) << 8) | (hex(s[2]) << 4) | hex(s[3]);
+	}
+
+	static void appendUtf8(std::string &out, unsigned cp){
+		if (cp < 0x80){
+			out += (char) cp;
+		} else if (cp < 0x800){
+			out += (char) (0xC0 | (cp >> 6));
+			out += (char) (0x80 | (cp & 0x3F));
+		} else if (cp < 0x10000){
+			out += (char) (0xE0 | (cp >> 12));
+			out += (char) (0x80 | ((cp >> 6) & 0x3F));
+			out += (char) (0x80 | (cp & 0x3F));
+		} else {
+			out += (char) (0xF0 | (cp >> 18));
+			out += (char) (0x80 | ((cp >> 12) & 0x3F));
+			out += (char) (0x80 | ((cp >> 6) & 0x3F));
+			out += (char) (0x80 | (cp & 0x3F));
+		}
+	}
+
+	/// Decodes string contents which were already checked by parse
+	static void unescape(const char *s, size_t len, std::string &out){
+		const char *e = s + len;
+		out.clear();
+		out.reserve(len);
+		while (s < e){
+			if (*s != '\\'){
+				out += *s++;
+				continue;
+			}
+
+			char c = s[1];
+			s += 2;
+			switch (c){
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				unsigned cp = hex4(s);
+				s += 4;
+				if (cp >= 0xD800 && cp < 0xDC00 && e - s >= 6 && s[0] == '\\' && s[1] == 'u'){
+					unsigned low = hex4(s + 2);
+					if (low >= 0xDC00 && low < 0xE000){
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+						s += 6;
+					}
+				}
+				appendUtf8(out, cp);
+				break;
+			}
+			default:
+				// '"', '\\' and '/'
+				out += c;
+			}
+		}
+	}
+
+	inline void skipWs(){
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')){
+			++p;
+		}
+	}
+
+	bool readString(Field &f){
+		// p is on opening quote
+		f.kind = Kind::string;
+		f.escaped = false;
+		f.begin = ++p;
+		while (p < end){
+			char c = *p;
+			if (c == '"'){
+				f.len = p++ - f.begin;
+				return true;
+			}
+			if (c != '\\'){
+				++p;
+				continue;
+			}
+
+			f.escaped = true;
+			if (end - p < 2){
+				return false;
+			}
+			switch (p[1]){
+			case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+				p += 2;
+				break;
+			case 'u':
+				if (end - p < 6 || hex(p[2]) < 0 || hex(p[3]) < 0 || hex(p[4]) < 0 || hex(p[5]) < 0){
+					return false;
+				}
+				p += 6;
+				break;
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	inline bool readDigits(){
+		const char *start = p;
+		while (p < end && *p >= '0' && *p <= '9'){
+			++p;
+		}
+		return p != start;
+	}
+
+	bool readNumber(Field &f){
+		f.kind = Kind::number;
+		f.begin = p;
+		if (*p == '-'){
+			++p;
+		}
+		if (p < end && *p == '0'){
+			++p;
+		} else if (!readDigits()){
+			return false;
+		}
+		if (p < end && *p == '.'){
+			++p;
+			if (!readDigits()){
+				return false;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')){
+			++p;
+			if (p < end && (*p == '+' || *p == '-')){
+				++p;
+			}
+			if (!readDigits()){
+				return false;
+			}
+		}
+		f.len = p - f.begin;
+		return true;
+	}
+
+	bool readLiteral(Field &f, const char *word, size_t wordLen, Kind kind){
+		if ((size_t) (end - p) < wordLen || boost::string_view(p, wordLen) != boost::string_view(word, wordLen)){
+			return false;
+		}
+		f.kind = kind;
+		f.begin = p;
+		f.len = wordLen;
+		p += wordLen;
+		return true;
+	}
+
+	/// Checks and skips object or array, p is on opening bracket
+	bool readContainer(Field &f, int depth){
+		if (depth > maxDepth){
+			return false;
+		}
+
+		bool object = *p == '{';
+		char close = object ? '}' : ']';
+		f.kind = object ? Kind::object : Kind::array;
+		f.begin = p++;
+
+		skipWs();
+		if (p < end && *p == close){
+			f.len = ++p - f.begin;
+			return true;
+		}
+
+		Field item;
+		while (true){
+			if (object){
+				if (p == end || *p != '"' || !readString(item)){
+					return false;
+				}
+				skipWs();
+				if (p == end || *p != ':'){
+					return false;
+				}
+				++p;
+				skipWs();
+			}
+			if (!readValue(item, depth + 1)){
+				return false;
+			}
+			skipWs();
+			if (p == end){
+				return false;
+			}
+			if (*p == close){
+				f.len = ++p - f.begin;
+				return true;
+			}
+			if (*p != ','){
+				return false;
+			}
+			++p;
+			skipWs();
+		}
+	}
+
+	bool readValue(Field &f, int depth){
+		if (p == end){
+			return false;
+		}
+		switch (*p){
+		case '"':
+			return readString(f);
+		case '{':
+		case '[':
+			return readContainer(f, depth);
+		case 't':
+			return readLiteral(f, "true", 4, Kind::boolean);
+		case 'f':
+			return readLiteral(f, "false", 5, Kind::boolean);
+		case 'n':
+			return readLiteral(f, "null", 4, Kind::null);
+		default:
+			if (*p == '-' || (*p >= '0' && *p <= '9')){
+				return readNumber(f);
+			}
+			return false;
+		}
+	}
+
+	static bool keyEquals(const Field &key, boost::string_view name){
+		if (!key.escaped){
+			return key.raw() == name;
+		}
+		std::string decoded;
+		unescape(key.begin, key.len, decoded);
+		return boost::string_view(decoded) == name;
+	}
+
+	bool parseTop(const char *data, size_t size, bool object){
+		fields.clear();
+		p = data;
+		end = data + size;
+
+		char open = object ? '{' : '[';
+		char close = object ? '}' : ']';
+		skipWs();
+		if (p == end || *p != open){
+			return false;
+		}
+		++p;
+		skipWs();
+
+		if (p < end && *p == close){
+			++p;
+		} else {
+			while (true){
+				Entry e;
+				if (object){
+					if (p == end || *p != '"' || !readString(e.key)){
+						return false;
+					}
+					skipWs();
+					if (p == end || *p != ':'){
+						return false;
+					}
+					++p;
+					skipWs();
+				}
+				if (!readValue(e.value, 1)){
+					return false;
+				}
+				fields.push_back(e);
+
+				skipWs();
+				if (p == end){
+					return false;
+				}
+				if (*p == close){
+					++p;
+					break;
+				}
+				if (*p != ','){
+					return false;
+				}
+				++p;
+				skipWs();
+			}
+		}
+
+		skipWs();
+		return p == end;
+	}
+public:
+	/// Returns false if data is not valid JSON object. Nothing else is allowed at top level
+	inline bool parse(const char *data, size_t size){
+		return parseTop(data, size, true);
+	}
+
+	/// Same for JSON array, its items have missing keys
+	inline bool parseArray(const char *data, size_t size){
+		return parseTop(data, size, false);
+	}
+
+	inline bool parse(const std::string &data){
+		return parse(data.data(), data.size());
+	}
+
+	/// Field of top level key, missing field if there is no such key. Last one wins for duplicates
+	const Field &operator [](boost::string_view name) const {
+		static const Field missing;
+		for (auto it = fields.rbegin(); it != fields.rend(); ++it){
+			if (keyEquals(it->key, name)){
+				return it->value;
+			}
+		}
+		return missing;
+	}
+
+	inline size_t size() const { return fields.size(); }
+
+	/// Calls func(key, value) for every field or array item in order of frame
+	template<typename F>
+	void forEach(F func) const {
+		for (auto &e : fields){
+			func(e.key, e.value);
+		}
+	}
+};
+
+#endif //JSON_FIELDS_HPP
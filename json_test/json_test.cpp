@@ -0,0 +1,507 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <jsoncpp/json/json.h>
+
+#include "../json_fields.hpp"
+#include "../json_writer.hpp"
+#include "../packet_fields.hpp"
+#include "../cbor.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Compares Json::Reader into Json::Value with JsonFields on frames like those clients
+// send. Both sides read the same fields as deserialize of packets does.
+// Then compares Json::Value with Json::FastWriter against JsonWriter on outbound packets,
+// output must be byte to byte the same. CBOR written from packet must equal CBOR
+// transcoded from its JSON, and inbound CBOR frames must give the same fields as JSON ones.
+
+struct Fields {
+	bool valid = false;
+	int type = 0;
+	string target, message, login, password;
+	unsigned to = 0;
+	uint64_t time = 0;
+	int status = 0;
+	bool flag = false;
+
+	bool operator ==(const Fields &o) const {
+		return valid == o.valid && type == o.type && target == o.target && message == o.message && login == o.login
+			&& password == o.password && to == o.to && time == o.time && status == o.status && flag == o.flag;
+	}
+};
+
+template<typename Obj>
+static void extract(const Obj &obj, Fields &f){
+	f.type = obj["type"].asInt();
+	switch (f.type){
+	case 2:
+		f.message = obj["message"].asString();
+		f.target = obj["target"].asString();
+		f.to = obj["to"].asUInt();
+		f.time = obj["time"].asUInt64();
+		break;
+	case 4:
+		f.login = obj["login"].asString();
+		f.password = obj["password"].asString();
+		f.flag = obj["batch"].asBool();
+		break;
+	case 5:
+		f.target = obj["target"].asString();
+		f.status = obj["status"].asInt();
+		break;
+	case 6:
+		f.target = obj["target"].asString();
+		f.flag = obj["load_history"].asBool();
+		break;
+	}
+}
+
+static Fields readDom(const string &frame){
+	static Json::Reader rd;
+	Json::Value obj;
+	Fields f;
+	if (rd.parse(frame, obj) && obj.isObject()){
+		f.valid = true;
+		extract(obj, f);
+	}
+	return f;
+}
+
+static Fields readFields(const string &frame){
+	static JsonFields obj;
+	Fields f;
+	if (obj.parse(frame)){
+		f.valid = true;
+		extract(obj, f);
+	}
+	return f;
+}
+
+static Fields readCbor(const string &frame){
+	static CborFields obj;
+	Fields f;
+	if (obj.parse(frame)){
+		f.valid = true;
+		extract(obj, f);
+	}
+	return f;
+}
+
+static string toCbor(const string &json){
+	string res;
+	jsonToCbor(json, res);
+	return res;
+}
+
+static string escape(const string &s){
+	Json::FastWriter wr;
+	string res = wr.write(Json::Value(s));
+	return res.substr(0, res.size() - 1);
+}
+
+static string randomText(mt19937 &rnd, size_t len){
+	static const vector<string> words = { "привет", "как", "дела", "hello", "world", "чат", "\"quoted\"", "tab\there",
+		"line\n", "slash\\", "😀", "ok", "сегодня", "weather" };
+	string res;
+	while (res.size() < len){
+		res += words[rnd() % words.size()];
+		res += ' ';
+	}
+	return res;
+}
+
+static string messageFrame(mt19937 &rnd, size_t len){
+	return "{\"type\":2,\"target\":\"#main\",\"to\":" + to_string(rnd() % 3 ? 0 : rnd() % 1000) + ",\"time\":"
+		+ to_string(1500000000 + rnd() % 1000000) + ",\"message\":" + escape(randomText(rnd, len)) + "}";
+}
+
+static vector<string> makeMix(const string &name, mt19937 &rnd, size_t count){
+	vector<string> res;
+	for (size_t i = 0; i < count; ++i){
+		unsigned r = rnd() % 100;
+		if (name == "chat"){
+			// typical room: short messages, typing statuses and pings
+			if (r < 60){
+				res.push_back(messageFrame(rnd, 10 + rnd() % 150));
+			} else if (r < 85){
+				res.push_back("{\"type\":5,\"target\":\"#main\",\"status\":" + to_string(rnd() % 3) + "}");
+			} else if (r < 95){
+				res.push_back("{\"type\":10}");
+			} else {
+				res.push_back("{\"type\":6,\"target\":\"#room" + to_string(rnd() % 50) + "\",\"auto_login\":false,\"load_history\":true}");
+			}
+		} else if (name == "long"){
+			res.push_back(messageFrame(rnd, 1000 + rnd() % 29000));
+		} else {
+			// reconnect storm: logins and joins
+			if (r < 40){
+				res.push_back("{\"type\":4,\"login\":\"user" + to_string(rnd() % 10000) + "\",\"password\":\"secret\",\"ukey\":\"\",\"api_key\":\"\",\"batch\":true}");
+			} else {
+				res.push_back("{\"type\":6, \"target\": \"#room" + to_string(rnd() % 50) + "\", \"auto_login\": true, \"load_history\": true}");
+			}
+		}
+	}
+	return res;
+}
+
+static bool checkCorrectness(){
+	mt19937 rnd(1);
+	vector<string> frames;
+	for (auto mix : { "chat", "long", "login" }){
+		auto part = makeMix(mix, rnd, 300);
+		frames.insert(frames.end(), part.begin(), part.end());
+	}
+
+	// edge cases of syntax and conversions
+	vector<string> edge = {
+		R"({})", R"( { "type" : 2 , "message" : "aAé€😀\/b" } )",
+		R"({"type":2,"to":7.9,"time":1e3,"message":12.5,"target":true})",
+		R"({"type":2,"target":"#a","target":"#b","extra":{"x":[1,2,{"y":null}]},"arr":[]})",
+		R"({"type":5,"status":-1,"target":null})", R"({"type":6,"load_history":1})",
+		R"({"type":4,"batch":0,"login":"x"})", R"({"type":2,"message":"\"\\\b\f\n\r\t"})",
+		R"({"type":2,"mess\u0061ge":"escaped key"})",
+		R"({"type":2,)", R"({"type":2 "a":1})", R"({"type":2,"message":"\x"})",
+		R"({"type":tru})", R"([1,2])", R"("str")", "",
+	};
+	frames.insert(frames.end(), edge.begin(), edge.end());
+
+	bool ok = true;
+
+	// Json::Reader accepts these, JsonFields is strict
+	for (string frame : { R"({"type":01})", R"({"type":2}})", R"({"type":-})" }){
+		if (readFields(frame).valid){
+			cout << "Accepted invalid frame: " << frame << endl;
+			ok = false;
+		}
+	}
+
+	for (auto &frame : frames){
+		Fields dom, fields;
+		bool domThrew = false, fieldsThrew = false;
+		try { dom = readDom(frame); } catch (exception &){ domThrew = true; }
+		try { fields = readFields(frame); } catch (exception &){ fieldsThrew = true; }
+		if (domThrew != fieldsThrew || !(dom == fields)){
+			cout << "Mismatch on frame: " << frame.substr(0, 200) << endl;
+			ok = false;
+		}
+
+		// the same frame sent as CBOR
+		if (dom.valid && !domThrew){
+			Fields cbor;
+			bool cborThrew = false;
+			try { cbor = readCbor(toCbor(frame)); } catch (exception &){ cborThrew = true; }
+			if (cborThrew || !(cbor == fields)){
+				cout << "CBOR mismatch on frame: " << frame.substr(0, 200) << endl;
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+
+// copies of outbound packets with the same field descriptions
+struct StatusOut {
+	int type = 5;
+	string target, name, color, data;
+	int status = 2;
+	unsigned member_id = 0, user_id = 0;
+	bool girl = false, is_owner = false, is_moder = false;
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("color", p.color, FieldDir::out);
+		v("data", p.data, FieldDir::out);
+		v("girl", p.girl, FieldDir::out);
+		v("is_moder", p.is_moder, FieldDir::out);
+		v("is_owner", p.is_owner, FieldDir::out);
+		v("member_id", p.member_id, FieldDir::out);
+		v("name", p.name, FieldDir::out);
+		v("status", p.status, FieldDir::both);
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+		v("user_id", p.user_id, FieldDir::out);
+	}
+
+	Json::Value toValue() const {
+		Json::Value obj;
+		obj["type"] = type;
+		obj["target"] = target;
+		obj["name"] = name;
+		obj["status"] = status;
+		obj["member_id"] = member_id;
+		obj["user_id"] = user_id;
+		obj["girl"] = girl;
+		obj["color"] = color;
+		obj["data"] = data;
+		obj["is_owner"] = is_owner;
+		obj["is_moder"] = is_moder;
+		return obj;
+	}
+};
+
+struct MessageOut {
+	int type = 2;
+	time_t msgtime = 0;
+	string target, message, color, from_login;
+	unsigned from_id = 0, to_id = 0;
+	uint8_t style = 0;
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("color", p.color, FieldDir::out);
+		v("from", p.from_id, FieldDir::out);
+		v("from_login", p.from_login, FieldDir::out);
+		v("message", p.message, FieldDir::both);
+		v("style", p.style, FieldDir::out);
+		v("target", p.target, FieldDir::both);
+		v("time", p.msgtime, FieldDir::both);
+		v("to", p.to_id, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
+
+	Json::Value toValue() const {
+		Json::Value obj;
+		obj["type"] = type;
+		obj["target"] = target;
+		obj["time"] = (Json::UInt64) msgtime;
+		obj["color"] = color;
+		obj["from_login"] = from_login;
+		obj["from"] = from_id;
+		obj["to"] = to_id;
+		obj["style"] = (unsigned) style;
+		obj["message"] = message;
+		return obj;
+	}
+};
+
+struct OnlineListOut {
+	int type = 3;
+	string target;
+	vector<StatusOut> list;
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("list", p.list, FieldDir::out);
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
+
+	Json::Value toValue() const {
+		Json::Value res;
+		res["type"] = type;
+		res["target"] = target;
+		Json::Value arr(Json::arrayValue);
+		for (auto &st : list){
+			arr.append(st.toValue());
+		}
+		res["list"] = arr;
+		return res;
+	}
+};
+
+template<typename T>
+static string writeDom(const T &pack){
+	static Json::FastWriter wr;
+	return wr.write(pack.toValue());
+}
+
+template<typename T>
+static string writeDirect(const T &pack){
+	static string out;
+	out.clear();
+	JsonWriter wr(out);
+	FieldWriter<JsonWriter>::write(wr, pack);
+	out += '\n';
+	return out;
+}
+
+template<typename T>
+static string writeCbor(const T &pack){
+	static string out;
+	out.clear();
+	CborWriter wr(out);
+	FieldWriter<CborWriter>::write(wr, pack);
+	return out;
+}
+
+static string randomBytes(mt19937 &rnd, size_t len){
+	string res;
+	for (size_t i = 0; i < len; ++i){
+		res += (char) (rnd() % 256);
+	}
+	return res;
+}
+
+static MessageOut randomMessage(mt19937 &rnd, size_t len){
+	MessageOut m;
+	m.msgtime = 1500000000 + rnd() % 1000000;
+	m.target = "#main";
+	m.color = "#ff00" + to_string(rnd() % 100);
+	m.from_login = rnd() % 2 ? "Вася" : "user_" + to_string(rnd() % 1000);
+	m.from_id = rnd() % 100000;
+	m.to_id = rnd() % 4 ? 0 : rnd() % 100000;
+	m.style = rnd() % 4;
+	m.message = randomText(rnd, len);
+	return m;
+}
+
+static StatusOut randomStatus(mt19937 &rnd){
+	StatusOut st;
+	st.target = "#main";
+	st.name = "user_" + to_string(rnd() % 1000) + " Петя";
+	st.color = "#00aa" + to_string(rnd() % 100);
+	st.status = rnd() % 10;
+	st.member_id = rnd() % 100000;
+	st.user_id = rnd() % 100000;
+	st.girl = rnd() % 2;
+	st.is_owner = rnd() % 10 == 0;
+	st.is_moder = st.is_owner || rnd() % 5 == 0;
+	return st;
+}
+
+static OnlineListOut randomList(mt19937 &rnd, size_t members){
+	OnlineListOut l;
+	l.target = "#main";
+	for (size_t i = 0; i < members; ++i){
+		l.list.push_back(randomStatus(rnd));
+	}
+	return l;
+}
+
+static bool checkWriter(){
+	mt19937 rnd(3);
+	bool ok = true;
+	auto check = [&](const string &dom, const string &direct){
+		if (dom != direct){
+			cout << "Output differs:\n" << dom.substr(0, 300) << "\n" << direct.substr(0, 300) << endl;
+			ok = false;
+		}
+	};
+
+	for (int i = 0; i < 2000 && ok; ++i){
+		auto m = randomMessage(rnd, rnd() % 500);
+		// every byte value, invalid UTF-8 included
+		if (i % 2){
+			m.message = randomBytes(rnd, rnd() % 64);
+			m.from_login = randomBytes(rnd, rnd() % 8);
+		}
+		check(writeDom(m), writeDirect(m));
+
+		auto st = randomStatus(rnd);
+		st.data = randomBytes(rnd, rnd() % 16);
+		check(writeDom(st), writeDirect(st));
+	}
+
+	check(writeDom(randomList(rnd, 0)), writeDirect(randomList(rnd, 0)));
+	auto l = randomList(rnd, 50);
+	check(writeDom(l), writeDirect(l));
+
+	// CBOR straight from packet is what history and other processes get by transcoding
+	for (int i = 0; i < 2000 && ok; ++i){
+		auto m = randomMessage(rnd, rnd() % 500);
+		if (i % 2){
+			m.message = randomBytes(rnd, rnd() % 64);
+		}
+		if (writeCbor(m) != toCbor(writeDirect(m))){
+			cout << "CBOR differs for message: " << writeDirect(m).substr(0, 300) << endl;
+			ok = false;
+		}
+	}
+	if (writeCbor(l) != toCbor(writeDirect(l))){
+		cout << "CBOR differs for online list" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+static volatile size_t sink;
+
+template<typename F>
+static double bench(const vector<string> &frames, int rounds, F read){
+	size_t sum = 0;
+	auto start = steady_clock::now();
+	for (int r = 0; r < rounds; ++r){
+		for (auto &frame : frames){
+			auto f = read(frame);
+			sum += f.type + f.message.size() + f.target.size();
+		}
+	}
+	sink = sum;
+	return duration<double, nano>(steady_clock::now() - start).count() / (frames.size() * rounds);
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	if (!checkWriter()){
+		cout << "Writer check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	cout << setw(8) << left << "mix" << right << setw(14) << "avg bytes" << setw(16) << "Json::Value ns"
+		<< setw(16) << "JsonFields ns" << setw(10) << "speedup" << endl;
+
+	mt19937 rnd(2);
+	for (auto mix : { "chat", "long", "login" }){
+		auto frames = makeMix(mix, rnd, string(mix) == "long" ? 2000 : 20000);
+		size_t bytes = 0;
+		for (auto &f : frames){
+			bytes += f.size();
+		}
+
+		int n = string(mix) == "long" ? rounds / 4 + 1 : rounds;
+		double dom = bench(frames, n, readDom);
+		double fields = bench(frames, n, readFields);
+		cout << setw(8) << left << mix << right << setw(14) << bytes / frames.size() << setw(16) << fixed << setprecision(0) << dom
+			<< setw(16) << fields << setw(9) << setprecision(2) << dom / fields << "x" << endl;
+	}
+
+	auto cborFrames = makeMix("chat", rnd, 20000);
+	for (auto &f : cborFrames){
+		f = toCbor(f);
+	}
+	cout << setw(8) << left << "chat cbor" << right << setw(13) << "" << setw(16) << "" << setw(16) << fixed << setprecision(0)
+		<< bench(cborFrames, rounds, readCbor) << endl;
+
+	cout << endl << setw(14) << left << "packet" << right << setw(10) << "bytes" << setw(16) << "FastWriter ns"
+		<< setw(16) << "JsonWriter ns" << setw(10) << "speedup" << setw(12) << "cbor bytes" << setw(14) << "CborWriter ns" << endl;
+
+	auto benchWrite = [&](const char *name, auto pack, int n){
+		size_t bytes = writeDirect(pack).size();
+		auto run = [&](auto write){
+			size_t sum = 0;
+			auto start = steady_clock::now();
+			for (int i = 0; i < n; ++i){
+				sum += write(pack).size();
+			}
+			sink = sum;
+			return duration<double, nano>(steady_clock::now() - start).count() / n;
+		};
+		double dom = run([](auto &p){ return writeDom(p); });
+		double direct = run([](auto &p){ return writeDirect(p); });
+		double cbor = run([](auto &p){ return writeCbor(p); });
+		cout << setw(14) << left << name << right << setw(10) << bytes << setw(16) << fixed << setprecision(0) << dom
+			<< setw(16) << direct << setw(9) << setprecision(2) << dom / direct << "x" << setw(12) << writeCbor(pack).size()
+			<< setw(14) << setprecision(0) << cbor << endl;
+	};
+
+	int n = rounds * 5000;
+	benchWrite("status", randomStatus(rnd), n);
+	benchWrite("message", randomMessage(rnd, 100), n);
+	benchWrite("message 30k", randomMessage(rnd, 30000), n / 100 + 1);
+	benchWrite("online 100", randomList(rnd, 100), n / 100 + 1);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef JSON_WRITER_HPP
+#define JSON_WRITER_HPP
+
+#include <cstdint>
+#include <string>
+#include <boost/utility/string_view.hpp>
+
+/// Writes JSON straight into string, byte to byte as Json::FastWriter of jsoncpp 1.9 does:
+/// no spaces, everything outside ASCII escaped as \u, invalid UTF-8 decoded the same
+/// lenient way. Order of keys is up to caller, FastWriter sorts them.
+///
+/// Commas are placed by one flag, so nested objects and arrays need no stack
+class JsonWriter {
+private:
+	std::string &out;
+	bool comma = false;
+
+	inline void sep(){
+		if (comma){
+			out += ',';
+		}
+	}
+
+	void appendHex(unsigned cp){
+		static const char digits[] = "0123456789abcdef";
+		char buf[6] = { '\\', 'u', digits[(cp >> 12) & 0xF], digits[(cp >> 8) & 0xF], digits[(cp >> 4) & 0xF], digits[cp & 0xF] };
+		out.append(buf, 6);
+	}
+
+	void appendEscaped(boost::string_view str){
+		auto s = reinterpret_cast<const unsigned char *>(str.data());
+		auto e = s + str.size();
+		auto run = s;
+
+		out += '"';
+		for (; s < e; ++s){
+			unsigned char c = *s;
+			if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\'){
+				continue;
+			}
+
+			// plain characters are copied in runs
+			out.append(reinterpret_cast<const char *>(run), s - run);
+			switch (c){
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\b': out += "\\b"; break;
+			case '\f': out += "\\f"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if (c < 0x20){
+					appendHex(c);
+				} else {
+					unsigned cp = decodeUtf8(s, e);
+					if (cp < 0x80){
+						out += (char) cp;
+					} else if (cp < 0x10000){
+						appendHex(cp);
+					} else {
+						cp -= 0x10000;
+						appendHex(0xD800 + ((cp >> 10) & 0x3FF));
+						appendHex(0xDC00 + (cp & 0x3FF));
+					}
+				}
+			}
+			run = s + 1;
+		}
+		out.append(reinterpret_cast<const char *>(run), e - run);
+		out += '"';
+	}
+public:
+	JsonWriter(std::string &o) : out(o){}
+
+	/// Same as utf8ToCodepoint of jsoncpp, continuation bytes aren't checked. Moves s to last byte of sequence
+	static unsigned decodeUtf8(const unsigned char *&s, const unsigned char *e){
+		const unsigned replacement = 0xFFFD;
+		unsigned first = *s;
+		if (first < 0xE0){
+			if (e - s < 2){
+				return replacement;
+			}
+			unsigned cp = ((first & 0x1F) << 6) | (s[1] & 0x3F);
+			s += 1;
+			return cp < 0x80 ? replacement : cp;
+		}
+		if (first < 0xF0){
+			if (e - s < 3){
+				return replacement;
+			}
+			unsigned cp = ((first & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+			s += 2;
+			if (cp >= 0xD800 && cp <= 0xDFFF){
+				return replacement;
+			}
+			return cp < 0x800 ? replacement : cp;
+		}
+		if (first < 0xF8){
+			if (e - s < 4){
+				return replacement;
+			}
+			unsigned cp = ((first & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+			s += 3;
+			return cp < 0x10000 ? replacement : cp;
+		}
+		return replacement;
+	}
+
+	void beginObject(){
+		sep();
+		out += '{';
+		comma = false;
+	}
+
+	void endObject(){
+		out += '}';
+		comma = true;
+	}
+
+	void beginArray(){
+		sep();
+		out += '[';
+		comma = false;
+	}
+
+	void endArray(){
+		out += ']';
+		comma = true;
+	}
+
+	/// Keys are names from code and are written without escaping
+	void key(boost::string_view k){
+		sep();
+		out += '"';
+		out.append(k.data(), k.size());
+		out += "\":";
+		comma = false;
+	}
+
+	void writeNull(){
+		sep();
+		out += "null";
+		comma = true;
+	}
+
+	void writeBool(bool v){
+		sep();
+		out += v ? "true" : "false";
+		comma = true;
+	}
+
+	void writeUInt(uint64_t v){
+		sep();
+		char buf[20];
+		char *p = buf + sizeof(buf);
+		do {
+			*--p = (char) ('0' + v % 10);
+			v /= 10;
+		} while (v);
+		out.append(p, buf + sizeof(buf) - p);
+		comma = true;
+	}
+
+	void writeInt(int64_t v){
+		if (v < 0){
+			sep();
+			out += '-';
+			comma = false;
+			writeUInt(0 - (uint64_t) v);
+		} else {
+			writeUInt((uint64_t) v);
+		}
+	}
+
+	void writeString(boost::string_view v){
+		sep();
+		appendEscaped(v);
+		comma = true;
+	}
+
+	/// Value which is JSON already
+	void writeRaw(boost::string_view v){
+		sep();
+		out.append(v.data(), v.size());
+		comma = true;
+	}
+};
+
+#endif //JSON_WRITER_HPP
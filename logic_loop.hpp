@@ -0,0 +1,84 @@
+#ifndef LOGIC_LOOP_HPP
+#define LOGIC_LOOP_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <boost/asio.hpp>
+#include <boost/lockfree/queue.hpp>
+
+#include "logger.hpp"
+
+/// Single thread which owns chat state. I/O threads hand tasks to it through
+/// lock-free queue, timers of chat logic run on its io_service
+class LogicLoop {
+public:
+	using Task = std::function<void()>;
+private:
+	boost::asio::io_service service;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	std::thread thread;
+	boost::lockfree::queue<Task *> inbox;
+	std::atomic<bool> drainPosted;
+
+	void drain(){
+		drainPosted = false;
+
+		Task *task;
+		while (inbox.pop(task)){
+			std::unique_ptr<Task> t(task);
+			try {
+				(*t)();
+			} catch (const std::exception &e){
+				Logger::error("Exception in logic thread: ", e.what());
+			} catch (...){
+				Logger::error("Unknown exception in logic thread");
+			}
+		}
+	}
+public:
+	LogicLoop() : inbox(1024), drainPosted(false){}
+
+	LogicLoop(const LogicLoop &) = delete;
+
+	~LogicLoop(){
+		stop();
+
+		Task *task;
+		while (inbox.pop(task)){
+			delete task;
+		}
+	}
+
+	void start(){
+		if (thread.joinable()){
+			return;
+		}
+
+		service.reset();
+		work.reset(new boost::asio::io_service::work(service));
+		thread = std::thread([this]{ service.run(); });
+	}
+
+	void stop(){
+		work.reset();
+		service.stop();
+		if (thread.joinable()){
+			thread.join();
+		}
+	}
+
+	/// Safe to call from any thread
+	void push(Task task){
+		inbox.push(new Task(std::move(task)));
+		if (!drainPosted.exchange(true)){
+			service.post([this]{ drain(); });
+		}
+	}
+
+	inline boost::asio::io_service &getService(){ return service; }
+};
+
+#endif //LOGIC_LOOP_HPP
@@ -1,3 +1,3 @@
 #include "memcached.hpp"
 
-unique_ptr<Memcache::memcached_st_my> Memcache::mci;
+thread_local unique_ptr<Memcache::memcached_st_my> Memcache::mci;
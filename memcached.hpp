@@ -34,7 +34,7 @@ private:
 		}
 	};
 
-	static unique_ptr<memcached_st_my> mci;
+	static thread_local unique_ptr<memcached_st_my> mci;
 	
 	Memcache(const Memcache &);
 public:
@@ -0,0 +1,153 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/// Blocks of one size carved from slabs. Freed blocks go to free list and are reused,
+/// slabs are never returned to the system. Objects may be freed by other thread than
+/// the one which allocated them, so free list is guarded by mutex
+class BlockPool {
+public:
+	static const size_t granularity = 16;
+	static const size_t maxBlockSize = 1024;
+
+	struct Stats {
+		size_t blockSize = 0;
+		size_t slabs = 0;
+		size_t inUse = 0;
+		size_t allocations = 0;		// every allocate() call
+		size_t fresh = 0;			// allocations served from new slab memory instead of free list
+	};
+private:
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	std::mutex mtx;
+	FreeBlock *freeList = nullptr;
+	std::vector<std::unique_ptr<char[]>> slabs;
+	char *slabPos = nullptr;
+	char *slabEnd = nullptr;
+	Stats stats;
+
+	size_t blocksPerSlab(){
+		size_t n = 16*1024 / stats.blockSize;
+		return n < 8 ? 8 : n;
+	}
+public:
+	BlockPool(size_t blockSize){
+		stats.blockSize = blockSize;
+	}
+
+	BlockPool(const BlockPool &) = delete;
+
+	void *allocate(){
+		std::lock_guard<std::mutex> lock(mtx);
+		++stats.allocations;
+		++stats.inUse;
+
+		if (freeList){
+			auto b = freeList;
+			freeList = b->next;
+			return b;
+		}
+
+		if (slabPos == slabEnd){
+			size_t size = blocksPerSlab() * stats.blockSize;
+			slabs.emplace_back(new char[size]);
+			slabPos = slabs.back().get();
+			slabEnd = slabPos + size;
+			++stats.slabs;
+		}
+
+		++stats.fresh;
+		void *res = slabPos;
+		slabPos += stats.blockSize;
+		return res;
+	}
+
+	void deallocate(void *p){
+		std::lock_guard<std::mutex> lock(mtx);
+		--stats.inUse;
+		auto b = static_cast<FreeBlock *>(p);
+		b->next = freeList;
+		freeList = b;
+	}
+
+	Stats getStats(){
+		std::lock_guard<std::mutex> lock(mtx);
+		return stats;
+	}
+
+	/// Pool of size class for size, nullptr if size is too big for pools
+	static BlockPool *forSize(size_t size){
+		// never destroyed, static objects may free blocks after exit of main
+		static BlockPool **pools = []{
+			auto res = new BlockPool *[maxBlockSize / granularity];
+			for (size_t i = 0; i < maxBlockSize / granularity; ++i){
+				res[i] = new BlockPool((i + 1) * granularity);
+			}
+			return res;
+		}();
+
+		if (size == 0 || size > maxBlockSize){
+			return nullptr;
+		}
+		return pools[(size - 1) / granularity];
+	}
+
+	/// Stats of size classes which were used at least once
+	static std::vector<Stats> getAllStats(){
+		std::vector<Stats> res;
+		for (size_t s = granularity; s <= maxBlockSize; s += granularity){
+			auto st = forSize(s)->getStats();
+			if (st.allocations > 0){
+				res.push_back(st);
+			}
+		}
+		return res;
+	}
+
+	static void *allocate(size_t size){
+		auto pool = forSize(size);
+		return pool ? pool->allocate() : ::operator new(size);
+	}
+
+	static void deallocate(void *p, size_t size){
+		auto pool = forSize(size);
+		if (pool){
+			pool->deallocate(p);
+		} else {
+			::operator delete(p);
+		}
+	}
+};
+
+/// Allocator for std::allocate_shared, object and control block share one pooled block
+template<typename T>
+struct PoolAllocator {
+	using value_type = T;
+
+	PoolAllocator() = default;
+	template<typename U>
+	PoolAllocator(const PoolAllocator<U> &){}
+
+	T *allocate(size_t n){
+		return static_cast<T *>(BlockPool::allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n){
+		BlockPool::deallocate(p, n * sizeof(T));
+	}
+
+	template<typename U>
+	bool operator ==(const PoolAllocator<U> &) const { return true; }
+	template<typename U>
+	bool operator !=(const PoolAllocator<U> &) const { return false; }
+};
+
+#endif //OBJECT_POOL_HPP
@@ -1,7 +1,10 @@
 #include <exception>
 #include <string>
+#include <memory>
 #include "packet.hpp"
+#include "object_pool.hpp"
 #include "packets.hpp"
+#include "logger.hpp"
 
 Packet::Packet(){
 	type = Type::error;
@@ -11,38 +14,122 @@ Packet::~Packet(){
 	
 }
 
-Packet *Packet::read(const std::string &data){
-	Json::Value obj;
-	Json::Reader jreader;
+const char *const cborProtocol = "wschat.cbor";
 
-	if (!jreader.parse(data, obj)){
-		return nullptr;
+Encoding encodingForProtocol(const string &chosen){
+	return chosen == cborProtocol ? Encoding::cbor : Encoding::json;
+}
+
+template<typename Source>
+static void readFields(const Source &obj, AnyPacket &out){
+	auto &readers = AnyPacket::readers<Source>();
+	int type = obj["type"].asInt();
+	if (type < 0 || (size_t) type >= readers.size() || !readers[type]){
+		return;
 	}
-	
-	Packet *pack = nullptr;
-	switch ((Type) obj["type"].asInt()){
-		case Type::error:				pack = new PacketError(); break;
-		case Type::system:				pack = new PacketSystem(); break;
-		case Type::message:				pack = new PacketMessage(); break;
-		case Type::online_list:			pack = new PacketOnlineList(); break;
-		case Type::auth:				pack = new PacketAuth(); break;
-		case Type::status:				pack = new PacketStatus(); break;
-		case Type::join:				pack = new PacketJoin(); break;
-		case Type::leave:				pack = new PacketLeave(); break;
-		case Type::create_room:			pack = new PacketCreateRoom(); break;
-		case Type::remove_room:			pack = new PacketRemoveRoom(); break;
-		case Type::ping:				pack = new PacketPing(); break;
+
+	try {
+		readers[type](out, obj);
+	} catch (std::out_of_range &e) {
+		out.clear();
+	}
+}
+
+void Packet::read(const std::string &data, AnyPacket &out, Encoding enc){
+	// fields of previous message are reused, frame isn't copied into Json::Value
+	static thread_local JsonFields json;
+	static thread_local CborFields cbor;
+
+	out.clear();
+	if (enc == Encoding::cbor){
+		if (cbor.parse(data)){
+			readFields(cbor, out);
+		}
+	} else if (json.parse(data)){
+		readFields(json, out);
+	}
+}
+
+PacketBuffer Packet::toBuffer(Encoding enc) const {
+	// grows to the biggest packet once, then only shared copy is allocated. Taken while
+	// packet is written: items of RawList may be serialized in it and get their own buffer
+	static thread_local string cache;
+	string out;
+	out.swap(cache);
+	out.clear();
+	if (enc == Encoding::cbor){
+		CborWriter wr(out);
+		serialize(wr);
+	} else {
+		JsonWriter wr(out);
+		serialize(wr);
+		// Json::FastWriter ended every packet with new line, clients may rely on it
+		out += '\n';
+	}
+	auto res = std::allocate_shared<const string>(PoolAllocator<string>(), out);
+	cache.swap(out);
+	return res;
+}
+
+const PacketBuffer &EncodedPacket::get(Encoding enc) const {
+	auto &buf = buffers[(size_t) enc];
+	if (buf){
+		return buf;
 	}
 
 	if (pack){
-		try {
-			pack->deserialize(obj);
-		} catch (std::out_of_range &e) {
-			delete pack;
-			pack = nullptr;
+		buf = pack->toBuffer(enc);
+		return buf;
+	}
+
+	static thread_local string out;
+	out.clear();
+	auto &json = buffers[(size_t) Encoding::json];
+	if (!jsonToCbor(*json, out)){
+		Logger::error("Can't transcode packet to CBOR: ", *json);
+	}
+	buf = std::allocate_shared<const string>(PoolAllocator<string>(), out);
+	return buf;
+}
+
+void RawList::write(JsonWriter &wr) const {
+	wr.beginArray();
+	for (auto item : items){
+		// without new line which ends every packet
+		boost::string_view buf(*item->get(Encoding::json));
+		if (!buf.empty() && buf.back() == '\n'){
+			buf.remove_suffix(1);
 		}
+		wr.writeRaw(buf);
 	}
-	
-	return pack;
+	wr.endArray();
 }
 
+void RawList::write(CborWriter &wr) const {
+	wr.beginArray();
+	for (auto item : items){
+		wr.writeRaw(*item->get(Encoding::cbor));
+	}
+	wr.endArray();
+}
+
+const PacketBuffer &EncodedPacket::getDeflated(Encoding enc) const {
+	auto &buf = deflated[(size_t) enc];
+	if (buf){
+		return buf;
+	}
+
+	auto &plain = get(enc);
+	if (plain->size() < DeflateOptions::get().minSize){
+		return buf;
+	}
+
+	static thread_local string out;
+	out.clear();
+	if (!Deflater::shared().compress(*plain, out)){
+		Logger::error("Can't compress packet of ", plain->size(), " bytes");
+		return buf;
+	}
+	buf = std::allocate_shared<const string>(PoolAllocator<string>(), out);
+	return buf;
+}
@@ -2,14 +2,38 @@
 #define PACKET_H_
 
 #include <string>
-#include <jsoncpp/json/json.h>
+#include <memory>
+#include <vector>
+#include "packet_fields.hpp"
+#include "json_fields.hpp"
+#include "json_writer.hpp"
+#include "cbor.hpp"
+#include "deflate.hpp"
 
 using std::string;
 
+// Immutable serialized packet, shared between all recipients
+using PacketBuffer = std::shared_ptr<const string>;
+
+/// Wire encoding of connection, chosen by client through Sec-WebSocket-Protocol.
+/// Values index buffers of EncodedPacket
+enum class Encoding : uint8_t {
+	json = 0,
+	cbor,
+};
+
+/// Subprotocol of CBOR packets, JSON ones need none
+extern const char *const cborProtocol;
+
+/// CBOR for subprotocol chosen in handshake, JSON otherwise
+Encoding encodingForProtocol(const string &chosen);
+
 #ifndef CLIENT_CLASS_DEFINED
 class Client;
 #endif
 
+class AnyPacket;
+
 class Packet {
 private:
 	
@@ -26,6 +50,8 @@ public:
 		create_room,
 		remove_room,
 		ping,
+		history_before,
+		typing,
 	};
 	
 	Type type;
@@ -33,11 +59,84 @@ public:
 	Packet();
 	virtual ~Packet();
 	
-	static Packet *read(const string &data);
+	/// Parses packet into out, leaves it empty if data is not a valid packet
+	static void read(const string &data, AnyPacket &out, Encoding enc = Encoding::json);
 	
-	virtual void deserialize(const Json::Value &) = 0;
-	virtual Json::Value serialize() const = 0;
+	virtual void deserialize(const JsonFields &) = 0;
+	virtual void deserialize(const CborFields &) = 0;
+	virtual void serialize(JsonWriter &) const = 0;
+	virtual void serialize(CborWriter &) const = 0;
 	virtual void process(Client &) = 0;
+
+	/// Droppable packets are discarded first when client send queue is full
+	virtual bool isDroppable() const { return false; }
+
+	PacketBuffer toBuffer(Encoding enc = Encoding::json) const;
+};
+
+/// Packet serialized once for every encoding which its recipients use. Buffers are made on
+/// first request, from packet or, when there is only JSON, by transcoding it. Compressed
+/// buffers for permessage-deflate clients are made the same way, once for all of them.
+/// Must be used by one thread at a time
+class EncodedPacket {
+private:
+	const Packet *pack = nullptr;
+	mutable PacketBuffer buffers[2];
+	mutable PacketBuffer deflated[2];
+public:
+	EncodedPacket(){}
+	/// Packet must outlive this object
+	EncodedPacket(const Packet &p) : pack(&p){}
+	EncodedPacket(const PacketBuffer &json){ buffers[(size_t) Encoding::json] = json; }
+
+	const PacketBuffer &get(Encoding enc) const;
+
+	/// Buffer compressed without context takeover, null when it is shorter than DeflateOptions::minSize
+	const PacketBuffer &getDeflated(Encoding enc) const;
+
+	/// Copy which doesn't refer to packet, may be stored
+	EncodedPacket detach() const {
+		EncodedPacket res(get(Encoding::json));
+		res.buffers[(size_t) Encoding::cbor] = buffers[(size_t) Encoding::cbor];
+		res.deflated[0] = deflated[0];
+		res.deflated[1] = deflated[1];
+		return res;
+	}
+};
+
+/// List field of packets which are serialized already, their buffers are copied as they are.
+/// Packets must live until the one which has the list is serialized
+struct RawList : public SelfWritten {
+	std::vector<const EncodedPacket *> items;
+
+	void write(JsonWriter &wr) const;
+	void write(CborWriter &wr) const;
+};
+
+/// Packet which describes its fields by static fields(), see packet_fields.hpp.
+/// deserialize and serialize are generated from that one description
+template<typename P>
+class DescribedPacket : public Packet {
+public:
+	virtual void deserialize(const JsonFields &obj){ read(obj); }
+	virtual void deserialize(const CborFields &obj){ read(obj); }
+
+	virtual void serialize(JsonWriter &wr) const {
+		FieldWriter<JsonWriter>::write(wr, static_cast<const P &>(*this));
+	}
+
+	virtual void serialize(CborWriter &wr) const {
+		FieldWriter<CborWriter>::write(wr, static_cast<const P &>(*this));
+	}
+
+	/// Called after deserialize, packet may check and fix values which came from client
+	void afterRead(){}
+private:
+	template<typename Source>
+	void read(const Source &obj){
+		FieldReader<Source>::read(obj, static_cast<P &>(*this));
+		static_cast<P &>(*this).afterRead();
+	}
 };
 
 #endif
@@ -0,0 +1,189 @@
+#ifndef PACKET_FIELDS_HPP
+#define PACKET_FIELDS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#ifdef _DEBUG_
+#include <cassert>
+#endif
+
+
+/// Direction of packet field: read from client, sent to client or both
+enum class FieldDir : uint8_t {
+	in = 1,
+	out = 2,
+	both = 3,
+};
+
+inline bool hasDir(FieldDir d, FieldDir of){
+	return ((uint8_t) d & (uint8_t) of) != 0;
+}
+
+/// Base of field type which writes itself by write(Writer &), reading it isn't supported
+struct SelfWritten {};
+
+/// Packet describes its fields once, as static template
+///
+///	template<typename Self, typename V>
+///	static void fields(Self &p, V &v){
+///		v("key", p.member, FieldDir::both);
+///	}
+///
+/// FieldReader and FieldWriter of some encoding are passed as v. Keys go in alphabetical
+/// order, the one in which Json::FastWriter wrote them, debug build checks it. Integers are
+/// read as Json::Value::asInt for signed types up to int, asUInt for unsigned up to unsigned
+/// int and asUInt64 for the rest, enums as asInt
+
+/// Reads fields marked FieldDir::in from parsed frame, JsonFields or CborFields
+template<typename Source>
+class FieldReader {
+private:
+	const Source &obj;
+public:
+	FieldReader(const Source &o) : obj(o){}
+
+	void operator ()(const char *key, std::string &v, FieldDir d){
+		if (hasDir(d, FieldDir::in)){
+			obj[key].copyTo(v);
+		}
+	}
+
+	void operator ()(const char *key, bool &v, FieldDir d){
+		if (hasDir(d, FieldDir::in)){
+			v = obj[key].asBool();
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value>::type operator ()(const char *key, T &v, FieldDir d){
+		if (!hasDir(d, FieldDir::in)){
+			return;
+		}
+		auto &f = obj[key];
+		if (std::is_signed<T>::value && sizeof(T) <= sizeof(int)){
+			v = (T) f.asInt();
+		} else if (!std::is_signed<T>::value && sizeof(T) <= sizeof(unsigned)){
+			v = (T) f.asUInt();
+		} else {
+			v = (T) f.asUInt64();
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_enum<T>::value>::type operator ()(const char *key, T &v, FieldDir d){
+		if (hasDir(d, FieldDir::in)){
+			v = (T) obj[key].asInt();
+		}
+	}
+
+	template<typename T>
+	void operator ()(const char *key, std::vector<T> &v, FieldDir d){
+		if (hasDir(d, FieldDir::in)){
+			throw std::logic_error(std::string("Inbound list field is not supported: ") + key);
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_base_of<SelfWritten, T>::value>::type operator ()(const char *key, T &, FieldDir d){
+		if (hasDir(d, FieldDir::in)){
+			throw std::logic_error(std::string("Inbound field is not supported: ") + key);
+		}
+	}
+
+	/// Reads described object
+	template<typename T>
+	static void read(const Source &obj, T &res){
+		FieldReader rd(obj);
+		T::fields(res, rd);
+	}
+};
+
+/// Writes fields marked FieldDir::out as members of current object by JsonWriter or CborWriter
+template<typename Writer>
+class FieldWriter {
+private:
+	Writer &wr;
+#ifdef _DEBUG_
+	const char *lastKey = nullptr;
+#endif
+
+	bool begin(const char *key, FieldDir d){
+		if (!hasDir(d, FieldDir::out)){
+			return false;
+		}
+#ifdef _DEBUG_
+		assert(!lastKey || strcmp(lastKey, key) < 0);
+		lastKey = key;
+#endif
+		wr.key(key);
+		return true;
+	}
+public:
+	FieldWriter(Writer &w) : wr(w){}
+
+	void operator ()(const char *key, const std::string &v, FieldDir d){
+		if (begin(key, d)){
+			wr.writeString(v);
+		}
+	}
+
+	void operator ()(const char *key, bool v, FieldDir d){
+		if (begin(key, d)){
+			wr.writeBool(v);
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value>::type operator ()(const char *key, const T &v, FieldDir d){
+		if (!begin(key, d)){
+			return;
+		}
+		if (std::is_signed<T>::value){
+			wr.writeInt((int64_t) v);
+		} else {
+			wr.writeUInt((uint64_t) v);
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_enum<T>::value>::type operator ()(const char *key, const T &v, FieldDir d){
+		if (begin(key, d)){
+			wr.writeInt((int64_t) v);
+		}
+	}
+
+	/// List of described objects
+	template<typename T>
+	void operator ()(const char *key, const std::vector<T> &v, FieldDir d){
+		if (!begin(key, d)){
+			return;
+		}
+		wr.beginArray();
+		for (auto &item : v){
+			write(wr, item);
+		}
+		wr.endArray();
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_base_of<SelfWritten, T>::value>::type operator ()(const char *key, const T &v, FieldDir d){
+		if (begin(key, d)){
+			v.write(wr);
+		}
+	}
+
+	/// Writes described object
+	template<typename T>
+	static void write(Writer &w, const T &obj){
+		FieldWriter fw(w);
+		w.beginObject();
+		T::fields(obj, fw);
+		w.endObject();
+	}
+};
+
+#endif //PACKET_FIELDS_HPP
@@ -7,6 +7,7 @@
 #include "logger.hpp"
 #include "db.hpp"
 #include "gate.hpp"
+#include "profile_cache.hpp"
 
 #include <cstdlib>
 #include <memory>
@@ -19,20 +20,6 @@ using std::regex;
 
 //----
 
-void PacketError::deserialize(const Json::Value &obj){
-
-}
-
-Json::Value PacketError::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["source"] = (uint) source;
-	obj["target"] = target;
-	obj["code"] = (uint) code;
-	obj["info"] = info;
-	return obj;
-}
-
 void PacketError::process(Client &client){
 
 }
@@ -43,16 +30,6 @@ PacketSystem::PacketSystem(){ type = Type::system; }
 PacketSystem::PacketSystem(const string &targ, const string &msg) :  target(targ), message(msg){ type = Type::system; }
 PacketSystem::~PacketSystem(){}
 
-void PacketSystem::deserialize(const Json::Value &obj){}
-
-Json::Value PacketSystem::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["message"] = message;
-	obj["target"] = target;
-	return obj;
-}
-
 void PacketSystem::process(Client &client){}
 
 //----
@@ -83,12 +60,7 @@ PacketMessage::~PacketMessage(){
 
 }
 
-void PacketMessage::deserialize(const Json::Value &obj){
-	message = obj["message"].asString();
-	target = obj["target"].asString();
-	to_id = obj["to"].asUInt();
-	msgtime = obj["time"].asUInt64();
-
+void PacketMessage::afterRead(){
 	message = regex_replace(message, regex("\n{3,}"), "\n\n\n");
 	if (message.size() > 30*1024){
 		message = string(message, 0, 30*1024);
@@ -96,20 +68,6 @@ void PacketMessage::deserialize(const Json::Value &obj){
 	replaceInvalidUtf8(message, ' ');
 }
 
-Json::Value PacketMessage::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	obj["time"] = (Json::UInt64) msgtime;
-	obj["color"] = color;
-	obj["from_login"] = from_login;
-	obj["from"] = from_id;
-	obj["to"] = to_id;
-	obj["style"] = (uint) style;
-	obj["message"] = message;
-	return obj;
-}
-
 void PacketMessage::process(Client &client){
 	if (!target.empty() && !message.empty()){
 		time_t curtime = time(nullptr);
@@ -137,15 +95,23 @@ void PacketMessage::process(Client &client){
 			return;
 		}
 
-		auto member = room->findMemberByClient(client.getSelfPtr());
-		if (!processCommand(member, room, message)){
-			string nick = member->getNick();
-			if (nick.empty()){
-				client.sendPacket(PacketSystem(target, "Перед началом общения укажите свой ник: /nick MyNick"));
-			} else {
-				room->sendPacketToAll(PacketMessage(member, message));
+		auto cli = client.getSelfPtr();
+		auto pack = *this;
+		room->post([room, cli, pack]() mutable {
+			auto member = room->findMemberByClient(cli);
+			if (!member){
+				return;
 			}
-		}
+
+			if (!pack.processCommand(member, room, pack.message)){
+				string nick = member->getNick();
+				if (nick.empty()){
+					cli->sendPacket(PacketSystem(pack.target, "Перед началом общения укажите свой ник: /nick MyNick"));
+				} else {
+					room->sendPacketToAll(PacketMessage(member, pack.message));
+				}
+			}
+		});
 	}
 }
 
@@ -180,11 +146,17 @@ CommandProcessor PacketMessage::cmd_moder {
 CommandProcessor PacketMessage::cmd_owner {
 	new CommandAddModer(),
 	new CommandDelModer(),
+	new CommandHistorySize(),
 };
 
 CommandProcessor PacketMessage::cmd_admin {
 	new CommandRoomList(),
 	new CommandIpCounter(),
+	new CommandSendQueue(),
+	new CommandAuthStat(),
+	new CommandUncache(),
+	new CommandAllocStat(),
+	new CommandClusterStat(),
 };
 
 bool PacketMessage::processCommand(MemberPtr member, RoomPtr room, const string &msg){
@@ -225,36 +197,14 @@ bool PacketMessage::processCommand(MemberPtr member, RoomPtr room, const string
 
 PacketOnlineList::PacketOnlineList(){
 	type = Type::online_list;
-}
-
-PacketOnlineList::PacketOnlineList(RoomPtr room) : PacketOnlineList(){
-	target = room->getName();
-	list = Json::Value(Json::arrayValue);
-	auto members = room->getMembers();
-	for (MemberPtr m : members){
-		if (!m->getNick().empty()){
-			PacketStatus pack(m);
-			list.append(pack.serialize());
-		}
-	}
+	since = 0;
+	version = 0;
 }
 
 PacketOnlineList::~PacketOnlineList(){
 
 }
 
-void PacketOnlineList::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-}
-
-Json::Value PacketOnlineList::serialize() const {
-	Json::Value res;
-	res["type"] = (int) type;
-	res["target"] = target;
-	res["list"] = list;
-	return res;
-}
-
 void PacketOnlineList::process(Client &client){
 	auto room = client.getRoomByName(target);
 	if (!room){
@@ -262,47 +212,36 @@ void PacketOnlineList::process(Client &client){
 		return;
 	}
 
-	client.sendPacket(PacketOnlineList(room));
+	auto cli = client.getSelfPtr();
+	room->post([room, cli, since = version]{
+		room->sendOnlineList(cli, since);
+	});
 }
 
 //----
 
 PacketAuth::PacketAuth(){
 	type = Type::auth;
+	user_id = 0;
+	batch = false;
 }
 
 PacketAuth::~PacketAuth(){
 
 }
 
-void PacketAuth::deserialize(const Json::Value &obj){
-	ukey = obj["ukey"].asString();
-	api_key = obj["api_key"].asString();
-	name = obj["login"].asString();
-	password = obj["password"].asString();
-}
-
-Json::Value PacketAuth::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["user_id"] = user_id;
-	obj["name"] = name;
-	return obj;
-}
-
-void PacketAuth::process(Client &client){
-	static vector<string> colors { "gray", "#f44", "dodgerblue", "aquamarine", "deeppink" };
-
+PacketAuth::Result PacketAuth::lookup(const string &ip){
+	Result res;
 	Database db;
 	Gate gate;
 	try {
 		int uid = 0;
 
-		auto initUser = [&](int uid, int gid, const string &name){
-			client.setID(uid);
-			client.setName(name);
-			client.setGirl(gid == 4);
-			client.setColor(colors[gid < (int) colors.size() ? gid : 2]);
+		auto fail = [&](PacketError::Code code, const string &info){
+			res.failed = true;
+			res.error = code;
+			res.info = info;
+			return res;
 		};
 
 		if (!ukey.empty()){
@@ -314,59 +253,137 @@ void PacketAuth::process(Client &client){
 			}
 		}
 		else if (!api_key.empty()){
-			if (!gate.auth(client.getIP())){
-				client.sendPacket(PacketError(type, PacketError::Code::access_denied, "Слишком частые попытки авторизации! Попробуйте позже."));
-				return;
+			if (!gate.auth(ip)){
+				return fail(PacketError::Code::access_denied, "Слишком частые попытки авторизации! Попробуйте позже.");
 			}
 
 			auto ps = db.prepare("SELECT user_id FROM api_keys WHERE `key` = ?");
-			ps->setString(1, api_key);
+			ps.setString(1, api_key);
 
 			auto rs = ps.executeQuery();
 			if (rs->next()){
 				uid = rs->getInt(1);
-				gate.auth(client.getIP(), true);
+				gate.auth(ip, true);
 			}
 		}
 
 		if (uid != 0){
-			auto ps = db.prepare("SELECT login, gid FROM users WHERE id = ?");
-			ps->setInt(1, uid);
+			auto &cache = ProfileCache::instance();
+			ProfileCache::Profile profile;
+
+			if (!cache.get(uid, profile)){
+				auto ps = db.prepare("SELECT login, gid FROM users WHERE id = ?");
+				ps.setInt(1, uid);
+
+				auto rs = ps.executeQuery();
+				if (rs->next()){
+					profile.exists = true;
+					profile.gid = rs->getInt(2);
+					profile.login = rs->getString(1);
+				}
+				cache.put(uid, profile);
+			}
 
-			auto rs = ps.executeQuery();
-			if (rs->next()){
-				initUser(uid, rs->getInt(2), rs->getString(1));
+			if (profile.exists){
+				res.user_id = uid;
+				res.gid = profile.gid;
+				res.login = profile.login;
 			}
 		}
 		else if (!name.empty() && !password.empty()){
-			if (!gate.auth(client.getIP())){
-				client.sendPacket(PacketError(type, PacketError::Code::access_denied, "Слишком частые попытки авторизации! Попробуйте позже."));
-				return;
+			if (!gate.auth(ip)){
+				return fail(PacketError::Code::access_denied, "Слишком частые попытки авторизации! Попробуйте позже.");
 			}
 
 			auto ps = db.prepare("SELECT id, login, gid FROM users WHERE login = ? AND pass = MD5(?)");
-			ps->setString(1, name);
-			ps->setString(2, password);
+			ps.setString(1, name);
+			ps.setString(2, password);
 
 			auto rs = ps.executeQuery();
 			if (rs->next()){
-				initUser(rs->getInt(1), rs->getInt(3), rs->getString(2));
-				gate.auth(client.getIP(), true);
+				res.user_id = rs->getInt(1);
+				res.gid = rs->getInt(3);
+				res.login = rs->getString(2);
+				gate.auth(ip, true);
+
+				ProfileCache::Profile profile;
+				profile.exists = true;
+				profile.gid = res.gid;
+				profile.login = res.login;
+				ProfileCache::instance().put(res.user_id, profile);
 			} else {
-				client.sendPacket(PacketError(type, PacketError::Code::incorrect_loginpass, "Неверный логин/пароль!"));
-				return;
+				return fail(PacketError::Code::incorrect_loginpass, "Неверный логин/пароль!");
 			}
 		}
 	} catch (SQLException &e){
 		Logger::error("SQLException code ", e.getErrorCode(), ", SQLState: ", e.getSQLState(), "\n", e.what());
 		db.reconnect();
-		client.sendPacket(PacketError(type, PacketError::Code::database_error, "Ошибка подключения к БД при авторизации!"));
+		res.failed = true;
+		res.error = PacketError::Code::database_error;
+		res.info = "Ошибка подключения к БД при авторизации!";
+	}
+
+	return res;
+}
+
+PacketAuth::Result PacketAuth::authenticate(const string &ip){
+	try {
+		return lookup(ip);
+	} catch (const std::exception &e){
+		Logger::error("Exception while authenticating: ", e.what());
+	} catch (...){
+		Logger::error("Unknown exception while authenticating");
+	}
+
+	Result res;
+	res.failed = true;
+	res.error = PacketError::Code::unknown;
+	res.info = "Ошибка авторизации, попробуйте позже";
+	return res;
+}
+
+void PacketAuth::complete(Client &client, const Result &res){
+	static vector<string> colors { "gray", "#f44", "dodgerblue", "aquamarine", "deeppink" };
+
+	if (res.failed){
+		client.sendPacket(PacketError(type, res.error, res.info));
+		client.endAuth();
 		return;
 	}
 
+	if (res.user_id != 0){
+		client.getServer()->setClientUser(client.getSelfPtr(), res.user_id, res.login);
+		client.setGirl(res.gid == 4);
+		client.setColor(colors[res.gid < (int) colors.size() ? res.gid : 2]);
+	}
+
 	user_id = client.getID();
 	name = client.getName();
+	client.setBatching(batch);
 	client.sendPacket(*this);
+	client.endAuth();
+}
+
+void PacketAuth::process(Client &client){
+	auto server = client.getServer();
+	auto cli = client.getSelfPtr();
+	auto ip = client.getIP();
+	auto pack = *this;
+
+	client.beginAuth();
+	bool queued = server->getAuthPool().submit([server, cli, ip, pack]() mutable {
+		auto res = pack.authenticate(ip);
+		server->post([server, cli, pack, res]() mutable {
+			if (server->isConnected(cli)){
+				pack.complete(*cli, res);
+			}
+		});
+	});
+
+	if (!queued){
+		client.sendPacket(PacketError(type, PacketError::Code::overloaded, "Сервер перегружен, попробуйте авторизоваться позже"));
+		client.endAuth();
+	}
 }
 
 //----
@@ -407,46 +424,37 @@ PacketStatus::~PacketStatus(){
 
 }
 
-void PacketStatus::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-	status = (Member::Status) obj["status"].asInt();
-}
-
-Json::Value PacketStatus::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	obj["name"] = name;
-	obj["status"] = (int) status;
-	obj["member_id"] = member_id;
-	obj["user_id"] = user_id;
-	obj["girl"] = girl;
-	obj["color"] = color;
-	obj["data"] = data;
-	obj["is_owner"] = is_owner;
-	obj["is_moder"] = is_moder;
-	return obj;
+bool PacketStatus::isDroppable() const {
+	return status == Member::Status::typing || status == Member::Status::stop_typing
+			|| status == Member::Status::away || status == Member::Status::back;
 }
 
 void PacketStatus::process(Client &client){
-	auto room = client.getRoomByName(target);
-	MemberPtr member = nullptr;
-	if (room)
-		member = room->findMemberByClient(client.getSelfPtr());
+	auto cli = client.getSelfPtr();
+	auto stat = status;
 
 	if (status == Member::Status::away || status == Member::Status::back){
 		auto nstat = status == Member::Status::back ? Member::Status::online : Member::Status::away;
-		for (auto troom : client.getConnectedRooms()){
-			auto mem = troom->findMemberByClient(client.getSelfPtr());
-			if (mem && !mem->getNick().empty()){
-				mem->setStatus(nstat);
-				troom->sendPacketToAll(PacketStatus(mem, status));
-			}
+		for (auto &r : client.getConnectedRooms()){
+			auto troom = r.second;
+			troom->post([troom, cli, stat, nstat]{
+				auto mem = troom->findMemberByClient(cli);
+				if (mem && !mem->getNick().empty()){
+					mem->setStatus(nstat);
+					troom->sendPacketToAll(PacketStatus(mem, stat));
+				}
+			});
 		}
 	}
 	else if (status == Member::Status::typing || status == Member::Status::stop_typing){
-		if (member && !member->getNick().empty()){
-			room->sendPacketToAll(PacketStatus(member, status));
+		auto room = client.getRoomByName(target);
+		if (room){
+			room->post([room, cli, stat]{
+				auto member = room->findMemberByClient(cli);
+				if (member && !member->getNick().empty()){
+					room->onTyping(member, stat);
+				}
+			});
 		}
 	}
 }
@@ -458,6 +466,7 @@ PacketJoin::PacketJoin(){
 	member_id = 0;
 	auto_login = true;
 	load_history = true;
+	version = 0;
 }
 
 PacketJoin::PacketJoin(MemberPtr member) : PacketJoin(){
@@ -470,21 +479,6 @@ PacketJoin::~PacketJoin(){
 
 }
 
-void PacketJoin::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-	auto_login = obj["auto_login"].asBool();
-	load_history = obj["load_history"].asBool();
-}
-
-Json::Value PacketJoin::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	obj["member_id"] = member_id;
-	obj["login"] = login;
-	return obj;
-}
-
 void PacketJoin::process(Client &client){
 	if (client.getRoomByName(target)){
 		client.sendPacket(PacketError(type, target, PacketError::Code::already_connected, "Вы уже подключены к комнате \"" + target + "\""));
@@ -498,17 +492,15 @@ void PacketJoin::process(Client &client){
 		return;
 	}
 
-	auto m = client.joinRoom(room);
-	if (m){
-		if (load_history){
-			for (const string &s : room->getHistory()){
-				client.sendRawData(s);
-			}
+	client.joinRoom(room, version, [room, history = load_history, autoLogin = auto_login](MemberPtr m){
+		auto cli = m->getClient();
+		if (history){
+			cli->sendHistory(room->getHistory());
 		}
 
 		string nick;
 
-		if (auto_login){
+		if (autoLogin){
 			auto info = room->getStoredMemberInfo(m);
 			if (info.user_id != 0){
 				nick = info.nick;
@@ -523,8 +515,7 @@ void PacketJoin::process(Client &client){
 				}
 			}
 
-			auto member = room->findMemberByNick(nick);
-			if (member){
+			if (room->isNickTaken(nick)){
 				m->sendPacket(PacketSystem("", "Выбранный вами ранее ник (" + nick + ") занят, выберите другой ник"));
 				nick.clear();
 			}
@@ -536,7 +527,7 @@ void PacketJoin::process(Client &client){
 		else {
 			m->setNick(nick);
 		}
-	}
+	});
 }
 
 //----
@@ -553,17 +544,6 @@ PacketLeave::~PacketLeave(){
 
 }
 
-void PacketLeave::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-}
-
-Json::Value PacketLeave::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	return obj;
-}
-
 void PacketLeave::process(Client &client){
 	auto room = client.getRoomByName(target);
 	if (!room){
@@ -571,7 +551,6 @@ void PacketLeave::process(Client &client){
 		return;
 	}
 
-	auto member = room->findMemberByClient(client.getSelfPtr());
 	client.leaveRoom(room);
 }
 
@@ -589,17 +568,6 @@ PacketCreateRoom::~PacketCreateRoom(){
 
 }
 
-void PacketCreateRoom::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-}
-
-Json::Value PacketCreateRoom::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	return obj;
-}
-
 void PacketCreateRoom::process(Client &client){
 	if (client.isGuest()){
 		client.sendPacket(PacketError(type, target, PacketError::Code::access_denied, "Гости не могут создавать комнаты"));
@@ -636,17 +604,6 @@ PacketRemoveRoom::~PacketRemoveRoom(){
 
 }
 
-void PacketRemoveRoom::deserialize(const Json::Value &obj){
-	target = obj["target"].asString();
-}
-
-Json::Value PacketRemoveRoom::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	obj["target"] = target;
-	return obj;
-}
-
 void PacketRemoveRoom::process(Client &client){
 	if (client.isGuest()){
 		client.sendPacket(PacketError(type, target, PacketError::Code::access_denied, "Гости не могут удалять комнаты"));
@@ -680,16 +637,51 @@ PacketPing::~PacketPing(){
 
 }
 
-void PacketPing::deserialize(const Json::Value &obj){
+void PacketPing::process(Client &client){
 
 }
 
-Json::Value PacketPing::serialize() const {
-	Json::Value obj;
-	obj["type"] = (int) type;
-	return obj;
+//----
+
+PacketHistoryBefore::PacketHistoryBefore(){
+	type = Type::history_before;
+	before = 0;
+	time = 0;
+	limit = 50;
 }
 
-void PacketPing::process(Client &client){
+PacketHistoryBefore::~PacketHistoryBefore(){
+
+}
+
+void PacketHistoryBefore::process(Client &client){
+	auto room = client.getRoomByName(target);
+	if (!room){
+		client.sendPacket(PacketError(type, target, PacketError::Code::not_found, "Вы не подключены к комнате \"" + target + "\""));
+		return;
+	}
+
+	auto cli = client.getSelfPtr();
+	uint count = std::min(limit, maxLimit);
+	room->post([room, cli, before = before, time = time, count]{
+		room->sendHistoryPage(cli, before, (int64_t) time, count);
+	});
+}
+
+//----
+
+PacketTyping::PacketTyping(){
+	type = Type::typing;
+}
 
+PacketTyping::~PacketTyping(){
+
+}
+
+void PacketTyping::process(Client &client){
+
+}
+
+bool PacketTyping::isDroppable() const {
+	return true;
 }
@@ -3,6 +3,7 @@
 
 #include <ctime>
 #include <vector>
+#include <boost/variant.hpp>
 
 #include "packet.hpp"
 #include "rooms.hpp"
@@ -10,7 +11,7 @@
 
 using std::vector;
 
-class PacketError : public Packet {
+class PacketError : public DescribedPacket<PacketError> {
 public:
 	enum class Code : uint8_t {
 		unknown = 0,
@@ -21,6 +22,7 @@ public:
 		invalid_target,
 		already_exists,
 		incorrect_loginpass,
+		overloaded,
 	};
 public:
 	Type source;
@@ -28,18 +30,25 @@ public:
 	Code code;
 	string info;
 
-	PacketError() { type = Type::error; }
+	PacketError() : source(Type::error), code(Code::unknown){ type = Type::error; }
 	PacketError(Type src, const string &targ, Code cod, const string &inf = "")
 			: source(src), target(targ), code(cod), info(inf){ type = Type::error; }
 	PacketError(Type src, Code cod, const string &inf = "") : PacketError(src, "", cod, inf){}
 	PacketError(Code cod, const string &inf = "") : PacketError(Type::error, cod, inf){}
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("code", p.code, FieldDir::out);
+		v("info", p.info, FieldDir::out);
+		v("source", p.source, FieldDir::out);
+		v("target", p.target, FieldDir::out);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketSystem : public Packet {
+class PacketSystem : public DescribedPacket<PacketSystem> {
 private:
 
 public:
@@ -50,12 +59,17 @@ public:
 	PacketSystem(const string &targ, const string &msg);
 	virtual ~PacketSystem();
 	
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("message", p.message, FieldDir::out);
+		v("target", p.target, FieldDir::out);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketMessage : public Packet {
+class PacketMessage : public DescribedPacket<PacketMessage> {
 public:
 	enum class Style : uint8_t {
 		message = 0,
@@ -88,46 +102,70 @@ public:
 	PacketMessage(MemberPtr from, MemberPtr to, const string &msg, const time_t &tm);
 	virtual ~PacketMessage();
 	
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
-	virtual void process(Client &);
-};
-
-class PacketOnlineList : public Packet {
-private:
-
-public:
-	string target;
-	Json::Value list;
+	void afterRead();
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("color", p.color, FieldDir::out);
+		v("from", p.from_id, FieldDir::out);
+		v("from_login", p.from_login, FieldDir::out);
+		v("message", p.message, FieldDir::both);
+		v("style", p.style, FieldDir::out);
+		v("target", p.target, FieldDir::both);
+		v("time", p.msgtime, FieldDir::both);
+		v("to", p.to_id, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
 
-	PacketOnlineList();
-	PacketOnlineList(RoomPtr room);
-	virtual ~PacketOnlineList();
-	
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
 	virtual void process(Client &);
 };
 
-class PacketAuth : public Packet {
+class PacketAuth : public DescribedPacket<PacketAuth> {
+public:
+	/// Looked up on worker of auth pool, completed on logic thread
+	struct Result {
+		uint user_id = 0;
+		int gid = 0;
+		string login;
+		bool failed = false;
+		PacketError::Code error = PacketError::Code::unknown;
+		string info;
+	};
 private:
-
+	Result lookup(const string &ip);
 public:
 	string ukey;
 	string api_key;
 	uint user_id;
 	string name;
 	string password;
+	bool batch;
 	
 	PacketAuth();
 	virtual ~PacketAuth();
 	
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("api_key", p.api_key, FieldDir::in);
+		v("batch", p.batch, FieldDir::in);
+		v("login", p.name, FieldDir::in);
+		v("name", p.name, FieldDir::out);
+		v("password", p.password, FieldDir::in);
+		v("type", p.type, FieldDir::out);
+		v("ukey", p.ukey, FieldDir::in);
+		v("user_id", p.user_id, FieldDir::out);
+	}
+
+	/// Never throws, failure of lookup comes as failed result, so auth of client is always completed
+	Result authenticate(const string &ip);
+	/// Sends PacketError for failed result, otherwise sets user of client and answers it.
+	/// Then processes packets which client sent meanwhile
+	void complete(Client &client, const Result &res);
+
 	virtual void process(Client &);
 };
 
-class PacketStatus : public Packet {
+class PacketStatus : public DescribedPacket<PacketStatus> {
 private:
 
 public:
@@ -147,12 +185,53 @@ public:
 	PacketStatus(MemberPtr member, const string &data = "");
 	virtual ~PacketStatus();
 	
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("color", p.color, FieldDir::out);
+		v("data", p.data, FieldDir::out);
+		v("girl", p.girl, FieldDir::out);
+		v("is_moder", p.is_moder, FieldDir::out);
+		v("is_owner", p.is_owner, FieldDir::out);
+		v("member_id", p.member_id, FieldDir::out);
+		v("name", p.name, FieldDir::out);
+		v("status", p.status, FieldDir::both);
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+		v("user_id", p.user_id, FieldDir::out);
+	}
+
 	virtual void process(Client &);
+	virtual bool isDroppable() const;
 };
 
-class PacketJoin : public Packet {
+class PacketOnlineList : public DescribedPacket<PacketOnlineList> {
+private:
+
+public:
+	string target;
+	// statuses of members, see RoomPresence
+	RawList list;
+	// 0 for whole list, otherwise list has only members changed after this version
+	uint64_t since;
+	// in: version of list which client has, out: version of this list
+	uint64_t version;
+
+	PacketOnlineList();
+	virtual ~PacketOnlineList();
+	
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("list", p.list, FieldDir::out);
+		v("since", p.since, FieldDir::out);
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+		v("version", p.version, FieldDir::both);
+	}
+
+	virtual void process(Client &);
+};
+
+class PacketJoin : public DescribedPacket<PacketJoin> {
 private:
 
 public:
@@ -161,17 +240,28 @@ public:
 	string login;
 	bool auto_login;
 	bool load_history;
+	// version of online list which client has, it gets only changes since it
+	uint64_t version;
 
 	PacketJoin();
 	PacketJoin(MemberPtr member);
 	virtual ~PacketJoin();
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("auto_login", p.auto_login, FieldDir::in);
+		v("load_history", p.load_history, FieldDir::in);
+		v("login", p.login, FieldDir::out);
+		v("member_id", p.member_id, FieldDir::out);
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+		v("version", p.version, FieldDir::in);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketLeave : public Packet {
+class PacketLeave : public DescribedPacket<PacketLeave> {
 private:
 
 public:
@@ -181,12 +271,16 @@ public:
 	PacketLeave(string targ);
 	virtual ~PacketLeave();
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketCreateRoom : public Packet {
+class PacketCreateRoom : public DescribedPacket<PacketCreateRoom> {
 private:
 
 public:
@@ -196,12 +290,16 @@ public:
 	PacketCreateRoom(string targ);
 	virtual ~PacketCreateRoom();
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketRemoveRoom : public Packet {
+class PacketRemoveRoom : public DescribedPacket<PacketRemoveRoom> {
 private:
 
 public:
@@ -211,22 +309,167 @@ public:
 	PacketRemoveRoom(string targ);
 	virtual ~PacketRemoveRoom();
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("target", p.target, FieldDir::both);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
-class PacketPing : public Packet {
+class PacketPing : public DescribedPacket<PacketPing> {
 private:
 
 public:
 	PacketPing();
 	virtual ~PacketPing();
 
-	virtual void deserialize(const Json::Value &);
-	virtual Json::Value serialize() const;
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("type", p.type, FieldDir::out);
+	}
+
+	virtual void process(Client &);
+};
+
+/// Page of room history from HistoryLog, older than what client already has. Request gives
+/// before, number of the message which page ends at, or time, or none of them for page before
+/// history sent on join. Messages of page are sent as they were, then this packet with before
+/// of the oldest sent message for the next request and limit set to count of sent messages
+class PacketHistoryBefore : public DescribedPacket<PacketHistoryBefore> {
+public:
+	static const uint maxLimit = 100;
+
+	string target;
+	uint64_t before;
+	uint64_t time;
+	uint limit;
+
+	PacketHistoryBefore();
+	virtual ~PacketHistoryBefore();
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("before", p.before, FieldDir::both);
+		v("limit", p.limit, FieldDir::both);
+		v("target", p.target, FieldDir::both);
+		v("time", p.time, FieldDir::in);
+		v("type", p.type, FieldDir::out);
+	}
+
 	virtual void process(Client &);
 };
 
+/// Typing indicators which changed in room during interval, sent instead of typing and
+/// stop_typing statuses when room coalesces them, see RoomTyping
+class PacketTyping : public DescribedPacket<PacketTyping> {
+public:
+	struct Item {
+		uint member_id;
+		string name;
+		Member::Status status;
+
+		template<typename Self, typename V>
+		static void fields(Self &p, V &v){
+			v("member_id", p.member_id, FieldDir::out);
+			v("name", p.name, FieldDir::out);
+			v("status", p.status, FieldDir::out);
+		}
+	};
+
+	string target;
+	vector<Item> list;
+
+	PacketTyping();
+	virtual ~PacketTyping();
+
+	template<typename Self, typename V>
+	static void fields(Self &p, V &v){
+		v("list", p.list, FieldDir::out);
+		v("target", p.target, FieldDir::out);
+		v("type", p.type, FieldDir::out);
+	}
+
+	virtual void process(Client &);
+	virtual bool isDroppable() const;
+};
+
+//----
+
+/// Inbound packet stored by value. Packet::read deserializes into it without heap
+/// allocation and process calls handler of concrete type without virtual dispatch.
+/// New packet type is added to this list and to Packet::Type
+template<typename ...Packets>
+class PacketVariant : public boost::variant<boost::blank, Packets...> {
+private:
+	using Base = boost::variant<boost::blank, Packets...>;
+
+	struct Processor : public boost::static_visitor<> {
+		Client &client;
+
+		Processor(Client &cli) : client(cli){}
+
+		void operator ()(boost::blank &) const {}
+
+		template<typename P>
+		void operator ()(P &pack) const {
+			pack.P::process(client);
+		}
+	};
+public:
+	template<typename Source>
+	using Reader = void (*)(PacketVariant &, const Source &);
+
+	using Base::Base;
+	using Base::operator =;
+
+	/// Reader of every packet type from JsonFields or CborFields, indexed by Packet::Type
+	template<typename Source>
+	static const vector<Reader<Source>> &readers(){
+		static const vector<Reader<Source>> table = []{
+			vector<Reader<Source>> res;
+			for (auto t : { (size_t) Packets().type... }){
+				if (res.size() <= t){
+					res.resize(t + 1, nullptr);
+				}
+			}
+			int unused[] = { (res[(size_t) Packets().type] = &readAs<Packets, Source>, 0)... };
+			(void) unused;
+			return res;
+		}();
+		return table;
+	}
+
+	template<typename P, typename Source>
+	static void readAs(PacketVariant &var, const Source &obj){
+		var = P();
+		boost::get<P>(var).deserialize(obj);
+	}
+
+	inline bool empty() const { return this->which() == 0; }
+	inline void clear(){ *this = boost::blank(); }
+
+	void process(Client &client){
+		boost::apply_visitor(Processor(client), *this);
+	}
+};
+
+class AnyPacket : public PacketVariant<
+		PacketError,
+		PacketSystem,
+		PacketMessage,
+		PacketOnlineList,
+		PacketAuth,
+		PacketStatus,
+		PacketJoin,
+		PacketLeave,
+		PacketCreateRoom,
+		PacketRemoveRoom,
+		PacketPing,
+		PacketHistoryBefore,
+		PacketTyping
+	> {};
+
 #endif
 
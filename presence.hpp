@@ -0,0 +1,150 @@
+#ifndef PRESENCE_HPP
+#define PRESENCE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "packets.hpp"
+
+/// Online list of room with version, which grows by one on every change of it: member gets
+/// or drops nick, changes nick, status, gender, color or rights. Status of every listed member
+/// is kept serialized, so the whole list is a copy of ready items, and it is made once for
+/// every version. Numbers of members changed by the latest maxChanges versions are kept too:
+/// client which knows some version of them gets only those members, removed ones as offline.
+///
+/// Versions of room start from its creation time and number of cluster process, so version
+/// which client got before restart or from other process doesn't match changes kept here.
+/// Used only by thread of room
+class RoomPresence {
+public:
+	static const size_t maxChanges = 4096;
+
+	/// List of members changed after some version. Refers to entries of RoomPresence,
+	/// so it is sent before the next change
+	struct Delta {
+		PacketOnlineList packet;
+		std::deque<PacketStatus> removed;
+		std::deque<EncodedPacket> removedEncoded;
+	};
+private:
+	struct Entry {
+		PacketStatus status;
+		// refers to status, so entry is never copied
+		EncodedPacket encoded;
+	};
+
+	struct Change {
+		uint64_t version;
+		uint member_id;
+		// nick of removed member, offline status is sent with it
+		string name;
+	};
+
+	string room;
+	uint64_t version;
+	std::map<uint, Entry> entries;
+	std::deque<Change> changes;
+
+	PacketOnlineList full;
+	EncodedPacket fullEncoded;
+	bool fullValid = false;
+
+	void changed(uint member_id, const string &removed_name){
+		++version;
+		changes.push_back(Change{ version, member_id, removed_name });
+		if (changes.size() > maxChanges){
+			changes.pop_front();
+		}
+		fullValid = false;
+	}
+public:
+	RoomPresence(const string &room_name, uint64_t first_version) : room(room_name), version(first_version){
+		full.target = room;
+	}
+
+	RoomPresence(const RoomPresence &) = delete;
+
+	inline uint64_t getVersion() const { return version; }
+	inline size_t size() const { return entries.size(); }
+
+	/// Listed status of member, nullptr if it isn't listed
+	const PacketStatus *find(uint member_id) const {
+		auto it = entries.find(member_id);
+		return it != entries.end() ? &it->second.status : nullptr;
+	}
+
+	/// Adds member or replaces its status, which must be its current one
+	void update(const PacketStatus &status){
+		auto &e = entries[status.member_id];
+		e.status = status;
+		e.encoded = EncodedPacket(e.status);
+		changed(status.member_id, "");
+	}
+
+	void remove(uint member_id, const string &name){
+		if (entries.erase(member_id) > 0){
+			changed(member_id, name);
+		}
+	}
+
+	/// Whole list of the current version
+	const EncodedPacket &getFull(){
+		if (!fullValid){
+			full.version = version;
+			full.list.items.clear();
+			full.list.items.reserve(entries.size());
+			for (auto &p : entries){
+				full.list.items.push_back(&p.second.encoded);
+			}
+			fullEncoded = EncodedPacket(full);
+			fullValid = true;
+		}
+		return fullEncoded;
+	}
+
+	/// True if changes after version since are known, then res lists members changed after it
+	bool getDelta(uint64_t since, Delta &res){
+		if (since == 0 || since > version){
+			return false;
+		}
+		if (since < version && (changes.empty() || since + 1 < changes.front().version)){
+			return false;
+		}
+
+		auto &items = res.packet.list.items;
+		res.packet.target = room;
+		res.packet.since = since;
+		res.packet.version = version;
+		items.clear();
+		std::unordered_set<uint> seen;
+		for (auto it = changes.rbegin(); it != changes.rend() && it->version > since; ++it){
+			if (!seen.insert(it->member_id).second){
+				continue;
+			}
+
+			auto e = entries.find(it->member_id);
+			if (e != entries.end()){
+				items.push_back(&e->second.encoded);
+			} else {
+				res.removed.emplace_back();
+				auto &st = res.removed.back();
+				st.target = room;
+				st.member_id = it->member_id;
+				st.name = it->name;
+				st.status = Member::Status::offline;
+				res.removedEncoded.emplace_back(st);
+				items.push_back(&res.removedEncoded.back());
+			}
+		}
+		// in order of changes
+		std::reverse(items.begin(), items.end());
+		return true;
+	}
+};
+
+#endif //PRESENCE_HPP
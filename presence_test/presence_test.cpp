@@ -0,0 +1,396 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <jsoncpp/json/json.h>
+
+#include "../presence.hpp"
+#include "../test_common/chat_fixture.hpp"
+#include "../packets.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Replica of client kept from full lists and deltas of RoomPresence matches members of room,
+// also of other processes of cluster. Then compares mass reconnect with rebuilt list of every join
+
+struct Status {
+	string name;
+	int status;
+	bool moder;
+
+	bool operator ==(const Status &o) const {
+		return name == o.name && status == o.status && moder == o.moder;
+	}
+};
+
+static Json::Value parse(const EncodedPacket &data){
+	Json::Value res;
+	Json::Reader().parse(*data.get(Encoding::json), res);
+	return res;
+}
+
+static PacketStatus makeStatus(uint id, const string &name, Member::Status status, bool moder){
+	PacketStatus st;
+	st.target = "main";
+	st.member_id = id;
+	st.user_id = id;
+	st.name = name;
+	st.status = status;
+	st.is_moder = moder;
+	return st;
+}
+
+// what client knows about room
+struct Replica {
+	uint64_t version = 0;
+	map<uint, Status> members;
+
+	// applies list sent by presence, returns false if it isn't the one expected
+	bool apply(const Json::Value &list, bool delta){
+		if (list["type"].asInt() != (int) Packet::Type::online_list || (list["since"].asUInt64() != 0) != delta){
+			out << "Wrong list: " << Json::FastWriter().write(list) << endl;
+			return false;
+		}
+		if (!delta){
+			members.clear();
+		}
+		for (auto &item : list["list"]){
+			uint id = item["member_id"].asUInt();
+			int status = item["status"].asInt();
+			if (status == (int) Member::Status::offline){
+				members.erase(id);
+			} else {
+				members[id] = Status{ item["name"].asString(), status, item["is_moder"].asBool() };
+			}
+		}
+		version = list["version"].asUInt64();
+		return true;
+	}
+
+	bool sync(RoomPresence &p, bool &gotDelta){
+		RoomPresence::Delta delta;
+		gotDelta = p.getDelta(version, delta);
+		return apply(gotDelta ? parse(EncodedPacket(delta.packet)) : parse(p.getFull()), gotDelta);
+	}
+
+	bool matches(const map<uint, Status> &expected) const {
+		return members == expected;
+	}
+};
+
+static void mutate(RoomPresence &p, map<uint, Status> &listed, mt19937 &rnd, uint &nextId){
+	auto pick = [&]() -> uint {
+		auto it = listed.begin();
+		advance(it, rnd() % listed.size());
+		return it->first;
+	};
+	auto update = [&](uint id, const Status &s){
+		listed[id] = s;
+		p.update(makeStatus(id, s.name, (Member::Status) s.status, s.moder));
+	};
+	switch (listed.empty() ? 0 : rnd() % 4){
+		case 0:
+			++nextId;
+			update(nextId, Status{ "nick" + to_string(nextId), (int) Member::Status::online, false });
+			break;
+		case 1: {
+			uint id = pick();
+			p.remove(id, listed[id].name);
+			listed.erase(id);
+			break;
+		}
+		case 2: {
+			uint id = pick();
+			Status s = listed[id];
+			s.status = (int) (rnd() % 2 ? Member::Status::online : Member::Status::away);
+			update(id, s);
+			break;
+		}
+		default: {
+			uint id = pick();
+			Status s = listed[id];
+			s.moder = !s.moder;
+			s.name += "_";
+			update(id, s);
+			break;
+		}
+	}
+}
+
+static bool checkReplicas(){
+	mt19937 rnd(1);
+	uint nextId = 0;
+	RoomPresence p("main", 1000);
+	map<uint, Status> listed;
+	vector<Replica> clients(20);
+	size_t deltas = 0, fulls = 0;
+	for (int i = 0; i < 20000; ++i){
+		mutate(p, listed, rnd, nextId);
+		if (rnd() % 10 == 0){
+			auto &c = clients[rnd() % clients.size()];
+			bool delta;
+			if (!c.sync(p, delta)){
+				return false;
+			}
+			(delta ? deltas : fulls)++;
+			if (!c.matches(listed) || c.version != p.getVersion()){
+				out << "Replica differs after " << (delta ? "delta" : "full list") << endl;
+				return false;
+			}
+		}
+	}
+	if (!deltas || !fulls){
+		out << "Deltas or full lists were never sent" << endl;
+		return false;
+	}
+
+	// version of other process or of room before restart
+	Replica stranger;
+	stranger.version = p.getVersion() + 100;
+	bool delta;
+	if (!stranger.sync(p, delta) || delta || !stranger.matches(listed)){
+		out << "Unknown version got delta" << endl;
+		return false;
+	}
+
+	// nothing changed: empty delta
+	RoomPresence::Delta d;
+	if (!p.getDelta(p.getVersion(), d) || !d.packet.list.items.empty()){
+		out << "Current version didn't get empty delta" << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool checkWindow(){
+	RoomPresence p("main", 1);
+	p.update(makeStatus(1, "first", Member::Status::online, false));
+	p.update(makeStatus(2, "second", Member::Status::online, false));
+	uint64_t start = p.getVersion();
+	for (size_t i = 0; i < RoomPresence::maxChanges; ++i){
+		p.update(makeStatus(2, "second", i % 2 ? Member::Status::online : Member::Status::away, false));
+	}
+
+	// the oldest change kept is the one right after start
+	RoomPresence::Delta d;
+	if (!p.getDelta(start, d) || d.packet.list.items.size() != 1){
+		out << "Version at the edge of window didn't get delta" << endl;
+		return false;
+	}
+	RoomPresence::Delta old;
+	if (p.getDelta(start - 1, old)){
+		out << "Version before window got delta" << endl;
+		return false;
+	}
+
+	// removed member comes as offline with its nick, listed ones as they are now
+	uint64_t before = p.getVersion();
+	p.remove(1, "first");
+	p.remove(1, "first");
+	RoomPresence::Delta rd;
+	if (!p.getDelta(before, rd) || p.getVersion() != before + 1){
+		out << "Removal wasn't counted once" << endl;
+		return false;
+	}
+	auto list = parse(EncodedPacket(rd.packet));
+	if (list["list"].size() != 1 || list["list"][0]["status"].asInt() != (int) Member::Status::offline
+			|| list["list"][0]["name"].asString() != "first" || list["list"][0]["member_id"].asUInt() != 1){
+		out << "Removed member isn't listed as offline: " << Json::FastWriter().write(list);
+		return false;
+	}
+	if (p.find(1) || parse(p.getFull())["list"].size() != 1){
+		out << "Removed member is still listed" << endl;
+		return false;
+	}
+	return true;
+}
+
+// moderator added to Room is listed with new rights in the next full list and in delta
+static bool checkRights(Server &server){
+	auto room = makeRoom(server, "main");
+
+	vector<MemberPtr> members;
+	for (uint uid = 10; uid < 15; ++uid){
+		auto m = room->addMember(makeClient(server, uid));
+		m->setNick("user" + to_string(uid));
+		members.push_back(m);
+	}
+
+	auto &p = room->getPresence();
+	Replica client;
+	bool delta;
+	client.sync(p, delta);
+	auto full = client.members;
+	uint64_t before = p.getVersion();
+
+	room->addModerator(12);
+	RoomPresence::Delta d;
+	if (!p.getDelta(before, d) || p.getVersion() != before + 1){
+		out << "Rights change isn't a new version" << endl;
+		return false;
+	}
+	if (!client.apply(parse(EncodedPacket(d.packet)), true)){
+		return false;
+	}
+	full[members[2]->getId()].moder = true;
+	if (!client.matches(full)){
+		out << "Delta doesn't list new moderator" << endl;
+		return false;
+	}
+
+	Replica fresh;
+	if (!fresh.apply(parse(p.getFull()), false) || !fresh.matches(full)){
+		out << "Full list of old version is sent after rights change" << endl;
+		return false;
+	}
+
+	// member who leaves is listed as offline
+	before = p.getVersion();
+	room->removeMember(members[0]->getClient());
+	RoomPresence::Delta ld;
+	if (!p.getDelta(before, ld) || !client.apply(parse(EncodedPacket(ld.packet)), true)){
+		return false;
+	}
+	full.erase(members[0]->getId());
+	if (!client.matches(full)){
+		out << "Member who left is still listed" << endl;
+		return false;
+	}
+	return true;
+}
+
+// members of other process of cluster are listed and hold their nicks, answer to resync
+// replaces them, process which died takes them away
+static bool checkRemote(){
+	ClusterBus bus(2, 64);
+	bus.setNode(0);
+	Server server(0, &bus);
+	auto room = makeRoom(server, "main");
+
+	auto local = room->addMember(makeClient(server, 10));
+	local->setNick("local");
+
+	// odd numbers are given out by the second process
+	auto &p = room->getPresence();
+	auto send = [&](const PacketStatus &st){
+		room->onRemoteStatus(*EncodedPacket(st).get(Encoding::json));
+	};
+	send(makeStatus(1, "remote", Member::Status::online, false));
+	send(makeStatus(3, "other", Member::Status::away, false));
+	if (!room->isNickTaken("remote") || !room->isNickTaken("local") || room->isNickTaken("free") || p.size() != 3){
+		out << "Remote member isn't listed" << endl;
+		return false;
+	}
+
+	auto change = makeStatus(3, "renamed", Member::Status::nick_change, false);
+	change.data = "other";
+	send(change);
+	auto listed = p.find(3);
+	if (room->isNickTaken("other") || !room->isNickTaken("renamed") || !listed || listed->name != "renamed" || listed->status != Member::Status::away){
+		out << "Nick change of remote member isn't listed" << endl;
+		return false;
+	}
+
+	send(makeStatus(1, "remote", Member::Status::offline, false));
+	if (room->isNickTaken("remote") || p.find(1)){
+		out << "Remote member who left is listed" << endl;
+		return false;
+	}
+
+	Json::Value list(Json::arrayValue);
+	list.append(parse(EncodedPacket(makeStatus(5, "missed", Member::Status::online, true))));
+	room->applyRemoteMembers(1, list);
+	if (!p.find(5) || !p.find(5)->is_moder || p.find(3) || room->isNickTaken("renamed") || !room->isNickTaken("missed")){
+		out << "Members of resync aren't listed" << endl;
+		return false;
+	}
+
+	room->applyRemoteMembers(1, Json::Value(Json::arrayValue));
+	if (p.size() != 1 || !p.find(local->getId()) || room->isNickTaken("missed")){
+		out << "Members of process which died are listed" << endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	Server server(0);
+	cout.rdbuf(nullptr);
+	if (!checkReplicas() || !checkWindow() || !checkRights(server) || !checkRemote()){
+		out << "Correctness check failed" << endl;
+		return 1;
+	}
+	out << "Correctness check passed" << endl;
+
+	// every member of room reconnects after restart of proxy, few changes meanwhile
+	size_t count = rounds * 100;
+	mt19937 rnd(2);
+	uint nextId = 0;
+	RoomPresence p("main", 1000);
+	map<uint, Status> listed;
+	for (size_t i = 0; i < count; ++i){
+		++nextId;
+		listed[nextId] = Status{ "nick" + to_string(nextId), (int) Member::Status::online, false };
+		p.update(makeStatus(nextId, listed[nextId].name, Member::Status::online, false));
+	}
+	uint64_t known = p.getVersion();
+
+	size_t bytes = 0;
+	auto start = steady_clock::now();
+	for (size_t i = 0; i < count; ++i){
+		// list of every member made for joined one
+		deque<PacketStatus> statuses;
+		deque<EncodedPacket> encoded;
+		PacketOnlineList list;
+		list.target = "main";
+		for (auto &l : listed){
+			statuses.push_back(makeStatus(l.first, l.second.name, (Member::Status) l.second.status, l.second.moder));
+			encoded.emplace_back(statuses.back());
+			list.list.items.push_back(&encoded.back());
+		}
+		bytes += EncodedPacket(list).get(Encoding::json)->size();
+	}
+	double rebuildMs = duration<double, milli>(steady_clock::now() - start).count();
+	size_t rebuildBytes = bytes;
+
+	bytes = 0;
+	start = steady_clock::now();
+	for (size_t i = 0; i < count; ++i){
+		bytes += p.getFull().get(Encoding::json)->size();
+	}
+	double cachedMs = duration<double, milli>(steady_clock::now() - start).count();
+	size_t cachedBytes = bytes;
+
+	bytes = 0;
+	size_t deltas = 0;
+	start = steady_clock::now();
+	for (size_t i = 0; i < count; ++i){
+		if (i % 10 == 0){
+			mutate(p, listed, rnd, nextId);
+		}
+		RoomPresence::Delta d;
+		if (p.getDelta(known, d)){
+			++deltas;
+			bytes += EncodedPacket(d.packet).get(Encoding::json)->size();
+		} else {
+			bytes += p.getFull().get(Encoding::json)->size();
+		}
+	}
+	double deltaMs = duration<double, milli>(steady_clock::now() - start).count();
+
+	out << "Reconnect of " << count << " members, " << count / 10 << " changes meanwhile, " << deltas << " deltas" << endl;
+	out << setw(16) << left << "" << right << setw(12) << "ms" << setw(16) << "bytes sent" << endl;
+	out << setw(16) << left << "rebuilt list" << right << fixed << setprecision(1) << setw(12) << rebuildMs << setw(16) << rebuildBytes << endl;
+	out << setw(16) << left << "cached list" << right << setw(12) << cachedMs << setw(16) << cachedBytes << endl;
+	out << setw(16) << left << "delta" << right << setw(12) << deltaMs << setw(16) << bytes << endl;
+	return 0;
+}
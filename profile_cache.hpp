@@ -0,0 +1,123 @@
+#ifndef PROFILE_CACHE_HPP
+#define PROFILE_CACHE_HPP
+
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "config.hpp"
+
+/// LRU cache of user profiles (uid -> login, gid) in front of users table.
+/// Missing users are cached too, with shorter TTL. Used from auth workers
+class ProfileCache {
+public:
+	struct Profile {
+		std::string login;
+		int gid = 0;
+		bool exists = false;
+	};
+
+	struct Stats {
+		size_t size = 0;
+		size_t capacity = 0;
+		size_t hits = 0;
+		size_t negativeHits = 0;
+		size_t misses = 0;
+		size_t invalidations = 0;
+	};
+private:
+	struct Entry {
+		Profile profile;
+		time_t expires;
+		std::list<uint>::iterator lru;
+	};
+
+	std::mutex mtx;
+	std::unordered_map<uint, Entry> entries;
+	std::list<uint> lru;
+	size_t capacity;
+	int ttl;
+	int negativeTtl;
+	Stats stats;
+
+	ProfileCache(){
+		auto conf = config["auth"];
+		capacity = conf.get("cache_size", 10000).asUInt();
+		ttl = conf.get("cache_ttl", 300).asInt();
+		negativeTtl = conf.get("cache_negative_ttl", 30).asInt();
+	}
+
+	void erase(std::unordered_map<uint, Entry>::iterator it){
+		lru.erase(it->second.lru);
+		entries.erase(it);
+	}
+public:
+	static ProfileCache &instance(){
+		static ProfileCache cache;
+		return cache;
+	}
+
+	bool get(uint uid, Profile &profile){
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = entries.find(uid);
+		if (it == entries.end()){
+			++stats.misses;
+			return false;
+		}
+
+		if (it->second.expires < time(nullptr)){
+			erase(it);
+			++stats.misses;
+			return false;
+		}
+
+		lru.splice(lru.begin(), lru, it->second.lru);
+		profile = it->second.profile;
+		++(profile.exists ? stats.hits : stats.negativeHits);
+		return true;
+	}
+
+	void put(uint uid, const Profile &profile){
+		if (!capacity){
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = entries.find(uid);
+		if (it != entries.end()){
+			erase(it);
+		}
+
+		while (entries.size() >= capacity){
+			entries.erase(lru.back());
+			lru.pop_back();
+		}
+
+		lru.push_front(uid);
+		entries[uid] = Entry{profile, time(nullptr) + (profile.exists ? ttl : negativeTtl), lru.begin()};
+	}
+
+	bool invalidate(uint uid){
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = entries.find(uid);
+		if (it == entries.end()){
+			return false;
+		}
+
+		erase(it);
+		++stats.invalidations;
+		return true;
+	}
+
+	Stats getStats(){
+		std::lock_guard<std::mutex> lock(mtx);
+		Stats s = stats;
+		s.size = entries.size();
+		s.capacity = capacity;
+		return s;
+	}
+};
+
+#endif //PROFILE_CACHE_HPP
@@ -0,0 +1,177 @@
+#ifndef ROOM_HISTORY_HPP
+#define ROOM_HISTORY_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "packet.hpp"
+#include "object_pool.hpp"
+#include "server_wss_ex.hpp"
+
+/// Appends frame of data to run of ready frames: text frame for JSON, binary for CBOR,
+/// RSV1 when data is compressed by permessage-deflate
+inline void appendFrame(std::string &run, boost::string_view data, Encoding enc, bool deflated){
+	unsigned char opcode = (enc == Encoding::cbor ? 130 : 129) | (deflated ? 0x40 : 0);
+	std::array<unsigned char, 10> header;
+	size_t header_size = WebSocketServerEx::makeFrameHeader(header, opcode, data.size());
+	run.append((const char *) header.data(), header_size);
+	run.append(data.data(), data.size());
+}
+
+/// Last packets of room in ring of fixed capacity. Whole history is also kept as ready run
+/// of WebSocket frames for every encoding, plain and compressed, which is sent to joining
+/// member as one buffer. Run of variant is made on first request and then kept up to date:
+/// new frame is appended to it, frame of evicted packet is cut from its front.
+/// Used only by thread of room
+class RoomHistory {
+public:
+	static const size_t variants = 4;
+private:
+	struct Entry {
+		EncodedPacket packet;
+		// number of packet in HistoryLog, 0 if it isn't logged
+		uint64_t seq;
+		// length of frame of packet in run of every variant
+		uint32_t framed[variants];
+	};
+
+	struct Replay {
+		bool used = false;
+		std::string run;
+		// copy of run handed to send queues, made once after every change
+		PacketBuffer snapshot;
+	};
+
+	std::vector<Entry> ring;
+	size_t head = 0;
+	size_t count = 0;
+	Replay replays[variants];
+
+	static size_t variant(Encoding enc, bool deflated){
+		return (size_t) enc * 2 + (deflated ? 1 : 0);
+	}
+
+	Entry &at(size_t i){
+		return ring[(head + i) % ring.size()];
+	}
+
+	void frameEntry(Entry &e, size_t v){
+		auto enc = (Encoding) (v / 2);
+		bool deflated = v % 2 && e.packet.getDeflated(enc);
+		auto &data = deflated ? *e.packet.getDeflated(enc) : *e.packet.get(enc);
+
+		auto &run = replays[v].run;
+		size_t before = run.size();
+		appendFrame(run, data, enc, deflated);
+		e.framed[v] = (uint32_t) (run.size() - before);
+	}
+
+	void dropOldest(){
+		auto &e = at(0);
+		for (size_t v = 0; v < variants; ++v){
+			if (replays[v].used){
+				replays[v].run.erase(0, e.framed[v]);
+			}
+		}
+		e.packet = EncodedPacket();
+		head = (head + 1) % ring.size();
+		--count;
+	}
+
+	void invalidate(){
+		for (auto &r : replays){
+			r.snapshot.reset();
+		}
+	}
+public:
+	RoomHistory(size_t capacity) : ring(capacity ? capacity : 1){}
+
+	inline size_t size() const { return count; }
+	inline size_t capacity() const { return ring.size(); }
+
+	/// Keeps the latest packets which fit
+	void setCapacity(size_t capacity){
+		if (!capacity){
+			capacity = 1;
+		}
+		if (capacity == ring.size()){
+			return;
+		}
+
+		while (count > capacity){
+			dropOldest();
+		}
+		std::vector<Entry> res(capacity);
+		for (size_t i = 0; i < count; ++i){
+			res[i] = std::move(at(i));
+		}
+		ring.swap(res);
+		head = 0;
+		invalidate();
+	}
+
+	void push(const EncodedPacket &data, uint64_t seq = 0){
+		if (count == ring.size()){
+			dropOldest();
+		}
+
+		auto &e = at(count++);
+		e.packet = data;
+		e.seq = seq;
+		for (size_t v = 0; v < variants; ++v){
+			if (replays[v].used){
+				frameEntry(e, v);
+			}
+		}
+		invalidate();
+	}
+
+	void clear(){
+		while (count){
+			dropOldest();
+		}
+		head = 0;
+		invalidate();
+	}
+
+	/// Number in HistoryLog of the oldest packet logged by this process, 0 if there is none.
+	/// Packets restored from state after restart aren't numbered
+	uint64_t getOldestSeq(){
+		for (size_t i = 0; i < count; ++i){
+			if (at(i).seq){
+				return at(i).seq;
+			}
+		}
+		return 0;
+	}
+
+	/// Calls func for every packet from the oldest one
+	template<typename F>
+	void forEach(F func){
+		for (size_t i = 0; i < count; ++i){
+			func(at(i).packet);
+		}
+	}
+
+	/// Frames of all packets in one buffer, null when history is empty. Compressed packets are
+	/// the ones compressed once for every recipient, shorter packets go as they are
+	const PacketBuffer &getReplay(Encoding enc, bool deflated){
+		size_t v = variant(enc, deflated);
+		auto &r = replays[v];
+		if (!r.used){
+			r.used = true;
+			for (size_t i = 0; i < count; ++i){
+				frameEntry(at(i), v);
+			}
+		}
+
+		if (!r.snapshot && !r.run.empty()){
+			r.snapshot = std::allocate_shared<const std::string>(PoolAllocator<std::string>(), r.run);
+		}
+		return r.snapshot;
+	}
+};
+
+#endif //ROOM_HISTORY_HPP
@@ -0,0 +1,232 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../test_common/chat_fixture.hpp"
+#include "../packets.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Lookups of real Room by client, nick and member id find exactly its members while they join,
+// change nicks, get kicked and leave. Then times them against linear scan of members
+
+struct Expected {
+	MemberPtr member;
+	uint id;
+	string nick;
+};
+
+static bool check(const RoomPtr &room, const map<ClientPtr, Expected> &joined, const vector<pair<ClientPtr, uint>> &left,
+		const vector<string> &freeNicks){
+	if (room->getMembers().size() != joined.size()){
+		out << "Room has " << room->getMembers().size() << " members instead of " << joined.size() << endl;
+		return false;
+	}
+
+	for (auto &j : joined){
+		auto &e = j.second;
+		if (room->getMembers().count(e.member) == 0 || room->findMemberByClient(j.first) != e.member
+				|| room->findMemberById(e.id) != e.member){
+			out << "Member " << e.id << " isn't found by client or id" << endl;
+			return false;
+		}
+		if (!e.nick.empty() && room->findMemberByNick(e.nick) != e.member){
+			out << "Member " << e.id << " isn't found by nick " << e.nick << endl;
+			return false;
+		}
+	}
+
+	for (auto &l : left){
+		if (room->findMemberByClient(l.first) || room->findMemberById(l.second)){
+			out << "Member " << l.second << " is found after it left" << endl;
+			return false;
+		}
+	}
+
+	for (auto &n : freeNicks){
+		if (room->findMemberByNick(n)){
+			out << "Nick " << n << " is found while nobody has it" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool checkCorrectness(Server &server){
+	mt19937 rnd(1);
+	auto room = makeRoom(server, "test");
+	map<ClientPtr, Expected> joined;
+	vector<pair<ClientPtr, uint>> left;
+	uint nextUid = 10;
+
+	vector<string> nicks;
+	for (int i = 0; i < 40; ++i){
+		nicks.push_back("nick" + to_string(i));
+	}
+	auto freeNicks = [&]{
+		vector<string> res;
+		for (auto &n : nicks){
+			bool taken = false;
+			for (auto &j : joined){
+				taken = taken || j.second.nick == n;
+			}
+			if (!taken){
+				res.push_back(n);
+			}
+		}
+		return res;
+	};
+	auto pick = [&]{
+		auto it = joined.begin();
+		advance(it, rnd() % joined.size());
+		return it;
+	};
+
+	for (int step = 0; step < 3000; ++step){
+		int op = joined.empty() ? 0 : rnd() % 5;
+		if (op == 0 || joined.size() < 5){
+			auto cli = makeClient(server, nextUid++);
+			auto m = room->addMember(cli);
+			if (!m){
+				out << "Member isn't added" << endl;
+				return false;
+			}
+			joined[cli] = Expected{ m, m->getId(), "" };
+		} else if (op == 1 || op == 2){
+			// nick is unique in room, server checks it before setNick
+			auto it = pick();
+			auto vacant = freeNicks();
+			string nick = rnd() % 4 == 0 || vacant.empty() ? string() : vacant[rnd() % vacant.size()];
+			it->second.member->setNick(nick);
+			it->second.nick = nick;
+		} else if (op == 3){
+			auto it = pick();
+			if (!room->kickMember(it->second.member)){
+				out << "Member isn't kicked" << endl;
+				return false;
+			}
+			left.emplace_back(it->first, it->second.id);
+			joined.erase(it);
+		} else {
+			auto it = pick();
+			if (!room->removeMember(it->first)){
+				out << "Member isn't removed" << endl;
+				return false;
+			}
+			left.emplace_back(it->first, it->second.id);
+			joined.erase(it);
+		}
+
+		if (!check(room, joined, left, freeNicks())){
+			return false;
+		}
+	}
+
+	// the same client can't be removed twice
+	if (!left.empty() && room->removeMember(left.back().first)){
+		out << "Member removed twice" << endl;
+		return false;
+	}
+	return true;
+}
+
+static volatile size_t sink;
+
+// lookups of Room before its members were indexed
+static MemberPtr scanByClient(const RoomPtr &room, ClientPtr client){
+	for (MemberPtr m : room->getMembers()){
+		if (m->getClient() == client){
+			return m;
+		}
+	}
+	return nullptr;
+}
+
+static MemberPtr scanByNick(const RoomPtr &room, string nick){
+	for (MemberPtr m : room->getMembers()){
+		if (!m->getNick().empty() && m->getNick() == nick){
+			return m;
+		}
+	}
+	return nullptr;
+}
+
+static MemberPtr scanById(const RoomPtr &room, uint id){
+	for (MemberPtr m : room->getMembers()){
+		if (m->getId() == id){
+			return m;
+		}
+	}
+	return nullptr;
+}
+
+int main(int argc, char **argv){
+	size_t count = argc > 1 ? atol(argv[1]) : 10000;
+	size_t lookups = 2000;
+
+	Server server(0);
+	cout.rdbuf(nullptr);
+	if (!checkCorrectness(server)){
+		out << "Correctness check failed" << endl;
+		return 1;
+	}
+	out << "Correctness check passed" << endl;
+
+	auto room = makeRoom(server, "test");
+	vector<MemberPtr> all;
+	auto t0 = steady_clock::now();
+	for (size_t i = 0; i < count; ++i){
+		auto m = room->addMember(makeClient(server, 10 + i));
+		m->setNick("member" + to_string(i));
+		all.push_back(m);
+	}
+	auto t1 = steady_clock::now();
+
+	// index and scan look up the same members
+	mt19937 rnd(3);
+	vector<MemberPtr> targets;
+	for (size_t i = 0; i < lookups; ++i){
+		targets.push_back(all[rnd() % all.size()]);
+	}
+
+	size_t found = 0;
+	auto time = [&](auto lookup){
+		auto start = steady_clock::now();
+		for (auto &m : targets){
+			found += lookup(m) != nullptr;
+		}
+		return duration_cast<nanoseconds>(steady_clock::now() - start).count() / (double) lookups / 1000;
+	};
+
+	double indexed[3] = {
+		time([&](const MemberPtr &m){ return room->findMemberByClient(m->getClient()); }),
+		time([&](const MemberPtr &m){ return room->findMemberByNick(m->getNick()); }),
+		time([&](const MemberPtr &m){ return room->findMemberById(m->getId()); })
+	};
+	double scanned[3] = {
+		time([&](const MemberPtr &m){ return scanByClient(room, m->getClient()); }),
+		time([&](const MemberPtr &m){ return scanByNick(room, m->getNick()); }),
+		time([&](const MemberPtr &m){ return scanById(room, m->getId()); })
+	};
+	sink = found;
+
+	out << "Room with " << count << " members, join " << fixed << setprecision(3)
+		 << duration_cast<nanoseconds>(t1 - t0).count() / (double) count / 1000 << " us, lookups in us per call" << endl;
+	out << setw(14) << "" << setw(14) << "by client" << setw(14) << "by nick" << setw(14) << "by id" << endl;
+	out << setw(14) << "index";
+	for (auto t : indexed){
+		out << setw(14) << t;
+	}
+	out << endl << setw(14) << "linear scan";
+	for (auto t : scanned){
+		out << setw(14) << t;
+	}
+	out << endl;
+	return 0;
+}
@@ -1,5 +1,8 @@
 #include "rooms.hpp"
 #include "packets.hpp"
+#include "presence.hpp"
+#include "object_pool.hpp"
+#include <chrono>
 #include <ctime>
 
 MemberInfo::MemberInfo(){
@@ -13,15 +16,13 @@ MemberInfo::MemberInfo(MemberPtr member){
 	color = member->getColor();
 }
 
-Json::Value MemberInfo::serialize(){
-	Json::Value v(Json::objectValue);
-
-	v["user_id"] = user_id;
-	v["nick"] = nick;
-	v["girl"] = girl;
-	v["color"] = color;
-
-	return v;
+Json::Value MemberInfo::serialize() const {
+	Json::Value val;
+	val["user_id"] = user_id;
+	val["nick"] = nick;
+	val["girl"] = girl;
+	val["color"] = color;
+	return val;
 }
 
 void MemberInfo::deserialize(const Json::Value &val){
@@ -49,6 +50,7 @@ void Member::setNick(const string &nnick){
 
 	string oldnick = nick;
 	nick = nnick;
+	roomp->onNickChange(self.lock(), oldnick);
 
 	PacketStatus spack(self.lock());
 	if (!oldnick.empty()){
@@ -69,14 +71,30 @@ void Member::setNick(const string &nnick){
 }
 
 bool Member::isAdmin(){ return client->isAdmin(); }
-bool Member::isOwner(){ return client->isAdmin() || (client->getID() != 0 && !room.expired() && client->getID() == room.lock()->getOwner()); }
-bool Member::isModer(){ return isOwner() || (client->getID() != 0 && !room.expired() && room.lock()->isModerator(client->getID())); }
+bool Member::isOwner(){
+	if (client->isAdmin()){
+		return true;
+	}
+	auto r = room.lock();
+	return client->getID() != 0 && r && client->getID() == r->getOwner();
+}
+
+bool Member::isModer(){
+	if (isOwner()){
+		return true;
+	}
+	auto r = room.lock();
+	return client->getID() != 0 && r && r->isModerator(client->getID());
+}
 
 
-Room::Room(Server *srv){
+Room::Room(Server *srv) : history(defaultHistorySize) {
 	server = srv;
 	ownerId = -1;
 	nextMemberId = 0;
+	shard = nullptr;
+	logOpened = false;
+	typingActive = false;
 }
 
 Room::~Room(){
@@ -91,50 +109,101 @@ void Room::onDestroy(){
 	auto mems = members;
 	auto ptr = self.lock();
 	for (MemberPtr m : mems){
-		m->client->leaveRoom(ptr);
+		auto cli = m->client;
+		removeMember(cli);
+		postToServer([cli, ptr]{ cli->onKick(ptr); });
 	}
 }
 
-Json::Value Room::serialize(){
-	auto storeSet = [](auto &stg, const string &name, const auto &set){
-		stg[name] = Json::Value(Json::arrayValue);
-		auto &sval = stg[name];
-		for (auto p : set){
-			sval.append(p);
-		}
-	};
-
-	Json::Value val;
-	val["owner_id"] = ownerId;
-	val["name"] = name;
+void Room::post(std::function<void()> func){
+	if (shard){
+		shard->push(std::move(func));
+	} else {
+		func();
+	}
+}
 
-	val["history"] = Json::Value(Json::arrayValue);
-	auto &hist = val["history"];
-	for (string p : history){
-		hist.append(p);
+void Room::postToServer(std::function<void()> func){
+	if (shard){
+		server->post(std::move(func));
+	} else {
+		func();
 	}
+}
 
-	val["members_info"] = Json::Value(Json::arrayValue);
-	auto &mi = val["members_info"];
+SnapshotRoom Room::snapshot(){
+	SnapshotRoom res;
+	res.name = name;
+	res.owner = ownerId;
+	res.historySize = (uint32_t) history.capacity();
+	res.bannedNicks.assign(bannedNicks.begin(), bannedNicks.end());
+	res.bannedIps.assign(bannedIps.begin(), bannedIps.end());
+	res.bannedUids.assign(bannedUids.begin(), bannedUids.end());
+	res.moderators.assign(moderators.begin(), moderators.end());
+
+	res.membersInfo.reserve(membersInfo.size());
 	for (auto &p : membersInfo){
-		mi.append(p.second.serialize());
+		auto &mi = p.second;
+		res.membersInfo.push_back(SnapshotRoom::Info{ mi.user_id, mi.nick, mi.girl, mi.color });
 	}
 
-	storeSet(val, "bannedNicks", bannedNicks);
-	storeSet(val, "bannedIps", bannedIps);
-	storeSet(val, "bannedUids", bannedUids);
-	storeSet(val, "moderators", moderators);
+	history.forEach([&](const EncodedPacket &p){
+		res.history.push_back(p.get(Encoding::json));
+	});
+	return res;
+}
 
-	return val;
+void Room::deserialize(const SnapshotReader::Room &snap){
+	name = snap.name().to_string();
+	ownerId = snap.owner();
+
+	bannedNicks.clear();
+	bannedNicks.reserve(snap.bannedNicks());
+	for (size_t i = 0; i < snap.bannedNicks(); ++i){
+		bannedNicks.insert(snap.bannedNick(i).to_string());
+	}
+	bannedIps.clear();
+	bannedIps.reserve(snap.bannedIps());
+	for (size_t i = 0; i < snap.bannedIps(); ++i){
+		bannedIps.insert(snap.bannedIp(i).to_string());
+	}
+	bannedUids.clear();
+	bannedUids.reserve(snap.bannedUids());
+	for (size_t i = 0; i < snap.bannedUids(); ++i){
+		bannedUids.insert(snap.bannedUid(i));
+	}
+	moderators.clear();
+	moderators.reserve(snap.moderators());
+	for (size_t i = 0; i < snap.moderators(); ++i){
+		moderators.insert(snap.moderator(i));
+	}
+
+	history.clear();
+	history.setCapacity(snap.historySize() ? std::min<size_t>(snap.historySize(), maxHistorySize) : defaultHistorySize);
+	snap.forEachHistory([&](boost::string_view p){
+		history.push(EncodedPacket(make_shared<const string>(p.data(), p.size())));
+	});
+
+	membersInfo.clear();
+	membersInfo.reserve(snap.membersInfo());
+	snap.forEachMemberInfo([&](uint32_t uid, boost::string_view nick, bool girl, boost::string_view color){
+		auto &mi = membersInfo[uid];
+		mi.user_id = uid;
+		mi.nick = nick.to_string();
+		mi.girl = girl;
+		mi.color = color.to_string();
+	});
 }
 
 void Room::deserialize(const Json::Value &val){
-	ownerId = val["owner_id"].asUInt();
 	name = val["name"].asString();
 
+	// depth of history first, so that it keeps the latest packets
+	deserializeSettings(val);
+
 	history.clear();
 	for (auto &v : val["history"]){
-		history.push_back(v.asString());
+		history.push(EncodedPacket(make_shared<const string>(v.asString())));
 	}
 
 	membersInfo.clear();
@@ -143,6 +212,31 @@ void Room::deserialize(const Json::Value &val){
 		info.deserialize(v);
 		membersInfo[info.user_id] = info;
 	}
+}
+
+Json::Value Room::serializeSettings(){
+	auto storeSet = [](auto &stg, const string &name, const auto &set){
+		stg[name] = Json::Value(Json::arrayValue);
+		auto &sval = stg[name];
+		for (auto p : set){
+			sval.append(p);
+		}
+	};
+
+	Json::Value val;
+	val["owner_id"] = ownerId.load();
+
+	storeSet(val, "bannedNicks", bannedNicks);
+	storeSet(val, "bannedIps", bannedIps);
+	storeSet(val, "bannedUids", bannedUids);
+	storeSet(val, "moderators", moderators);
+	val["history_size"] = (Json::UInt64) history.capacity();
+
+	return val;
+}
+
+void Room::deserializeSettings(const Json::Value &val){
+	ownerId = val["owner_id"].asUInt();
 
 	bannedNicks.clear();
 	for (auto &v : val["bannedNicks"]){
@@ -163,62 +257,231 @@ void Room::deserialize(const Json::Value &val){
 	for (auto &v : val["moderators"]){
 		moderators.insert(v.asUInt());
 	}
+
+	history.setCapacity(std::min<size_t>(val.get("history_size", (Json::UInt64) defaultHistorySize).asUInt64(), maxHistorySize));
+	rightsChanged(true);
+}
+
+void Room::publishSettings(){
+	auto cluster = server->getCluster();
+	if (cluster){
+		Json::FastWriter wr;
+		cluster->publish(ClusterBus::Event::room_settings, name, wr.write(serializeSettings()));
+	}
+}
+
+void Room::logChange(StateLog::Op op, const string &data){
+	auto slog = server->getStateLog();
+	if (slog){
+		slog->appendData(op, name, data);
+	}
+}
+
+void Room::logChange(StateLog::Op op, uint64_t data){
+	auto slog = server->getStateLog();
+	if (slog){
+		slog->appendData(op, name, data);
+	}
+}
+
+void Room::logSettings(){
+	Json::FastWriter wr;
+	logChange(StateLog::Op::settings, wr.write(serializeSettings()));
+}
+
+void Room::applyStateRecord(const CborFields &rec){
+	auto &data = rec["data"];
+	switch ((StateLog::Op) rec["type"].asUInt()){
+		case StateLog::Op::settings: {
+			Json::Value val;
+			Json::Reader rd;
+			if (rd.parse(data.asString(), val)){
+				deserializeSettings(val);
+			}
+			break;
+		}
+		case StateLog::Op::owner:
+			ownerId = data.asUInt();
+			break;
+		case StateLog::Op::history_size:
+			history.setCapacity(std::min<size_t>(data.asUInt64(), maxHistorySize));
+			break;
+		case StateLog::Op::ban_nick:
+			bannedNicks.insert(data.asString());
+			break;
+		case StateLog::Op::unban_nick:
+			bannedNicks.erase(data.asString());
+			break;
+		case StateLog::Op::ban_ip:
+			bannedIps.insert(data.asString());
+			break;
+		case StateLog::Op::unban_ip:
+			bannedIps.erase(data.asString());
+			break;
+		case StateLog::Op::ban_uid:
+			bannedUids.insert(data.asUInt());
+			break;
+		case StateLog::Op::unban_uid:
+			bannedUids.erase(data.asUInt());
+			break;
+		case StateLog::Op::add_moder:
+			moderators.insert(data.asUInt());
+			break;
+		case StateLog::Op::remove_moder:
+			moderators.erase(data.asUInt());
+			break;
+		case StateLog::Op::member_info: {
+			MemberInfo info;
+			info.user_id = rec["user_id"].asUInt();
+			info.nick = rec["name"].asString();
+			info.girl = rec["girl"].asBool();
+			info.color = rec["color"].asString();
+			membersInfo[info.user_id] = info;
+			break;
+		}
+		default:
+			break;
+	}
 }
 
 uint Room::genNextMemberId(){
+	// processes of cluster give out ids from different residues, so ids don't collide
+	auto cluster = server->getCluster();
+	uint step = cluster ? cluster->getNodes() : 1;
+	if (nextMemberId == 0 && cluster){
+		nextMemberId = cluster->getNode();
+	}
+
 	do {
-		++nextMemberId;
+		nextMemberId += step;
 	} while (nextMemberId == 0 || findMemberById(nextMemberId));
 	return nextMemberId;
 }
 
-void Room::addToHistory(const Packet &pack){
-	if (pack.type == Packet::Type::message && ((const PacketMessage &) pack).to_id == 0){
-		Json::FastWriter wr;
-		history.push_back(wr.write(pack.serialize()));
-		if (history.size() > 50){
-			history.pop_front();
+void Room::addToHistory(const EncodedPacket &data){
+	auto lg = getLog();
+	uint64_t seq = lg ? lg->append(time(nullptr), *data.get(Encoding::json)) : 0;
+	history.push(data, seq);
+}
+
+HistoryLog *Room::getLog(){
+	if (!logOpened){
+		logOpened = true;
+		auto flusher = server->getHistoryFlusher();
+		if (flusher){
+			log.reset(new HistoryLog(server->getHistoryLogOptions(), *flusher, name));
 		}
 	}
+	return log.get();
 }
 
-MemberPtr Room::findMemberByClient(ClientPtr client){
-	for (MemberPtr m : members){
-		if (m->client == client){
-			return m;
+void Room::sendHistoryPage(ClientPtr client, uint64_t before, int64_t time, uint limit){
+	auto lg = getLog();
+	if (!lg){
+		client->sendPacket(PacketError(Packet::Type::history_before, name, PacketError::Code::not_found, "История комнаты не сохраняется"));
+		return;
+	}
+
+	if (!before){
+		if (time){
+			before = lg->seqAtTime(time);
+		} else {
+			// history restored after crash doesn't match the log, whose unflushed tail may be lost,
+			// so its packets may come again but none is skipped
+			before = history.getOldestSeq();
+			if (!before){
+				before = lg->getNextSeq();
+			}
 		}
 	}
 
-	return nullptr;
+	vector<boost::string_view> page;
+	PacketHistoryBefore res;
+	res.target = name;
+	res.before = lg->readBefore(before, limit, [&](uint64_t, int64_t, boost::string_view payload){
+		page.push_back(payload);
+	});
+	res.limit = (uint) page.size();
+
+	client->sendFrames(page);
+	client->sendPacket(res);
+}
+
+void Room::indexMember(MemberPtr member){
+	membersByClient[member->client] = member;
+	membersById[member->id] = member;
+	if (!member->nick.empty()){
+		membersByNick[member->nick] = member;
+	}
+}
+
+bool Room::unindexMember(MemberPtr member){
+	auto it = membersByClient.find(member->client);
+	if (it != membersByClient.end() && it->second == member){
+		membersByClient.erase(it);
+	}
+
+	auto iit = membersById.find(member->id);
+	if (iit != membersById.end() && iit->second == member){
+		membersById.erase(iit);
+	}
+
+	auto nit = membersByNick.find(member->nick);
+	if (nit != membersByNick.end() && nit->second == member){
+		membersByNick.erase(nit);
+	}
+
+	return members.erase(member) > 0;
+}
+
+void Room::onNickChange(MemberPtr member, const string &oldnick){
+	if (members.find(member) == members.end()){
+		return;
+	}
+
+	auto it = membersByNick.find(oldnick);
+	if (it != membersByNick.end() && it->second == member){
+		membersByNick.erase(it);
+	}
+
+	if (!member->nick.empty()){
+		membersByNick[member->nick] = member;
+	}
+}
+
+MemberPtr Room::findMemberByClient(ClientPtr client){
+	auto it = membersByClient.find(client);
+	return it != membersByClient.end() ? it->second : nullptr;
 }
 
 MemberPtr Room::findMemberByNick(string nick){
-	for (MemberPtr m : members){
-		if (!m->nick.empty() && m->nick == nick){
-			return m;
-		}
+	if (nick.empty()){
+		return nullptr;
 	}
 
-	return nullptr;
+	auto it = membersByNick.find(nick);
+	return it != membersByNick.end() ? it->second : nullptr;
 }
 
 MemberPtr Room::findMemberById(uint id){
-	for (MemberPtr m : members){
-		if (m->id == id){
-			return m;
-		}
-	}
+	auto it = membersById.find(id);
+	return it != membersById.end() ? it->second : nullptr;
+}
 
-	return nullptr;
+bool Room::isNickTaken(const string &nick){
+	return !nick.empty() && (findMemberByNick(nick) || remoteNicks.find(nick) != remoteNicks.end());
 }
 
 void Room::setOwner(uint nid){
 	ownerId = nid;
+	publishSettings();
+	logChange(StateLog::Op::owner, (uint64_t) nid);
+	rightsChanged(true);
 }
 
-MemberPtr Room::addMember(ClientPtr user){
+MemberPtr Room::addMember(ClientPtr user, uint64_t version){
 	auto ptr = self.lock();
-	auto m = make_shared<Member>(ptr, user);
+	auto m = allocate_shared<Member>(PoolAllocator<Member>(), ptr, user);
 	m->setSelfPtr(m);
 	m->id = genNextMemberId();
 
@@ -234,9 +497,12 @@ MemberPtr Room::addMember(ClientPtr user){
 	}
 
 	auto res = members.insert(m);
+	if (res.second){
+		indexMember(m);
+	}
 
 	user->sendPacket(PacketJoin(m));
-	user->sendPacket(PacketOnlineList(self.lock()));
+	sendOnlineList(user, version);
 
 	if (res.second){
 		return *res.first;
@@ -247,6 +513,10 @@ MemberPtr Room::addMember(ClientPtr user){
 
 bool Room::removeMember(ClientPtr user){
 	auto m = findMemberByClient(user);
+	if (!m){
+		return false;
+	}
+
 	if (!m->getNick().empty()){
 		sendPacketToAll(PacketStatus(m, Member::Status::offline));
 	}
@@ -255,10 +525,33 @@ bool Room::removeMember(ClientPtr user){
 
 	auto cli = m->getClient();
 	if (!cli->isGuest()){
-		membersInfo[cli->getID()] = MemberInfo(m);
+		MemberInfo info(m);
+		storeMemberInfo(info);
+		auto cluster = server->getCluster();
+		if (cluster){
+			Json::FastWriter wr;
+			cluster->publish(ClusterBus::Event::member_info, name, wr.write(info.serialize()));
+		}
 	}
 
-	return members.erase(m) > 0;
+	return unindexMember(m);
+}
+
+void Room::storeMemberInfo(const MemberInfo &info){
+	membersInfo[info.user_id] = info;
+	auto slog = server->getStateLog();
+	if (slog){
+		slog->append(StateLog::Op::member_info, name, [&](CborWriter &wr){
+			wr.key("user_id");
+			wr.writeUInt(info.user_id);
+			wr.key("name");
+			wr.writeString(info.nick);
+			wr.key("girl");
+			wr.writeBool(info.girl);
+			wr.key("color");
+			wr.writeString(info.color);
+		});
+	}
 }
 
 MemberInfo Room::getStoredMemberInfo(MemberPtr member){
@@ -286,20 +579,286 @@ bool Room::kickMember(ClientPtr user, string reason){
 
 bool Room::kickMember(MemberPtr member, string reason){
 	auto ptr = self.lock();
-	member->getClient()->onKick(ptr);
+	auto cli = member->getClient();
+	postToServer([cli, ptr]{ cli->onKick(ptr); });
 	if (!member->getNick().empty()){
 		sendPacketToAll(PacketStatus(member, Member::Status::offline));
 	}
 
 	member->sendPacket(PacketLeave(name));
 
-	return members.erase(member) > 0;
+	return unindexMember(member);
+}
+
+RoomPresence &Room::getPresence(){
+	if (!presence){
+		// versions of other process or of room before restart don't match
+		auto cluster = server->getCluster();
+		uint64_t first = ((uint64_t) (cluster ? cluster->getNode() : 0) << 56) | ((uint64_t) time(nullptr) << 20);
+		presence.reset(new RoomPresence(name, first));
+	}
+	return *presence;
+}
+
+void Room::onStatus(const Packet &pack){
+	auto &st = (const PacketStatus &) pack;
+	if (st.status == Member::Status::typing || st.status == Member::Status::stop_typing){
+		return;
+	}
+
+	if (st.status == Member::Status::offline){
+		getPresence().remove(st.member_id, st.name);
+		if (typing){
+			typing->remove(st.member_id);
+		}
+		return;
+	}
+
+	// listed with current state, not with change
+	auto m = findMemberById(st.member_id);
+	if (m && !m->getNick().empty()){
+		getPresence().update(PacketStatus(m));
+	}
+}
+
+bool Room::rightsChanged(bool res){
+	if (!res || !presence){
+		return res;
+	}
+
+	// every process gets settings and lists rights of its own members for the others
+	for (auto &p : membersById){
+		auto listed = presence->find(p.first);
+		if (!listed){
+			continue;
+		}
+		PacketStatus st(p.second);
+		if (st.is_owner != listed->is_owner || st.is_moder != listed->is_moder){
+			presence->update(st);
+			publish(EncodedPacket(st), ClusterBus::member_status | ClusterBus::list_only);
+		}
+	}
+	return res;
+}
+
+static PacketStatus readStatus(const Json::Value &val){
+	PacketStatus st;
+	st.target = val["target"].asString();
+	st.status = (Member::Status) val["status"].asInt();
+	st.member_id = val["member_id"].asUInt();
+	st.user_id = val["user_id"].asUInt();
+	st.girl = val["girl"].asBool();
+	st.color = val["color"].asString();
+	st.name = val["name"].asString();
+	st.is_owner = val["is_owner"].asBool();
+	st.is_moder = val["is_moder"].asBool();
+	return st;
+}
+
+void Room::onRemoteStatus(const string &data){
+	Json::Value val;
+	Json::Reader rd;
+	if (!rd.parse(data, val)){
+		return;
+	}
+
+	auto st = readStatus(val);
+	if (st.status == Member::Status::typing || st.status == Member::Status::stop_typing){
+		return;
+	}
+	if (st.status == Member::Status::offline){
+		removeRemoteMember(st.member_id);
+		return;
+	}
+	setRemoteStatus(st);
+}
+
+void Room::setRemoteStatus(PacketStatus st){
+	auto &p = getPresence();
+	auto listed = p.find(st.member_id);
+	switch (st.status){
+		case Member::Status::away:
+			break;
+		case Member::Status::online:
+		case Member::Status::back:
+			st.status = Member::Status::online;
+			break;
+		default:
+			// change of nick, gender or color keeps status
+			st.status = listed ? listed->status : Member::Status::online;
+			break;
+	}
+	st.target = name;
+	st.data.clear();
+
+	auto it = remoteMembers.find(st.member_id);
+	if (it != remoteMembers.end() && it->second != st.name){
+		auto nit = remoteNicks.find(it->second);
+		if (nit != remoteNicks.end() && nit->second == st.member_id){
+			remoteNicks.erase(nit);
+		}
+	}
+	remoteMembers[st.member_id] = st.name;
+	remoteNicks[st.name] = st.member_id;
+	p.update(st);
+}
+
+bool Room::removeRemoteMember(uint id){
+	auto it = remoteMembers.find(id);
+	if (it == remoteMembers.end()){
+		return false;
+	}
+
+	auto nit = remoteNicks.find(it->second);
+	if (nit != remoteNicks.end() && nit->second == id){
+		remoteNicks.erase(nit);
+	}
+	getPresence().remove(id, it->second);
+	remoteMembers.erase(it);
+	return true;
+}
+
+void Room::publishMembers(){
+	auto cluster = server->getCluster();
+	if (!cluster){
+		return;
+	}
+
+	Json::Value val;
+	val["node"] = cluster->getNode();
+	auto &list = val["list"] = Json::Value(Json::arrayValue);
+	for (auto &m : members){
+		if (m->nick.empty()){
+			continue;
+		}
+		PacketStatus st(m);
+		Json::Value item;
+		item["member_id"] = st.member_id;
+		item["user_id"] = st.user_id;
+		item["name"] = st.name;
+		item["status"] = (int) st.status;
+		item["girl"] = st.girl;
+		item["color"] = st.color;
+		item["is_owner"] = st.is_owner;
+		item["is_moder"] = st.is_moder;
+		list.append(item);
+	}
+	Json::FastWriter wr;
+	cluster->publish(ClusterBus::Event::room_members, name, wr.write(val));
+}
+
+void Room::applyRemoteMembers(uint node, const Json::Value &list){
+	auto cluster = server->getCluster();
+	if (!cluster){
+		return;
+	}
+
+	unordered_set<uint> listed;
+	for (auto &v : list){
+		auto st = readStatus(v);
+		listed.insert(st.member_id);
+		bool known = remoteMembers.find(st.member_id) != remoteMembers.end();
+		setRemoteStatus(st);
+		if (!known){
+			sendRawDataToAll(EncodedPacket(*getPresence().find(st.member_id)), false, false);
+		}
+	}
+
+	vector<std::pair<uint, string>> gone;
+	for (auto &p : remoteMembers){
+		if (p.first % cluster->getNodes() == node && listed.find(p.first) == listed.end()){
+			gone.push_back(p);
+		}
+	}
+	for (auto &p : gone){
+		removeRemoteMember(p.first);
+		PacketStatus st;
+		st.target = name;
+		st.member_id = p.first;
+		st.name = p.second;
+		st.status = Member::Status::offline;
+		sendRawDataToAll(EncodedPacket(st), false, false);
+	}
+}
+
+void Room::sendOnlineList(ClientPtr client, uint64_t since){
+	auto &p = getPresence();
+	RoomPresence::Delta delta;
+	if (p.getDelta(since, delta)){
+		client->sendPacket(delta.packet);
+	} else {
+		client->sendRawData(p.getFull());
+	}
+}
+
+void Room::onTyping(MemberPtr member, Member::Status status){
+	if (!typing){
+		sendPacketToAll(PacketStatus(member, status));
+		return;
+	}
+
+	if (status == Member::Status::typing){
+		auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		typing->typing(member->getId(), now);
+	} else {
+		typing->stop(member->getId());
+	}
+	typingActive = !typing->empty();
+}
+
+void Room::flushTyping(){
+	if (!typing){
+		return;
+	}
+
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	vector<std::pair<uint, bool>> changes;
+	typing->flush(now, changes);
+	typingActive = !typing->empty();
+
+	PacketTyping pack;
+	pack.target = name;
+	for (auto &c : changes){
+		auto m = findMemberById(c.first);
+		if (m && !m->getNick().empty()){
+			pack.list.push_back(PacketTyping::Item{ c.first, m->getNick(), c.second ? Member::Status::typing : Member::Status::stop_typing });
+		}
+	}
+	if (!pack.list.empty()){
+		sendPacketToAll(pack);
+	}
 }
 
 void Room::sendPacketToAll(const Packet &pack){
-	addToHistory(pack);
+	if (pack.type == Packet::Type::status){
+		onStatus(pack);
+	}
+
+	// serialized once for every encoding used by members
+	EncodedPacket data(pack);
+	bool droppable = pack.isDroppable();
+	bool toHistory = pack.type == Packet::Type::message && ((const PacketMessage &) pack).to_id == 0;
+	sendRawDataToAll(data, droppable, toHistory);
+
+	uint8_t flags = (droppable ? ClusterBus::droppable : 0) | (toHistory ? ClusterBus::to_history : 0)
+			| (pack.type == Packet::Type::status ? ClusterBus::member_status : 0);
+	publish(data, flags);
+}
+
+void Room::publish(const EncodedPacket &data, uint8_t flags){
+	auto cluster = server->getCluster();
+	if (cluster){
+		cluster->publish(ClusterBus::Event::broadcast, name, *data.get(Encoding::json), flags);
+	}
+}
+
+void Room::sendRawDataToAll(const EncodedPacket &data, bool droppable, bool toHistory){
 	for (MemberPtr m : members){
-		m->getClient()->sendPacket(pack);
+		m->getClient()->sendRawData(data, droppable);
+	}
+	// after sending, so that history keeps every encoding which was made
+	if (toHistory){
+		addToHistory(data.detach());
 	}
 }
 
@@ -5,10 +5,13 @@
 
 class Member;
 class Room;
+class RoomPresence;
+class PacketStatus;
 
 using MemberPtr = std::shared_ptr<Member>;
 using RoomPtr = std::shared_ptr<Room>;
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <cstdint>
@@ -19,6 +22,12 @@ using RoomPtr = std::shared_ptr<Room>;
 
 #include "server.hpp"
 #include "client.hpp"
+#include "logic_loop.hpp"
+#include "room_history.hpp"
+#include "history_log.hpp"
+#include "state_log.hpp"
+#include "snapshot.hpp"
+#include "typing.hpp"
 
 using std::vector;
 using std::string;
@@ -36,7 +45,7 @@ struct MemberInfo {
 	MemberInfo();
 	MemberInfo(MemberPtr);
 
-	Json::Value serialize();
+	Json::Value serialize() const;
 	void deserialize(const Json::Value &);
 };
 
@@ -104,45 +113,141 @@ public:
 
 class Room {
 private:
+	friend class Member;
+
 	Server *server;
 	string name;
-	uint ownerId;
+	// written by thread of room, read by server thread for room list
+	std::atomic<uint> ownerId;
 	weak_ptr<Room> self;
 
+	// thread which owns room and its members, nullptr when rooms are not sharded
+	LogicLoop *shard;
+
 	unordered_set<MemberPtr> members;
+	unordered_map<ClientPtr, MemberPtr> membersByClient;
+	unordered_map<string, MemberPtr> membersByNick;
+	unordered_map<uint, MemberPtr> membersById;
 	unordered_map<uint, MemberInfo> membersInfo;
+	// members connected to other processes of cluster, which have nick: nicks by number and
+	// numbers by nick. Process of member is its number modulo count of processes
+	unordered_map<uint, string> remoteMembers;
+	unordered_map<string, uint> remoteNicks;
 	unordered_set<string> bannedNicks;
 	unordered_set<string> bannedIps;
 	unordered_set<uint> bannedUids;
 
 	unordered_set<uint> moderators;
 
-	list<string> history;
+	RoomHistory history;
+	// opened on first use, nullptr when history isn't logged
+	std::unique_ptr<HistoryLog> log;
+	bool logOpened;
 
 	uint nextMemberId;
 
+	// versioned online list, made on first use
+	std::unique_ptr<RoomPresence> presence;
+
+	// nullptr when typing is sent at once
+	std::unique_ptr<RoomTyping> typing;
+	// set by thread of room while typing has members, read by timer of server
+	std::atomic<bool> typingActive;
+
 	uint genNextMemberId();
-	void addToHistory(const Packet &pack);
+	void addToHistory(const EncodedPacket &data);
+	HistoryLog *getLog();
+
+	// other processes of cluster get new settings, state log gets the change
+	void logChange(StateLog::Op op, const string &data);
+	void logChange(StateLog::Op op, uint64_t data);
+	template<typename T>
+	inline bool changed(bool res, StateLog::Op op, const T &data){
+		if (res){
+			publishSettings();
+			logChange(op, data);
+		}
+		return res;
+	}
+
+	void indexMember(MemberPtr member);
+	bool unindexMember(MemberPtr member);
+	void onNickChange(MemberPtr member, const string &oldnick);
+
+	/// Keeps online list up to date with status sent to members
+	void onStatus(const Packet &pack);
+	/// Owner or moderators changed, listed rights of members are updated
+	bool rightsChanged(bool res);
+
+	/// Sends serialized packet to other processes of cluster with flags of ClusterBus
+	void publish(const EncodedPacket &data, uint8_t flags);
+	/// Lists member of other process with current state, not with change of status
+	void setRemoteStatus(PacketStatus st);
+	bool removeRemoteMember(uint id);
 public:
 	Room(Server *srv);
 	~Room();
 
 	void setSelfPtr(weak_ptr<Room> ptr){ self = ptr; }
 
+	inline void setShard(LogicLoop *loop){ shard = loop; }
+
+	/// Runs func on thread of room, safe to call from any thread.
+	/// Inline when rooms are not sharded
+	void post(std::function<void()> func);
+	/// Runs func on thread which owns clients, inline when rooms are not sharded
+	void postToServer(std::function<void()> func);
+
 	void setOwner(uint nid);
+	/// Safe to call from any thread
 	inline uint getOwner(){ return ownerId; }
 
 	string getName(){ return name; }
 	void setName(string nm){ name = nm; }
 
-	const list<string> &getHistory(){ return history; }
+	inline RoomHistory &getHistory(){ return history; }
+
+	inline size_t getHistorySize(){ return history.capacity(); }
+	inline bool setHistorySize(size_t size){
+		bool res = size != history.capacity();
+		history.setCapacity(size);
+		return changed(res, StateLog::Op::history_size, (uint64_t) history.capacity());
+	}
 
 	void onCreate();
 	void onDestroy();
 
-	Json::Value serialize();
+	/// Copy of state for checkpoint
+	SnapshotRoom snapshot();
+	void deserialize(const SnapshotReader::Room &);
+	/// Room of rooms.dat in JSON, written by older versions
 	void deserialize(const Json::Value &);
 
+	static const size_t defaultHistorySize = 50;
+	static const size_t maxHistorySize = 500;
+
+	/// Owner, bans, moderators and depth of history
+	Json::Value serializeSettings();
+	void deserializeSettings(const Json::Value &);
+	/// Sends settings to other processes of cluster
+	void publishSettings();
+	/// Writes all settings to state log, after they came from other process of cluster
+	void logSettings();
+	/// Applies record of state log on start, without publishing it
+	void applyStateRecord(const CborFields &rec);
+
+	/// Keeps nick, gender and color of user who left, the first process of cluster logs them
+	void storeMemberInfo(const MemberInfo &info);
+
+	/// Keeps member of other process of cluster in online list and nick index, data is its
+	/// status sent to all
+	void onRemoteStatus(const string &data);
+	/// Sends statuses of members connected to this process to other processes of cluster
+	void publishMembers();
+	/// Replaces members of process node with ones of list, sent by publishMembers. Members
+	/// connected here are told who came and who left. Empty list when process died
+	void applyRemoteMembers(uint node, const Json::Value &list);
+
 	inline const unordered_set<MemberPtr> &getMembers(){ return members; }
 	inline const unordered_set<uint> &getModerators(){ return moderators; }
 
@@ -152,24 +257,30 @@ public:
 
 	inline bool isBannedNick(const string &nick){ return bannedNicks.find(nick) != bannedNicks.end(); }
 
-	inline bool banNick(const string &nick){ return bannedNicks.insert(nick).second; }
-	inline bool banIp(const string &ip){ return bannedIps.insert(ip).second; }
-	inline bool banUid(uint uid){ return bannedUids.insert(uid).second; }
+	inline bool banNick(const string &nick){ return changed(bannedNicks.insert(nick).second, StateLog::Op::ban_nick, nick); }
+	inline bool banIp(const string &ip){ return changed(bannedIps.insert(ip).second, StateLog::Op::ban_ip, ip); }
+	inline bool banUid(uint uid){ return changed(bannedUids.insert(uid).second, StateLog::Op::ban_uid, (uint64_t) uid); }
 
-	inline bool unbanNick(const string &nick){ return bannedNicks.erase(nick) > 0; }
-	inline bool unbanIp(const string &ip){ return bannedIps.erase(ip) > 0; }
-	inline bool unbanUid(uint uid){ return bannedUids.erase(uid) > 0; }
+	inline bool unbanNick(const string &nick){ return changed(bannedNicks.erase(nick) > 0, StateLog::Op::unban_nick, nick); }
+	inline bool unbanIp(const string &ip){ return changed(bannedIps.erase(ip) > 0, StateLog::Op::unban_ip, ip); }
+	inline bool unbanUid(uint uid){ return changed(bannedUids.erase(uid) > 0, StateLog::Op::unban_uid, (uint64_t) uid); }
 
-	inline bool addModerator(uint uid){ return moderators.insert(uid).second; }
-	inline bool removeModerator(uint uid){ return moderators.erase(uid) > 0; }
+	inline bool addModerator(uint uid){ return rightsChanged(changed(moderators.insert(uid).second, StateLog::Op::add_moder, (uint64_t) uid)); }
+	inline bool removeModerator(uint uid){ return rightsChanged(changed(moderators.erase(uid) > 0, StateLog::Op::remove_moder, (uint64_t) uid)); }
 	inline bool isModerator(uint uid){ return moderators.find(uid) != moderators.end(); }
 
-	MemberPtr addMember(ClientPtr user);
+	/// Versioned online list, must be used on thread of room
+	RoomPresence &getPresence();
+
+	/// Adds member and sends online list to it, only changes since version if it has one
+	MemberPtr addMember(ClientPtr user, uint64_t version = 0);
 	bool removeMember(ClientPtr user);
 
 	MemberPtr findMemberByClient(ClientPtr client);
 	MemberPtr findMemberByNick(string nick);
 	MemberPtr findMemberById(uint id);
+	/// Nick is used by member connected to this or other process of cluster
+	bool isNickTaken(const string &nick);
 
 	MemberInfo getStoredMemberInfo(MemberPtr member);
 
@@ -177,6 +288,20 @@ public:
 	bool kickMember(MemberPtr member, string reason = "");
 
 	void sendPacketToAll(const Packet &pack);
+	/// Coalesces typing of member if room does it, otherwise sends it to all at once
+	void onTyping(MemberPtr member, Member::Status status);
+	/// Sends typing indicators changed since the last flush, called every interval of options
+	void flushTyping();
+	inline void setTypingOptions(const TypingOptions &opts){ typing.reset(new RoomTyping(opts)); }
+	inline bool hasTyping() const { return typingActive; }
+	/// Sends online list to client, only members changed since version if client has it
+	void sendOnlineList(ClientPtr client, uint64_t since);
+	/// Sends up to limit logged messages before message before or, if it is 0, before time or
+	/// before history sent on join. Ends page with PacketHistoryBefore
+	void sendHistoryPage(ClientPtr client, uint64_t before, int64_t time, uint limit);
+
+	/// Sends serialized packet to members connected to this process
+	void sendRawDataToAll(const EncodedPacket &data, bool droppable, bool toHistory);
 };
 
 #endif
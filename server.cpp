@@ -2,31 +2,124 @@
 #include <map>
 #include <time.h>
 #include <regex>
+#include <atomic>
 
 #include "algo.hpp"
 #include "client.hpp"
 #include "server.hpp"
 #include "packets.hpp"
 #include "logger.hpp"
+#include "object_pool.hpp"
 
-Server::Server(int port)
-	: server(config["ssl"]["certificate"].asString(), config["ssl"]["private_key"].asString())
+Server::Server(int port, ClusterBus *bus)
+	: server(config["ssl"]["certificate"].asString(), config["ssl"]["private_key"].asString()),
+	  idleTimers(time(nullptr)),
+	  authPool(config["auth"].get("workers", 4).asUInt(), config["auth"].get("queue", 256).asUInt()),
+	  cluster(bus)
 {
+	// io_threads > 0 enables pipeline mode: TLS, framing and packet parsing run on io_threads threads
+	// (each connection on its own strand, so one TLS stream is never used by two threads),
+	// chat logic runs on one logic thread. Otherwise everything runs on one thread
+	int ioThreads = config["io_threads"].asInt();
+	pipeline = ioThreads > 0;
+
 	server.config.port = (unsigned short) port;
-	server.config.thread_pool_size = 1;
+	server.config.thread_pool_size = pipeline ? ioThreads : 1;
+
+	// room_shards > 0 runs rooms, their members and commands on that many threads
+	int roomShards = config["room_shards"].asInt();
+	for (int i = 0; i < roomShards; ++i){
+		shards.emplace_back(new LogicLoop());
+	}
+
+	server.setPostSends(pipeline || !shards.empty());
+	server.setReusePort(cluster != nullptr);
+
+	auto sqconf = config["send_queue"];
+	server.setSendQueueLimits(sqconf.get("max_bytes", 4*1024*1024).asUInt(), sqconf.get("max_messages", 2000).asUInt());
+	server.on_overflow = [&](auto connection) {
+		runLogic([this, connection]{
+			auto it = clients.find(connection);
+			if (it != clients.end()){
+				auto cli = it->second;
+				kick(cli);
+				Logger::info("Kicked by send queue overflow: ", cli->getName(), " [", cli->getIP(), "]");
+			}
+		});
+	};
+
+	// permessage-deflate, settings are read before any client connects
+	auto dfconf = config["deflate"];
+	auto &deflate = DeflateOptions::get();
+	deflate.enabled = dfconf.get("enabled", true).asBool();
+	deflate.level = dfconf.get("level", Z_DEFAULT_COMPRESSION).asInt();
+	deflate.minSize = dfconf.get("min_size", 256).asUInt();
+	deflate.contextTakeover = dfconf.get("context_takeover", false).asBool();
+
+	// every process of cluster logs the broadcasts it gets into its own directory
+	auto hlconf = config["history_log"];
+	if (hlconf.get("enabled", true).asBool()){
+		historyLogOptions.dir = hlconf.get("dir", "history").asString();
+		if (cluster){
+			historyLogOptions.dir += "/node" + to_string(cluster->getNode());
+		}
+		historyLogOptions.segmentSize = hlconf.get("segment_size", 4*1024*1024).asUInt();
+		historyLogOptions.maxSegments = hlconf.get("max_segments", 16).asUInt();
+		historyLogOptions.maxAge = hlconf.get("max_age_days", 30).asInt() * 24*3600;
+		historyLogOptions.flushInterval = hlconf.get("flush_interval", 1000).asInt();
+		historyFlusher.reset(new HistoryFlusher(historyLogOptions.flushInterval));
+	}
+
+	auto slconf = config["state_log"];
+	stateLogEnabled = slconf.get("enabled", true).asBool();
+	stateLogOptions.dir = slconf.get("dir", "state").asString();
+	stateLogOptions.checkpoint = slconf.get("checkpoint", "rooms.dat").asString();
+	stateLogOptions.flushInterval = slconf.get("flush_interval", 200).asInt();
+	stateLogOptions.checkpointInterval = slconf.get("checkpoint_interval", 300).asInt();
+	stateLogOptions.checkpointSize = slconf.get("checkpoint_size", 16*1024*1024).asUInt();
+
+	auto tpconf = config["typing"];
+	for (auto &r : tpconf["rooms"]){
+		typingOptions.rooms.insert(r.asString());
+	}
+	typingOptions.interval = tpconf.get("interval", 500).asInt();
+	typingOptions.memberInterval = tpconf.get("member_interval", 1000).asInt();
+	typingOptions.timeout = tpconf.get("timeout", 5000).asInt();
 
 	auto& chat = server.endpoint["^/chat/?$"];
+	chat.protocols = { cborProtocol };
 	
 	chat.on_message = [&](auto connection, auto message) {
 		string msg = message->string();
-		try {
-			if (clients.find(connection) != clients.end()){
-				clients[connection]->onPacket(msg);
+		// RSV1 marks message compressed by permessage-deflate
+		if (message->fin_rsv_opcode & 0x40){
+			string inflated;
+			if (!Inflater::shared().decompress(msg, inflated, maxInflatedSize)){
+				Logger::warn("Dropped message which can't be inflated from ", connection->remote_endpoint_address);
+				return;
 			}
+			msg.swap(inflated);
+		}
+		// binary frames are CBOR, whatever encoding client asked for its own packets
+		auto enc = (message->fin_rsv_opcode & 0x0f) == 2 ? Encoding::cbor : Encoding::json;
+		AnyPacket pack;
+		try {
+			Packet::read(msg, pack, enc);
 		} catch (const exception &e){
-			Logger::error("Exception: ", e.what(), "\nWhile processing message:", msg);
+			Logger::error("Exception: ", e.what(), "\nWhile parsing message:", msg);
+			return;
 		} catch (...){
-			Logger::error("Unknown error while processing message:", msg);
+			Logger::error("Unknown error while parsing message:", msg);
+			return;
+		}
+
+		// without pipeline packet is processed in place, without copy into task
+		if (pipeline){
+			logic.push([this, connection, pack, msg]() mutable {
+				onMessage(connection, pack, msg);
+			});
+		} else {
+			onMessage(connection, pack, msg);
 		}
 	};
 	
@@ -36,151 +129,586 @@ Server::Server(int port)
 			connection->remote_endpoint_address = iphdr->second;
 		}
 
-		ClientPtr cli = make_shared<Client>(this, connection);
-		cli->setSelfPtr(cli);
+		runLogic([this, connection]{
+			ClientPtr cli = allocate_shared<Client>(PoolAllocator<Client>(), this, connection);
+			cli->setSelfPtr(cli);
 
-		Logger::info("Opened connection from ", cli->getIP());
+			Logger::info("Opened connection from ", cli->getIP());
 
-		auto &cnt = connectionsCountFromIp[cli->getIP()];
-		if (cnt >= 5){ //TODO: to config
-			Logger::info("Connections limit reached for ", cli->getIP());
-			server.send_close(connection, 0);
-		}
-		++cnt;
+			auto &cnt = connectionsCountFromIp[cli->getIP()];
+			int total = cluster ? cluster->addCounter(cli->getIP(), 1) - 1 : (int) cnt;
+			if (total >= 5){ //TODO: to config
+				Logger::info("Connections limit reached for ", cli->getIP());
+				server.send_close(connection, 0);
+			}
+			++cnt;
 
-	    clients[connection] = cli;
+			clients[connection] = cli;
+			idleTimers.schedule(cli->idleTimer, cli, cli->lastPacketTime + pingTimeout);
+		});
 	};
 	
 	chat.on_close = [&](auto connection, int status, const string& reason) {
 	    Logger::info("Closed connection from ", connection->remote_endpoint_address, " with status code ", status);
 
-		auto &cnt = connectionsCountFromIp[connection->remote_endpoint_address];
-		--cnt;
-
-		if (cnt <= 0){
-			connectionsCountFromIp.erase(connection->remote_endpoint_address);
-		}
-
-	    if (clients.find(connection) != clients.end()){
-			clients[connection]->onDisconnect();
-			clients.erase(connection);
-	    }
+		runLogic([this, connection]{
+			onConnectionClosed(connection);
+		});
 	};
 	
 	chat.on_error = [&](auto connection, const boost::system::error_code& ec) {
 		Logger::warn("Error in connection from ", connection->remote_endpoint_address,
 				". Error: ", ec, ", error message: ", ec.message());
 
-		auto &cnt = connectionsCountFromIp[connection->remote_endpoint_address];
-		--cnt;
+		runLogic([this, connection]{
+			onConnectionClosed(connection);
+		});
+	};
 
-		if (cnt <= 0){
-			connectionsCountFromIp.erase(connection->remote_endpoint_address);
-		}
+	server.runWithInterval(idleCheckInterval, [&]{
+		idleTimers.advance(time(nullptr), [&](ClientPtr cli){
+			onIdleTimeout(cli);
+		});
+	}, &getLogicService());
 
-		if (clients.find(connection) != clients.end()){
-			clients[connection]->onDisconnect();
-			clients.erase(connection);
-		}
-	};
+	if (cluster){
+		server.runWithInterval(config["cluster"].get("poll_interval", 5).asInt(), [&]{
+			pollCluster();
+		}, &getLogicService());
+	}
 
-	server.runWithInterval(pingInterval, [&]{
-		time_t cur = time(nullptr);
-		vector<ClientPtr> toKick;
+	if (stateLogEnabled && (!cluster || cluster->getNode() == 0)){
+		server.runWithInterval(checkpointCheckInterval, [&]{
+			checkpointIfDue();
+		}, &getLogicService());
+	}
+
+	if (!typingOptions.rooms.empty()){
+		server.runWithInterval(typingOptions.interval, [&]{
+			flushTyping();
+		}, &getLogicService());
+	}
+}
 
-		for (auto c : clients){
-			auto &cli = c.second;
+void Server::flushTyping(){
+	for (auto &room : rooms){
+		if (room->hasTyping()){
+			room->post([room]{ room->flushTyping(); });
+		}
+	}
+}
 
-			if (cur - cli->lastPacketTime > connectTimeout){
-				toKick.push_back(cli);
+void Server::pollCluster(){
+	cluster->poll([&](ClusterBus::Event event, const string &name, const string &payload, uint8_t flags){
+		switch (event){
+			case ClusterBus::Event::broadcast: {
+				auto room = getRoomByName(name);
+				if (room){
+					EncodedPacket data(allocate_shared<const string>(PoolAllocator<string>(), payload));
+					room->post([room, data, flags]{
+						if (flags & ClusterBus::member_status){
+							room->onRemoteStatus(*data.get(Encoding::json));
+						}
+						if (!(flags & ClusterBus::list_only)){
+							room->sendRawDataToAll(data, flags & ClusterBus::droppable, flags & ClusterBus::to_history);
+						}
+					});
+				}
+				break;
+			}
+			case ClusterBus::Event::room_created:
+				addRoom(name);
+				break;
+			case ClusterBus::Event::room_removed:
+				dropRoom(name);
+				break;
+			case ClusterBus::Event::room_settings: {
+				auto room = getRoomByName(name);
+				Json::Value val;
+				Json::Reader rd;
+				if (room && rd.parse(payload, val)){
+					room->post([room, val]{
+						room->deserializeSettings(val);
+						room->logSettings();
+					});
+				}
+				break;
+			}
+			case ClusterBus::Event::resync:
+				// the first process answers, or the second one when the first lost events
+				if (cluster->getNode() == (payload == "0" ? 1 : 0)){
+					publishRooms();
+				}
+				// every process lists its own members
+				for (auto &room : rooms){
+					room->post([room]{ room->publishMembers(); });
+				}
+				break;
+			case ClusterBus::Event::member_info: {
+				auto room = getRoomByName(name);
+				Json::Value val;
+				Json::Reader rd;
+				if (room && rd.parse(payload, val)){
+					MemberInfo info;
+					info.deserialize(val);
+					room->post([room, info]{ room->storeMemberInfo(info); });
+				}
+				break;
 			}
-			else if (cur - cli->lastPacketTime > pingTimeout){
-				//cout << date("[%H:%M:%S] ") << "Server: Sending ping to " << cli->getName() << " [" << cli->getIP() << "]" << endl;
-				cli->sendPacket(PacketPing());
+			case ClusterBus::Event::room_members: {
+				auto room = getRoomByName(name);
+				Json::Value val;
+				Json::Reader rd;
+				if (room && rd.parse(payload, val)){
+					room->post([room, val]{ room->applyRemoteMembers(val["node"].asUInt(), val["list"]); });
+				}
+				break;
+			}
+			case ClusterBus::Event::room_list: {
+				Json::Value val;
+				Json::Reader rd;
+				if (!rd.parse(payload, val)){
+					break;
+				}
+				unordered_set<string> names;
+				for (auto &v : val){
+					names.insert(v.asString());
+					addRoom(v.asString());
+				}
+				vector<string> removed;
+				for (auto &room : rooms){
+					if (names.find(room->getName()) == names.end()){
+						removed.push_back(room->getName());
+					}
+				}
+				for (auto &name : removed){
+					dropRoom(name);
+				}
+				break;
 			}
 		}
+	});
 
-		for (auto cli : toKick){
-			kick(cli);
-			Logger::info("Kicked by no ping: ", cli->getName(), " [", cli->getIP(), "]");
+	// counters of writers are cluster-wide, every process reports them
+	auto st = cluster->getStats();
+	if (st.lost > clusterStats.lost){
+		Logger::warn("Cluster bus lost ", st.lost - clusterStats.lost, " events, asking for resync");
+		cluster->publish(ClusterBus::Event::resync, "", to_string(cluster->getNode()));
+	}
+	if (st.oversized > clusterStats.oversized){
+		Logger::error("Events too big for cluster bus were dropped: ", st.oversized - clusterStats.oversized);
+	}
+	if (st.lagging > clusterStats.lagging){
+		Logger::warn("Processes of cluster stopped reading bus: ", st.lagging - clusterStats.lagging);
+		// members of process which died are gone
+		for (uint8_t n = 0; n < cluster->getNodes(); ++n){
+			if (n == cluster->getNode() || cluster->isAlive(n) || !deadNodes.insert(n).second){
+				continue;
+			}
+			Logger::error("Process ", (int) n, " of cluster died, its members leave rooms");
+			for (auto &room : rooms){
+				room->post([room, n]{ room->applyRemoteMembers(n, Json::Value(Json::arrayValue)); });
+			}
 		}
-	});
+	}
+	if (st.recovered > clusterStats.recovered){
+		Logger::warn("Locks of cluster bus taken over from processes which died: ", st.recovered - clusterStats.recovered);
+	}
+	clusterStats = st;
+}
+
+void Server::publishRooms(){
+	Json::Value names(Json::arrayValue);
+	for (auto &room : rooms){
+		names.append(room->getName());
+	}
+	Json::FastWriter wr;
+	cluster->publish(ClusterBus::Event::room_list, "", wr.write(names));
+
+	for (auto &room : rooms){
+		room->post([room]{ room->publishSettings(); });
+	}
+}
+
+void Server::onMessage(shared_ptr<WSServerBase::Connection> connection, AnyPacket &pack, const string &msg){
+	try {
+		auto it = clients.find(connection);
+		if (it != clients.end()){
+			it->second->onPacket(pack, msg);
+		}
+	} catch (const exception &e){
+		Logger::error("Exception: ", e.what(), "\nWhile processing message:", msg);
+	} catch (...){
+		Logger::error("Unknown error while processing message:", msg);
+	}
+}
+
+void Server::onConnectionClosed(shared_ptr<WSServerBase::Connection> connection){
+	auto &cnt = connectionsCountFromIp[connection->remote_endpoint_address];
+	--cnt;
+	if (cluster){
+		cluster->addCounter(connection->remote_endpoint_address, -1);
+	}
+
+	if (cnt <= 0){
+		connectionsCountFromIp.erase(connection->remote_endpoint_address);
+	}
+
+	auto it = clients.find(connection);
+	if (it != clients.end()){
+		auto cli = it->second;
+		idleTimers.cancel(cli->idleTimer);
+		unindexClient(cli);
+		cli->onDisconnect();
+		clients.erase(connection);
+	}
+
+	server.release(connection);
+}
+
+void Server::runLogic(std::function<void()> func){
+	if (pipeline){
+		logic.push(std::move(func));
+	} else {
+		func();
+	}
+}
+
+LogicLoop *Server::getShardFor(const string &roomName){
+	if (shards.empty()){
+		return nullptr;
+	}
+	return shards[hash<string>()(roomName) % shards.size()].get();
+}
+
+boost::asio::io_service &Server::getLogicService(){
+	return pipeline ? logic.getService() : *server.io_service;
+}
+
+void Server::post(std::function<void()> func){
+	if (pipeline){
+		logic.push(std::move(func));
+	} else {
+		server.io_service->post(func);
+	}
+}
+
+bool Server::isConnected(ClientPtr client){
+	auto it = clients.find(client->getConnection());
+	return it != clients.end() && it->second == client;
+}
+
+void Server::onIdleTimeout(ClientPtr cli){
+	if (!cli->pingSent){
+		cli->pingSent = true;
+		cli->sendPacket(PacketPing());
+		idleTimers.schedule(cli->idleTimer, cli, cli->lastPacketTime + connectTimeout);
+	} else {
+		kick(cli);
+		Logger::info("Kicked by no ping: ", cli->getName(), " [", cli->getIP(), "]");
+	}
+}
+
+void Server::onClientActivity(Client &client){
+	client.pingSent = false;
+	idleTimers.schedule(client.idleTimer, client.getSelfPtr(), client.lastPacketTime + pingTimeout);
 }
 
 void Server::start(){
 	Logger::info("Started wsserver at port ", server.config.port);
 	connectionsCountFromIp.clear();
+	if (pipeline){
+		logic.start();
+	}
+	for (auto &shard : shards){
+		shard->start();
+	}
+
+	// signal only ends run of io_service, everything else is stopped by caller on its thread
+	boost::asio::signal_set signals(*server.io_service, SIGINT, SIGTERM);
+	signals.async_wait([this](const boost::system::error_code &ec, int signum){
+		if (!ec){
+			Logger::info("Received signal ", signum);
+			server.stop();
+		}
+	});
 	server.start();
 }
 
 void Server::stop(){
 	server.stop();
+	logic.stop();
+	for (auto &shard : shards){
+		shard->stop();
+	}
+	if (historyFlusher){
+		historyFlusher->stop();
+	}
+	// checkpoint being written is finished, state log gets the rest of buffered records
+	checkpointPool.reset();
+	if (stateLog){
+		stateLog->stop();
+	}
 }
 
-Json::Value Server::serialize(){
-	Json::Value val;
-
-	auto &sr = val["rooms"];
-	for (RoomPtr r : rooms){
-		sr.append(r->serialize());
+void Server::deserialize(const SnapshotReader &snap){
+	rooms.clear();
+	roomsByName.clear();
+	rooms.reserve(snap.rooms());
+	roomsByName.reserve(snap.rooms());
+	for (size_t i = 0; i < snap.rooms(); ++i){
+		RoomPtr rm = make_shared<Room>(this);
+		rm->setSelfPtr(rm);
+		rm->deserialize(snap.room(i));
+		rm->setShard(getShardFor(rm->getName()));
+		if (typingOptions.enabledFor(rm->getName())){
+			rm->setTypingOptions(typingOptions);
+		}
+		if (roomsByName.emplace(rm->getName(), rm).second){
+			rooms.insert(rm);
+		}
 	}
-
-	return val;
 }
 
 void Server::deserialize(const Json::Value &val){
 	rooms.clear();
+	roomsByName.clear();
 	for (auto &v : val["rooms"]){
 		RoomPtr rm = make_shared<Room>(this);
 		rm->setSelfPtr(rm);
 		rm->deserialize(v);
-		rooms.insert(rm);
+		rm->setShard(getShardFor(rm->getName()));
+		if (typingOptions.enabledFor(rm->getName())){
+			rm->setTypingOptions(typingOptions);
+		}
+		if (roomsByName.emplace(rm->getName(), rm).second){
+			rooms.insert(rm);
+		}
 	}
 }
 
-void Server::sendRawData(shared_ptr<WSServerBase::Connection> conn, const string &rdata){
-	auto response_ss = make_shared<SendStream>();
-	*response_ss << rdata;
-	server.send(conn, response_ss);
+void Server::loadState(){
+	uint64_t generation = 0;
+	auto &path = stateLogOptions.checkpoint;
+	try {
+		if (SnapshotReader::isSnapshot(path)){
+			SnapshotReader snap;
+			if (!snap.open(path)){
+				throw runtime_error("Broken snapshot " + path + ": " + snap.getError());
+			}
+			deserialize(snap);
+			generation = snap.getWalGeneration();
+		} else {
+			Json::Value val;
+			Config::loadFromFile(path, val);
+			deserialize(val);
+			generation = val["wal_generation"].asUInt64();
+		}
+		Logger::info("Last server state loaded");
+	} catch (exception &e){
+		Logger::error("Exception while loading last server state:\n", e.what());
+	}
+
+	if (!stateLogEnabled){
+		return;
+	}
+
+	size_t applied = 0;
+	uint64_t last = StateLog::replay(stateLogOptions.dir, generation, [&](const CborFields &rec){
+		try {
+			applyStateRecord(rec);
+			++applied;
+		} catch (exception &e){
+			Logger::error("Exception while applying state log record:\n", e.what());
+		}
+	});
+	Logger::info("Applied ", applied, " records of state log");
+
+	// every start writes to new generation, after the one which may end with unfinished record
+	if (!cluster || cluster->getNode() == 0){
+		stateLog.reset(new StateLog(stateLogOptions, last + 1));
+		checkpointPool.reset(new WorkerPool(1, 1));
+		lastCheckpoint = time(nullptr);
+	}
 }
 
-void Server::sendPacket(shared_ptr<WSServerBase::Connection> conn, const Packet &pack){
-	Json::FastWriter wr;
-	auto response_ss = make_shared<SendStream>();
-	*response_ss << wr.write(pack.serialize());
-	server.send(conn, response_ss);
+void Server::saveState(){
+	if (stateLogEnabled){
+		return;
+	}
+
+	SnapshotWriter wr;
+	for (auto &rm : rooms){
+		wr.addRoom(rm->snapshot());
+	}
+	if (!StateLog::writeFile(stateLogOptions.checkpoint, wr.finish(0))){
+		throw runtime_error("Can't write " + stateLogOptions.checkpoint);
+	}
+}
+
+void Server::applyStateRecord(const CborFields &rec){
+	string name = rec["target"].asString();
+	switch ((StateLog::Op) rec["type"].asUInt()){
+		case StateLog::Op::room_created:
+			addRoom(name);
+			break;
+		case StateLog::Op::room_removed:
+			dropRoom(name);
+			break;
+		default: {
+			auto room = getRoomByName(name);
+			if (room){
+				room->applyStateRecord(rec);
+			}
+			break;
+		}
+	}
+}
+
+void Server::checkpointIfDue(){
+	if (!stateLog || checkpointRunning){
+		return;
+	}
+
+	size_t appended = stateLog->getAppended();
+	if (appended >= stateLogOptions.checkpointSize
+			|| (appended > 0 && time(nullptr) - lastCheckpoint >= stateLogOptions.checkpointInterval)){
+		checkpoint();
+	}
+}
+
+void Server::checkpoint(){
+	checkpointRunning = true;
+	lastCheckpoint = time(nullptr);
+
+	// every room is serialized by its thread after log moved to new generation, so checkpoint
+	// contains everything logged before it. Changes made meanwhile are in both, which is harmless
+	struct Snapshot {
+		uint64_t generation;
+		vector<SnapshotRoom> rooms;
+		std::atomic<size_t> left;
+	};
+	auto snap = make_shared<Snapshot>();
+	snap->generation = stateLog->rotate();
+	snap->rooms.resize(rooms.size());
+	snap->left = rooms.size() + 1;
+
+	auto finish = [this, snap]{
+		if (--snap->left > 0){
+			return;
+		}
+
+		bool queued = checkpointPool->submit([this, snap]{
+			SnapshotWriter wr;
+			for (auto &r : snap->rooms){
+				wr.addRoom(r);
+			}
+			if (StateLog::writeFile(stateLogOptions.checkpoint, wr.finish(snap->generation))){
+				stateLog->removeBefore(snap->generation);
+			} else {
+				Logger::error("Can't write checkpoint ", stateLogOptions.checkpoint, ", state log is kept");
+			}
+			post([this]{ checkpointRunning = false; });
+		});
+		if (!queued){
+			post([this]{ checkpointRunning = false; });
+		}
+	};
+
+	size_t i = 0;
+	for (auto &rm : rooms){
+		SnapshotRoom *slot = &snap->rooms[i++];
+		rm->post([rm, slot, finish]{
+			*slot = rm->snapshot();
+			finish();
+		});
+	}
+	finish();
+}
+
+void Server::sendRawData(shared_ptr<WSServerBase::Connection> conn, const PacketBuffer &rdata, bool droppable, Encoding enc,
+		const PacketBuffer &deflated){
+	// text frame for JSON, binary for CBOR
+	server.send(conn, rdata, droppable, enc == Encoding::cbor ? 130 : 129, deflated);
+}
+
+void Server::sendPacket(shared_ptr<WSServerBase::Connection> conn, const Packet &pack, Encoding enc){
+	sendRawData(conn, pack.toBuffer(enc), pack.isDroppable(), enc);
+}
+
+void Server::sendFramed(shared_ptr<WSServerBase::Connection> conn, const PacketBuffer &frames){
+	server.sendFramed(conn, frames);
+}
+
+void Server::setFrameBatching(shared_ptr<WSServerBase::Connection> conn, bool enabled){
+	server.setFrameBatching(conn, enabled);
 }
 
 void Server::sendPacketToAll(const Packet &pack){
-	Json::FastWriter wr;
-	auto response_ss = make_shared<SendStream>();
-	string spack = wr.write(pack.serialize());
+	EncodedPacket data(pack);
+	for (auto &c : clients){
+		c.second->sendRawData(data);
+	}
+}
 
-	*response_ss << spack;
-	for (auto conn : server.get_connections()){
-		//response_ss->seekg(0);
-		server.send(conn, response_ss);
+void Server::indexClient(ClientPtr client){
+	if (client->getID() > 0){
+		clientsByUid[client->getID()].insert(client);
+	}
+	if (!client->getName().empty()){
+		clientsByName[client->getName()].insert(client);
+	}
+}
+
+void Server::unindexClient(ClientPtr client){
+	auto uit = clientsByUid.find(client->getID());
+	if (uit != clientsByUid.end()){
+		uit->second.erase(client);
+		if (uit->second.empty()){
+			clientsByUid.erase(uit);
+		}
+	}
+
+	auto nit = clientsByName.find(client->getName());
+	if (nit != clientsByName.end()){
+		nit->second.erase(client);
+		if (nit->second.empty()){
+			clientsByName.erase(nit);
+		}
+	}
+}
+
+void Server::setClientUser(ClientPtr client, uint uid, const string &name){
+	unindexClient(client);
+	client->setID(uid);
+	client->setName(name);
+	if (isConnected(client)){
+		indexClient(client);
 	}
 }
 
 ClientPtr Server::getClientByName(string name){
-	for (auto clip : clients){
-		auto cli = clip.second;
-		if (!cli->getName().empty() && cli->getName() == name)
-			return cli; 
+	auto it = clientsByName.find(name);
+	if (it != clientsByName.end() && !it->second.empty()){
+		return *it->second.begin();
 	}
 	return ClientPtr();
 }
 
 ClientPtr Server::getClientByID(uint uid){
-	for (auto clip : clients){
-		auto cli = clip.second;
-		if (cli->getID() > 0 && cli->getID() == uid)
-			return cli; 
+	auto it = clientsByUid.find(uid);
+	if (it != clientsByUid.end() && !it->second.empty()){
+		return *it->second.begin();
 	}
 	return ClientPtr();
 }
 
+const unordered_set<ClientPtr> &Server::getClientsByID(uint uid){
+	static const unordered_set<ClientPtr> empty;
+	auto it = clientsByUid.find(uid);
+	return it != clientsByUid.end() ? it->second : empty;
+}
+
 vector<ClientPtr> Server::getClients(){
 	vector<ClientPtr> res;
 	for (auto clip : clients){
@@ -191,14 +719,38 @@ vector<ClientPtr> Server::getClients(){
 	return res;
 }
 
+WSServer::QueueStats Server::getSendQueueDepth(ClientPtr client){
+	return server.getQueueDepth(client->getConnection());
+}
+
 void Server::kick(ClientPtr client){
 	auto conn = client->getConnection();
+	idleTimers.cancel(client->idleTimer);
+	unindexClient(client);
 	clients.erase(conn);
 	client->onDisconnect();
 	server.send_close(conn, 0);
 }
 
 RoomPtr Server::createRoom(string name){
+	auto rm = addRoom(name);
+	if (rm && cluster){
+		cluster->publish(ClusterBus::Event::room_created, name, "");
+	}
+
+	return rm;
+}
+
+bool Server::removeRoom(string name){
+	bool res = dropRoom(name);
+	if (res && cluster){
+		cluster->publish(ClusterBus::Event::room_removed, name, "");
+	}
+
+	return res;
+}
+
+RoomPtr Server::addRoom(const string &name){
 	auto rm = getRoomByName(name);
 	if (rm)
 		return nullptr;
@@ -206,18 +758,30 @@ RoomPtr Server::createRoom(string name){
 	rm = make_shared<Room>(this);
 	rm->setName(name);
 	rm->setSelfPtr(rm);
+	rm->setShard(getShardFor(name));
+	if (typingOptions.enabledFor(name)){
+		rm->setTypingOptions(typingOptions);
+	}
 	rooms.insert(rm);
-	rm->onCreate();
+	roomsByName[name] = rm;
+	rm->post([rm]{ rm->onCreate(); });
+	if (stateLog){
+		stateLog->append(StateLog::Op::room_created, name);
+	}
 
 	return rm;
 }
 
-bool Server::removeRoom(string name){
+bool Server::dropRoom(const string &name){
 	auto rm = getRoomByName(name);
 	if (rm){
+		roomsByName.erase(name);
 		bool res = rooms.erase(rm) > 0;
 		if (res){
-			rm->onDestroy();
+			rm->post([rm]{ rm->onDestroy(); });
+			if (stateLog){
+				stateLog->append(StateLog::Op::room_removed, name);
+			}
 		}
 		return res;
 	}
@@ -226,12 +790,7 @@ bool Server::removeRoom(string name){
 }
 
 RoomPtr Server::getRoomByName(string name){
-	for (RoomPtr room : rooms){
-		if (room->getName() == name){
-			return room;
-		}
-	}
-
-	return nullptr;
+	auto it = roomsByName.find(name);
+	return it != roomsByName.end() ? it->second : nullptr;
 }
 
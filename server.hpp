@@ -5,7 +5,7 @@
 #include "server_wss_ex.hpp"
 
 class Server;
-using WSServerBase = SimpleWeb::SocketServerBase<SimpleWeb::WSS>;
+using WSServerBase = WebSocketServerEx;
 using WSServer = WebSocketServerEx;
 
 #include <unordered_set>
@@ -15,39 +15,139 @@ using WSServer = WebSocketServerEx;
 #include "packet.hpp"
 #include "memcached.hpp"
 #include "rooms.hpp"
+#include "timer_wheel.hpp"
+#include "worker_pool.hpp"
+#include "logic_loop.hpp"
+#include "cluster.hpp"
+#include "history_log.hpp"
+#include "state_log.hpp"
+#include "snapshot.hpp"
+#include "typing.hpp"
 
 using namespace std;
 
 class Server {
-public:
-	using SendStream = WSServerBase::SendStream;
 private:
 	static const int connectTimeout = 5*60;
 	static const int pingTimeout = 3*60;
-	static const int pingInterval = 30000;
+	static const int idleCheckInterval = 1000;
+	static const int checkpointCheckInterval = 1000;
+	// inflated message from client can't be longer
+	static const size_t maxInflatedSize = 1024*1024;
 
 	unordered_map<shared_ptr<WSServerBase::Connection>, ClientPtr> clients;
 	unordered_map<string, uint> connectionsCountFromIp;
 	WSServer server;
 
+	// pipeline mode: chat state is owned by logic thread
+	bool pipeline;
+	LogicLoop logic;
+
+	// room_shards > 0: every room is owned by one of shard threads
+	vector<unique_ptr<LogicLoop>> shards;
+
+	void runLogic(std::function<void()> func);
+	LogicLoop *getShardFor(const string &roomName);
+	void onConnectionClosed(shared_ptr<WSServerBase::Connection> connection);
+	void onMessage(shared_ptr<WSServerBase::Connection> connection, AnyPacket &pack, const string &msg);
+
+	// deadline of ping or kick for every client
+	TimerWheel<ClientPtr> idleTimers;
+
+	// database and memcached lookups of PacketAuth
+	WorkerPool authPool;
+
+	void onIdleTimeout(ClientPtr client);
+
 	unordered_set<RoomPtr> rooms;
+	unordered_map<string, RoomPtr> roomsByName;
+
+	// authorized clients, one user can have many connections
+	unordered_map<uint, unordered_set<ClientPtr>> clientsByUid;
+	unordered_map<string, unordered_set<ClientPtr>> clientsByName;
+
+	void indexClient(ClientPtr client);
+	void unindexClient(ClientPtr client);
+
+	// other wsserver processes on the same port, nullptr when running alone
+	ClusterBus *cluster;
+	// counters of bus at the last poll, events lost since then make process ask for resync
+	ClusterBus::Stats clusterStats;
+	// processes of cluster found dead, their members are removed from rooms once
+	unordered_set<uint8_t> deadNodes;
+
+	// on-disk history of rooms, flusher is nullptr when it is disabled
+	HistoryLogOptions historyLogOptions;
+	unique_ptr<HistoryFlusher> historyFlusher;
+
+	// write-ahead log of rooms and their settings, only the first process of cluster writes it.
+	// nullptr when it is disabled or not written by this process
+	bool stateLogEnabled;
+	StateLogOptions stateLogOptions;
+	unique_ptr<StateLog> stateLog;
+	// writes checkpoints, so logic thread doesn't wait for disk
+	unique_ptr<WorkerPool> checkpointPool;
+	bool checkpointRunning = false;
+	time_t lastCheckpoint = 0;
+
+	// rooms of options send typing indicators coalesced every interval
+	TypingOptions typingOptions;
+
+	void flushTyping();
+	void checkpointIfDue();
+	void checkpoint();
+	void applyStateRecord(const CborFields &rec);
+
+	void pollCluster();
+	/// Sends names and settings of all rooms to processes which lost events of bus
+	void publishRooms();
+	RoomPtr addRoom(const string &name);
+	bool dropRoom(const string &name);
 public:
-	Server(int port);
+	Server(int port, ClusterBus *bus = nullptr);
 	~Server(){ stop(); }
 	
+	/// Serves clients until stop or SIGINT or SIGTERM
 	void start();
 	void stop();
 	
-	Json::Value serialize();
+	void deserialize(const SnapshotReader &);
+	/// rooms.dat in JSON, written by older versions
 	void deserialize(const Json::Value &);
 
+	/// Loads the last checkpoint and applies state log written after it
+	void loadState();
+	/// Called after stop: state log is already on disk, full dump is written only without it
+	void saveState();
+
+	/// Runs func on thread which owns clients and room set, safe to call from any thread
+	void post(std::function<void()> func);
+	boost::asio::io_service &getLogicService();
+	bool isConnected(ClientPtr client);
+
+	inline WorkerPool &getAuthPool(){ return authPool; }
+	inline ClusterBus *getCluster(){ return cluster; }
+	inline HistoryFlusher *getHistoryFlusher(){ return historyFlusher.get(); }
+	inline const HistoryLogOptions &getHistoryLogOptions(){ return historyLogOptions; }
+	inline StateLog *getStateLog(){ return stateLog.get(); }
+
 	void kick(ClientPtr client);
-	void sendPacket(shared_ptr<WSServerBase::Connection> conn, const Packet &);
+	void onClientActivity(Client &client);
+	void sendPacket(shared_ptr<WSServerBase::Connection> conn, const Packet &, Encoding enc = Encoding::json);
 	void sendPacketToAll(const Packet &);
-	void sendRawData(shared_ptr<WSServerBase::Connection> conn, const string &rdata);
+	/// Sends buffer of ready WebSocket frames
+	void sendFramed(shared_ptr<WSServerBase::Connection> conn, const PacketBuffer &frames);
+	void setFrameBatching(shared_ptr<WSServerBase::Connection> conn, bool enabled);
+	/// deflated is rdata compressed once for all recipients, sent when client uses permessage-deflate
+	void sendRawData(shared_ptr<WSServerBase::Connection> conn, const PacketBuffer &rdata, bool droppable = false,
+			Encoding enc = Encoding::json, const PacketBuffer &deflated = nullptr);
 	
 	ClientPtr getClientByName(string name);
 	ClientPtr getClientByID(uint uid);
+	const unordered_set<ClientPtr> &getClientsByID(uint uid);
+
+	/// Changes user of client, keeps client indexes consistent
+	void setClientUser(ClientPtr client, uint uid, const string &name);
 	
 	vector<ClientPtr> getClients();
 	inline const unordered_set<RoomPtr> &getRooms(){ return rooms; }
@@ -57,6 +157,9 @@ public:
 	RoomPtr getRoomByName(string name);
 
 	inline const unordered_map<string, uint> &getConnectionsCounter(){ return connectionsCountFromIp; }
+
+	inline WSServer::QueueStats getSendQueueStats(){ return server.getQueueStats(); }
+	WSServer::QueueStats getSendQueueDepth(ClientPtr client);
 };
 
 #endif
@@ -4,24 +4,878 @@
 
 #pragma once
 
-#include "simple_wss/server_wss.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
 #include "algo.hpp"
+#include "deflate.hpp"
 #include "logger.hpp"
 
-class WebSocketServerEx : public SimpleWeb::SocketServer<SimpleWeb::WSS> {
+/// WebSocket server over TLS. Connections are accepted, TLS and upgrade handshakes are made
+/// and frames of clients are read here, so that every byte written to connection goes through
+/// its send queue: packets, pong replies and close frames alike, and frames never interleave.
+/// Reads, writes, timers and handlers of connection run on the strand of its queue, so
+/// io_service may run on several threads while one ssl::stream is never used by two of them.
+/// Replaces simple_wss, which copied every payload into its SendStream queue and left no way
+/// to answer offers of subprotocol and permessage-deflate in handshake
+class WebSocketServerEx {
+public:
+	using Buffer = std::shared_ptr<const std::string>;
+	using Socket = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
+
+	struct CaseInsensitiveHash {
+		size_t operator ()(const std::string &s) const {
+			size_t h = 0;
+			for (char c : s){
+				h = h * 31 + (unsigned char) tolower(c);
+			}
+			return h;
+		}
+	};
+
+	struct CaseInsensitiveEqual {
+		bool operator ()(const std::string &a, const std::string &b) const {
+			return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y){
+				return tolower(x) == tolower(y);
+			});
+		}
+	};
+
+	using Header = std::unordered_multimap<std::string, std::string, CaseInsensitiveHash, CaseInsensitiveEqual>;
+
+	class Connection;
+	using ConnectionPtr = std::shared_ptr<Connection>;
+
+	/// Message of client, fragments are joined
+	class Message {
+	public:
+		// of the first frame, FIN is set
+		unsigned char fin_rsv_opcode;
+		std::string data;
+
+		const std::string &string() const { return data; }
+	};
+
+	class Endpoint {
+	public:
+		/// Subprotocols of endpoint. The first one which client offers in Sec-WebSocket-Protocol
+		/// is echoed in handshake response and kept in Connection::protocol
+		std::vector<std::string> protocols;
+
+		std::function<void(ConnectionPtr)> on_open;
+		std::function<void(ConnectionPtr, std::shared_ptr<Message>)> on_message;
+		/// Called once when connection is closed by close frame, otherwise on_error is called once
+		std::function<void(ConnectionPtr, int, const std::string &)> on_close;
+		std::function<void(ConnectionPtr, const boost::system::error_code &)> on_error;
+	};
+
+	struct Config {
+		unsigned short port = 443;
+		// all interfaces when empty
+		std::string address;
+		size_t thread_pool_size = 1;
+		bool reuse_address = true;
+		// seconds for TLS and upgrade handshakes, and for reply to close frame of server
+		long timeout_request = 5;
+		// longer message of client closes connection with 1009
+		size_t max_message_size = 1024*1024;
+	};
+
+	struct QueueStats {
+		size_t frames = 0;
+		size_t bytes = 0;
+		size_t dropped = 0;
+		size_t evicted = 0;
+	};
+
+	Config config;
+	/// Endpoints by regex of path, must not change after start
+	std::map<std::string, Endpoint> endpoint;
+	std::shared_ptr<boost::asio::io_service> io_service;
+
+	/// Called when connection send queue is over limit even after dropping of droppable frames
+	std::function<void(const ConnectionPtr &)> on_overflow;
+private:
+	static const size_t maxHandshakeSize = 16*1024;
+
+	struct Frame {
+		std::array<unsigned char, 10> header;
+		// header_size is 0 when data already holds whole frames
+		size_t header_size;
+		Buffer data;
+		// permessage-deflate payload, shared by all recipients or made for this connection by write
+		Buffer deflated;
+		// queue limits count uncompressed frame
+		size_t bytes;
+		bool droppable;
+
+		size_t size() const { return bytes; }
+	};
+
+	// everything except counters is touched only on the strand of queue, which is also
+	// the strand of every read, timer and handler of connection
+	struct OutQueue {
+		boost::asio::io_service::strand strand;
+		std::deque<Frame> frames;
+		std::vector<boost::asio::const_buffer> iov;
+		size_t writing = 0;
+		std::atomic<size_t> count{0};
+		std::atomic<size_t> bytes{0};
+		bool overflowed = false;
+		bool dirty = false;
+		// close frame is queued, nothing is sent after it
+		bool closing = false;
+
+		// client accepts several packets as one frame: JSON array of text packets
+		// or CBOR array of binary ones
+		bool batch = false;
+		std::array<unsigned char, 10> batchHeader;
+		std::string batchData;
+
+		// permessage-deflate was negotiated, deflater is set when connection keeps its window
+		bool deflate = false;
+		std::unique_ptr<Deflater> deflater;
+
+		OutQueue(boost::asio::io_service &service) : strand(service){}
+	};
+
+	struct Counters {
+		std::atomic<size_t> frames{0};
+		std::atomic<size_t> bytes{0};
+		std::atomic<size_t> dropped{0};
+		std::atomic<size_t> evicted{0};
+	};
+public:
+	class Connection {
+		friend class WebSocketServerEx;
+	public:
+		std::string method, path, query_string, http_version;
+		Header header;
+		std::string remote_endpoint_address;
+		unsigned short remote_endpoint_port = 0;
+		/// subprotocol chosen in handshake, empty when client offered none of endpoint
+		std::string protocol;
+		/// permessage-deflate negotiated in handshake, frames are then compressed by send queue
+		DeflateParams deflate;
+
+		Connection(boost::asio::io_service &service, boost::asio::ssl::context &context)
+				: socket(service, context), queue(std::make_shared<OutQueue>(service)), timer(service){}
+	private:
+		Socket socket;
+		std::shared_ptr<OutQueue> queue;
+		// bytes read from socket and not parsed yet
+		boost::asio::streambuf input;
+		boost::asio::deadline_timer timer;
+		Endpoint *endpoint = nullptr;
+
+		// opcode of fragmented message and its fragments so far
+		unsigned char fragmentOpcode = 0;
+		std::string fragments;
+
+		// on_close or on_error was called, nothing is read after it
+		bool closed = false;
+	};
+private:
+	boost::asio::ssl::context context;
+	// loaded by start, so server can be made without them
+	std::string certFile, privateKeyFile;
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+	std::vector<std::thread> threads;
+	std::vector<std::pair<std::regex, Endpoint *>> endpoints;
+
+	std::mutex connectionsMutex;
+	std::unordered_set<ConnectionPtr> connections;
+
+	size_t maxQueueBytes = 0;
+	size_t maxQueueFrames = 0;
+	Counters stats;
+
+	// send() is called from threads other than io_service ones
+	bool postSends = false;
+
+	// several processes listen on the same port
+	bool reusePort = false;
+
+	inline std::shared_ptr<OutQueue> getQueue(const ConnectionPtr &conn){
+		return conn->queue;
+	}
+
+	template<typename F>
+	void runOnStrand(const std::shared_ptr<OutQueue> &q, F func){
+		if (postSends){
+			q->strand.post(func);
+		} else {
+			func();
+		}
+	}
+
+	void removeFrame(OutQueue &q, const Frame &f){
+		q.bytes -= f.size();
+		--q.count;
+		stats.bytes -= f.size();
+		--stats.frames;
+	}
+
+	bool overLimit(const OutQueue &q, size_t add_bytes){
+		return (maxQueueBytes && q.bytes + add_bytes > maxQueueBytes)
+				|| (maxQueueFrames && q.frames.size() + 1 > maxQueueFrames);
+	}
+
+	// queued close frame is kept unless socket failed, client must learn why it is closed
+	void dropFrames(OutQueue &q, bool only_droppable, bool keep_close = true){
+		auto it = q.frames.begin() + q.writing;
+		while (it != q.frames.end()){
+			if ((!only_droppable || it->droppable) && !(keep_close && it->header[0] == 136)){
+				removeFrame(q, *it);
+				++stats.dropped;
+				it = q.frames.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	void popWritten(OutQueue &q){
+		for (size_t i = 0; i < q.writing; ++i){
+			removeFrame(q, q.frames[i]);
+		}
+		q.frames.erase(q.frames.begin(), q.frames.begin() + q.writing);
+		q.writing = 0;
+	}
+
+	static bool canBatch(const OutQueue &q){
+		if (!q.batch || q.frames.size() < 2){
+			return false;
+		}
+
+		unsigned char opcode = q.frames.front().header[0];
+		if (opcode != 129 && opcode != 130){
+			return false;
+		}
+		for (auto &f : q.frames){
+			if (f.header[0] != opcode){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Joins frames into one JSON or CBOR array. Parts compressed once for everyone stay as
+	// they are inside of compressed batch, so broadcasts aren't compressed again per connection
+	template<typename Out>
+	static void joinBatch(const OutQueue &q, unsigned char opcode, Out &out){
+		bool json = opcode == 129;
+		// CBOR array of indefinite length
+		out.addPlain(json ? "[" : "\x9f");
+		bool first = true;
+		for (auto &f : q.frames){
+			if (json && !first){
+				out.addPlain(",");
+			}
+			first = false;
+			if (f.deflated){
+				out.addCompressed(*f.deflated, *f.data);
+			} else {
+				out.addPlain(*f.data);
+			}
+		}
+		out.addPlain(json ? "]" : "\xff");
+	}
+
+	struct PlainBatch {
+		std::string &out;
+
+		void addPlain(boost::string_view data){ out.append(data.data(), data.size()); }
+		void addCompressed(boost::string_view, boost::string_view plain){ addPlain(plain); }
+	};
+
+	// Compresses frame for connection unless it was compressed once for everyone. Small frames go as they are
+	static void deflateFrame(OutQueue &q, Frame &f){
+		if (!f.deflated){
+			if (f.data->size() < DeflateOptions::get().minSize){
+				return;
+			}
+
+			static thread_local std::string out;
+			out.clear();
+			if (!(q.deflater ? *q.deflater : Deflater::shared()).compress(*f.data, out)){
+				Logger::error("Can't compress frame of ", f.data->size(), " bytes");
+				return;
+			}
+			f.deflated = std::make_shared<const std::string>(out);
+		} else if (q.deflater && !q.deflater->addHistory(*f.data)){
+			Logger::error("Can't add frame to history of deflater");
+		}
+		f.header_size = makeFrameHeader(f.header, f.header[0] | 0x40, f.deflated->size());
+	}
+
+	void write(const ConnectionPtr &conn, const std::shared_ptr<OutQueue> &q){
+		q->iov.clear();
+		if (canBatch(*q)){
+			unsigned char opcode = q->frames.front().header[0];
+			q->batchData.clear();
+			bool compressed = q->deflate && q->bytes >= DeflateOptions::get().minSize;
+			if (compressed){
+				DeflateMessage msg(q->batchData, q->deflater.get());
+				joinBatch(*q, opcode, msg);
+				if (msg.finish()){
+					opcode |= 0x40;
+				} else {
+					Logger::error("Can't compress batch of ", q->frames.size(), " frames");
+					compressed = false;
+					q->batchData.clear();
+				}
+			}
+			if (!compressed){
+				q->batchData.reserve(q->bytes + q->frames.size() + 1);
+				PlainBatch batch{q->batchData};
+				joinBatch(*q, opcode, batch);
+			}
+
+			size_t header_size = makeFrameHeader(q->batchHeader, opcode, q->batchData.size());
+			q->iov.emplace_back(q->batchHeader.data(), header_size);
+			q->iov.emplace_back(q->batchData.data(), q->batchData.size());
+		} else {
+			for (auto &f : q->frames){
+				if (!f.header_size){
+					q->iov.emplace_back(f.data->data(), f.data->size());
+					continue;
+				}
+
+				// frame is compressed right before writing, dropped frames never get into window of deflater.
+				// Control frames are never compressed
+				if (q->deflate && !(f.header[0] & 0x08)){
+					deflateFrame(*q, f);
+				}
+				auto &payload = f.header[0] & 0x40 ? f.deflated : f.data;
+				q->iov.emplace_back(f.header.data(), f.header_size);
+				q->iov.emplace_back(payload->data(), payload->size());
+			}
+		}
+		q->writing = q->frames.size();
+
+		boost::asio::async_write(conn->socket, q->iov, q->strand.wrap([this, conn, q](const boost::system::error_code &ec, size_t){
+			popWritten(*q);
+			if (ec){
+				dropFrames(*q, false, false);
+				return;
+			}
+
+			if (!q->frames.empty()){
+				write(conn, q);
+			} else if (q->closing){
+				onCloseSent(conn);
+			}
+		}));
+	}
+
+	void enqueue(const ConnectionPtr &conn, const std::shared_ptr<OutQueue> &q, Frame &&f){
+		// close frame goes out even after overflow, so that kicked client learns about it
+		bool close = f.header[0] == 136;
+		if (q->closing || (q->overflowed && !close)){
+			return;
+		}
+
+		if (!close && overLimit(*q, f.size())){
+			if (f.droppable){
+				++stats.dropped;
+				return;
+			}
+
+			dropFrames(*q, true);
+			if (overLimit(*q, f.size())){
+				q->overflowed = true;
+				dropFrames(*q, false);
+				++stats.evicted;
+				if (on_overflow){
+					io_service->post([this, conn]{ on_overflow(conn); });
+				}
+				return;
+			}
+		}
+
+		q->bytes += f.size();
+		++q->count;
+		stats.bytes += f.size();
+		++stats.frames;
+		q->frames.push_back(std::move(f));
+		q->closing = close;
+
+		// frames queued until the end of current handler go out with one write
+		if (!q->writing && !q->dirty){
+			q->dirty = true;
+			q->strand.post([this, conn, q]{
+				q->dirty = false;
+				if (!q->writing && !q->frames.empty()){
+					write(conn, q);
+				}
+			});
+		}
+	}
+
+	//---- connection
+
+	void setTimeout(const ConnectionPtr &conn, long seconds){
+		conn->timer.expires_from_now(boost::posix_time::seconds(seconds));
+		conn->timer.async_wait(conn->queue->strand.wrap([conn](const boost::system::error_code &ec){
+			if (!ec){
+				closeSocket(conn);
+			}
+		}));
+	}
+
+	static void closeSocket(const ConnectionPtr &conn){
+		boost::system::error_code ignored;
+		conn->timer.cancel(ignored);
+		conn->socket.lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+		conn->socket.lowest_layer().close(ignored);
+	}
+
+	void accept(){
+		auto conn = std::make_shared<Connection>(*io_service, context);
+		acceptor->async_accept(conn->socket.lowest_layer(), [this, conn](const boost::system::error_code &ec){
+			if (ec != boost::asio::error::operation_aborted){
+				accept();
+			}
+			if (ec){
+				return;
+			}
+
+			boost::system::error_code ignored;
+			conn->socket.lowest_layer().set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+			auto remote = conn->socket.lowest_layer().remote_endpoint(ignored);
+			conn->remote_endpoint_address = remote.address().to_string();
+			conn->remote_endpoint_port = remote.port();
+
+			conn->queue->strand.dispatch([this, conn]{
+				setTimeout(conn, config.timeout_request);
+				conn->socket.async_handshake(boost::asio::ssl::stream_base::server, conn->queue->strand.wrap(
+						[this, conn](const boost::system::error_code &ec){
+					if (ec){
+						closeSocket(conn);
+						return;
+					}
+					readHandshake(conn);
+				}));
+			});
+		});
+	}
+
+	void readHandshake(const ConnectionPtr &conn){
+		auto request = std::make_shared<boost::asio::streambuf>(maxHandshakeSize);
+		boost::asio::async_read_until(conn->socket, *request, "\r\n\r\n", conn->queue->strand.wrap(
+				[this, conn, request](const boost::system::error_code &ec, size_t size){
+			if (ec){
+				closeSocket(conn);
+				return;
+			}
+
+			auto data = request->data();
+			std::string head(boost::asio::buffers_begin(data), boost::asio::buffers_begin(data) + size);
+			request->consume(size);
+			// client may send frames right after request, they are read later
+			size_t rest = boost::asio::buffer_copy(conn->input.prepare(request->size()), request->data());
+			conn->input.commit(rest);
+
+			if (!parseRequest(*conn, head)){
+				closeSocket(conn);
+				return;
+			}
+			writeHandshake(conn);
+		}));
+	}
+
+	static bool parseRequest(Connection &conn, const std::string &head){
+		std::istringstream in(head);
+		std::string line;
+		if (!std::getline(in, line)){
+			return false;
+		}
+		if (!line.empty() && line.back() == '\r'){
+			line.pop_back();
+		}
+
+		// GET /chat?query HTTP/1.1
+		size_t sp1 = line.find(' ');
+		size_t sp2 = line.rfind(' ');
+		if (sp1 == std::string::npos || sp2 <= sp1){
+			return false;
+		}
+		conn.method = line.substr(0, sp1);
+		auto target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+		size_t query = target.find('?');
+		conn.path = target.substr(0, query);
+		if (query != std::string::npos){
+			conn.query_string = target.substr(query + 1);
+		}
+		size_t slash = line.find('/', sp2);
+		conn.http_version = slash != std::string::npos ? line.substr(slash + 1) : std::string();
+
+		while (std::getline(in, line)){
+			if (!line.empty() && line.back() == '\r'){
+				line.pop_back();
+			}
+			size_t colon = line.find(':');
+			if (colon == std::string::npos){
+				continue;
+			}
+			size_t value = line.find_first_not_of(" \t", colon + 1);
+			conn.header.emplace(line.substr(0, colon), value != std::string::npos ? line.substr(value) : std::string());
+		}
+		return true;
+	}
+
+	/// Value of Sec-WebSocket-Accept for Sec-WebSocket-Key of client
+	static std::string acceptKey(const std::string &key){
+		static const std::string guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		std::string src = key + guid;
+		unsigned char sha[SHA_DIGEST_LENGTH];
+		SHA1((const unsigned char *) src.data(), src.size(), sha);
+		unsigned char out[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+		int n = EVP_EncodeBlock(out, sha, SHA_DIGEST_LENGTH);
+		return std::string((const char *) out, n);
+	}
+
+	/// Values of all headers with name as one comma separated list
+	static std::string headerList(const Header &header, const char *name){
+		std::string res;
+		auto range = header.equal_range(name);
+		for (auto it = range.first; it != range.second; ++it){
+			res += (res.empty() ? "" : ", ") + it->second;
+		}
+		return res;
+	}
+
+	static std::string chooseProtocol(const std::string &offered, const std::vector<std::string> &supported){
+		size_t pos = 0;
+		while (pos < offered.size()){
+			size_t next = offered.find(',', pos);
+			if (next == std::string::npos){
+				next = offered.size();
+			}
+
+			size_t b = offered.find_first_not_of(" \t", pos);
+			size_t e = offered.find_last_not_of(" \t", next - 1);
+			if (b < next && e != std::string::npos && e >= b){
+				auto name = offered.substr(b, e - b + 1);
+				if (std::find(supported.begin(), supported.end(), name) != supported.end()){
+					return name;
+				}
+			}
+			pos = next + 1;
+		}
+		return std::string();
+	}
+
+	static bool hasToken(const Header &header, const char *name, const char *token){
+		auto it = header.find(name);
+		if (it == header.end()){
+			return false;
+		}
+		std::string value = it->second;
+		std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+		return value.find(token) != std::string::npos;
+	}
+
+	void writeHandshake(const ConnectionPtr &conn){
+		Endpoint *ep = nullptr;
+		for (auto &e : endpoints){
+			if (std::regex_match(conn->path, e.first)){
+				ep = e.second;
+				break;
+			}
+		}
+
+		auto key = conn->header.find("Sec-WebSocket-Key");
+		auto version = conn->header.find("Sec-WebSocket-Version");
+		auto response = std::make_shared<std::string>();
+		if (!ep){
+			*response = "HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+		} else if (conn->method != "GET" || key == conn->header.end() || version == conn->header.end() || version->second != "13"
+				|| !hasToken(conn->header, "Upgrade", "websocket")){
+			*response = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n";
+			ep = nullptr;
+		} else {
+			*response = "HTTP/1.1 101 Switching Protocols\r\n"
+					"Upgrade: websocket\r\n"
+					"Connection: Upgrade\r\n"
+					"Sec-WebSocket-Accept: " + acceptKey(key->second) + "\r\n";
+
+			conn->protocol = chooseProtocol(headerList(conn->header, "Sec-WebSocket-Protocol"), ep->protocols);
+			if (!conn->protocol.empty()){
+				*response += "Sec-WebSocket-Protocol: " + conn->protocol + "\r\n";
+			}
+
+			// offers may come in several headers
+			conn->deflate = DeflateParams::negotiate(headerList(conn->header, "Sec-WebSocket-Extensions"));
+			if (conn->deflate.enabled){
+				*response += "Sec-WebSocket-Extensions: " + conn->deflate.responseHeader() + "\r\n";
+				auto &q = *conn->queue;
+				q.deflate = true;
+				if (conn->deflate.contextTakeover){
+					q.deflater.reset(new Deflater(true));
+				}
+			}
+			*response += "\r\n";
+		}
+
+		boost::asio::async_write(conn->socket, boost::asio::buffer(*response), conn->queue->strand.wrap(
+				[this, conn, response, ep](const boost::system::error_code &ec, size_t){
+			if (ec || !ep){
+				closeSocket(conn);
+				return;
+			}
+
+			conn->timer.cancel();
+			conn->endpoint = ep;
+			{
+				std::lock_guard<std::mutex> lock(connectionsMutex);
+				connections.insert(conn);
+			}
+			if (ep->on_open){
+				ep->on_open(conn);
+			}
+			readFrame(conn);
+		}));
+	}
+
+	/// Calls then when input has at least n bytes. Never calls it inline, so frames which
+	/// came in one read don't nest handlers
+	template<typename F>
+	void readAtLeast(const ConnectionPtr &conn, size_t n, F then){
+		if (conn->input.size() >= n){
+			conn->queue->strand.post(then);
+			return;
+		}
+
+		boost::asio::async_read(conn->socket, conn->input, boost::asio::transfer_at_least(n - conn->input.size()),
+				conn->queue->strand.wrap([this, conn, then](const boost::system::error_code &ec, size_t){
+			if (ec){
+				onReadError(conn, ec);
+				return;
+			}
+			then();
+		}));
+	}
+
+	static const unsigned char *inputData(const ConnectionPtr &conn){
+		return boost::asio::buffer_cast<const unsigned char *>(conn->input.data());
+	}
+
+	void readFrame(const ConnectionPtr &conn){
+		readAtLeast(conn, 2, [this, conn]{
+			auto p = inputData(conn);
+			unsigned char fin_rsv_opcode = p[0];
+			unsigned char len = p[1] & 127;
+			// frames of client are masked
+			if (!(p[1] & 128)){
+				fail(conn, 1002, "Unmasked frame");
+				return;
+			}
+
+			size_t length_bytes = len == 126 ? 2 : len == 127 ? 8 : 0;
+			size_t header_size = 2 + length_bytes + 4;
+			readAtLeast(conn, header_size, [this, conn, fin_rsv_opcode, length_bytes, header_size]{
+				auto p = inputData(conn);
+				uint64_t length = p[1] & 127;
+				if (length_bytes){
+					length = 0;
+					for (size_t i = 0; i < length_bytes; ++i){
+						length = (length << 8) | p[2 + i];
+					}
+				}
+				std::array<unsigned char, 4> mask;
+				std::copy(p + header_size - 4, p + header_size, mask.begin());
+
+				bool control = fin_rsv_opcode & 0x08;
+				if (control && (length > 125 || !(fin_rsv_opcode & 0x80))){
+					fail(conn, 1002, "Bad control frame");
+					return;
+				}
+				if (!control && length > config.max_message_size - std::min(conn->fragments.size(), config.max_message_size)){
+					fail(conn, 1009, "Message too big");
+					return;
+				}
+				conn->input.consume(header_size);
+
+				readAtLeast(conn, (size_t) length, [this, conn, fin_rsv_opcode, length, mask]{
+					auto p = inputData(conn);
+					std::string payload(length, '\0');
+					for (size_t i = 0; i < length; ++i){
+						payload[i] = (char) (p[i] ^ mask[i % 4]);
+					}
+					conn->input.consume(length);
+					onFrame(conn, fin_rsv_opcode, std::move(payload));
+				});
+			});
+		});
+	}
+
+	void onFrame(const ConnectionPtr &conn, unsigned char fin_rsv_opcode, std::string &&payload){
+		unsigned char opcode = fin_rsv_opcode & 0x0f;
+		bool fin = fin_rsv_opcode & 0x80;
+		// RSV1 is permessage-deflate, it is set on the first frame of message only
+		if ((fin_rsv_opcode & 0x30) || ((fin_rsv_opcode & 0x40) && (!conn->deflate.enabled || (opcode != 1 && opcode != 2)))){
+			fail(conn, 1002, "Unexpected RSV bits");
+			return;
+		}
+
+		switch (opcode){
+			case 0:
+				if (!conn->fragmentOpcode){
+					fail(conn, 1002, "Unexpected continuation frame");
+					return;
+				}
+				conn->fragments += payload;
+				if (fin){
+					std::string data;
+					data.swap(conn->fragments);
+					unsigned char first = conn->fragmentOpcode;
+					conn->fragmentOpcode = 0;
+					deliver(conn, first | 0x80, std::move(data));
+				}
+				break;
+			case 1:
+			case 2:
+				if (conn->fragmentOpcode){
+					fail(conn, 1002, "Expected continuation frame");
+					return;
+				}
+				if (fin){
+					deliver(conn, fin_rsv_opcode, std::move(payload));
+				} else {
+					conn->fragmentOpcode = fin_rsv_opcode;
+					conn->fragments = std::move(payload);
+				}
+				break;
+			case 8: {
+				int status = payload.size() >= 2 ? ((unsigned char) payload[0] << 8) | (unsigned char) payload[1] : 1005;
+				std::string reason = payload.size() > 2 ? payload.substr(2) : std::string();
+				// reply to close of client, or close of server is answered
+				if (!conn->queue->closing){
+					sendClose(conn, status == 1005 ? 0 : status);
+				}
+				finish(conn, status, reason);
+				runOnStrand(conn->queue, [this, conn]{
+					auto q = conn->queue;
+					if (!q->writing && q->frames.empty()){
+						closeSocket(conn);
+					}
+				});
+				return;
+			}
+			case 9:
+				send(conn, std::make_shared<const std::string>(std::move(payload)), false, 138);
+				break;
+			case 10:
+				break;
+			default:
+				fail(conn, 1002, "Unknown opcode");
+				return;
+		}
+		readFrame(conn);
+	}
+
+	void deliver(const ConnectionPtr &conn, unsigned char fin_rsv_opcode, std::string &&data){
+		auto msg = std::make_shared<Message>();
+		msg->fin_rsv_opcode = fin_rsv_opcode;
+		msg->data = std::move(data);
+		if (conn->endpoint->on_message){
+			conn->endpoint->on_message(conn, msg);
+		}
+	}
+
+	void unregister(const ConnectionPtr &conn){
+		std::lock_guard<std::mutex> lock(connectionsMutex);
+		connections.erase(conn);
+	}
+
+	void finish(const ConnectionPtr &conn, int status, const std::string &reason){
+		if (conn->closed){
+			return;
+		}
+		conn->closed = true;
+		unregister(conn);
+		if (conn->endpoint->on_close){
+			conn->endpoint->on_close(conn, status, reason);
+		}
+	}
+
+	/// Protocol error of client: connection is closed with status, nothing more is read
+	void fail(const ConnectionPtr &conn, int status, const std::string &reason){
+		Logger::warn("Closing connection from ", conn->remote_endpoint_address, ": ", reason);
+		sendClose(conn, status, reason);
+		finish(conn, status, reason);
+	}
+
+	void onReadError(const ConnectionPtr &conn, const boost::system::error_code &ec){
+		if (!conn->closed){
+			conn->closed = true;
+			unregister(conn);
+			if (conn->endpoint->on_error){
+				conn->endpoint->on_error(conn, ec);
+			}
+		}
+		closeSocket(conn);
+	}
+
+	// Close frame is written. Socket is closed when client has answered, otherwise client
+	// gets time to answer
+	void onCloseSent(const ConnectionPtr &conn){
+		if (conn->closed){
+			closeSocket(conn);
+		} else {
+			setTimeout(conn, config.timeout_request);
+		}
+	}
 public:
+	/// Writes header of unmasked frame with payload of length bytes, returns its size
+	static size_t makeFrameHeader(std::array<unsigned char, 10> &hdr, unsigned char fin_rsv_opcode, size_t length){
+		hdr[0] = fin_rsv_opcode;
+		if (length < 126){
+			hdr[1] = (unsigned char) length;
+			return 2;
+		}
+
+		size_t num_bytes = length > 0xffff ? 8 : 2;
+		hdr[1] = num_bytes == 8 ? 127 : 126;
+		for (size_t c = 0; c < num_bytes; ++c){
+			hdr[2 + c] = (unsigned char) (length >> (8*(num_bytes - c - 1)));
+		}
+		return 2 + num_bytes;
+	}
+
 	WebSocketServerEx(const std::string& cert_file, const std::string& private_key_file) :
-			SimpleWeb::SocketServer<SimpleWeb::WSS>(cert_file, private_key_file)
+			io_service(std::make_shared<boost::asio::io_service>()),
+			context(boost::asio::ssl::context::sslv23_server),
+			certFile(cert_file),
+			privateKeyFile(private_key_file)
 	{
-		io_service = std::make_shared<boost::asio::io_service>();
-		internal_io_service = true;
+		using boost::asio::ssl::context;
+		this->context.set_options(context::default_workarounds | context::no_sslv2 | context::no_sslv3
+				| context::no_tlsv1 | context::no_tlsv1_1 | context::single_dh_use);
 	}
 
-	void runWithTimeout(int msec, std::function<void()> func){
+	void runWithTimeout(int msec, std::function<void()> func, boost::asio::io_service *service = nullptr){
 		using namespace boost;
 		using namespace boost::asio;
 
-		auto timer = std::make_shared<deadline_timer>(*io_service);
+		auto timer = std::make_shared<deadline_timer>(service ? *service : *io_service);
 		std::function<void(const system::error_code& ec)> f;
 		f = [func, timer](const system::error_code& ec){
 			if(!ec){
@@ -36,11 +890,11 @@ public:
 		timer->async_wait(f);
 	}
 
-	void runWithInterval(int msec, std::function<void()> func){
+	void runWithInterval(int msec, std::function<void()> func, boost::asio::io_service *service = nullptr){
 		using namespace boost;
 		using namespace boost::asio;
 
-		auto timer = std::make_shared<deadline_timer>(*io_service);
+		auto timer = std::make_shared<deadline_timer>(service ? *service : *io_service);
 		auto f = std::make_shared<std::function<void(const system::error_code& ec)>>();
 		*f = [=](const system::error_code& ec){
 			if(!ec){
@@ -57,4 +911,171 @@ public:
 		timer->async_wait(*f);
 	}
 
+	/// Zero limit means unlimited
+	void setSendQueueLimits(size_t max_bytes, size_t max_frames){
+		maxQueueBytes = max_bytes;
+		maxQueueFrames = max_frames;
+	}
+
+	/// Lets several processes listen on the same port, kernel balances new connections between them
+	void setReusePort(bool enabled){
+		reusePort = enabled;
+	}
+
+	/// Listens on config.port and runs io_service on config.thread_pool_size threads, returns after stop
+	void start(){
+		using namespace boost::asio;
+
+		context.use_certificate_chain_file(certFile);
+		context.use_private_key_file(privateKeyFile, ssl::context::pem);
+
+		endpoints.clear();
+		for (auto &e : endpoint){
+			endpoints.emplace_back(std::regex(e.first), &e.second);
+		}
+
+		if (io_service->stopped()){
+			io_service->reset();
+		}
+		if (config.thread_pool_size > 1){
+			postSends = true;
+		}
+
+		ip::tcp::endpoint endpoint;
+		if (config.address.size() > 0){
+			endpoint = ip::tcp::endpoint(ip::address::from_string(config.address), config.port);
+		} else {
+			endpoint = ip::tcp::endpoint(ip::tcp::v4(), config.port);
+		}
+
+		acceptor = std::unique_ptr<ip::tcp::acceptor>(new ip::tcp::acceptor(*io_service));
+		acceptor->open(endpoint.protocol());
+		acceptor->set_option(socket_base::reuse_address(config.reuse_address));
+		if (reusePort){
+			acceptor->set_option(detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+		}
+		acceptor->bind(endpoint);
+		acceptor->listen();
+
+		accept();
+
+		threads.clear();
+		for (size_t c = 1; c < config.thread_pool_size; ++c){
+			threads.emplace_back([this]{ io_service->run(); });
+		}
+		io_service->run();
+
+		for (auto &t : threads){
+			t.join();
+		}
+	}
+
+	/// Stops accepting and running handlers, start returns after it
+	void stop(){
+		if (acceptor){
+			boost::system::error_code ignored;
+			acceptor->close(ignored);
+		}
+		io_service->stop();
+		std::lock_guard<std::mutex> lock(connectionsMutex);
+		connections.clear();
+	}
+
+	/// Must be enabled when send() is called from threads which don't run io_service.
+	/// Queue of every connection is then touched only on its strand. Always enabled when
+	/// io_service runs on several threads, handlers of one connection may send to another
+	void setPostSends(bool enabled){
+		postSends = enabled;
+	}
+
+	/// Enables sending of packets queued during one handler run as one JSON or CBOR array frame
+	void setFrameBatching(const ConnectionPtr &conn, bool enabled){
+		auto q = getQueue(conn);
+		runOnStrand(q, [q, enabled]{ q->batch = enabled; });
+	}
+
+	/// Sends shared immutable buffer as one frame. Frames queued during one handler run
+	/// are flushed after it with one gathered write, payload is never copied.
+	/// When queue is full, droppable frames are discarded first, then on_overflow is called.
+	/// deflated is data compressed once for all recipients without context takeover, it is sent
+	/// instead of data when connection uses permessage-deflate. Otherwise data is compressed
+	/// for connection when it is written
+	void send(const ConnectionPtr &conn, const Buffer &data, bool droppable = false, unsigned char fin_rsv_opcode = 129,
+			const Buffer &deflated = nullptr){
+		Frame f;
+		f.header_size = makeFrameHeader(f.header, fin_rsv_opcode, data->size());
+		f.data = data;
+		f.deflated = deflated;
+		f.bytes = f.header_size + data->size();
+		f.droppable = droppable;
+
+		auto q = getQueue(conn);
+		if (postSends){
+			q->strand.post([this, conn, q, f]() mutable { enqueue(conn, q, std::move(f)); });
+		} else {
+			enqueue(conn, q, std::move(f));
+		}
+	}
+
+	/// Sends buffer of ready frames as it is, e.g. history of room made by RoomHistory.
+	/// Frames in it must not use context takeover of permessage-deflate and are never batched
+	void sendFramed(const ConnectionPtr &conn, const Buffer &frames){
+		Frame f;
+		f.header[0] = 0;
+		f.header_size = 0;
+		f.data = frames;
+		f.bytes = frames->size();
+		f.droppable = false;
+
+		auto q = getQueue(conn);
+		if (postSends){
+			q->strand.post([this, conn, q, f]() mutable { enqueue(conn, q, std::move(f)); });
+		} else {
+			enqueue(conn, q, std::move(f));
+		}
+	}
+
+	/// Queues close frame after frames already queued, nothing is sent after it. Status 0
+	/// sends close frame without status. Socket is closed when client answers or after timeout
+	void sendClose(const ConnectionPtr &conn, int status, const std::string &reason = ""){
+		auto payload = std::make_shared<std::string>();
+		if (status){
+			payload->push_back((char) (status >> 8));
+			payload->push_back((char) status);
+			payload->append(reason, 0, 123);
+		}
+		send(conn, payload, false, 136);
+	}
+
+	inline void send_close(const ConnectionPtr &conn, int status, const std::string &reason = ""){
+		sendClose(conn, status, reason);
+	}
+
+	/// Drops send queue of closed connection
+	void release(const ConnectionPtr &conn){
+		auto q = getQueue(conn);
+		runOnStrand(q, [this, q]{
+			q->overflowed = true;
+			dropFrames(*q, false);
+		});
+	}
+
+	/// Returns count of frames and bytes waiting to be written to connection
+	QueueStats getQueueDepth(const ConnectionPtr &conn){
+		QueueStats res;
+		res.frames = conn->queue->count;
+		res.bytes = conn->queue->bytes;
+		return res;
+	}
+
+	/// Returns totals over all connections
+	QueueStats getQueueStats(){
+		QueueStats res;
+		res.frames = stats.frames;
+		res.bytes = stats.bytes;
+		res.dropped = stats.dropped;
+		res.evicted = stats.evicted;
+		return res;
+	}
+
 };
@@ -0,0 +1,508 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <jsoncpp/json/json.h>
+
+/// Binary checkpoint of rooms, read straight from mapping of file. File is header, table of
+/// strings and table of rooms with data of every room after it:
+///   header: magic, version, crc32 of the rest of file, generation of state log, counts
+///   strings: offsets of count + 1 ends, then bytes of all strings
+///   room entry: name, owner, history size, counts of its arrays and offset of its data
+///   room data: arrays of banned nicks, banned IPs, banned uids, moderators, members info,
+///              then history as packets with length before each, every part aligned to 4 bytes
+/// Strings are referred by index, so color or nick which many rooms have is stored once.
+/// Arrays of uids and stored members are sorted by uid. Numbers are little-endian words as
+/// on hosts which run server. Reader checks crc and bounds of every part once when file is
+/// opened, after that it only reads words, strings are views into mapping
+
+/// Contents of one room, made by thread of room and written by SnapshotWriter
+struct SnapshotRoom {
+	struct Info {
+		uint32_t uid;
+		std::string nick;
+		bool girl;
+		std::string color;
+	};
+
+	std::string name;
+	uint32_t owner = (uint32_t) -1;
+	uint32_t historySize = 0;
+	std::vector<std::string> bannedNicks;
+	std::vector<std::string> bannedIps;
+	std::vector<uint32_t> bannedUids;
+	std::vector<uint32_t> moderators;
+	std::vector<Info> membersInfo;
+	std::vector<std::shared_ptr<const std::string>> history;
+
+	/// Room of rooms.dat in JSON, as Room::serialize wrote it
+	static SnapshotRoom fromJson(const Json::Value &val){
+		SnapshotRoom r;
+		r.name = val["name"].asString();
+		r.owner = val["owner_id"].asUInt();
+		r.historySize = val.get("history_size", 0).asUInt();
+		for (auto &v : val["bannedNicks"]){
+			r.bannedNicks.push_back(v.asString());
+		}
+		for (auto &v : val["bannedIps"]){
+			r.bannedIps.push_back(v.asString());
+		}
+		for (auto &v : val["bannedUids"]){
+			r.bannedUids.push_back(v.asUInt());
+		}
+		for (auto &v : val["moderators"]){
+			r.moderators.push_back(v.asUInt());
+		}
+		for (auto &v : val["members_info"]){
+			r.membersInfo.push_back(Info{ v["user_id"].asUInt(), v["nick"].asString(), v["girl"].asBool(), v["color"].asString() });
+		}
+		for (auto &v : val["history"]){
+			r.history.push_back(std::make_shared<const std::string>(v.asString()));
+		}
+		return r;
+	}
+};
+
+namespace snapshot_detail {
+	static const char magic[8] = { 'W', 'S', 'S', 'N', 'A', 'P', '\r', '\n' };
+	static const uint32_t version = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t crc;
+		uint64_t walGeneration;
+		uint32_t roomCount;
+		uint32_t stringCount;
+		uint64_t stringsOffset;
+		uint64_t roomsOffset;
+		uint64_t size;
+	};
+
+	struct RoomEntry {
+		uint32_t name;
+		uint32_t owner;
+		uint32_t historySize;
+		uint32_t bannedNicks;
+		uint32_t bannedIps;
+		uint32_t bannedUids;
+		uint32_t moderators;
+		uint32_t membersInfo;
+		uint32_t history;
+		uint32_t reserved;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct InfoEntry {
+		uint32_t uid;
+		uint32_t nick;
+		uint32_t color;
+		uint32_t flags;
+	};
+
+	inline uint32_t checksum(const char *data, size_t size){
+		uLong crc = crc32(0, nullptr, 0);
+		while (size > 0){
+			uInt n = (uInt) std::min<size_t>(size, 1u << 30);
+			crc = crc32(crc, (const Bytef *) data, n);
+			data += n;
+			size -= n;
+		}
+		return (uint32_t) crc;
+	}
+
+	inline size_t padded(size_t size){
+		return (size + 3) & ~(size_t) 3;
+	}
+}
+
+/// Builds snapshot in memory, used by checkpoint worker
+class SnapshotWriter {
+private:
+	std::string strings;
+	std::vector<uint32_t> ends;
+	std::unordered_map<std::string, uint32_t> index;
+	std::vector<snapshot_detail::RoomEntry> entries;
+	std::string data;
+
+	uint32_t intern(const std::string &s){
+		auto it = index.find(s);
+		if (it != index.end()){
+			return it->second;
+		}
+		uint32_t idx = (uint32_t) ends.size();
+		strings += s;
+		ends.push_back((uint32_t) strings.size());
+		index.emplace(s, idx);
+		return idx;
+	}
+
+	void put(uint32_t v){
+		data.append((const char *) &v, sizeof(v));
+	}
+public:
+	void addRoom(const SnapshotRoom &r){
+		using namespace snapshot_detail;
+		RoomEntry e;
+		memset(&e, 0, sizeof(e));
+		e.name = intern(r.name);
+		e.owner = r.owner;
+		e.historySize = r.historySize;
+		e.offset = data.size();
+
+		auto nicks = r.bannedNicks;
+		std::sort(nicks.begin(), nicks.end());
+		for (auto &s : nicks){
+			put(intern(s));
+		}
+		e.bannedNicks = (uint32_t) nicks.size();
+
+		auto ips = r.bannedIps;
+		std::sort(ips.begin(), ips.end());
+		for (auto &s : ips){
+			put(intern(s));
+		}
+		e.bannedIps = (uint32_t) ips.size();
+
+		for (auto *arr : { &r.bannedUids, &r.moderators }){
+			auto sorted = *arr;
+			std::sort(sorted.begin(), sorted.end());
+			for (auto v : sorted){
+				put(v);
+			}
+		}
+		e.bannedUids = (uint32_t) r.bannedUids.size();
+		e.moderators = (uint32_t) r.moderators.size();
+
+		std::vector<const SnapshotRoom::Info *> infos;
+		for (auto &i : r.membersInfo){
+			infos.push_back(&i);
+		}
+		std::sort(infos.begin(), infos.end(), [](auto a, auto b){ return a->uid < b->uid; });
+		for (auto i : infos){
+			InfoEntry ie{ i->uid, intern(i->nick), intern(i->color), i->girl ? 1u : 0u };
+			data.append((const char *) &ie, sizeof(ie));
+		}
+		e.membersInfo = (uint32_t) infos.size();
+
+		for (auto &h : r.history){
+			put((uint32_t) h->size());
+			data += *h;
+			data.resize(padded(data.size()));
+		}
+		e.history = (uint32_t) r.history.size();
+
+		e.size = data.size() - e.offset;
+		entries.push_back(e);
+	}
+
+	/// Contents of file
+	std::string finish(uint64_t wal_generation){
+		using namespace snapshot_detail;
+		Header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, magic, sizeof(magic));
+		h.version = version;
+		h.walGeneration = wal_generation;
+		h.roomCount = (uint32_t) entries.size();
+		h.stringCount = (uint32_t) ends.size();
+
+		std::string res((const char *) &h, sizeof(h));
+		h.stringsOffset = res.size();
+		uint32_t zero = 0;
+		res.append((const char *) &zero, sizeof(zero));
+		res.append((const char *) ends.data(), ends.size() * sizeof(uint32_t));
+		res += strings;
+		res.resize(padded(res.size()));
+
+		// room data follows the table, offsets in entries become offsets in file
+		h.roomsOffset = res.size();
+		uint64_t dataOffset = h.roomsOffset + entries.size() * sizeof(RoomEntry);
+		for (auto e : entries){
+			e.offset += dataOffset;
+			res.append((const char *) &e, sizeof(e));
+		}
+		res += data;
+
+		h.size = res.size();
+		memcpy(&res[0], &h, sizeof(h));
+		h.crc = checksum(res.data() + sizeof(h), res.size() - sizeof(h));
+		memcpy(&res[0], &h, sizeof(h));
+		return res;
+	}
+};
+
+/// Mapped snapshot file
+class SnapshotReader {
+public:
+	class Room;
+private:
+	void *map = MAP_FAILED;
+	size_t mapSize = 0;
+	const char *base = nullptr;
+	snapshot_detail::Header header;
+	const char *stringData = nullptr;
+	std::string error;
+
+	template<typename T>
+	T read(uint64_t offset) const {
+		T v;
+		memcpy(&v, base + offset, sizeof(T));
+		return v;
+	}
+
+	bool fail(const std::string &msg){
+		error = msg;
+		return false;
+	}
+
+	bool checkRoom(const snapshot_detail::RoomEntry &e);
+public:
+	SnapshotReader(){}
+	SnapshotReader(const SnapshotReader &) = delete;
+
+	~SnapshotReader(){
+		if (map != MAP_FAILED){
+			munmap(map, mapSize);
+		}
+	}
+
+	/// True if file begins as snapshot, otherwise it may be rooms.dat in JSON
+	static bool isSnapshot(const std::string &path){
+		char buf[sizeof(snapshot_detail::magic)];
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0){
+			return false;
+		}
+		bool res = ::read(fd, buf, sizeof(buf)) == (ssize_t) sizeof(buf) && memcmp(buf, snapshot_detail::magic, sizeof(buf)) == 0;
+		close(fd);
+		return res;
+	}
+
+	/// Maps file and checks it, getError tells what is wrong when it returns false
+	bool open(const std::string &path){
+		using namespace snapshot_detail;
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0){
+			return fail("can't open " + path);
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header)){
+			close(fd);
+			return fail("file is too short");
+		}
+		mapSize = (size_t) st.st_size;
+		map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED){
+			return fail("can't map " + path);
+		}
+		madvise(map, mapSize, MADV_WILLNEED);
+		base = (const char *) map;
+
+		header = read<Header>(0);
+		if (memcmp(header.magic, magic, sizeof(magic)) != 0){
+			return fail("not a snapshot");
+		}
+		if (header.version != version){
+			return fail("unknown version " + std::to_string(header.version));
+		}
+		if (header.size != mapSize){
+			return fail("file is cut");
+		}
+		if (checksum(base + sizeof(Header), mapSize - sizeof(Header)) != header.crc){
+			return fail("checksum mismatch");
+		}
+
+		uint64_t ends = header.stringsOffset;
+		if (ends > mapSize || (mapSize - ends) / sizeof(uint32_t) < (uint64_t) header.stringCount + 1){
+			return fail("string table is out of file");
+		}
+		stringData = base + ends + ((uint64_t) header.stringCount + 1) * sizeof(uint32_t);
+		uint32_t last = 0;
+		for (uint32_t i = 0; i <= header.stringCount; ++i){
+			uint32_t end = read<uint32_t>(ends + (uint64_t) i * sizeof(uint32_t));
+			if (end < last){
+				return fail("broken string table");
+			}
+			last = end;
+		}
+		if (last > (uint64_t) (base + mapSize - stringData)){
+			return fail("strings are out of file");
+		}
+
+		if (header.roomsOffset > mapSize || (mapSize - header.roomsOffset) / sizeof(RoomEntry) < header.roomCount){
+			return fail("room table is out of file");
+		}
+		for (uint32_t i = 0; i < header.roomCount; ++i){
+			if (!checkRoom(read<RoomEntry>(header.roomsOffset + (uint64_t) i * sizeof(RoomEntry)))){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	inline const std::string &getError() const { return error; }
+	inline uint64_t getWalGeneration() const { return header.walGeneration; }
+	inline size_t rooms() const { return header.roomCount; }
+
+	boost::string_view string(uint32_t idx) const {
+		uint32_t begin = read<uint32_t>(header.stringsOffset + (uint64_t) idx * sizeof(uint32_t));
+		uint32_t end = read<uint32_t>(header.stringsOffset + ((uint64_t) idx + 1) * sizeof(uint32_t));
+		return boost::string_view(stringData + begin, end - begin);
+	}
+
+	Room room(size_t i) const;
+};
+
+/// View of room in mapped snapshot, valid while reader lives
+class SnapshotReader::Room {
+private:
+	friend class SnapshotReader;
+
+	const SnapshotReader &rd;
+	snapshot_detail::RoomEntry e;
+
+	Room(const SnapshotReader &r, const snapshot_detail::RoomEntry &entry) : rd(r), e(entry){}
+
+	inline uint64_t uidsOffset() const { return e.offset + ((uint64_t) e.bannedNicks + e.bannedIps) * sizeof(uint32_t); }
+	inline uint64_t infosOffset() const { return uidsOffset() + ((uint64_t) e.bannedUids + e.moderators) * sizeof(uint32_t); }
+	inline uint64_t historyOffset() const { return infosOffset() + (uint64_t) e.membersInfo * sizeof(snapshot_detail::InfoEntry); }
+public:
+	inline boost::string_view name() const { return rd.string(e.name); }
+	inline uint32_t owner() const { return e.owner; }
+	inline uint32_t historySize() const { return e.historySize; }
+
+	inline size_t bannedNicks() const { return e.bannedNicks; }
+	inline boost::string_view bannedNick(size_t i) const { return rd.string(rd.read<uint32_t>(e.offset + i * sizeof(uint32_t))); }
+
+	inline size_t bannedIps() const { return e.bannedIps; }
+	inline boost::string_view bannedIp(size_t i) const {
+		return rd.string(rd.read<uint32_t>(e.offset + ((uint64_t) e.bannedNicks + i) * sizeof(uint32_t)));
+	}
+
+	inline size_t bannedUids() const { return e.bannedUids; }
+	inline uint32_t bannedUid(size_t i) const { return rd.read<uint32_t>(uidsOffset() + i * sizeof(uint32_t)); }
+
+	inline size_t moderators() const { return e.moderators; }
+	inline uint32_t moderator(size_t i) const { return rd.read<uint32_t>(uidsOffset() + ((uint64_t) e.bannedUids + i) * sizeof(uint32_t)); }
+
+	inline size_t membersInfo() const { return e.membersInfo; }
+	/// Calls func(uid, nick, girl, color) for every stored member, ascending by uid
+	template<typename F>
+	void forEachMemberInfo(F func) const {
+		uint64_t off = infosOffset();
+		for (uint32_t i = 0; i < e.membersInfo; ++i, off += sizeof(snapshot_detail::InfoEntry)){
+			auto ie = rd.read<snapshot_detail::InfoEntry>(off);
+			func(ie.uid, rd.string(ie.nick), (ie.flags & 1) != 0, rd.string(ie.color));
+		}
+	}
+
+	inline size_t history() const { return e.history; }
+	/// Calls func(packet) for every packet of history, the oldest first
+	template<typename F>
+	void forEachHistory(F func) const {
+		uint64_t off = historyOffset();
+		for (uint32_t i = 0; i < e.history; ++i){
+			uint32_t len = rd.read<uint32_t>(off);
+			func(boost::string_view(rd.base + off + sizeof(uint32_t), len));
+			off += snapshot_detail::padded(sizeof(uint32_t) + len);
+		}
+	}
+
+	/// Room as Room::serialize writes it to rooms.dat in JSON
+	Json::Value toJson() const {
+		Json::Value val;
+		val["name"] = name().to_string();
+		val["owner_id"] = owner();
+		val["history_size"] = historySize();
+
+		auto &nicks = val["bannedNicks"] = Json::Value(Json::arrayValue);
+		for (size_t i = 0; i < bannedNicks(); ++i){
+			nicks.append(bannedNick(i).to_string());
+		}
+		auto &ips = val["bannedIps"] = Json::Value(Json::arrayValue);
+		for (size_t i = 0; i < bannedIps(); ++i){
+			ips.append(bannedIp(i).to_string());
+		}
+		auto &uids = val["bannedUids"] = Json::Value(Json::arrayValue);
+		for (size_t i = 0; i < bannedUids(); ++i){
+			uids.append(bannedUid(i));
+		}
+		auto &moders = val["moderators"] = Json::Value(Json::arrayValue);
+		for (size_t i = 0; i < moderators(); ++i){
+			moders.append(moderator(i));
+		}
+
+		auto &hist = val["history"] = Json::Value(Json::arrayValue);
+		forEachHistory([&](boost::string_view p){
+			hist.append(p.to_string());
+		});
+		auto &mi = val["members_info"] = Json::Value(Json::arrayValue);
+		forEachMemberInfo([&](uint32_t uid, boost::string_view nick, bool girl, boost::string_view color){
+			Json::Value v(Json::objectValue);
+			v["user_id"] = uid;
+			v["nick"] = nick.to_string();
+			v["girl"] = girl;
+			v["color"] = color.to_string();
+			mi.append(v);
+		});
+		return val;
+	}
+};
+
+inline SnapshotReader::Room SnapshotReader::room(size_t i) const {
+	return Room(*this, read<snapshot_detail::RoomEntry>(header.roomsOffset + i * sizeof(snapshot_detail::RoomEntry)));
+}
+
+inline bool SnapshotReader::checkRoom(const snapshot_detail::RoomEntry &e){
+	using namespace snapshot_detail;
+	if (e.offset > mapSize || e.size > mapSize - e.offset){
+		return fail("room data is out of file");
+	}
+	if (e.name >= header.stringCount){
+		return fail("bad name of room");
+	}
+
+	Room r(*this, e);
+	uint64_t fixed = r.historyOffset() - e.offset;
+	if (fixed > e.size){
+		return fail("arrays of room are out of its data");
+	}
+	for (size_t i = 0; i < (size_t) e.bannedNicks + e.bannedIps; ++i){
+		if (read<uint32_t>(e.offset + i * sizeof(uint32_t)) >= header.stringCount){
+			return fail("bad string of room");
+		}
+	}
+	for (uint64_t off = r.infosOffset(); off < r.historyOffset(); off += sizeof(InfoEntry)){
+		auto ie = read<InfoEntry>(off);
+		if (ie.nick >= header.stringCount || ie.color >= header.stringCount){
+			return fail("bad string of member");
+		}
+	}
+
+	uint64_t off = r.historyOffset(), end = e.offset + e.size;
+	for (uint32_t i = 0; i < e.history; ++i){
+		if (end - off < sizeof(uint32_t) || read<uint32_t>(off) > end - off - sizeof(uint32_t)){
+			return fail("history is out of room data");
+		}
+		off += padded(sizeof(uint32_t) + read<uint32_t>(off));
+		off = std::min(off, end);
+	}
+	return true;
+}
+
+#endif //SNAPSHOT_HPP
@@ -0,0 +1,317 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <cstdlib>
+
+#include "../snapshot.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Writes random rooms to snapshot and reads them back, also through JSON export and import,
+// and checks that broken files are refused. Then measures startup: rooms.dat in JSON parsed
+// by Json::Reader into sets of rooms, as Server::deserialize did, and mapped snapshot.
+
+static const string file = "snapshot_test.tmp";
+
+// Sets and maps which Room fills on load
+struct LoadedRoom {
+	string name;
+	uint32_t owner;
+	unordered_set<string> bannedNicks;
+	unordered_set<string> bannedIps;
+	unordered_set<uint32_t> bannedUids;
+	unordered_set<uint32_t> moderators;
+	struct Info {
+		uint32_t uid;
+		string nick;
+		bool girl;
+		string color;
+	};
+	unordered_map<uint32_t, Info> membersInfo;
+	vector<shared_ptr<const string>> history;
+};
+
+static SnapshotRoom randomRoom(mt19937 &rnd, size_t i, size_t infos, size_t history){
+	static const char *const colors[] = { "gray", "red", "blue", "green", "#ff8800" };
+	SnapshotRoom r;
+	r.name = "room" + to_string(i);
+	r.owner = rnd() % 100000;
+	r.historySize = 50;
+	for (size_t n = rnd() % 10; n > 0; --n){
+		r.bannedNicks.push_back("nick" + to_string(rnd() % 100000));
+		r.bannedIps.push_back("10.0." + to_string(rnd() % 256) + "." + to_string(rnd() % 256));
+		r.bannedUids.push_back(rnd() % 100000);
+	}
+	for (size_t n = rnd() % 4; n > 0; --n){
+		r.moderators.push_back(rnd() % 100000);
+	}
+	unordered_set<uint32_t> uids;
+	for (size_t n = 0; n < infos; ++n){
+		uint32_t uid = rnd() % 1000000;
+		if (uids.insert(uid).second){
+			r.membersInfo.push_back(SnapshotRoom::Info{ uid, "nick" + to_string(uid), uid % 2 == 0, colors[uid % 5] });
+		}
+	}
+	for (size_t n = 0; n < history; ++n){
+		r.history.push_back(make_shared<const string>("{\"color\":\"gray\",\"from\":\"nick" + to_string(rnd() % 1000)
+			+ "\",\"message\":\"" + string(rnd() % 200, 'a' + n % 26) + "\",\"target\":\"" + r.name + "\",\"type\":2}\n"));
+	}
+	return r;
+}
+
+static bool writeFile(const string &path, const string &data){
+	ofstream ofs(path, ios::binary);
+	ofs.write(data.data(), data.size());
+	return (bool) ofs;
+}
+
+// Rooms of JSON are compared as JSON, sets in it are sorted
+static Json::Value normalized(Json::Value v){
+	for (auto key : { "bannedNicks", "bannedIps", "bannedUids", "moderators" }){
+		vector<Json::Value> items(v[key].begin(), v[key].end());
+		sort(items.begin(), items.end());
+		v[key] = Json::Value(Json::arrayValue);
+		for (auto &i : items){
+			v[key].append(i);
+		}
+	}
+	vector<Json::Value> infos(v["members_info"].begin(), v["members_info"].end());
+	sort(infos.begin(), infos.end(), [](auto &a, auto &b){ return a["user_id"].asUInt() < b["user_id"].asUInt(); });
+	v["members_info"] = Json::Value(Json::arrayValue);
+	for (auto &i : infos){
+		v["members_info"].append(i);
+	}
+	return v;
+}
+
+static Json::Value toJson(const SnapshotRoom &r){
+	Json::Value v;
+	v["name"] = r.name;
+	v["owner_id"] = r.owner;
+	v["history_size"] = r.historySize;
+	for (auto &s : r.bannedNicks){
+		v["bannedNicks"].append(s);
+	}
+	for (auto &s : r.bannedIps){
+		v["bannedIps"].append(s);
+	}
+	for (auto u : r.bannedUids){
+		v["bannedUids"].append(u);
+	}
+	for (auto u : r.moderators){
+		v["moderators"].append(u);
+	}
+	for (auto &i : r.membersInfo){
+		Json::Value mi(Json::objectValue);
+		mi["user_id"] = i.uid;
+		mi["nick"] = i.nick;
+		mi["girl"] = i.girl;
+		mi["color"] = i.color;
+		v["members_info"].append(mi);
+	}
+	v["history"] = Json::Value(Json::arrayValue);
+	for (auto &h : r.history){
+		v["history"].append(*h);
+	}
+	for (auto key : { "bannedNicks", "bannedIps", "bannedUids", "moderators", "members_info" }){
+		if (v[key].isNull()){
+			v[key] = Json::Value(Json::arrayValue);
+		}
+	}
+	return normalized(v);
+}
+
+static bool checkCorrectness(){
+	mt19937 rnd(1);
+	vector<SnapshotRoom> rooms;
+	SnapshotWriter wr;
+	for (size_t i = 0; i < 200; ++i){
+		rooms.push_back(randomRoom(rnd, i, rnd() % 50, rnd() % 30));
+		wr.addRoom(rooms.back());
+	}
+	rooms.push_back(SnapshotRoom());
+	wr.addRoom(rooms.back());
+	string data = wr.finish(42);
+	writeFile(file, data);
+
+	if (!SnapshotReader::isSnapshot(file)){
+		cout << "Snapshot isn't recognized" << endl;
+		return false;
+	}
+	{
+		SnapshotReader snap;
+		if (!snap.open(file) || snap.rooms() != rooms.size() || snap.getWalGeneration() != 42){
+			cout << "Can't read snapshot: " << snap.getError() << endl;
+			return false;
+		}
+		for (size_t i = 0; i < rooms.size(); ++i){
+			auto r = snap.room(i);
+			if (normalized(r.toJson()) != toJson(rooms[i])){
+				cout << "Room " << i << " differs" << endl;
+				return false;
+			}
+			// import of exported JSON gives the same room
+			if (toJson(SnapshotRoom::fromJson(r.toJson())) != toJson(rooms[i])){
+				cout << "Room " << i << " differs after import" << endl;
+				return false;
+			}
+		}
+	}
+
+	// every broken file is refused
+	auto refused = [&](const string &broken, const char *what){
+		writeFile(file, broken);
+		SnapshotReader snap;
+		if (snap.open(file)){
+			cout << "Accepted " << what << endl;
+			return false;
+		}
+		return true;
+	};
+	string flipped = data;
+	flipped[data.size() / 2] ^= 1;
+	string version = data;
+	version[8] = 2;
+	if (!refused(data.substr(0, data.size() - 1), "cut file") || !refused(flipped, "changed byte")
+			|| !refused(version, "unknown version") || !refused("WSSNAP\r\n", "header only")){
+		return false;
+	}
+
+	// bounds are checked even when checksum is right
+	string bad = data;
+	snapshot_detail::Header h;
+	memcpy(&h, bad.data(), sizeof(h));
+	h.roomCount += 1000;
+	memcpy(&bad[0], &h, sizeof(h));
+	if (!refused(bad, "room table out of file")){
+		return false;
+	}
+	return true;
+}
+
+static void fill(LoadedRoom &r, const SnapshotReader::Room &s){
+	r.name = s.name().to_string();
+	r.owner = s.owner();
+	r.bannedNicks.reserve(s.bannedNicks());
+	for (size_t i = 0; i < s.bannedNicks(); ++i){
+		r.bannedNicks.insert(s.bannedNick(i).to_string());
+	}
+	r.bannedIps.reserve(s.bannedIps());
+	for (size_t i = 0; i < s.bannedIps(); ++i){
+		r.bannedIps.insert(s.bannedIp(i).to_string());
+	}
+	for (size_t i = 0; i < s.bannedUids(); ++i){
+		r.bannedUids.insert(s.bannedUid(i));
+	}
+	for (size_t i = 0; i < s.moderators(); ++i){
+		r.moderators.insert(s.moderator(i));
+	}
+	r.membersInfo.reserve(s.membersInfo());
+	s.forEachMemberInfo([&](uint32_t uid, boost::string_view nick, bool girl, boost::string_view color){
+		r.membersInfo[uid] = LoadedRoom::Info{ uid, nick.to_string(), girl, color.to_string() };
+	});
+	s.forEachHistory([&](boost::string_view p){
+		r.history.push_back(make_shared<const string>(p.data(), p.size()));
+	});
+}
+
+static void fill(LoadedRoom &r, const Json::Value &v){
+	r.name = v["name"].asString();
+	r.owner = v["owner_id"].asUInt();
+	for (auto &s : v["bannedNicks"]){
+		r.bannedNicks.insert(s.asString());
+	}
+	for (auto &s : v["bannedIps"]){
+		r.bannedIps.insert(s.asString());
+	}
+	for (auto &u : v["bannedUids"]){
+		r.bannedUids.insert(u.asUInt());
+	}
+	for (auto &u : v["moderators"]){
+		r.moderators.insert(u.asUInt());
+	}
+	for (auto &i : v["members_info"]){
+		uint32_t uid = i["user_id"].asUInt();
+		r.membersInfo[uid] = LoadedRoom::Info{ uid, i["nick"].asString(), i["girl"].asBool(), i["color"].asString() };
+	}
+	for (auto &h : v["history"]){
+		r.history.push_back(make_shared<const string>(h.asString()));
+	}
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	// stored info of members who left is the bulk of state
+	size_t roomCount = rounds * 100;
+	mt19937 rnd(2);
+	SnapshotWriter wr;
+	Json::Value json;
+	json["rooms"] = Json::Value(Json::arrayValue);
+	for (size_t i = 0; i < roomCount; ++i){
+		auto r = randomRoom(rnd, i, 200, 50);
+		wr.addRoom(r);
+		json["rooms"].append(toJson(r));
+	}
+	string data = wr.finish(1);
+	writeFile(file, data);
+	{
+		ofstream ofs(file + ".json");
+		Json::StyledStreamWriter jw;
+		jw.write(ofs, json);
+	}
+	json = Json::Value();
+
+	auto start = steady_clock::now();
+	size_t jsonMembers = 0;
+	{
+		vector<LoadedRoom> loaded;
+		ifstream ifs(file + ".json");
+		Json::Value val;
+		Json::Reader rd;
+		rd.parse(ifs, val);
+		loaded.resize(val["rooms"].size());
+		for (size_t i = 0; i < loaded.size(); ++i){
+			fill(loaded[i], val["rooms"][(Json::ArrayIndex) i]);
+			jsonMembers += loaded[i].membersInfo.size();
+		}
+	}
+	double jsonMs = duration<double, milli>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	size_t snapMembers = 0;
+	{
+		vector<LoadedRoom> loaded;
+		SnapshotReader snap;
+		snap.open(file);
+		loaded.resize(snap.rooms());
+		for (size_t i = 0; i < loaded.size(); ++i){
+			fill(loaded[i], snap.room(i));
+			snapMembers += loaded[i].membersInfo.size();
+		}
+	}
+	double snapMs = duration<double, milli>(steady_clock::now() - start).count();
+
+	ifstream jf(file + ".json", ios::ate);
+	size_t jsonSize = (size_t) jf.tellg();
+	cout << roomCount << " rooms, " << snapMembers << " stored members" << (jsonMembers == snapMembers ? "" : " (JSON differs)") << endl;
+	cout << setw(10) << left << "format" << right << setw(12) << "bytes" << setw(12) << "load ms" << endl;
+	cout << setw(10) << left << "json" << right << setw(12) << jsonSize << setw(12) << fixed << setprecision(1) << jsonMs << endl;
+	cout << setw(10) << left << "snapshot" << right << setw(12) << data.size() << setw(12) << snapMs << endl;
+
+	system(("rm -f " + file + " " + file + ".json").c_str());
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "../snapshot.hpp"
+
+using namespace std;
+
+// Converts checkpoint of server between binary snapshot and JSON of rooms.dat:
+//   snapshot_tool export rooms.dat rooms.json
+//   snapshot_tool import rooms.json rooms.dat
+// Server reads both formats, so JSON of older versions may also be used as it is.
+// Run it on a copy or while server is stopped, server replaces checkpoint in background.
+
+static int exportJson(const string &from, const string &to){
+	SnapshotReader snap;
+	if (!snap.open(from)){
+		cerr << "Can't read snapshot " << from << ": " << snap.getError() << endl;
+		return 1;
+	}
+
+	Json::Value val;
+	val["wal_generation"] = (Json::UInt64) snap.getWalGeneration();
+	auto &rooms = val["rooms"] = Json::Value(Json::arrayValue);
+	for (size_t i = 0; i < snap.rooms(); ++i){
+		rooms.append(snap.room(i).toJson());
+	}
+
+	ofstream ofs(to);
+	Json::StyledStreamWriter wr;
+	wr.write(ofs, val);
+	if (!ofs){
+		cerr << "Can't write " << to << endl;
+		return 1;
+	}
+	cout << "Exported " << snap.rooms() << " rooms" << endl;
+	return 0;
+}
+
+static int importJson(const string &from, const string &to){
+	ifstream ifs(from);
+	Json::Value val;
+	Json::Reader rd;
+	if (!ifs || !rd.parse(ifs, val)){
+		cerr << "Can't parse " << from << ": " << rd.getFormattedErrorMessages() << endl;
+		return 1;
+	}
+
+	SnapshotWriter wr;
+	for (auto &r : val["rooms"]){
+		wr.addRoom(SnapshotRoom::fromJson(r));
+	}
+	string data = wr.finish(val["wal_generation"].asUInt64());
+
+	ofstream ofs(to, ios::binary);
+	ofs.write(data.data(), data.size());
+	if (!ofs){
+		cerr << "Can't write " << to << endl;
+		return 1;
+	}
+	cout << "Imported " << val["rooms"].size() << " rooms, " << data.size() << " bytes" << endl;
+	return 0;
+}
+
+int main(int argc, char **argv){
+	string cmd = argc > 1 ? argv[1] : "";
+	if (argc != 4 || (cmd != "export" && cmd != "import")){
+		cerr << "Usage: " << argv[0] << " export <snapshot> <json>" << endl;
+		cerr << "       " << argv[0] << " import <json> <snapshot>" << endl;
+		return 2;
+	}
+	return cmd == "export" ? exportJson(argv[2], argv[3]) : importJson(argv[2], argv[3]);
+}
@@ -0,0 +1,375 @@
+#ifndef STATE_LOG_HPP
+#define STATE_LOG_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cbor.hpp"
+#include "logger.hpp"
+
+/// Write-ahead log of server state. Every change of room set, bans, moderators and stored
+/// member info is appended as a short CBOR record, and checkpoint file (rooms.dat) is written
+/// from time to time in background. Log is split into files by generation: checkpoint starts
+/// a new generation before it takes state of rooms and stores its number, log files of older
+/// generations are removed when checkpoint is on disk. At start state is loaded from checkpoint,
+/// then records of its generation and later ones are applied. Record sets value instead of
+/// changing it, so record which checkpoint already contains is applied once more harmlessly.
+///
+/// Appending only copies record into buffer under mutex. Thread of log writes buffer and calls
+/// fdatasync every flush interval, so crash loses changes of the last interval at most, and
+/// shutdown only writes what is buffered
+
+struct StateLogOptions {
+	std::string dir = ".";
+	std::string checkpoint = "rooms.dat";
+	int flushInterval = 200;
+	// checkpoint is written when log has grown and interval passed, or when log is that big
+	int checkpointInterval = 300;
+	size_t checkpointSize = 16*1024*1024;
+};
+
+class StateLog {
+public:
+	enum class Op : uint8_t {
+		room_created = 1,
+		room_removed,
+		// all settings of room, got from other process of cluster
+		settings,
+		owner,
+		history_size,
+		ban_nick,
+		unban_nick,
+		ban_ip,
+		unban_ip,
+		ban_uid,
+		unban_uid,
+		add_moder,
+		remove_moder,
+		member_info,
+	};
+private:
+	// record: size of payload, crc32 of payload, payload
+	static const size_t headerSize = 8;
+
+	struct Chunk {
+		uint64_t generation;
+		std::string data;
+	};
+
+	std::string dir;
+	int interval;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<Chunk> pending;
+	uint64_t generation;
+	// appended to current generation, checkpoint is due when it grows
+	size_t appended = 0;
+	bool stopping = false;
+	std::thread thread;
+
+	// file of log is written under it, files of checkpointed generations are removed under it
+	std::mutex fileMtx;
+	int fd = -1;
+	uint64_t fdGeneration = 0;
+	// records of older generations are in checkpoint, their buffers are dropped
+	uint64_t removedBefore = 0;
+
+	static std::string path(const std::string &dir, uint64_t gen){
+		char buf[32];
+		snprintf(buf, sizeof(buf), "/%020llu.wal", (unsigned long long) gen);
+		return dir + buf;
+	}
+
+	static uint32_t checksum(boost::string_view payload){
+		return (uint32_t) crc32(0, (const Bytef *) payload.data(), (uInt) payload.size());
+	}
+
+	void closeFile(){
+		if (fd >= 0){
+			fdatasync(fd);
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	void writeQueued(){
+		std::deque<Chunk> chunks;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			chunks.swap(pending);
+		}
+		if (chunks.empty()){
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(fileMtx);
+		for (auto &c : chunks){
+			if (c.generation < removedBefore){
+				continue;
+			}
+			if (fd < 0 || c.generation != fdGeneration){
+				closeFile();
+				fdGeneration = c.generation;
+				fd = open(path(dir, fdGeneration).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+				if (fd < 0){
+					Logger::error("Can't open state log ", path(dir, fdGeneration), ": ", strerror(errno));
+					continue;
+				}
+			}
+
+			const char *p = c.data.data();
+			size_t left = c.data.size();
+			while (left > 0){
+				ssize_t n = write(fd, p, left);
+				if (n < 0 && errno == EINTR){
+					continue;
+				}
+				if (n <= 0){
+					Logger::error("Can't write state log ", path(dir, fdGeneration), ": ", strerror(errno));
+					break;
+				}
+				p += n;
+				left -= n;
+			}
+		}
+		if (fd >= 0){
+			fdatasync(fd);
+		}
+	}
+
+	void run(){
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stopping){
+			cv.wait_for(lock, std::chrono::milliseconds(interval));
+			lock.unlock();
+			writeQueued();
+			lock.lock();
+		}
+	}
+
+	void push(std::string &&rec){
+		std::lock_guard<std::mutex> lock(mtx);
+		if (stopping){
+			return;
+		}
+		appended += rec.size();
+		if (pending.empty() || pending.back().generation != generation){
+			pending.push_back(Chunk{generation, std::move(rec)});
+		} else {
+			pending.back().data += rec;
+		}
+	}
+public:
+	/// Appends records to files of generation gen and later ones
+	StateLog(const StateLogOptions &opts, uint64_t gen) : dir(opts.dir), interval(opts.flushInterval), generation(gen){
+		mkdir(dir.c_str(), 0755);
+		thread = std::thread([this]{ run(); });
+	}
+
+	StateLog(const StateLog &) = delete;
+
+	~StateLog(){
+		stop();
+	}
+
+	/// Writes everything appended and stops thread. Later records are dropped
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (stopping){
+				return;
+			}
+			stopping = true;
+		}
+		cv.notify_all();
+		thread.join();
+		writeQueued();
+		std::lock_guard<std::mutex> lock(fileMtx);
+		closeFile();
+	}
+
+	/// Appends record of op on room, fill(CborWriter &) writes the rest of its fields
+	template<typename F>
+	void append(Op op, const std::string &room, F fill){
+		std::string rec(headerSize, '\0');
+		CborWriter wr(rec);
+		wr.beginObject();
+		wr.key("type");
+		wr.writeUInt((uint64_t) op);
+		wr.key("target");
+		wr.writeString(room);
+		fill(wr);
+		wr.endObject();
+
+		uint32_t head[2] = { (uint32_t) (rec.size() - headerSize), checksum(boost::string_view(rec).substr(headerSize)) };
+		memcpy(&rec[0], head, headerSize);
+		push(std::move(rec));
+	}
+
+	inline void append(Op op, const std::string &room){
+		append(op, room, [](CborWriter &){});
+	}
+
+	/// Record with one field, data
+	inline void appendData(Op op, const std::string &room, boost::string_view data){
+		append(op, room, [&](CborWriter &wr){
+			wr.key("data");
+			wr.writeString(data);
+		});
+	}
+
+	inline void appendData(Op op, const std::string &room, uint64_t data){
+		append(op, room, [&](CborWriter &wr){
+			wr.key("data");
+			wr.writeUInt(data);
+		});
+	}
+
+	/// Bytes appended since the last rotate
+	size_t getAppended(){
+		std::lock_guard<std::mutex> lock(mtx);
+		return appended;
+	}
+
+	/// Starts next generation, records appended after it go to its file. Returns its number
+	uint64_t rotate(){
+		std::lock_guard<std::mutex> lock(mtx);
+		appended = 0;
+		return ++generation;
+	}
+
+	/// Removes files of generations before gen, called when checkpoint of gen is on disk
+	void removeBefore(uint64_t gen){
+		std::lock_guard<std::mutex> lock(fileMtx);
+		removedBefore = std::max(removedBefore, gen);
+		if (fd >= 0 && fdGeneration < removedBefore){
+			close(fd);
+			fd = -1;
+		}
+		for (auto g : listGenerations(dir)){
+			if (g < gen){
+				unlink(path(dir, g).c_str());
+			}
+		}
+	}
+
+	/// Generations which have files in dir, ascending
+	static std::vector<uint64_t> listGenerations(const std::string &dir){
+		std::vector<uint64_t> res;
+		if (DIR *d = opendir(dir.c_str())){
+			while (dirent *e = readdir(d)){
+				unsigned long long gen;
+				char tail[8];
+				if (sscanf(e->d_name, "%20llu.%7s", &gen, tail) == 2 && strcmp(tail, "wal") == 0){
+					res.push_back(gen);
+				}
+			}
+			closedir(d);
+		}
+		std::sort(res.begin(), res.end());
+		return res;
+	}
+
+	/// Calls func(const CborFields &) for every record of generation from and later ones, in order
+	/// of appending. File is read up to the first broken record, which crash left unfinished.
+	/// Returns the last generation found, from if there are none
+	template<typename F>
+	static uint64_t replay(const std::string &dir, uint64_t from, F func){
+		uint64_t last = from;
+		CborFields rec;
+		for (auto g : listGenerations(dir)){
+			if (g < from){
+				continue;
+			}
+			last = g;
+
+			std::string data;
+			if (FILE *f = fopen(path(dir, g).c_str(), "rb")){
+				char buf[65536];
+				size_t n;
+				while ((n = fread(buf, 1, sizeof(buf), f)) > 0){
+					data.append(buf, n);
+				}
+				fclose(f);
+			}
+
+			size_t pos = 0;
+			while (data.size() - pos >= headerSize){
+				uint32_t head[2];
+				memcpy(head, &data[pos], headerSize);
+				if (head[0] > data.size() - pos - headerSize){
+					break;
+				}
+				auto payload = boost::string_view(data).substr(pos + headerSize, head[0]);
+				if (checksum(payload) != head[1] || !rec.parse(payload.data(), payload.size())){
+					break;
+				}
+				func(rec);
+				pos += headerSize + head[0];
+			}
+			if (pos < data.size()){
+				Logger::warn("State log ", path(dir, g), " is cut at ", pos, " of ", data.size(), " bytes");
+			}
+		}
+		return last;
+	}
+
+	/// Replaces file by data so that either old or new contents survive crash
+	static bool writeFile(const std::string &path, const std::string &data){
+		std::string tmp = path + ".tmp";
+		int f = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (f < 0){
+			return false;
+		}
+
+		const char *p = data.data();
+		size_t left = data.size();
+		while (left > 0){
+			ssize_t n = write(f, p, left);
+			if (n < 0 && errno == EINTR){
+				continue;
+			}
+			if (n <= 0){
+				close(f);
+				unlink(tmp.c_str());
+				return false;
+			}
+			p += n;
+			left -= n;
+		}
+		bool ok = fsync(f) == 0;
+		ok = close(f) == 0 && ok;
+		if (!ok || rename(tmp.c_str(), path.c_str()) != 0){
+			unlink(tmp.c_str());
+			return false;
+		}
+
+		// rename itself is durable when directory is synced
+		auto slash = path.rfind('/');
+		int d = open(slash == std::string::npos ? "." : path.substr(0, slash).c_str(), O_RDONLY);
+		if (d >= 0){
+			fsync(d);
+			close(d);
+		}
+		return true;
+	}
+};
+
+#endif //STATE_LOG_HPP
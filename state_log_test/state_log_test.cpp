@@ -0,0 +1,273 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <jsoncpp/json/json.h>
+
+#include "../state_log.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Changes rooms of simple model state and appends every change to StateLog, as Room does.
+// Checkpoints are taken the way Server takes them: log moves to new generation, state is
+// copied a bit later, so checkpoint also contains some records of its own generation.
+// State recovered from the last checkpoint and log after it, also after torn record at the
+// end, must be the same. Then compares append, shutdown and recovery with full dump of state.
+
+static const string dir = "state_log_test.tmp";
+
+struct Model {
+	map<string, set<string>> bans;
+	map<string, map<unsigned, string>> infos;
+
+	bool operator ==(const Model &o) const {
+		return bans == o.bans && infos == o.infos;
+	}
+
+	void apply(const CborFields &rec){
+		string room = rec["target"].asString();
+		switch ((StateLog::Op) rec["type"].asUInt()){
+			case StateLog::Op::room_created:
+				bans[room];
+				infos[room];
+				break;
+			case StateLog::Op::room_removed:
+				bans.erase(room);
+				infos.erase(room);
+				break;
+			case StateLog::Op::ban_nick:
+				if (bans.count(room)){
+					bans[room].insert(rec["data"].asString());
+				}
+				break;
+			case StateLog::Op::unban_nick:
+				if (bans.count(room)){
+					bans[room].erase(rec["data"].asString());
+				}
+				break;
+			case StateLog::Op::member_info:
+				if (infos.count(room)){
+					infos[room][rec["user_id"].asUInt()] = rec["name"].asString();
+				}
+				break;
+			default:
+				break;
+		}
+	}
+};
+
+static void appendInfo(StateLog &log, const string &room, unsigned uid, const string &nick){
+	log.append(StateLog::Op::member_info, room, [&](CborWriter &wr){
+		wr.key("user_id");
+		wr.writeUInt(uid);
+		wr.key("name");
+		wr.writeString(nick);
+		wr.key("girl");
+		wr.writeBool(uid % 2);
+		wr.key("color");
+		wr.writeString("gray");
+	});
+}
+
+// Random change of model, written to log
+static void mutate(Model &m, StateLog &log, mt19937 &rnd){
+	string room = "room" + to_string(rnd() % 8);
+	string nick = "nick" + to_string(rnd() % 50);
+	bool exists = m.bans.count(room) > 0;
+	switch (rnd() % 6){
+		case 0:
+			if (!exists){
+				m.bans[room];
+				m.infos[room];
+				log.append(StateLog::Op::room_created, room);
+			} else if (rnd() % 4 == 0){
+				m.bans.erase(room);
+				m.infos.erase(room);
+				log.append(StateLog::Op::room_removed, room);
+			}
+			break;
+		case 1:
+		case 2:
+			if (exists && m.bans[room].insert(nick).second){
+				log.appendData(StateLog::Op::ban_nick, room, nick);
+			}
+			break;
+		case 3:
+			if (exists && m.bans[room].erase(nick)){
+				log.appendData(StateLog::Op::unban_nick, room, nick);
+			}
+			break;
+		default:
+			if (exists){
+				unsigned uid = rnd() % 100;
+				m.infos[room][uid] = nick;
+				appendInfo(log, room, uid, nick);
+			}
+			break;
+	}
+}
+
+static Model recover(const Model &checkpoint, uint64_t generation, size_t *records = nullptr){
+	Model res = checkpoint;
+	size_t n = 0;
+	StateLog::replay(dir, generation, [&](const CborFields &rec){
+		res.apply(rec);
+		++n;
+	});
+	if (records){
+		*records = n;
+	}
+	return res;
+}
+
+static bool checkCorrectness(){
+	system(("rm -rf " + dir).c_str());
+	StateLogOptions opts;
+	opts.dir = dir;
+	opts.flushInterval = 5;
+
+	mt19937 rnd(1);
+	Model model, checkpoint;
+	uint64_t checkpointGen = 0;
+	{
+		StateLog log(opts, 1);
+		for (int round = 0; round < 20; ++round){
+			for (int i = 0; i < 500; ++i){
+				mutate(model, log, rnd);
+			}
+
+			uint64_t gen = log.rotate();
+			// changes made while rooms are serialized go to checkpoint and to new generation
+			for (int i = 0; i < 20; ++i){
+				mutate(model, log, rnd);
+			}
+			checkpoint = model;
+			checkpointGen = gen;
+			if (round % 3 == 0){
+				this_thread::sleep_for(milliseconds(10));
+			}
+			log.removeBefore(gen);
+		}
+		for (int i = 0; i < 300; ++i){
+			mutate(model, log, rnd);
+		}
+	}
+
+	if (StateLog::listGenerations(dir).front() < checkpointGen){
+		cout << "Old generations are kept" << endl;
+		return false;
+	}
+	if (!(recover(checkpoint, checkpointGen) == model)){
+		cout << "Recovered state differs" << endl;
+		return false;
+	}
+
+	// crash in the middle of record: the rest of file is ignored, next start writes next generation
+	auto gens = StateLog::listGenerations(dir);
+	{
+		ofstream f(dir + "/" + string(20 - to_string(gens.back()).size(), '0') + to_string(gens.back()) + ".wal", ios::app | ios::binary);
+		f.write("\x20\x00\x00\x00\x01\x02\x03\x04\xbf", 9);
+	}
+	size_t records = 0;
+	Model before = recover(checkpoint, checkpointGen, &records);
+	if (!(before == model) || !records){
+		cout << "Torn record broke recovery" << endl;
+		return false;
+	}
+	{
+		StateLog log(opts, gens.back() + 1);
+		for (int i = 0; i < 300; ++i){
+			mutate(model, log, rnd);
+		}
+	}
+	if (!(recover(checkpoint, checkpointGen) == model)){
+		cout << "State after torn record differs" << endl;
+		return false;
+	}
+
+	// checkpoint file is replaced whole
+	string data(100000, 'x');
+	if (!StateLog::writeFile(dir + "/checkpoint", data) || !StateLog::writeFile(dir + "/checkpoint", "new")){
+		cout << "Can't write checkpoint" << endl;
+		return false;
+	}
+	ifstream f(dir + "/checkpoint");
+	string got((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+	if (got != "new"){
+		cout << "Checkpoint has wrong contents" << endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	// stored info of members who left room is the bulk of state
+	size_t members = rounds * 10000;
+	size_t changes = rounds * 5000;
+	system(("rm -rf " + dir).c_str());
+	StateLogOptions opts;
+	opts.dir = dir;
+
+	Json::Value state;
+	auto &infos = state["rooms"][0]["members_info"];
+	for (size_t i = 0; i < members; ++i){
+		Json::Value v;
+		v["user_id"] = (Json::UInt) i;
+		v["nick"] = "nick" + to_string(i);
+		v["girl"] = i % 2 == 0;
+		v["color"] = "gray";
+		infos.append(v);
+	}
+
+	auto start = steady_clock::now();
+	{
+		Json::StyledStreamWriter wr;
+		ofstream ofs(dir + ".dat");
+		wr.write(ofs, state);
+	}
+	double dumpMs = duration<double, milli>(steady_clock::now() - start).count();
+
+	double appendNs, stopMs;
+	{
+		StateLog log(opts, 1);
+		start = steady_clock::now();
+		for (size_t i = 0; i < changes; ++i){
+			appendInfo(log, "main", (unsigned) i, "nick" + to_string(i));
+		}
+		appendNs = duration<double, nano>(steady_clock::now() - start).count() / changes;
+
+		start = steady_clock::now();
+		log.stop();
+		stopMs = duration<double, milli>(steady_clock::now() - start).count();
+	}
+
+	size_t replayed = 0;
+	start = steady_clock::now();
+	StateLog::replay(dir, 1, [&](const CborFields &rec){
+		replayed += rec["user_id"].asUInt() > 0;
+	});
+	double replayMs = duration<double, milli>(steady_clock::now() - start).count();
+
+	cout << "state of " << members << " stored members, " << changes << " changes since checkpoint" << endl;
+	cout << fixed << setprecision(1) << "full dump on shutdown " << dumpMs << " ms" << endl;
+	cout << setprecision(0) << "log append " << appendNs << " ns per change" << endl;
+	cout << setprecision(1) << "log flush on shutdown " << stopMs << " ms, replay " << replayMs << " ms" << endl;
+
+	system(("rm -rf " + dir + " " + dir + ".dat").c_str());
+	return 0;
+}
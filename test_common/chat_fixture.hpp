@@ -0,0 +1,38 @@
+#ifndef CHAT_FIXTURE_HPP
+#define CHAT_FIXTURE_HPP
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "../object_pool.hpp"
+#include "../server.hpp"
+#include "../client.hpp"
+#include "../rooms.hpp"
+
+// Clients and rooms of Server for tests which mute its log in cout and report to out.
+// Connections of clients are never opened, their frames stay in send queues
+
+static std::ostream out(std::cout.rdbuf());
+
+static boost::asio::io_service service;
+static boost::asio::ssl::context context(boost::asio::ssl::context::sslv23_server);
+
+/// Allocated as server.cpp does on open
+static ClientPtr makeClient(Server &server, uint uid){
+	auto conn = std::make_shared<WSServerBase::Connection>(service, context);
+	conn->remote_endpoint_address = "10.0." + std::to_string(uid / 250 % 250) + "." + std::to_string(uid % 250);
+	auto cli = std::allocate_shared<Client>(PoolAllocator<Client>(), &server, conn);
+	cli->setSelfPtr(cli);
+	cli->setID(uid);
+	return cli;
+}
+
+static RoomPtr makeRoom(Server &server, const std::string &name){
+	auto room = std::make_shared<Room>(&server);
+	room->setSelfPtr(room);
+	room->setName(name);
+	return room;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <array>
+#include <list>
+#include <cstdint>
+
+/// Hierarchical timing wheel. Every level has 64 slots, slot of level k covers 64^k ticks.
+/// Scheduling, rescheduling and canceling are O(1), advance touches only expired
+/// entries and entries cascading down from upper levels.
+template<typename T, size_t Levels = 4>
+class TimerWheel {
+public:
+	class Handle;
+private:
+	static const uint64_t slotBits = 6;
+	static const uint64_t slotCount = 1 << slotBits;
+	static const uint64_t slotMask = slotCount - 1;
+
+	struct Node {
+		uint64_t deadline;
+		size_t level;
+		size_t slot;
+		T value;
+		Handle *handle;
+	};
+
+	using Slot = std::list<Node>;
+
+	std::array<std::array<Slot, slotCount>, Levels> wheel;
+	uint64_t current;
+	size_t count;
+
+	Slot &place(Node &node){
+		for (size_t level = 0; level < Levels; ++level){
+			uint64_t shift = slotBits*level;
+			if ((node.deadline >> shift) - (current >> shift) < slotCount){
+				node.level = level;
+				node.slot = (node.deadline >> shift) & slotMask;
+				return wheel[level][node.slot];
+			}
+		}
+
+		// too far in future: park in the last slot of top level, it will be placed again on cascade
+		uint64_t shift = slotBits*(Levels - 1);
+		node.level = Levels - 1;
+		node.slot = ((current >> shift) - 1) & slotMask;
+		return wheel[node.level][node.slot];
+	}
+
+	void cascade(size_t level, size_t slot){
+		Slot nodes;
+		nodes.splice(nodes.end(), wheel[level][slot]);
+		while (!nodes.empty()){
+			auto it = nodes.begin();
+			Slot &dst = place(*it);
+			dst.splice(dst.end(), nodes, it);
+		}
+	}
+public:
+	/// Owned by the scheduled object, must stay at the same address while active
+	class Handle {
+	private:
+		friend class TimerWheel;
+		typename Slot::iterator it;
+		bool active = false;
+	public:
+		Handle(){}
+		Handle(const Handle &) = delete;
+		Handle &operator = (const Handle &) = delete;
+
+		bool isActive() const { return active; }
+	};
+
+	explicit TimerWheel(uint64_t now = 0) : current(now), count(0){}
+
+	void schedule(Handle &h, const T &value, uint64_t deadline){
+		if (h.active){
+			h.it->value = value;
+			reschedule(h, deadline);
+			return;
+		}
+
+		Slot tmp;
+		tmp.push_back(Node{std::max(deadline, current + 1), 0, 0, value, &h});
+		h.it = tmp.begin();
+		h.active = true;
+
+		Slot &dst = place(*h.it);
+		dst.splice(dst.end(), tmp);
+		++count;
+	}
+
+	void reschedule(Handle &h, uint64_t deadline){
+		if (!h.active){
+			return;
+		}
+
+		Slot &src = wheel[h.it->level][h.it->slot];
+		h.it->deadline = std::max(deadline, current + 1);
+		Slot &dst = place(*h.it);
+		dst.splice(dst.end(), src, h.it);
+	}
+
+	void cancel(Handle &h){
+		if (!h.active){
+			return;
+		}
+
+		wheel[h.it->level][h.it->slot].erase(h.it);
+		h.active = false;
+		--count;
+	}
+
+	/// Moves wheel to tick `now` and calls func(value) for every expired entry.
+	/// Handles of expired entries become inactive, func may schedule new entries
+	template<typename Func>
+	void advance(uint64_t now, Func func){
+		while (current < now){
+			++current;
+
+			for (size_t level = Levels - 1; level > 0; --level){
+				uint64_t shift = slotBits*level;
+				if ((current & ((1ull << shift) - 1)) == 0){
+					cascade(level, (current >> shift) & slotMask);
+				}
+			}
+
+			Slot expired;
+			expired.splice(expired.end(), wheel[0][current & slotMask]);
+			count -= expired.size();
+			for (auto &node : expired){
+				node.handle->active = false;
+			}
+			for (auto &node : expired){
+				func(node.value);
+			}
+		}
+	}
+
+	inline uint64_t now() const { return current; }
+	inline size_t size() const { return count; }
+};
+
+#endif //TIMER_WHEEL_HPP
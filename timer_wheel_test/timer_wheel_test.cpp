@@ -0,0 +1,134 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+
+#include "../timer_wheel.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+struct Conn {
+	uint64_t lastPacketTime = 0;
+	bool pinged = false;
+	TimerWheel<Conn *>::Handle timer;
+};
+
+static const uint64_t pingTimeout = 3*60;
+static const uint64_t connectTimeout = 5*60;
+
+static bool checkCorrectness(){
+	TimerWheel<int> wheel;
+	mt19937 rnd(1);
+	const int n = 20000;
+	vector<uint64_t> deadlines(n);
+	vector<unique_ptr<TimerWheel<int>::Handle>> handles;
+
+	for (int i = 0; i < n; ++i){
+		deadlines[i] = 1 + rnd() % 300000;
+		handles.emplace_back(new TimerWheel<int>::Handle());
+		wheel.schedule(*handles.back(), i, deadlines[i]);
+	}
+
+	// move half of timers to other deadlines
+	for (int i = 0; i < n; i += 2){
+		deadlines[i] = 1 + rnd() % 300000;
+		wheel.reschedule(*handles[i], deadlines[i]);
+	}
+
+	bool ok = true;
+	uint64_t end = 300001;
+	for (uint64_t t = 1; t <= end; ++t){
+		wheel.advance(t, [&](int i){
+			if (deadlines[i] != t){
+				cout << "Timer " << i << " fired at " << t << ", expected " << deadlines[i] << endl;
+				ok = false;
+			}
+		});
+	}
+
+	return ok && wheel.size() == 0;
+}
+
+static volatile size_t sink;
+
+// ticks once per second as the server does. Every client sends something once a minute,
+// except each thousandth one, which goes silent and gets pinged and kicked
+static void bench(size_t count){
+	vector<Conn> conns(count);
+	TimerWheel<Conn *> wheel;
+
+	uint64_t now = 0;
+	for (auto &c : conns){
+		c.lastPacketTime = now;
+		wheel.schedule(c.timer, &c, now + pingTimeout);
+	}
+
+	const int ticks = 900;
+	double wheelNs = 0, scanNs = 0;
+	size_t expired = 0;
+
+	for (int i = 0; i < ticks; ++i){
+		++now;
+		for (size_t j = now % 60; j < count; j += 60){
+			auto &c = conns[j];
+			if (j % 1000 != 0){
+				c.lastPacketTime = now;
+				c.pinged = false;
+				wheel.schedule(c.timer, &c, now + pingTimeout);
+			}
+		}
+
+		auto t0 = steady_clock::now();
+		size_t due = 0;
+		for (auto &c : conns){
+			if (now - c.lastPacketTime > pingTimeout){
+				++due;
+			}
+		}
+		sink = due;
+
+		auto t1 = steady_clock::now();
+		wheel.advance(now, [&](Conn *c){
+			++expired;
+			if (!c->pinged){
+				c->pinged = true;
+				wheel.schedule(c->timer, c, c->lastPacketTime + connectTimeout);
+			} else {
+				// kicked, the slot is reused by new connection
+				c->lastPacketTime = now;
+				c->pinged = false;
+				wheel.schedule(c->timer, c, now + pingTimeout);
+			}
+		});
+		auto t2 = steady_clock::now();
+
+		scanNs += duration_cast<nanoseconds>(t1 - t0).count();
+		wheelNs += duration_cast<nanoseconds>(t2 - t1).count();
+	}
+
+	cout << setw(10) << count
+		 << setw(16) << fixed << setprecision(2) << scanNs / ticks / 1000
+		 << setw(16) << wheelNs / ticks / 1000
+		 << setw(16) << (double) expired / ticks << endl;
+}
+
+int main(int argc, char **argv){
+	if (!checkCorrectness()){
+		cout << "Timer wheel check failed" << endl;
+		return 1;
+	}
+	cout << "Timer wheel check passed" << endl;
+
+	size_t maxCount = argc > 1 ? atol(argv[1]) : 1000000;
+
+	cout << setw(10) << "clients" << setw(16) << "scan us/tick" << setw(16) << "wheel us/tick" << setw(16) << "expired/tick" << endl;
+	for (size_t count = 1000; count <= maxCount; count *= 10){
+		bench(count);
+	}
+
+	return 0;
+}
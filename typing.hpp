@@ -0,0 +1,88 @@
+#ifndef TYPING_HPP
+#define TYPING_HPP
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/// Typing indicators of room, coalesced. Typing and stop_typing of members only change state
+/// here, and every interval room sends members whose shown state changed as one packet.
+/// Repeated typing of member only prolongs it, member who stops sending it stops typing after
+/// timeout, and shown state of member changes at most once per memberInterval, so room sends
+/// at most one packet per interval however many members type
+
+struct TypingOptions {
+	// rooms which coalesce typing, "*" is every room
+	std::unordered_set<std::string> rooms;
+	int interval = 500;
+	int memberInterval = 1000;
+	int timeout = 5000;
+
+	inline bool enabledFor(const std::string &room) const {
+		return rooms.count("*") > 0 || rooms.count(room) > 0;
+	}
+};
+
+/// Used only by thread of room, times are in milliseconds of steady clock
+class RoomTyping {
+private:
+	struct State {
+		bool shown = false;
+		bool wanted = false;
+		int64_t expires = 0;
+		int64_t changed = std::numeric_limits<int64_t>::min() / 2;
+	};
+
+	TypingOptions opts;
+	std::unordered_map<uint, State> members;
+public:
+	RoomTyping(const TypingOptions &options) : opts(options){}
+
+	inline bool empty() const { return members.empty(); }
+
+	void typing(uint member_id, int64_t now){
+		auto &s = members[member_id];
+		s.wanted = true;
+		s.expires = now + opts.timeout;
+	}
+
+	void stop(uint member_id){
+		auto it = members.find(member_id);
+		if (it != members.end()){
+			it->second.wanted = false;
+		}
+	}
+
+	/// Member left or dropped nick, its offline status ends typing for clients
+	void remove(uint member_id){
+		members.erase(member_id);
+	}
+
+	/// Adds members whose shown state changed to res, true for typing ones
+	void flush(int64_t now, std::vector<std::pair<uint, bool>> &res){
+		for (auto it = members.begin(); it != members.end(); ){
+			auto &s = it->second;
+			if (s.wanted && s.expires <= now){
+				s.wanted = false;
+			}
+			bool ready = now - s.changed >= opts.memberInterval;
+			if (s.wanted != s.shown && ready){
+				s.shown = s.wanted;
+				s.changed = now;
+				res.emplace_back(it->first, s.shown);
+			}
+			// forgotten when its last change can't limit the next one
+			if (!s.shown && !s.wanted && now - s.changed >= opts.memberInterval){
+				it = members.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+};
+
+#endif //TYPING_HPP
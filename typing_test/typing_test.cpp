@@ -0,0 +1,193 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "../typing.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Members of room send typing and stop_typing at random, RoomTyping is flushed every interval.
+// Clients which apply flushed changes must see what members want after they are quiet for
+// a while, shown state of member must change at most once per member interval and repeated
+// typing must not be sent again. Then counts packets which room sends to its members when
+// every typing status is sent at once and when they are coalesced
+
+using Changes = vector<pair<uint, bool>>;
+
+static bool checkCorrectness(){
+	TypingOptions opts;
+	opts.interval = 100;
+	opts.memberInterval = 1000;
+	opts.timeout = 5000;
+
+	// repeated typing is shown once, stop is delayed by member interval, silence by timeout
+	{
+		RoomTyping t(opts);
+		Changes ch;
+		for (int64_t now = 0; now < 900; now += opts.interval){
+			t.typing(1, now);
+			t.flush(now, ch);
+		}
+		if (ch.size() != 1 || !ch[0].second){
+			cout << "Repeated typing sent " << ch.size() << " changes" << endl;
+			return false;
+		}
+		ch.clear();
+		t.stop(1);
+		t.flush(900, ch);
+		if (!ch.empty()){
+			cout << "Stop sent before member interval" << endl;
+			return false;
+		}
+		t.flush(1000, ch);
+		if (ch.size() != 1 || ch[0].second){
+			cout << "Stop not sent after member interval" << endl;
+			return false;
+		}
+		ch.clear();
+		t.typing(1, 3000);
+		t.flush(3000, ch);
+		t.flush(3000 + opts.timeout, ch);
+		if (ch.size() != 2 || ch[1].second){
+			cout << "Typing didn't end by timeout" << endl;
+			return false;
+		}
+		t.flush(10000, ch);
+		if (!t.empty()){
+			cout << "Quiet member is kept" << endl;
+			return false;
+		}
+		t.typing(2, 10000);
+		t.remove(2);
+		t.flush(10000, ch);
+		if (ch.size() != 2 || !t.empty()){
+			cout << "Removed member is sent" << endl;
+			return false;
+		}
+	}
+
+	mt19937 rnd(1);
+	RoomTyping t(opts);
+	map<uint, bool> wanted, shown;
+	map<uint, int64_t> lastChange, lastTyping;
+	int64_t now = 0;
+	for (int round = 0; round < 200; ++round){
+		// busy period, then quiet one
+		for (int64_t end = now + 3000; now < end; now += opts.interval){
+			for (int i = 0; i < 5; ++i){
+				uint id = rnd() % 20;
+				if (rnd() % 3){
+					t.typing(id, now);
+					wanted[id] = true;
+					lastTyping[id] = now;
+				} else {
+					t.stop(id);
+					wanted[id] = false;
+				}
+			}
+			Changes ch;
+			t.flush(now, ch);
+			for (auto &c : ch){
+				if (lastChange.count(c.first) && now - lastChange[c.first] < opts.memberInterval){
+					cout << "Member changed twice within member interval" << endl;
+					return false;
+				}
+				if (shown[c.first] == c.second){
+					cout << "Unchanged state sent" << endl;
+					return false;
+				}
+				lastChange[c.first] = now;
+				shown[c.first] = c.second;
+			}
+		}
+		// quiet for less than timeout: members show what they want
+		for (int64_t end = now + opts.memberInterval + opts.interval; now < end; now += opts.interval){
+			Changes ch;
+			t.flush(now, ch);
+			for (auto &c : ch){
+				lastChange[c.first] = now;
+				shown[c.first] = c.second;
+			}
+		}
+		for (auto &w : wanted){
+			if (w.second && lastTyping[w.first] + opts.timeout <= now){
+				continue;
+			}
+			if (shown[w.first] != w.second){
+				cout << "Member " << w.first << " shown as " << shown[w.first] << endl;
+				return false;
+			}
+		}
+		// quiet for longer than timeout: nobody types
+		if (round % 10 == 0){
+			now += opts.timeout;
+			Changes ch;
+			t.flush(now, ch);
+			for (auto &c : ch){
+				lastChange[c.first] = now;
+				shown[c.first] = c.second;
+			}
+			for (auto &s : shown){
+				if (s.second){
+					cout << "Typing didn't end by timeout" << endl;
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+	if (!checkCorrectness()){
+		cout << "Correctness check failed" << endl;
+		return 1;
+	}
+	cout << "Correctness check passed" << endl;
+
+	// typists send typing every 300 ms, as clients do on key press, and stop now and then
+	size_t members = rounds * 100;
+	size_t typists = rounds * 2;
+	int64_t length = 60000;
+	TypingOptions opts;
+	mt19937 rnd(2);
+
+	size_t immediate = 0, coalesced = 0;
+	auto start = steady_clock::now();
+	RoomTyping t(opts);
+	Changes ch;
+	for (int64_t now = 0; now < length; now += 100){
+		for (size_t i = 0; i < typists; ++i){
+			if (rnd() % 3 != 0){
+				continue;
+			}
+			if (rnd() % 10){
+				t.typing((uint) i, now);
+			} else {
+				t.stop((uint) i);
+			}
+			++immediate;
+		}
+		if (now % opts.interval == 0){
+			ch.clear();
+			t.flush(now, ch);
+			coalesced += !ch.empty();
+		}
+	}
+	double ms = duration<double, milli>(steady_clock::now() - start).count();
+
+	cout << members << " members, " << typists << " typists for " << length / 1000 << " s" << endl;
+	cout << setw(12) << left << "" << right << setw(14) << "packets" << setw(16) << "deliveries" << endl;
+	cout << setw(12) << left << "immediate" << right << setw(14) << immediate << setw(16) << immediate * members << endl;
+	cout << setw(12) << left << "coalesced" << right << setw(14) << coalesced << setw(16) << coalesced * members << endl;
+	cout << fixed << setprecision(1) << "coalescing took " << ms << " ms" << endl;
+	return 0;
+}
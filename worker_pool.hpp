@@ -0,0 +1,134 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+
+#include "logger.hpp"
+
+/// Fixed count of threads with bounded job queue. Used for blocking work
+/// (database, memcached), which must not run on the io_service thread
+class WorkerPool {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats {
+		size_t workers = 0;
+		size_t queueLimit = 0;
+		size_t queued = 0;
+		size_t running = 0;
+		size_t done = 0;
+		size_t rejected = 0;
+		double avgWaitMs = 0;
+		double maxWaitMs = 0;
+	};
+private:
+	struct Job {
+		std::function<void()> func;
+		Clock::time_point queuedAt;
+	};
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<Job> jobs;
+	std::vector<std::thread> threads;
+	size_t queueLimit;
+	bool stopping = false;
+
+	size_t running = 0;
+	size_t done = 0;
+	size_t rejected = 0;
+	double totalWaitMs = 0;
+	double maxWaitMs = 0;
+
+	void run(){
+		while (true){
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty()){
+					return;
+				}
+
+				job = std::move(jobs.front());
+				jobs.pop_front();
+
+				double wait = std::chrono::duration<double, std::milli>(Clock::now() - job.queuedAt).count();
+				totalWaitMs += wait;
+				if (wait > maxWaitMs){
+					maxWaitMs = wait;
+				}
+				++running;
+			}
+
+			try {
+				job.func();
+			} catch (const std::exception &e){
+				Logger::error("Exception in worker: ", e.what());
+			} catch (...){
+				Logger::error("Unknown exception in worker");
+			}
+
+			std::lock_guard<std::mutex> lock(mtx);
+			--running;
+			++done;
+		}
+	}
+public:
+	WorkerPool(size_t workers, size_t queue_limit) : queueLimit(queue_limit){
+		for (size_t i = 0; i < workers; ++i){
+			threads.emplace_back([this]{ run(); });
+		}
+	}
+
+	WorkerPool(const WorkerPool &) = delete;
+
+	~WorkerPool(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		for (auto &t : threads){
+			t.join();
+		}
+	}
+
+	/// Returns false if queue is full
+	bool submit(std::function<void()> func){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (stopping || (queueLimit && jobs.size() >= queueLimit)){
+				++rejected;
+				return false;
+			}
+			jobs.push_back(Job{std::move(func), Clock::now()});
+		}
+		cv.notify_one();
+		return true;
+	}
+
+	Stats getStats(){
+		std::lock_guard<std::mutex> lock(mtx);
+		Stats s;
+		s.workers = threads.size();
+		s.queueLimit = queueLimit;
+		s.queued = jobs.size();
+		s.running = running;
+		s.done = done;
+		s.rejected = rejected;
+		s.avgWaitMs = done + running > 0 ? totalWaitMs / (done + running) : 0;
+		s.maxWaitMs = maxWaitMs;
+		return s;
+	}
+};
+
+#endif //WORKER_POOL_HPP
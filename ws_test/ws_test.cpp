@@ -0,0 +1,565 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "../server_wss_ex.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Client over TLS against WebSocketServerEx: handshake, framing, fragmentation and close.
+// Then measures broadcast of one shared buffer to many connections
+
+using boost::asio::ip::tcp;
+using WS = WebSocketServerEx;
+
+static const char *certFile = "ws_test_cert.pem";
+static const char *keyFile = "ws_test_key.pem";
+
+// self-signed certificate made for the run
+static bool makeCertificate(){
+	EVP_PKEY *key = nullptr;
+	auto ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+	bool ok = ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0 && EVP_PKEY_keygen(ctx, &key) > 0;
+	EVP_PKEY_CTX_free(ctx);
+	if (!ok){
+		return false;
+	}
+
+	auto cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_get_notBefore(cert), 0);
+	X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+	X509_set_pubkey(cert, key);
+	auto name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	ok = X509_sign(cert, key, EVP_sha256()) > 0;
+
+	auto cf = fopen(certFile, "w");
+	auto kf = fopen(keyFile, "w");
+	ok = ok && cf && kf && PEM_write_X509(cf, cert) && PEM_write_PrivateKey(kf, key, nullptr, nullptr, 0, nullptr, nullptr);
+	if (cf){
+		fclose(cf);
+	}
+	if (kf){
+		fclose(kf);
+	}
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+struct Frame {
+	unsigned char fin_rsv_opcode = 0;
+	// 7 bit length, or 126 and 127 for longer forms
+	unsigned char length_code = 0;
+	string payload;
+};
+
+class TestClient {
+private:
+	boost::asio::io_service service;
+	boost::asio::ssl::context context;
+	WS::Socket socket;
+	mt19937 rnd;
+public:
+	TestClient() : context(boost::asio::ssl::context::sslv23_client), socket(service, context), rnd(random_device()()){}
+
+	bool connect(unsigned short port){
+		boost::system::error_code ec;
+		socket.lowest_layer().connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port), ec);
+		if (ec){
+			return false;
+		}
+		// every read of test gives up after a while instead of hanging
+		timeval tv{ 5, 0 };
+		setsockopt(socket.lowest_layer().native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		socket.handshake(boost::asio::ssl::stream_base::client, ec);
+		return !ec;
+	}
+
+	/// Sends upgrade request with extra header lines, returns head of response
+	string handshake(const string &path = "/chat", const string &extra = "", const string &key = "dGhlIHNhbXBsZSBub25jZQ=="){
+		string req = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
+		if (!key.empty()){
+			req += "Sec-WebSocket-Key: " + key + "\r\n";
+		}
+		req += extra + "\r\n";
+		boost::system::error_code ec;
+		boost::asio::write(socket, boost::asio::buffer(req), ec);
+
+		boost::asio::streambuf buf;
+		size_t size = boost::asio::read_until(socket, buf, "\r\n\r\n", ec);
+		if (ec){
+			return string();
+		}
+		auto data = buf.data();
+		return string(boost::asio::buffers_begin(data), boost::asio::buffers_begin(data) + size);
+	}
+
+	void sendRaw(const string &data){
+		boost::system::error_code ec;
+		boost::asio::write(socket, boost::asio::buffer(data), ec);
+	}
+
+	static string frame(unsigned char fin_rsv_opcode, const string &payload, bool masked, mt19937 &rnd){
+		string res(1, (char) fin_rsv_opcode);
+		size_t n = payload.size();
+		if (n < 126){
+			res.push_back((char) n);
+		} else if (n < 65536){
+			res += { (char) 126, (char) (n >> 8), (char) n };
+		} else {
+			res.push_back((char) 127);
+			for (int i = 7; i >= 0; --i){
+				res.push_back((char) ((uint64_t) n >> (8*i)));
+			}
+		}
+		if (!masked){
+			return res + payload;
+		}
+		res[1] |= (char) 128;
+		unsigned char mask[4];
+		for (auto &m : mask){
+			m = (unsigned char) rnd();
+		}
+		res.append((const char *) mask, 4);
+		for (size_t i = 0; i < payload.size(); ++i){
+			res.push_back((char) (payload[i] ^ mask[i % 4]));
+		}
+		return res;
+	}
+
+	void send(unsigned char fin_rsv_opcode, const string &payload, bool masked = true){
+		sendRaw(frame(fin_rsv_opcode, payload, masked, rnd));
+	}
+
+	bool read(Frame &f){
+		unsigned char hdr[2];
+		boost::system::error_code ec;
+		if (boost::asio::read(socket, boost::asio::buffer(hdr), ec) != 2){
+			return false;
+		}
+		f.fin_rsv_opcode = hdr[0];
+		// frames of server are never masked
+		if (hdr[1] & 128){
+			return false;
+		}
+		f.length_code = hdr[1] & 127;
+		uint64_t length = f.length_code;
+		if (length >= 126){
+			unsigned char ext[8];
+			size_t n = length == 126 ? 2 : 8;
+			if (boost::asio::read(socket, boost::asio::buffer(ext, n), ec) != n){
+				return false;
+			}
+			length = 0;
+			for (size_t i = 0; i < n; ++i){
+				length = (length << 8) | ext[i];
+			}
+		}
+		f.payload.assign(length, '\0');
+		return boost::asio::read(socket, boost::asio::buffer(&f.payload[0], length), ec) == length || length == 0;
+	}
+
+	/// True when server has closed connection
+	bool closed(){
+		char c;
+		boost::system::error_code ec;
+		socket.read_some(boost::asio::buffer(&c, 1), ec);
+		return ec == boost::asio::error::eof || ec == boost::asio::ssl::error::stream_truncated || ec == boost::asio::error::connection_reset;
+	}
+};
+
+// what handlers of server saw
+struct Events {
+	mutex mtx;
+	condition_variable cv;
+	deque<string> messages;
+	deque<pair<int, string>> closes;
+	size_t errors = 0;
+	// connections of benchmark
+	vector<WS::ConnectionPtr> ready;
+
+	template<typename F>
+	bool waitFor(F pred){
+		unique_lock<mutex> lock(mtx);
+		return cv.wait_for(lock, seconds(5), pred);
+	}
+};
+
+static Events events;
+
+static void startServer(WS &server, unsigned short port){
+	server.config.port = port;
+	server.config.max_message_size = 1024*1024;
+	// benchmark sends from main thread
+	server.setPostSends(true);
+	auto &ep = server.endpoint["^/chat/?$"];
+	ep.protocols = { "wschat.cbor" };
+	ep.on_message = [&server](WS::ConnectionPtr conn, shared_ptr<WS::Message> msg){
+		string data = msg->string();
+		if (msg->fin_rsv_opcode & 0x40){
+			string inflated;
+			Inflater::shared().decompress(data, inflated, 1024*1024);
+			data.swap(inflated);
+		}
+		{
+			lock_guard<mutex> lock(events.mtx);
+			events.messages.push_back(data);
+			if (data == "ready"){
+				events.ready.push_back(conn);
+			}
+		}
+		events.cv.notify_all();
+
+		if (data == "ready"){
+			return;
+		}
+		if (data == "close me"){
+			// queued frame goes out before close, nothing after it
+			server.send(conn, make_shared<const string>("last"));
+			server.sendClose(conn, 4000, "done");
+			server.send(conn, make_shared<const string>("after close"));
+			return;
+		}
+		server.send(conn, make_shared<const string>(data), false, (unsigned char) (msg->fin_rsv_opcode & ~0x40));
+	};
+	ep.on_close = [](WS::ConnectionPtr, int status, const string &reason){
+		{
+			lock_guard<mutex> lock(events.mtx);
+			events.closes.emplace_back(status, reason);
+		}
+		events.cv.notify_all();
+	};
+	ep.on_error = [](WS::ConnectionPtr, const boost::system::error_code &){
+		{
+			lock_guard<mutex> lock(events.mtx);
+			++events.errors;
+		}
+		events.cv.notify_all();
+	};
+}
+
+static bool hasLine(const string &head, const string &line){
+	return head.find(line + "\r\n") != string::npos;
+}
+
+static bool checkHandshake(unsigned short port){
+	// key and answer of RFC 6455
+	TestClient c;
+	auto head = c.connect(port) ? c.handshake("/chat", "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: foo, wschat.cbor\r\n") : "";
+	if (head.compare(0, 12, "HTTP/1.1 101") != 0 || !hasLine(head, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+			|| !hasLine(head, "Sec-WebSocket-Protocol: wschat.cbor")){
+		cout << "Wrong response to upgrade: " << head << endl;
+		return false;
+	}
+
+	TestClient plain;
+	head = plain.connect(port) ? plain.handshake("/chat/", "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: foo\r\n"
+			"Sec-WebSocket-Extensions: x-unknown, permessage-deflate; client_max_window_bits\r\n") : "";
+	if (head.compare(0, 12, "HTTP/1.1 101") != 0 || head.find("Sec-WebSocket-Protocol") != string::npos
+			|| head.find("Sec-WebSocket-Extensions: permessage-deflate") == string::npos){
+		cout << "Wrong subprotocol or extensions: " << head << endl;
+		return false;
+	}
+
+	struct Bad {
+		const char *path, *extra, *key, *status;
+	};
+	for (auto &b : { Bad{ "/other", "Sec-WebSocket-Version: 13\r\n", "dGhlIHNhbXBsZSBub25jZQ==", "HTTP/1.1 404" },
+			Bad{ "/chat", "Sec-WebSocket-Version: 13\r\n", "", "HTTP/1.1 400" },
+			Bad{ "/chat", "Sec-WebSocket-Version: 8\r\n", "dGhlIHNhbXBsZSBub25jZQ==", "HTTP/1.1 400" } }){
+		TestClient bad;
+		head = bad.connect(port) ? bad.handshake(b.path, b.extra, b.key) : "";
+		if (head.compare(0, 12, b.status) != 0 || !bad.closed()){
+			cout << "Bad request to " << b.path << " isn't refused with " << b.status << ": " << head << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool connectClient(TestClient &c, unsigned short port, const string &extra = ""){
+	return c.connect(port) && c.handshake("/chat", "Sec-WebSocket-Version: 13\r\n" + extra).compare(0, 12, "HTTP/1.1 101") == 0;
+}
+
+static bool checkFraming(unsigned short port){
+	TestClient c;
+	if (!connectClient(c, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+
+	// lengths around 7, 16 and 64 bit forms
+	for (size_t size : { 0, 1, 125, 126, 127, 65535, 65536, 300000 }){
+		string data(size, '\0');
+		for (size_t i = 0; i < size; ++i){
+			data[i] = (char) ('a' + i % 26);
+		}
+		c.send(130, data);
+		Frame f;
+		unsigned char code = size < 126 ? (unsigned char) size : size < 65536 ? 126 : 127;
+		if (!c.read(f) || f.fin_rsv_opcode != 130 || f.length_code != code || f.payload != data){
+			cout << "Echo of " << size << " bytes differs" << endl;
+			return false;
+		}
+	}
+
+	// frames which came in one write are all read
+	string batch;
+	mt19937 rnd(1);
+	for (int i = 0; i < 10; ++i){
+		batch += TestClient::frame(129, "packet " + to_string(i), true, rnd);
+	}
+	c.sendRaw(batch);
+	for (int i = 0; i < 10; ++i){
+		Frame f;
+		if (!c.read(f) || f.payload != "packet " + to_string(i)){
+			cout << "Frames of one write aren't read in order" << endl;
+			return false;
+		}
+	}
+
+	c.send(137, "ping data");
+	Frame f;
+	if (!c.read(f) || f.fin_rsv_opcode != 138 || f.payload != "ping data"){
+		cout << "Ping isn't answered with pong" << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool checkFragments(unsigned short port){
+	TestClient c;
+	if (!connectClient(c, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+
+	// control frame may come between fragments and is answered at once
+	c.send(1, "Hello, ");
+	c.send(0, "fragmented ");
+	c.send(137, "between");
+	c.send(128, "world");
+	Frame pong, echo;
+	if (!c.read(pong) || pong.fin_rsv_opcode != 138 || pong.payload != "between"
+			|| !c.read(echo) || echo.fin_rsv_opcode != 129 || echo.payload != "Hello, fragmented world"){
+		cout << "Fragmented message isn't joined" << endl;
+		return false;
+	}
+
+	// compressed message has RSV1 on the first fragment only
+	TestClient dc;
+	if (!connectClient(dc, port, "Sec-WebSocket-Extensions: permessage-deflate\r\n")){
+		cout << "Can't connect with permessage-deflate" << endl;
+		return false;
+	}
+	string text;
+	for (int i = 0; i < 100; ++i){
+		text += "compressed text " + to_string(i) + " ";
+	}
+	string compressed;
+	if (!Deflater::shared().compress(text, compressed)){
+		cout << "Can't compress" << endl;
+		return false;
+	}
+	size_t half = compressed.size() / 2;
+	dc.send(1 | 0x40, compressed.substr(0, half));
+	dc.send(128, compressed.substr(half));
+	if (!events.waitFor([&]{ return !events.messages.empty() && events.messages.back() == text; })){
+		cout << "Compressed fragments aren't joined" << endl;
+		return false;
+	}
+
+	struct Broken {
+		vector<pair<unsigned char, string>> frames;
+		const char *what;
+	};
+	for (auto &b : { Broken{ { { 128, "continuation" } }, "continuation without start" },
+			Broken{ { { 1, "start" }, { 129, "other" } }, "new message inside of fragmented one" },
+			Broken{ { { 9, "ping" } }, "fragmented control frame" },
+			Broken{ { { 129 | 0x40, "compressed" } }, "RSV1 without permessage-deflate" } }){
+		TestClient bad;
+		if (!connectClient(bad, port)){
+			cout << "Can't connect" << endl;
+			return false;
+		}
+		for (auto &fr : b.frames){
+			bad.send(fr.first, fr.second);
+		}
+		Frame f;
+		while (bad.read(f) && f.fin_rsv_opcode != 136){
+		}
+		if (f.fin_rsv_opcode != 136 || f.payload.size() < 2 || ((unsigned char) f.payload[0] << 8 | (unsigned char) f.payload[1]) != 1002){
+			cout << "No close with 1002 after " << b.what << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static int statusOf(const Frame &f){
+	return f.payload.size() >= 2 ? (unsigned char) f.payload[0] << 8 | (unsigned char) f.payload[1] : 0;
+}
+
+static bool checkClose(unsigned short port){
+	// client closes: server answers with its status, calls on_close once and closes socket
+	TestClient c;
+	if (!connectClient(c, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+	size_t closes = events.closes.size();
+	c.send(136, string("\x03\xe8", 2) + "bye");
+	Frame f;
+	if (!c.read(f) || f.fin_rsv_opcode != 136 || statusOf(f) != 1000 || !c.closed()){
+		cout << "Close of client isn't answered" << endl;
+		return false;
+	}
+	if (!events.waitFor([&]{ return events.closes.size() == closes + 1; }) || events.closes.back() != make_pair(1000, string("bye"))){
+		cout << "on_close isn't called with status of client" << endl;
+		return false;
+	}
+
+	// server closes: queued frames go first, nothing after close, socket is closed after answer
+	TestClient s;
+	if (!connectClient(s, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+	s.send(129, "close me");
+	Frame last, close;
+	if (!s.read(last) || last.payload != "last" || !s.read(close) || close.fin_rsv_opcode != 136 || statusOf(close) != 4000
+			|| close.payload.substr(2) != "done"){
+		cout << "Close of server doesn't follow queued frames" << endl;
+		return false;
+	}
+	s.send(136, close.payload);
+	if (!s.closed()){
+		cout << "Frame after close is sent or socket isn't closed" << endl;
+		return false;
+	}
+
+	// unmasked frame and too big message are protocol errors
+	TestClient u;
+	if (!connectClient(u, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+	u.send(129, "unmasked", false);
+	if (!u.read(f) || f.fin_rsv_opcode != 136 || statusOf(f) != 1002){
+		cout << "Unmasked frame isn't refused" << endl;
+		return false;
+	}
+
+	TestClient big;
+	if (!connectClient(big, port)){
+		cout << "Can't connect" << endl;
+		return false;
+	}
+	big.send(1, string(600*1024, 'x'));
+	big.send(128, string(600*1024, 'x'));
+	if (!big.read(f) || f.fin_rsv_opcode != 136 || statusOf(f) != 1009){
+		cout << "Too big message isn't refused" << endl;
+		return false;
+	}
+
+	// connection which drops without close frame gets on_error
+	size_t errors = events.errors;
+	{
+		TestClient gone;
+		if (!connectClient(gone, port)){
+			cout << "Can't connect" << endl;
+			return false;
+		}
+	}
+	if (!events.waitFor([&]{ return events.errors > errors; })){
+		cout << "on_error isn't called for dropped connection" << endl;
+		return false;
+	}
+	return true;
+}
+
+// one shared buffer for all connections, as room broadcast is sent
+static bool bench(WS &server, unsigned short port, int messages, int clients){
+	vector<unique_ptr<TestClient>> conns;
+	for (int i = 0; i < clients; ++i){
+		conns.emplace_back(new TestClient());
+		if (!connectClient(*conns.back(), port)){
+			cout << "Can't connect" << endl;
+			return false;
+		}
+		conns.back()->send(129, "ready");
+	}
+	if (!events.waitFor([&]{ return events.ready.size() == (size_t) clients; })){
+		cout << "Connections of benchmark aren't open" << endl;
+		return false;
+	}
+
+	auto buf = make_shared<const string>(string(1024, 'b'));
+	vector<thread> readers;
+	auto start = steady_clock::now();
+	for (auto &c : conns){
+		readers.emplace_back([&c, messages]{
+			Frame f;
+			for (int i = 0; i < messages && c->read(f); ++i){
+			}
+		});
+	}
+	for (auto &conn : events.ready){
+		for (int i = 0; i < messages; ++i){
+			server.send(conn, buf);
+		}
+	}
+	for (auto &t : readers){
+		t.join();
+	}
+	double ms = duration<double, milli>(steady_clock::now() - start).count();
+
+	cout << "Broadcast of " << messages << " frames of " << buf->size() << " bytes to " << clients << " connections" << endl;
+	cout << setw(16) << left << "ms" << right << setw(16) << "frames/s" << endl;
+	cout << setw(16) << left << fixed << setprecision(1) << ms << right << setw(16) << (double) messages * clients * 1000 / ms << endl;
+	return true;
+}
+
+int main(int argc, char **argv){
+	unsigned short port = argc > 1 ? (unsigned short) atoi(argv[1]) : 18443;
+	int messages = argc > 2 ? atoi(argv[2]) : 2000;
+	int clients = argc > 3 ? atoi(argv[3]) : 20;
+
+	if (!makeCertificate()){
+		cout << "Can't make certificate" << endl;
+		return 1;
+	}
+
+	WS server(certFile, keyFile);
+	startServer(server, port);
+	thread runner([&]{ server.start(); });
+	this_thread::sleep_for(milliseconds(200));
+
+	bool ok = checkHandshake(port) && checkFraming(port) && checkFragments(port) && checkClose(port);
+	cout << (ok ? "Correctness check passed" : "Correctness check failed") << endl;
+	ok = ok && bench(server, port, messages, clients);
+
+	server.stop();
+	runner.join();
+	// connections must go before io_service of server
+	events.ready.clear();
+	remove(certFile);
+	remove(keyFile);
+	return ok ? 0 : 1;
+}
@@ -2,47 +2,71 @@
 #include <iostream>
 #include <memory>
 #include <exception>
+#include <vector>
 #include <signal.h>
+#include <unistd.h>
 
 #include "logger.hpp"
+#include "cluster.hpp"
 
 static std::shared_ptr<Server> server;
 
+// cluster mode: first process forks the others, only it saves state
+static std::unique_ptr<ClusterBus> cluster;
+static std::vector<pid_t> children;
+static int node = 0;
+
 static void save_state(){
+	if (node != 0){
+		return;
+	}
+
 	try {
-		Config::writeToFile("rooms.dat", server->serialize());
+		server->saveState();
 		Logger::info("Server state saved");
 	} catch (exception &e){
 		Logger::error("Exception while saving old server state:\n", e.what());
 	}
 }
 
-static void sighandler(int signum){
-	Logger::info("Received signal ", signum);
-	server->stop();
-	save_state();
-	exit(signum != SIGTERM ? signum : 0);
-}
-
 int main() {
-	if (signal(SIGTERM, sighandler) == SIG_ERR || signal(SIGINT, sighandler) == SIG_ERR || signal(SIGABRT, sighandler) == SIG_ERR){
-		Logger::error("Can't set signals. Aborting.");
-		return 1;
+	// must fork before any thread is started
+	int processes = config["cluster"].get("processes", 1).asInt();
+	if (processes > 1){
+		if (processes > 255){
+			Logger::error("Too many processes in cluster: ", processes);
+			return 1;
+		}
+
+		cluster.reset(new ClusterBus((uint8_t) processes, config["cluster"].get("bus_slots", 1024).asUInt()));
+		for (int i = 1; i < processes; ++i){
+			pid_t pid = fork();
+			if (pid < 0){
+				Logger::error("Can't fork cluster process ", i);
+				break;
+			}
+			if (pid == 0){
+				node = i;
+				children.clear();
+				break;
+			}
+			children.push_back(pid);
+		}
+		cluster->setNode((uint8_t) node);
+		Logger::info("Cluster process ", node, " of ", processes, ", pid ", getpid());
 	}
 
-	server = std::make_shared<Server>(config["port"].asInt());
+	server = std::make_shared<Server>(config["port"].asInt(), cluster.get());
 
-	try {
-		Json::Value val;
-		Config::loadFromFile("rooms.dat", val);
-		server->deserialize(val);
-		Logger::info("Last server state loaded");
-	} catch (exception &e){
-		Logger::error("Exception while loading last server state:\n", e.what());
-	}
+	server->loadState();
 
+	// returns on SIGINT or SIGTERM, shutdown runs here and not in signal handler
 	server->start();
 
+	for (pid_t pid : children){
+		kill(pid, SIGTERM);
+	}
+	server->stop();
 	save_state();
 
 	return 0;